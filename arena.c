@@ -0,0 +1,86 @@
+#include "arena.h"
+#include <stdlib.h>
+
+typedef struct
+{
+    void* object;
+    arena_release_t release;
+} owned_t;
+
+struct arena_t
+{
+    owned_t* owned;
+    size_t size;
+    size_t used;
+    arena_t* outer;     // The arena of the thread before this one was entered
+};
+
+static _Thread_local arena_t* current = NULL;
+
+arena_t* arena_new()
+{
+    arena_t* arena = malloc(sizeof (arena_t));
+    arena->owned = NULL;
+    arena->size = 0;
+    arena->used = 0;
+    arena->outer = NULL;
+    return arena;
+}
+
+void arena_free(arena_t* arena)
+{
+    // A compile stopped by panic() never left its arena
+    if (current == arena)
+        current = arena->outer;
+
+    for (size_t i = arena->used; i > 0; i--)
+        arena->owned[i - 1].release(arena->owned[i - 1].object);
+
+    free(arena->owned);
+    free(arena);
+}
+
+void arena_enter(arena_t* arena)
+{
+    arena->outer = current;
+    current = arena;
+}
+
+void arena_leave(arena_t* arena)
+{
+    current = arena->outer;
+}
+
+void* arena_own(void* object, arena_release_t release)
+{
+    arena_t* arena = current;
+
+    if (arena == NULL)
+        return object;
+
+    if (arena->used == arena->size)
+    {
+        arena->size = arena->size == 0 ? 64 : arena->size * 2;
+        arena->owned = realloc(arena->owned, sizeof (owned_t) * arena->size);
+    }
+
+    arena->owned[arena->used].object = object;
+    arena->owned[arena->used].release = release;
+    arena->used++;
+    return object;
+}
+
+void* arena_alloc(size_t size)
+{
+    return arena_own(malloc(size), free);
+}
+
+static void release_vector(void* vector)
+{
+    vec_free(vector);
+}
+
+vector_t* arena_vec_new()
+{
+    return arena_own(vec_new(0), release_vector);
+}
@@ -0,0 +1,38 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include "vector.h"
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+// The objects a compile makes for the tree: nodes, scopes, symbols and the
+// vectors hanging off them. The passes rewrite and share parts of the tree,
+// so nothing frees them one by one; they all go with the arena of the
+// session (parser.h), also when the compile stops on an error.
+typedef struct arena_t arena_t;
+
+typedef void (*arena_release_t)(void* object);
+
+arena_t* arena_new();
+// Releases everything the arena owns, the newest object first
+void arena_free(arena_t* arena);
+// Makes `arena` the owner of what this thread makes until arena_leave
+void arena_enter(arena_t* arena);
+void arena_leave(arena_t* arena);
+// Hands `object` to the arena of this thread, to be released with
+// `release`. Outside of any arena the object is not owned by anyone.
+void* arena_own(void* object, arena_release_t release);
+// malloc, owned by the arena of this thread
+void* arena_alloc(size_t size);
+// vec_new, owned by the arena of this thread
+vector_t* arena_vec_new();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* ARENA_H */
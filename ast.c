@@ -4,8 +4,10 @@
 #include "panic.h"
 #include "utf8.h"
 #include "builtin.h"
+#include "arena.h"
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
 #include <stdio.h>
 #include <stddef.h>
 
@@ -21,48 +23,46 @@ void halt()
 
 // Helper function to check if a type is an integer type
 // Java strategy: only signed integers are supported
-static bool is_integer_type(type_t type)
+bool_t is_integer_type(type_t type)
 {
     return type == MT_INT8 || type == MT_INT16 || type == MT_INT32 || type == MT_INT64;
 }
 
-// Helper function to emit constant opcode based on type
+bool_t is_kind(ast_t* ast, void* eval_func)
+{
+    return ast != NULL && ast->base->eval == (eval_t) eval_func;
+}
+
+// Helper function to read an integer constant as int64
+int64_t integer_value(type_t type, value_t value)
+{
+    switch (type) {
+        case MT_INT8:  return (int64_t)value.as_int8;
+        case MT_INT16: return (int64_t)value.as_int16;
+        case MT_INT32: return (int64_t)value.as_int32;
+        default:       return value.as_int64;
+    }
+}
+
+// Helper function to emit constant opcode based on type. The value, not
+// the declared type, picks the shortest encoding: every form is sign
+// extended to int64 on the stack.
 static void emit_integer_constant(type_t type, value_t value)
 {
-    // Use optimized constants for 0 and 1
-    if (type == MT_INT8 || type == MT_INT16 || type == MT_INT32 || type == MT_INT64) {
-        int64_t val;
-        switch (type) {
-            case MT_INT8:  val = (int64_t)value.as_int8; break;
-            case MT_INT16: val = (int64_t)value.as_int16; break;
-            case MT_INT32: val = (int64_t)value.as_int32; break;
-            case MT_INT64: val = value.as_int64; break;
-            default: return;
-        }
-        if (val == 0) {
-            EMIT(ICONST_0);
-        } else if (val == 1) {
-            EMIT(ICONST_1);
-        } else {
-            // Use type-specific opcodes for shorter bytecode
-            switch (type) {
-                case MT_INT8:
-                    EMIT(I8CONST, NUM8((int8_t)val));
-                    break;
-                case MT_INT16:
-                    EMIT(I16CONST, NUM16((int16_t)val));
-                    break;
-                case MT_INT32:
-                    EMIT(I32CONST, NUM32((int32_t)val));
-                    break;
-                case MT_INT64:
-                    EMIT(ICONST, NUM64(val));
-                    break;
-                default:
-                    EMIT(ICONST, NUM64(val));
-                    break;
-            }
-        }
+    int64_t val = integer_value(type, value);
+
+    if (val == 0) {
+        EMIT(ICONST_0);
+    } else if (val == 1) {
+        EMIT(ICONST_1);
+    } else if (val >= INT8_MIN && val <= INT8_MAX) {
+        EMIT(I8CONST, NUM8((int8_t)val));
+    } else if (val >= INT16_MIN && val <= INT16_MAX) {
+        EMIT(I16CONST, NUM16((int16_t)val));
+    } else if (val >= INT32_MIN && val <= INT32_MAX) {
+        EMIT(I32CONST, NUM32((int32_t)val));
+    } else {
+        EMIT(ICONST, NUM64(val));
     }
 }
 
@@ -101,7 +101,7 @@ type_t eval_constant(ast_constant_t* ast)
     }
     else if (ast->type == MT_REAL)
     {
-        if (ast->value.as_real == 0.0)
+        if (ast->value.as_real == 0.0 && !signbit(ast->value.as_real))
         {
             EMIT(RCONST_0);
         }
@@ -116,8 +116,7 @@ type_t eval_constant(ast_constant_t* ast)
     }
     else if (ast->type == MT_STR)
     {
-        uint16_t a = vm_data_addr();
-        vm_data_emit((uint8_t*)ast->value.as_str, utf8size((utf8_int8_t*)ast->value.as_str));
+        uint16_t a = vm_data_string(ast->value.as_str);
         EMIT(SCONST, NUM16(a));
     }
     return ast->type;
@@ -141,14 +140,9 @@ type_t eval_variable(ast_variable_t* ast)
     return var_type;
 }
 
-// Forward declarations for type inference
-type_t eval_unary(ast_unary_t* ast);
-type_t eval_binary(ast_binary_t* ast);
-type_t eval_func_call(ast_func_call_t* ast);
-
 // Helper function to infer the type of an AST node without emitting code
 // This recursively determines types for all expression types
-static type_t infer_type(ast_t* ast)
+type_t infer_type(ast_t* ast)
 {
     if (ast == NULL)
         return MT_UNKNOWN;
@@ -185,6 +179,11 @@ static type_t infer_type(ast_t* ast)
         ast_binary_t* binary = (ast_binary_t*) ast;
         type_t l_type = infer_type(binary->lhs_expr);
         type_t r_type = infer_type(binary->rhs_expr);
+
+        // `and` and `or` select 1 or 0 by the truth of their operands, which
+        // may be integers or reals in any mix
+        if (binary->op == TK_AND || binary->op == TK_OR)
+            return MT_INT64;
         
         // Binary operations on integers normalize to int64
         if (is_integer_type(l_type) && is_integer_type(r_type))
@@ -207,11 +206,40 @@ static type_t infer_type(ast_t* ast)
         return ret_type;
     }
     
+    if (ast->base->eval == (eval_t) eval_inline)
+        return ((ast_inline_t*) ast)->ret_type;
+
     // For other expression types, we can't infer without evaluating
     // This should not happen for type checking purposes
     return MT_UNKNOWN;
 }
 
+void check_logical(ast_binary_t* ast)
+{
+    if (infer_type(ast->lhs_expr) == MT_STR || infer_type(ast->rhs_expr) == MT_STR)
+        panic("Binary error");
+}
+
+// Helper functions to recognise the operand shapes covered by the
+// superinstructions (ILOAD_ILOAD_IADD, ILOAD_ICONST, IINC_LOCAL, I*_JEZ)
+static bool_t is_integer_variable(ast_t* ast)
+{
+    return ast != NULL && ast->base->eval == (eval_t) eval_variable &&
+           is_integer_type(((ast_variable_t*) ast)->symbol->type);
+}
+
+static bool_t is_integer_constant(ast_t* ast)
+{
+    int64_t x;
+    return integer_constant(ast, &x);
+}
+
+static int64_t constant_value(ast_t* ast)
+{
+    ast_constant_t* constant = (ast_constant_t*) ast;
+    return integer_value(constant->type, constant->value);
+}
+
 // Helper function to get the original type of an AST node for type checking
 // This uses infer_type to avoid emitting code during type checking
 static type_t get_expr_type_for_checking(ast_t* ast)
@@ -265,11 +293,31 @@ type_t eval_unary(ast_unary_t* ast)
     return MT_UNKNOWN;
 }
 
-type_t eval_binary(ast_binary_t* ast)
+// Emits both operands of a binary expression. An integer local compared or
+// combined with a constant is pushed by a single ILOAD_ICONST.
+static void eval_operands(ast_binary_t* ast, type_t* l_out, type_t* r_out)
 {
-    type_t l_out = eval(ast->lhs_expr);
-    type_t r_out = eval(ast->rhs_expr);
+    if (is_integer_variable(ast->lhs_expr) && is_integer_constant(ast->rhs_expr))
+    {
+        symbol_t* symbol = ((ast_variable_t*) ast->lhs_expr)->symbol;
+        int64_t value = constant_value(ast->rhs_expr);
 
+        if (value >= INT32_MIN && value <= INT32_MAX)
+        {
+            EMIT(ILOAD_ICONST, NUM16(symbol->addr), NUM32(value));
+            *l_out = symbol->type;
+            *r_out = MT_INT64;
+            return;
+        }
+    }
+
+    *l_out = eval(ast->lhs_expr);
+    *r_out = eval(ast->rhs_expr);
+}
+
+// Emits the opcode of a binary operator for already evaluated operands
+static type_t emit_binary(token_type_t op, type_t l_out, type_t r_out)
+{
     if (is_integer_type(l_out) && is_integer_type(r_out))
     {
         // Convert both operands to int64 for operations if not already
@@ -280,7 +328,7 @@ type_t eval_binary(ast_binary_t* ast)
             emit_conversion(r_out, MT_INT64);
         }
         // Operations work on int64
-        switch (ast->op)
+        switch (op)
         {
         case TK_PLUS:
             EMIT(IADD);
@@ -324,13 +372,12 @@ type_t eval_binary(ast_binary_t* ast)
         case TK_XOR_BIT:
             EMIT(IBXOR);
             break;
-        case TK_AND:
-            EMIT(IAND);
+        case TK_SHL:
+            EMIT(ISHL);
             break;
-        case TK_OR:
-            EMIT(IOR);
+        case TK_SHR:
+            EMIT(ISHR);
             break;
-        // Note: Shift operators (ISHL, ISHR) exist in VM but no token types yet
         default:
             ;
         }
@@ -338,7 +385,7 @@ type_t eval_binary(ast_binary_t* ast)
     }
     else if (l_out == MT_REAL && r_out == MT_REAL)
     {
-        switch (ast->op)
+        switch (op)
         {
         case TK_PLUS:
             EMIT(RADD);
@@ -386,8 +433,268 @@ type_t eval_binary(ast_binary_t* ast)
     return MT_UNKNOWN;
 }
 
+static type_t eval_logical(ast_binary_t* ast);
+
+type_t eval_binary(ast_binary_t* ast)
+{
+    if (ast->op == TK_AND || ast->op == TK_OR)
+        return eval_logical(ast);
+
+    // Sum of two integer locals
+    if (ast->op == TK_PLUS && is_integer_variable(ast->lhs_expr) && is_integer_variable(ast->rhs_expr))
+    {
+        uint16_t lhs_addr = ((ast_variable_t*) ast->lhs_expr)->symbol->addr;
+        uint16_t rhs_addr = ((ast_variable_t*) ast->rhs_expr)->symbol->addr;
+        EMIT(ILOAD_ILOAD_IADD, NUM16(lhs_addr), NUM16(rhs_addr));
+        return MT_INT64;
+    }
+
+    type_t l_out;
+    type_t r_out;
+
+    eval_operands(ast, &l_out, &r_out);
+
+    return emit_binary(ast->op, l_out, r_out);
+}
+
+// Helper function to map an integer comparison to its compare-and-branch
+static uint8_t compare_jez_opcode(token_type_t op)
+{
+    switch (op)
+    {
+    case TK_GT:  return IGT_JEZ;
+    case TK_LT:  return ILT_JEZ;
+    case TK_GTE: return IGE_JEZ;
+    case TK_LTE: return ILE_JEZ;
+    case TK_EQ:  return IEQ_JEZ;
+    case TK_NE:  return INQ_JEZ;
+    default:     return NOP;
+    }
+}
+
+// Same for real comparisons
+static uint8_t real_compare_jez_opcode(token_type_t op)
+{
+    switch (op)
+    {
+    case TK_GT:  return RGT_JEZ;
+    case TK_LT:  return RLT_JEZ;
+    case TK_GTE: return RGE_JEZ;
+    case TK_LTE: return RLE_JEZ;
+    case TK_EQ:  return REQ_JEZ;
+    case TK_NE:  return RNQ_JEZ;
+    default:     return NOP;
+    }
+}
+
+// Integer compare-and-branch that jumps when the comparison holds. Its
+// negation is exact for integers only: a real NaN compares false both ways.
+static uint8_t compare_jnz_opcode(token_type_t op)
+{
+    switch (op)
+    {
+    case TK_GT:  return ILE_JEZ;
+    case TK_LT:  return IGE_JEZ;
+    case TK_GTE: return ILT_JEZ;
+    case TK_LTE: return IGT_JEZ;
+    case TK_EQ:  return INQ_JEZ;
+    case TK_NE:  return IEQ_JEZ;
+    default:     return NOP;
+    }
+}
+
+static bool_t is_logical(ast_t* ast, token_type_t op)
+{
+    return ast != NULL && ast->base->eval == (eval_t) eval_binary &&
+           ((ast_binary_t*) ast)->op == op;
+}
+
+static void eval_jump_if_true(ast_t* condition, jump_t* target);
+
+// Emits a condition that jumps to `target` when it is false and falls
+// through when it is true. `and` and `or` short-circuit: their operands
+// branch on their own and no boolean is materialized. Comparisons fuse
+// into one compare-and-branch opcode of their numeric family, and other
+// conditions branch with the JEZ of their static type.
+static void eval_jump_if_false(ast_t* condition, jump_t* target)
+{
+    if (is_logical(condition, TK_AND))
+    {
+        ast_binary_t* binary = (ast_binary_t*) condition;
+        check_logical(binary);
+        eval_jump_if_false(binary->lhs_expr, target);
+        eval_jump_if_false(binary->rhs_expr, target);
+        return;
+    }
+
+    if (is_logical(condition, TK_OR))
+    {
+        ast_binary_t* binary = (ast_binary_t*) condition;
+        check_logical(binary);
+        jump_t* taken = jump_new();
+        eval_jump_if_true(binary->lhs_expr, taken);
+        eval_jump_if_false(binary->rhs_expr, target);
+        jump_label(taken);
+        jump_fix(taken);
+        jump_free(taken);
+        return;
+    }
+
+    if (condition != NULL && condition->base->eval == (eval_t) eval_binary)
+    {
+        ast_binary_t* binary = (ast_binary_t*) condition;
+        uint8_t opcode = compare_jez_opcode(binary->op);
+
+        if (opcode != NOP)
+        {
+            type_t l_out;
+            type_t r_out;
+
+            eval_operands(binary, &l_out, &r_out);
+
+            if (is_integer_type(l_out) && is_integer_type(r_out))
+            {
+                EMIT(opcode);
+            }
+            else if (l_out == MT_REAL && r_out == MT_REAL)
+            {
+                EMIT(real_compare_jez_opcode(binary->op));
+            }
+            else
+            {
+                type_t type = emit_binary(binary->op, l_out, r_out);
+                EMIT(type == MT_REAL ? RJEZ : JEZ);
+            }
+            jump_to(target);
+            return;
+        }
+    }
+
+    type_t type = eval(condition);
+    EMIT(type == MT_REAL ? RJEZ : JEZ);
+    jump_to(target);
+}
+
+// Emits a condition that jumps to `target` when it is true and falls
+// through when it is false
+static void eval_jump_if_true(ast_t* condition, jump_t* target)
+{
+    if (is_logical(condition, TK_OR))
+    {
+        ast_binary_t* binary = (ast_binary_t*) condition;
+        check_logical(binary);
+        eval_jump_if_true(binary->lhs_expr, target);
+        eval_jump_if_true(binary->rhs_expr, target);
+        return;
+    }
+
+    if (is_logical(condition, TK_AND))
+    {
+        ast_binary_t* binary = (ast_binary_t*) condition;
+        check_logical(binary);
+        jump_t* skip = jump_new();
+        eval_jump_if_false(binary->lhs_expr, skip);
+        eval_jump_if_true(binary->rhs_expr, target);
+        jump_label(skip);
+        jump_fix(skip);
+        jump_free(skip);
+        return;
+    }
+
+    if (condition != NULL && condition->base->eval == (eval_t) eval_binary)
+    {
+        ast_binary_t* binary = (ast_binary_t*) condition;
+        uint8_t opcode = compare_jnz_opcode(binary->op);
+
+        if (opcode != NOP)
+        {
+            type_t l_out;
+            type_t r_out;
+
+            eval_operands(binary, &l_out, &r_out);
+
+            if (is_integer_type(l_out) && is_integer_type(r_out))
+            {
+                EMIT(opcode);
+            }
+            else
+            {
+                type_t type = emit_binary(binary->op, l_out, r_out);
+                EMIT(type == MT_REAL ? RJNZ : JNZ);
+            }
+            jump_to(target);
+            return;
+        }
+    }
+
+    type_t type = eval(condition);
+    EMIT(type == MT_REAL ? RJNZ : JNZ);
+    jump_to(target);
+}
+
+// `and` and `or` as values: the short-circuit branches select 1 or 0
+static type_t eval_logical(ast_binary_t* ast)
+{
+    jump_t* is_false = jump_new();
+    jump_t* exit_addr = jump_new();
+
+    eval_jump_if_false((ast_t*) ast, is_false);
+
+    EMIT(ICONST_1, JMP);
+    jump_to(exit_addr);
+
+    jump_label(is_false);
+    EMIT(ICONST_0);
+
+    jump_label(exit_addr);
+
+    jump_fix(is_false);
+    jump_fix(exit_addr);
+    jump_free(is_false);
+    jump_free(exit_addr);
+
+    return MT_INT64;
+}
+
+// Helper function to match `x = x + k` and `x = x - k` with a small k
+static bool_t is_local_increment(ast_assign_t* ast, int8_t* delta)
+{
+    if (ast->expr == NULL || ast->expr->base->eval != (eval_t) eval_binary)
+        return false;
+
+    ast_binary_t* binary = (ast_binary_t*) ast->expr;
+
+    if (binary->op != TK_PLUS && binary->op != TK_MINUS)
+        return false;
+
+    if (!is_integer_variable(binary->lhs_expr) ||
+        ((ast_variable_t*) binary->lhs_expr)->symbol != ast->symbol ||
+        !is_integer_constant(binary->rhs_expr))
+        return false;
+
+    int64_t value = constant_value(binary->rhs_expr);
+
+    if (binary->op == TK_MINUS)
+        value = -value;
+
+    if (value < INT8_MIN || value > INT8_MAX)
+        return false;
+
+    *delta = (int8_t) value;
+    return true;
+}
+
 type_t eval_assign(ast_assign_t* ast)
 {
+    int8_t delta;
+
+    // In-place increment of an i64 local (narrower types need a cast)
+    if (ast->symbol->type == MT_INT64 && is_local_increment(ast, &delta))
+    {
+        EMIT(IINC_LOCAL, NUM16(ast->symbol->addr), NUM8(delta));
+        return MT_INT64;
+    }
+
     type_t expr_type = eval(ast->expr);
     type_t var_type = ast->symbol->type;
     uint16_t addr = ast->symbol->addr;
@@ -441,11 +748,7 @@ type_t eval_if_cond(ast_if_cond_t* ast)
     jump_t* else_addr = jump_new();
     jump_t* exit_addr = jump_new();
 
-    eval(ast->condition);
-
-    EMIT(JEZ);
-
-    jump_to(else_addr);
+    eval_jump_if_false(ast->condition, else_addr);
 
     eval(ast->if_then);
 
@@ -462,6 +765,8 @@ type_t eval_if_cond(ast_if_cond_t* ast)
 
     jump_fix(else_addr);
     jump_fix(exit_addr);
+    jump_free(else_addr);
+    jump_free(exit_addr);
 
     return MT_UNKNOWN;
 }
@@ -475,11 +780,7 @@ type_t eval_for_loop(ast_for_loop_t* ast)
 
     jump_label(ast->loop->begin);
 
-    eval(ast->condition);
-
-    EMIT(JEZ);
-
-    jump_to(ast->loop->end);
+    eval_jump_if_false(ast->condition, ast->loop->end);
 
     eval(ast->body);
 
@@ -500,8 +801,35 @@ type_t eval_for_loop(ast_for_loop_t* ast)
     return MT_UNKNOWN;
 }
 
+// Function whose body is being emitted, NULL in the global block
+static _Thread_local ast_func_decl_t* current_func = NULL;
+
+static type_t normalized_ret_type(type_t ret_type)
+{
+    return ret_type == MT_UNKNOWN || ret_type == MT_VOID ? MT_INT64 : ret_type;
+}
+
+ast_func_call_t* tail_call(ast_func_return_t* ast, ast_func_decl_t* func)
+{
+    if (func == NULL || ast->expr == NULL || ast->expr->base->eval != (eval_t) eval_func_call)
+        return NULL;
+
+    ast_func_call_t* call = (ast_func_call_t*) ast->expr;
+
+    if (call->symbol->addr == SYMBOL_BUILTIN_ADDR)
+        return NULL;
+
+    // The caller of `func` converts the result to the return type of
+    // `func`, so only a callee with the same return type can skip it
+    if (normalized_ret_type(call->symbol->extra.func.ret_type) != normalized_ret_type(func->ret_type))
+        return NULL;
+
+    return call;
+}
+
 type_t eval_func_decl(ast_func_decl_t* ast)
 {
+    ast_func_decl_t* enclosing = current_func;
     jump_t* func_end = jump_new();
     jump_t* func_beg = jump_new();
 
@@ -515,7 +843,9 @@ type_t eval_func_decl(ast_func_decl_t* ast)
 
     ast->symbol->addr = func_beg->label;
 
+    current_func = ast;
     eval((ast_t*) ast->body);
+    current_func = enclosing;
 
     EMIT(ICONST_0, RET);
 
@@ -523,12 +853,30 @@ type_t eval_func_decl(ast_func_decl_t* ast)
 
     jump_fix(func_end);
     jump_fix(func_beg);
+    jump_free(func_end);
+    jump_free(func_beg);
 
     return MT_UNKNOWN;
 }
 
+static void eval_call_args(ast_func_call_t* ast);
+
 type_t eval_func_return(ast_func_return_t* ast)
 {
+    ast_func_call_t* call = tail_call(ast, current_func);
+
+    if (call != NULL)
+    {
+        eval_call_args(call);
+        uint32_t addr = call->symbol->addr;
+
+        if (addr <= UINT16_MAX)
+            EMIT(TAILCALL, NUM16(addr), NUM16(vec_size(call->args)));
+        else
+            EMIT(TAILCALL_W, NUM32(addr), NUM16(vec_size(call->args)));
+        return normalized_ret_type(call->symbol->extra.func.ret_type);
+    }
+
     type_t out = eval(ast->expr);
     // Note: Return type conversion should be handled at function call site
     // For now, we return the expression type
@@ -537,7 +885,7 @@ type_t eval_func_return(ast_func_return_t* ast)
 }
 
 // Helper function to check if a type is in the acceptable types array
-static bool is_type_acceptable(type_t type, const type_t* acceptable_types)
+static bool_t is_type_acceptable(type_t type, const type_t* acceptable_types)
 {
     if (acceptable_types == NULL)
         return true;  // No type restrictions
@@ -640,14 +988,9 @@ static type_t eval_builtin_func(ast_func_call_t* ast)
     return builtin->ret_type;
 }
 
-type_t eval_func_call(ast_func_call_t* ast)
+// Checks the arguments of a user function call against its parameters
+static void check_call_args(ast_func_call_t* ast)
 {
-    // Check if this is a builtin function (marked by special addr value)
-    if (ast->symbol->addr == 0xFFFF)
-    {
-        return eval_builtin_func(ast);
-    }
-    
     // Regular user function call - check argument types
     if (ast->symbol->extra.func.param_types == NULL)
     {
@@ -681,20 +1024,38 @@ type_t eval_func_call(ast_func_call_t* ast)
             panic("Function argument type mismatch.");
         }
     }
-    
+}
+
+// Checks the arguments of a user function call and pushes them
+static void eval_call_args(ast_func_call_t* ast)
+{
+    check_call_args(ast);
+
     // Now evaluate all arguments to emit code
     for (size_t i = 0; i < vec_size(ast->args); i++)
     {
         eval(vec_get(ast->args, i));
     }
-    
-    EMIT(CALL, NUM16(ast->symbol->addr));
+}
+
+type_t eval_func_call(ast_func_call_t* ast)
+{
+    // Check if this is a builtin function (marked by special addr value)
+    if (ast->symbol->addr == SYMBOL_BUILTIN_ADDR)
+    {
+        return eval_builtin_func(ast);
+    }
+
+    eval_call_args(ast);
+
+    // Functions are defined before their calls, so the address is known
+    if (ast->symbol->addr <= UINT16_MAX)
+        EMIT(CALL, NUM16(ast->symbol->addr));
+    else
+        EMIT(CALL_W, NUM32(ast->symbol->addr));
     
     // Get function's return type and convert if needed
-    type_t ret_type = ast->symbol->extra.func.ret_type;
-    if (ret_type == MT_UNKNOWN || ret_type == MT_VOID) {
-        ret_type = MT_INT64;  // Default to int64 if not set
-    }
+    type_t ret_type = normalized_ret_type(ast->symbol->extra.func.ret_type);
     
     // Function returns int64 on stack, convert to declared return type
     if (is_integer_type(ret_type)) {
@@ -704,6 +1065,44 @@ type_t eval_func_call(ast_func_call_t* ast)
     return ret_type;
 }
 
+// End of the inlined body being emitted, where its returns jump to
+static _Thread_local jump_t* inline_end = NULL;
+
+type_t eval_inline(ast_inline_t* ast)
+{
+    jump_t* enclosing = inline_end;
+
+    // The body assigns the arguments to the parameters; the checks are the
+    // ones of the call
+    check_call_args(ast->call);
+
+    inline_end = jump_new();
+
+    eval((ast_t*) ast->body);
+
+    // Falling off the end yields 0, like the ICONST_0 RET of a function
+    EMIT(ICONST_0);
+
+    jump_label(inline_end);
+    jump_fix(inline_end);
+    jump_free(inline_end);
+    inline_end = enclosing;
+
+    // Same conversion as after the CALL
+    if (is_integer_type(ast->ret_type))
+        emit_conversion(MT_INT64, ast->ret_type);
+
+    return ast->ret_type;
+}
+
+type_t eval_inline_return(ast_func_return_t* ast)
+{
+    type_t out = eval(ast->expr);
+    EMIT(JMP);
+    jump_to(inline_end);
+    return out;
+}
+
 type_t eval_break_loop(ast_break_loop_t* ast)
 {
     EMIT(JMP);
@@ -722,9 +1121,71 @@ type_t eval_continue_loop(ast_continue_loop_t* ast)
     return MT_UNKNOWN;
 }
 
+bool_t integer_constant(ast_t* ast, int64_t* x)
+{
+    if (!is_kind(ast, eval_constant))
+        return false;
+
+    ast_constant_t* constant = (ast_constant_t*) ast;
+
+    if (constant->opcode != 0 || !is_integer_type(constant->type))
+        return false;
+
+    *x = integer_value(constant->type, constant->value);
+    return true;
+}
+
+static void visit_nodes(vector_t* nodes, ast_visit_t visit, void* data)
+{
+    for (size_t i = 0; i < vec_size(nodes); i++)
+        if (vec_get(nodes, i) != NULL)
+            vec_set(nodes, i, visit(vec_get(nodes, i), data));
+}
+
+#define VISIT(child) do { if ((child) != NULL) (child) = visit((ast_t*) (child), data); } while (0)
+
+void ast_visit_children(ast_t* ast, ast_visit_t visit, void* data)
+{
+    if (is_kind(ast, eval_unary))
+        VISIT(((ast_unary_t*) ast)->expr);
+    else if (is_kind(ast, eval_binary))
+    {
+        ast_binary_t* binary = (ast_binary_t*) ast;
+        VISIT(binary->lhs_expr);
+        VISIT(binary->rhs_expr);
+    }
+    else if (is_kind(ast, eval_assign))
+        VISIT(((ast_assign_t*) ast)->expr);
+    else if (is_kind(ast, eval_block))
+        visit_nodes(((ast_block_t*) ast)->nodes, visit, data);
+    else if (is_kind(ast, eval_if_cond))
+    {
+        ast_if_cond_t* if_cond = (ast_if_cond_t*) ast;
+        VISIT(if_cond->condition);
+        VISIT(if_cond->if_then);
+        VISIT(if_cond->if_else);
+    }
+    else if (is_kind(ast, eval_for_loop))
+    {
+        ast_for_loop_t* for_loop = (ast_for_loop_t*) ast;
+        VISIT(for_loop->init);
+        VISIT(for_loop->condition);
+        VISIT(for_loop->post);
+        VISIT(for_loop->body);
+    }
+    else if (is_kind(ast, eval_func_decl))
+        visit((ast_t*) ((ast_func_decl_t*) ast)->body, data);
+    else if (is_kind(ast, eval_func_return) || is_kind(ast, eval_inline_return))
+        VISIT(((ast_func_return_t*) ast)->expr);
+    else if (is_kind(ast, eval_func_call))
+        visit_nodes(((ast_func_call_t*) ast)->args, visit, data);
+    else if (is_kind(ast, eval_inline))
+        visit((ast_t*) ((ast_inline_t*) ast)->body, data);
+}
+
 ast_t* ast_new()
 {
-    ast_t* ast = malloc(sizeof (ast_t));
+    ast_t* ast = arena_alloc(sizeof (ast_t));
     ast->base = NULL;
     ast->eval = NULL;
     return ast;
@@ -732,7 +1193,7 @@ ast_t* ast_new()
 
 ast_constant_t* ast_new_constant(type_t type, value_t value)
 {
-    ast_constant_t* ast_constant = malloc(sizeof (ast_constant_t));
+    ast_constant_t* ast_constant = arena_alloc(sizeof (ast_constant_t));
     ast_constant->base = ast_new();
     ast_constant->base->eval = (eval_t) eval_constant;
     ast_constant->type = type;
@@ -741,9 +1202,16 @@ ast_constant_t* ast_new_constant(type_t type, value_t value)
     return ast_constant;
 }
 
+ast_t* ast_new_integer(int64_t x)
+{
+    value_t value;
+    value.as_int64 = x;
+    return (ast_t*) ast_new_constant(MT_INT64, value);
+}
+
 ast_constant_t* ast_new_builtin_constant(type_t type, uint8_t opcode)
 {
-    ast_constant_t* ast_constant = malloc(sizeof (ast_constant_t));
+    ast_constant_t* ast_constant = arena_alloc(sizeof (ast_constant_t));
     ast_constant->base = ast_new();
     ast_constant->base->eval = (eval_t) eval_constant;
     ast_constant->type = type;
@@ -754,7 +1222,7 @@ ast_constant_t* ast_new_builtin_constant(type_t type, uint8_t opcode)
 
 ast_unary_t* ast_new_unary(token_type_t op, ast_t* expr)
 {
-    ast_unary_t* ast_unary = malloc(sizeof (ast_unary_t));
+    ast_unary_t* ast_unary = arena_alloc(sizeof (ast_unary_t));
     ast_unary->base = ast_new();
     ast_unary->base->eval = (eval_t) eval_unary;
     ast_unary->op = op;
@@ -764,7 +1232,7 @@ ast_unary_t* ast_new_unary(token_type_t op, ast_t* expr)
 
 ast_binary_t* ast_new_binary(token_type_t op, ast_t* lhs_expr, ast_t* rhs_expr)
 {
-    ast_binary_t* ast_binary = malloc(sizeof (ast_binary_t));
+    ast_binary_t* ast_binary = arena_alloc(sizeof (ast_binary_t));
     ast_binary->base = ast_new();
     ast_binary->base->eval = (eval_t) eval_binary;
     ast_binary->op = op;
@@ -775,7 +1243,7 @@ ast_binary_t* ast_new_binary(token_type_t op, ast_t* lhs_expr, ast_t* rhs_expr)
 
 ast_variable_t* ast_new_variable(symbol_t* symbol)
 {
-    ast_variable_t* ast_variable = malloc(sizeof (ast_variable_t));
+    ast_variable_t* ast_variable = arena_alloc(sizeof (ast_variable_t));
     ast_variable->base = ast_new();
     ast_variable->base->eval = (eval_t) eval_variable;
     ast_variable->symbol = symbol;
@@ -784,7 +1252,7 @@ ast_variable_t* ast_new_variable(symbol_t* symbol)
 
 ast_assign_t* ast_new_assign(symbol_t* symbol, ast_t* expr)
 {
-    ast_assign_t* ast_assign = malloc(sizeof (ast_assign_t));
+    ast_assign_t* ast_assign = arena_alloc(sizeof (ast_assign_t));
     ast_assign->base = ast_new();
     ast_assign->base->eval = (eval_t) eval_assign;
     ast_assign->symbol = symbol;
@@ -794,17 +1262,17 @@ ast_assign_t* ast_new_assign(symbol_t* symbol, ast_t* expr)
 
 ast_block_t* ast_new_block(context_t* context)
 {
-    ast_block_t* ast_block = malloc(sizeof (ast_block_t));
+    ast_block_t* ast_block = arena_alloc(sizeof (ast_block_t));
     ast_block->base = ast_new();
     ast_block->base->eval = (eval_t) eval_block;
     ast_block->context = context;
-    ast_block->nodes = vec_new(0);
+    ast_block->nodes = arena_vec_new();
     return ast_block;
 }
 
 ast_if_cond_t* ast_new_if_cond(ast_t* condition, ast_t* if_then, ast_t* if_else)
 {
-    ast_if_cond_t* ast_if_cond = malloc(sizeof (ast_if_cond_t));
+    ast_if_cond_t* ast_if_cond = arena_alloc(sizeof (ast_if_cond_t));
     ast_if_cond->base = ast_new();
     ast_if_cond->base->eval = (eval_t) eval_if_cond;
     ast_if_cond->condition = condition;
@@ -815,7 +1283,7 @@ ast_if_cond_t* ast_new_if_cond(ast_t* condition, ast_t* if_then, ast_t* if_else)
 
 ast_for_loop_t* ast_new_for_loop(ast_t* init, ast_t* condition, ast_t* post, ast_t* body)
 {
-    ast_for_loop_t* ast_for_loop = malloc(sizeof (ast_for_loop_t));
+    ast_for_loop_t* ast_for_loop = arena_alloc(sizeof (ast_for_loop_t));
     ast_for_loop->base = ast_new();
     ast_for_loop->base->eval = (eval_t) eval_for_loop;
     ast_for_loop->init = init;
@@ -828,7 +1296,7 @@ ast_for_loop_t* ast_new_for_loop(ast_t* init, ast_t* condition, ast_t* post, ast
 
 ast_func_decl_t* ast_new_func_decl(symbol_t* symbol, ast_block_t* body, uint16_t args, type_t ret_type)
 {
-    ast_func_decl_t* ast_func_decl = malloc(sizeof (ast_func_decl_t));
+    ast_func_decl_t* ast_func_decl = arena_alloc(sizeof (ast_func_decl_t));
     ast_func_decl->base = ast_new();
     ast_func_decl->base->eval = (eval_t) eval_func_decl;
     ast_func_decl->symbol = symbol;
@@ -840,7 +1308,7 @@ ast_func_decl_t* ast_new_func_decl(symbol_t* symbol, ast_block_t* body, uint16_t
 
 ast_func_return_t* ast_new_func_return(ast_t* expr)
 {
-    ast_func_return_t* ast_func_return = malloc(sizeof (ast_func_return_t));
+    ast_func_return_t* ast_func_return = arena_alloc(sizeof (ast_func_return_t));
     ast_func_return->base = ast_new();
     ast_func_return->base->eval = (eval_t) eval_func_return;
     ast_func_return->expr = expr;
@@ -849,7 +1317,7 @@ ast_func_return_t* ast_new_func_return(ast_t* expr)
 
 ast_func_call_t* ast_new_func_call(symbol_t* symbol, vector_t* args)
 {
-    ast_func_call_t* ast_func_call = malloc(sizeof (ast_func_call_t));
+    ast_func_call_t* ast_func_call = arena_alloc(sizeof (ast_func_call_t));
     ast_func_call->base = ast_new();
     ast_func_call->base->eval = (eval_t) eval_func_call;
     ast_func_call->symbol = symbol;
@@ -859,7 +1327,7 @@ ast_func_call_t* ast_new_func_call(symbol_t* symbol, vector_t* args)
 
 ast_break_loop_t* ast_new_break_loop(loop_t* loop)
 {
-    ast_break_loop_t* ast_break_loop = malloc(sizeof (ast_break_loop_t));
+    ast_break_loop_t* ast_break_loop = arena_alloc(sizeof (ast_break_loop_t));
     ast_break_loop->base = ast_new();
     ast_break_loop->base->eval = (eval_t) eval_break_loop;
     ast_break_loop->loop = loop;
@@ -868,9 +1336,29 @@ ast_break_loop_t* ast_new_break_loop(loop_t* loop)
 
 ast_continue_loop_t* ast_new_continue_loop(loop_t* loop)
 {
-    ast_continue_loop_t* ast_continue_loop = malloc(sizeof (ast_continue_loop_t));
+    ast_continue_loop_t* ast_continue_loop = arena_alloc(sizeof (ast_continue_loop_t));
     ast_continue_loop->base = ast_new();
     ast_continue_loop->base->eval = (eval_t) eval_continue_loop;
     ast_continue_loop->loop = loop;
     return ast_continue_loop;
 }
+
+ast_inline_t* ast_new_inline(ast_func_call_t* call, ast_block_t* body, type_t ret_type)
+{
+    ast_inline_t* ast_inline = arena_alloc(sizeof (ast_inline_t));
+    ast_inline->base = ast_new();
+    ast_inline->base->eval = (eval_t) eval_inline;
+    ast_inline->call = call;
+    ast_inline->body = body;
+    ast_inline->ret_type = ret_type;
+    return ast_inline;
+}
+
+ast_func_return_t* ast_new_inline_return(ast_t* expr)
+{
+    ast_func_return_t* ast_func_return = arena_alloc(sizeof (ast_func_return_t));
+    ast_func_return->base = ast_new();
+    ast_func_return->base->eval = (eval_t) eval_inline_return;
+    ast_func_return->expr = expr;
+    return ast_func_return;
+}
@@ -125,12 +125,65 @@ typedef struct
     loop_t* loop;
 } ast_continue_loop_t;
 
+// A call replaced by the body of the callee (inline.h). The body stores the
+// arguments into copies of the parameters, then runs a copy of the callee
+// body in which every `ret` is an inline return. The call is kept for its
+// argument checks.
+typedef struct
+{
+    ast_t* base;
+    ast_func_call_t* call;
+    ast_block_t* body;
+    type_t ret_type;
+} ast_inline_t;
+
 type_t eval(ast_t* ast);
 void halt();
 
+// Node evaluators; a node's kind is told apart by comparing ast->base->eval
+type_t eval_constant(ast_constant_t* ast);
+type_t eval_variable(ast_variable_t* ast);
+type_t eval_unary(ast_unary_t* ast);
+type_t eval_binary(ast_binary_t* ast);
+type_t eval_assign(ast_assign_t* ast);
+type_t eval_block(ast_block_t* ast);
+type_t eval_if_cond(ast_if_cond_t* ast);
+type_t eval_for_loop(ast_for_loop_t* ast);
+type_t eval_func_decl(ast_func_decl_t* ast);
+type_t eval_func_return(ast_func_return_t* ast);
+type_t eval_func_call(ast_func_call_t* ast);
+type_t eval_break_loop(ast_break_loop_t* ast);
+type_t eval_continue_loop(ast_continue_loop_t* ast);
+type_t eval_inline(ast_inline_t* ast);
+type_t eval_inline_return(ast_func_return_t* ast);
+
+// Type of an expression without emitting code
+type_t infer_type(ast_t* ast);
+// Panics unless both operands of `and` / `or` are numbers
+void check_logical(ast_binary_t* ast);
+
+// Helpers shared by the passes over the tree
+bool_t is_integer_type(type_t type);
+bool_t is_kind(ast_t* ast, void* eval_func);
+// An integer constant of any width as int64
+int64_t integer_value(type_t type, value_t value);
+// Whether `ast` is a plain integer constant, whose value goes to `x`
+bool_t integer_constant(ast_t* ast, int64_t* x);
+
+// Calls `visit` on each child of `ast` that is not NULL, in the order the
+// code runs, and puts back the node it returns. The body of a function is
+// a child of its declaration; the body of an inlined call is the only
+// child of the call, as the arguments are assigned there.
+typedef ast_t* (*ast_visit_t)(ast_t* ast, void* data);
+void ast_visit_children(ast_t* ast, ast_visit_t visit, void* data);
+
+// The call of `ret f(...)` when it can run as a tail call of `func`, or NULL
+ast_func_call_t* tail_call(ast_func_return_t* ast, ast_func_decl_t* func);
+
 ast_t* ast_new();
 ast_constant_t* ast_new_constant(type_t type, value_t value);
 ast_constant_t* ast_new_builtin_constant(type_t type, uint8_t opcode);
+ast_t* ast_new_integer(int64_t x);
 ast_unary_t* ast_new_unary(token_type_t op, ast_t* expr);
 ast_binary_t* ast_new_binary(token_type_t op, ast_t* lhs_expr, ast_t* rhs_expr);
 ast_print_t* ast_new_print(ast_t* expr);
@@ -144,6 +197,8 @@ ast_func_return_t* ast_new_func_return(ast_t* expr);
 ast_func_call_t* ast_new_func_call(symbol_t* symbol, vector_t* args);
 ast_break_loop_t* ast_new_break_loop(loop_t* loop);
 ast_continue_loop_t* ast_new_continue_loop(loop_t* loop);
+ast_inline_t* ast_new_inline(ast_func_call_t* call, ast_block_t* body, type_t ret_type);
+ast_func_return_t* ast_new_inline_return(ast_t* expr);
 
 // free them all
 
@@ -0,0 +1,15 @@
+#!/bin/sh
+# Runs every benchmark script with the given mirza binary and prints the
+# wall time of each run in milliseconds. Remaining arguments are passed to
+# mirza, e.g. `run.sh build/mirza --regvm`.
+MIRZA=${1:-build/mirza}
+DIR=$(dirname "$0")
+[ $# -gt 0 ] && shift
+
+for script in "$DIR"/*.lm
+do
+    start=$(date +%s%N)
+    "$MIRZA" "$@" "$script" > /dev/null
+    end=$(date +%s%N)
+    printf "%-12s %6d ms\n" "$(basename "$script" .lm)" $(( (end - start) / 1000000 ))
+done
@@ -0,0 +1,83 @@
+#include "cache.h"
+#include "mirza.h"
+#include "vm.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <sys/stat.h>
+
+// A changed compiler may emit other code for the same source, so the hash
+// of its sources, set by the Makefile, is part of the key with the versions
+#ifndef MIRZA_BUILD_ID
+#error "MIRZA_BUILD_ID must be set to a hash of the sources, see the Makefile"
+#endif
+
+static const char COMPILER_ID[] = MIRZA_VERSION " " MIRZA_BUILD_ID;
+
+static uint64_t fnv1a(uint64_t hash, const void* bytes, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        hash ^= ((const uint8_t*) bytes)[i];
+        hash *= 1099511628211u;
+    }
+    return hash;
+}
+
+bool_t cache_path(const char* dir, const char* source, size_t size,
+                  const parser_options_t* options, char* path)
+{
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST)
+        return false;
+
+    uint8_t flags[] = {
+        VM_IMAGE_VERSION,
+        options->peephole,
+        options->inlining,
+        options->dead_code,
+        options->use_ir,
+    };
+
+    uint64_t hash = 14695981039346656037u;
+    hash = fnv1a(hash, COMPILER_ID, sizeof (COMPILER_ID));
+    hash = fnv1a(hash, flags, sizeof (flags));
+    hash = fnv1a(hash, source, size);
+
+    int len = snprintf(path, CACHE_PATH_SIZE, "%s/%016" PRIx64 ".mzi", dir, hash);
+    return len > 0 && len < CACHE_PATH_SIZE;
+}
+
+bool_t cache_load(const char* path)
+{
+    if (access(path, R_OK) != 0)
+        return false;
+
+    // A truncated or corrupt entry is only a miss, and is dropped so the
+    // store that follows replaces it
+    if (!vm_try_load(path))
+    {
+        remove(path);
+        return false;
+    }
+
+    return true;
+}
+
+bool_t cache_store(const char* path)
+{
+    char temp[CACHE_PATH_SIZE + 32];
+    snprintf(temp, sizeof (temp), "%s.%ld.tmp", path, (long) getpid());
+
+    if (!vm_save(temp))
+        return false;
+
+    if (rename(temp, path) != 0)
+    {
+        remove(temp);
+        return false;
+    }
+
+    return true;
+}
@@ -0,0 +1,34 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include "types.h"
+#include "parser.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+// On-disk cache of compiled programs. An entry is the image (vm_save) of a
+// script in the cache directory, named by a hash of the source, the version
+// and the sources of the compiler and the options that change the code it
+// emits.
+
+#define CACHE_PATH_SIZE 4096
+
+// Fills `path` with the entry of the source. False when the directory is
+// missing and cannot be made.
+bool_t cache_path(const char* dir, const char* source, size_t size,
+                  const parser_options_t* options, char* path);
+// Makes the entry the current program. False on a miss, which a bad entry
+// is too: it is removed without a report.
+bool_t cache_load(const char* path);
+// Writes the current program as the entry. Concurrent writers of the same
+// entry are safe, the last one wins.
+bool_t cache_store(const char* path);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CACHE_H */
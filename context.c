@@ -1,13 +1,68 @@
 #include "context.h"
+#include "arena.h"
 #include <stdlib.h>
 #include <string.h>
 
-context_t * const global_context = &(context_t){NULL, MB_GLOBAL, NULL};
+#define TABLE_INITIAL 16
+
+// Ids are interned, so the pointer stands for the name
+static uint32_t hash_id(const char* id)
+{
+    return (uint32_t) (((uintptr_t) id >> 3) * 0x9E3779B97F4A7C15ull >> 32);
+}
+
+// The slot of `id` in the table of `context`, or the empty slot where it
+// would go
+static symbol_t** table_slot(context_t* context, const char* id)
+{
+    uint32_t mask = context->table_size - 1;
+
+    for (uint32_t i = hash_id(id) & mask; ; i = (i + 1) & mask)
+    {
+        symbol_t** slot = &context->table[i];
+        if (*slot == NULL || (*slot)->id == id)
+            return slot;
+    }
+}
+
+static void table_insert(context_t* context, symbol_t* symbol)
+{
+    if (2 * (vec_size(context->symbols) + 1) > context->table_size)
+    {
+        symbol_t** old = context->table;
+        uint32_t old_size = context->table_size;
+
+        context->table_size = old_size == 0 ? TABLE_INITIAL : old_size * 2;
+        context->table = calloc(context->table_size, sizeof (symbol_t*));
+
+        for (uint32_t i = 0; i < old_size; i++)
+            if (old[i] != NULL)
+                *table_slot(context, old[i]->id) = old[i];
+        free(old);
+    }
+
+    *table_slot(context, symbol->id) = symbol;
+}
+
+// The symbol `id` declared in `context` itself
+static symbol_t* table_get(context_t* context, const char* id)
+{
+    if (context->table_size == 0)
+        return NULL;
+    return *table_slot(context, id);
+}
+
+static void release_context(void* context)
+{
+    context_free(context);
+}
 
 context_t* context_new(context_t* parent, block_t block_type)
 {
-    context_t* context = malloc(sizeof (context_t));
+    context_t* context = arena_own(malloc(sizeof (context_t)), release_context);
     context->symbols = NULL;
+    context->table = NULL;
+    context->table_size = 0;
     context->parent = parent;
     context->allocated = 0;
     context->block_type = block_type;
@@ -26,23 +81,46 @@ context_t* context_clone(context_t* context)
     cloned->parent = context->parent;
     cloned->block_type = context->block_type;
     cloned->symbols = vec_clone(context->symbols);
+    cloned->table_size = context->table_size;
+    cloned->table = NULL;
+    if (context->table_size != 0)
+    {
+        cloned->table = malloc(sizeof (symbol_t*) * context->table_size);
+        memcpy(cloned->table, context->table, sizeof (symbol_t*) * context->table_size);
+    }
     return cloned;
 }
 
 void context_free(context_t* context)
 {
-    vec_free(context->symbols);
+    if (context->block_type == MB_LOOP)
+    {
+        jump_free(context->loop.begin);
+        jump_free(context->loop.end);
+        jump_free(context->loop.post);
+    }
+
+    if (context->symbols != NULL)
+        vec_free(context->symbols);
+    free(context->table);
     free(context);
 }
 
 bool_t context_is_global(context_t* context)
 {
-    return context == global_context;
+    return context->parent == NULL;
+}
+
+context_t* context_get_global(context_t* context)
+{
+    while (context->parent != NULL)
+        context = context->parent;
+    return context;
 }
 
 symbol_t* context_add(context_t* context, const char* id, type_t type)
 {
-    symbol_t* symbol = context_get(context, id, true);
+    symbol_t* symbol = table_get(context, id);
     if (symbol != NULL)
     {
         symbol->type = type;
@@ -50,7 +128,7 @@ symbol_t* context_add(context_t* context, const char* id, type_t type)
         return symbol;
     }
 
-    symbol_t* new_symbol = malloc(sizeof (symbol_t));
+    symbol_t* new_symbol = arena_alloc(sizeof (symbol_t));
     new_symbol->id = id;
     new_symbol->type = type;
     new_symbol->addr = context_alloc_stack_addr(context);
@@ -60,6 +138,7 @@ symbol_t* context_add(context_t* context, const char* id, type_t type)
     if (context->symbols == NULL)
         context->symbols = vec_new(0);
 
+    table_insert(context, new_symbol);
     return (symbol_t*) vec_append(context->symbols, new_symbol);
 }
 
@@ -67,12 +146,9 @@ symbol_t* context_get(context_t* context, const char* id, bool_t local)
 {
     for (context_t* c = context; c != NULL; c = c->parent)
     {
-        for (size_t i = 0; i < vec_size(c->symbols); i++)
-        {
-            symbol_t* s = (symbol_t*) vec_get(c->symbols, i);
-            if (strcmp(id, s->id) == 0)
-                return s;
-        }
+        symbol_t* s = table_get(c, id);
+        if (s != NULL)
+            return s;
 
         if (local)
             break;
@@ -83,7 +159,7 @@ symbol_t* context_get(context_t* context, const char* id, bool_t local)
 
     if (!context_is_global(context) && !local)
     {
-        return context_get(global_context, id, false);
+        return context_get(context_get_global(context), id, false);
     }
 
     return NULL;
@@ -134,5 +210,5 @@ uint16_t context_alloc_stack_addr(context_t* context)
     {
         return func_context->allocated++;
     }
-    return global_context->allocated++;
+    return context_get_global(context)->allocated++;
 }
@@ -10,11 +10,14 @@ extern "C"
 {
 #endif
 
+// The addr of builtin functions, which have no code address
+#define SYMBOL_BUILTIN_ADDR 0xFFFFFFFF
+
 typedef struct
 {
-    const char* id;
+    const char* id;     // Interned by the lexer, compared by pointer
     type_t type;
-    uint16_t addr;
+    uint32_t addr;      // Stack slot of variables, code address of functions
     union {
         struct {
             type_t ret_type;
@@ -34,7 +37,9 @@ typedef struct context_t
 {
     struct context_t* parent;
     block_t block_type;
-    vector_t* symbols;
+    vector_t* symbols;      // In the order they were added
+    symbol_t** table;       // The same by id, open addressing, at most half full
+    uint32_t table_size;
     uint16_t allocated;
     loop_t loop;
 } context_t;
@@ -51,8 +56,9 @@ void context_add_args_count(context_t* context, uint16_t count);
 uint16_t context_alloc_stack_addr(context_t* context);
 loop_t* context_get_loop(context_t* context);
 context_t* context_get_func(context_t* context);
-
-extern context_t * const global_context;
+// The context of the whole program `context` is part of: the one without a
+// parent, made with MB_GLOBAL
+context_t* context_get_global(context_t* context);
 
 #ifdef __cplusplus
 }
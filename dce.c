@@ -0,0 +1,642 @@
+#include "dce.h"
+#include <stdint.h>
+#include <stdlib.h>
+
+// Each function is a frame of its own, and so is the global block. The
+// symbols of a frame are those of the contexts of its blocks, including the
+// contexts of inlined bodies and of for loops, which own the loop variable
+// and the hidden locals of loop.c. The liveness analysis leaves alone the
+// symbols that code of another frame refers to.
+//
+// eval gives a variable declared without a type the type of its first
+// assignment, so the assignments of such a variable are only removed when
+// all of them can be and the variable is never read.
+
+typedef struct
+{
+    ast_func_decl_t* func;  // NULL for the global block
+    ast_block_t* body;      // Body of the function, or the global block
+    vector_t* contexts;     // Contexts whose symbols have slots in the frame
+    vector_t* refs;         // Symbols read or assigned by the code of the frame
+    vector_t* tracked;      // Symbols whose dead assignments may be removed
+} frame_t;
+
+typedef struct
+{
+    loop_t* loop;
+    vector_t* end;          // Live where `break` jumps
+    vector_t* post;         // Live where `continue` jumps
+} live_loop_t;
+
+static _Thread_local vector_t* frames;
+static _Thread_local vector_t* reads;     // Symbols read anywhere
+static _Thread_local vector_t* pinned;    // Untyped symbols with an assignment that stays
+static _Thread_local vector_t* classes;   // Untyped symbol, type of its first assignment
+static _Thread_local vector_t* tracked;   // Those of the frame being analyzed
+static _Thread_local vector_t* loops;     // live_loop_t*, innermost last
+static _Thread_local vector_t* none;      // The empty set
+static _Thread_local bool_t removing;
+static _Thread_local bool_t changed;
+
+static void add(vector_t* symbols, void* symbol)
+{
+    if (!vec_contains(symbols, symbol))
+        vec_append(symbols, symbol);
+}
+
+static void add_all(vector_t* symbols, vector_t* from)
+{
+    for (size_t i = 0; i < vec_size(from); i++)
+        add(symbols, vec_get(from, i));
+}
+
+static void discard(vector_t* symbols, void* symbol)
+{
+    for (size_t i = 0; i < vec_size(symbols); i++)
+    {
+        if (vec_get(symbols, i) == symbol)
+        {
+            vec_set(symbols, i, vec_last(symbols));
+            symbols->vect_used--;
+            return;
+        }
+    }
+}
+
+static vector_t* copy(vector_t* symbols)
+{
+    vector_t* result = vec_new(0);
+    add_all(result, symbols);
+    return result;
+}
+
+static bool_t compatible(type_t a, type_t b)
+{
+    return a == b || (is_integer_type(a) && is_integer_type(b));
+}
+
+static bool_t is_nonzero_integer(ast_t* ast)
+{
+    int64_t x;
+    return integer_constant(ast, &x) && x != 0;
+}
+
+// Type of an expression that eval compiles without error and that runs
+// without failing or side effects, MT_UNKNOWN for any other expression.
+// Integers are all MT_INT64 here, as only the kind of type matters.
+static type_t safe_type(ast_t* ast)
+{
+    if (is_kind(ast, eval_constant))
+    {
+        type_t type = ((ast_constant_t*) ast)->type;
+        if (is_integer_type(type))
+            return MT_INT64;
+        return type == MT_REAL || type == MT_STR ? type : MT_UNKNOWN;
+    }
+
+    if (is_kind(ast, eval_variable))
+    {
+        type_t type = ((ast_variable_t*) ast)->symbol->type;
+        if (is_integer_type(type))
+            return MT_INT64;
+        return type == MT_REAL || type == MT_STR ? type : MT_UNKNOWN;
+    }
+
+    if (is_kind(ast, eval_unary))
+    {
+        ast_unary_t* unary = (ast_unary_t*) ast;
+        type_t type = safe_type(unary->expr);
+
+        if ((unary->op == TK_PLUS || unary->op == TK_MINUS) && (type == MT_INT64 || type == MT_REAL))
+            return type;
+        return MT_UNKNOWN;
+    }
+
+    if (is_kind(ast, eval_binary))
+    {
+        ast_binary_t* binary = (ast_binary_t*) ast;
+        type_t lhs = safe_type(binary->lhs_expr);
+        type_t rhs = safe_type(binary->rhs_expr);
+
+        if (lhs != rhs || (lhs != MT_INT64 && lhs != MT_REAL))
+            return MT_UNKNOWN;
+
+        switch (binary->op)
+        {
+        case TK_PLUS:
+        case TK_MINUS:
+        case TK_MUL:
+            return lhs;
+        case TK_DIV:
+            return lhs == MT_REAL || is_nonzero_integer(binary->rhs_expr) ? lhs : MT_UNKNOWN;
+        case TK_MOD:
+            return lhs == MT_INT64 && is_nonzero_integer(binary->rhs_expr) ? lhs : MT_UNKNOWN;
+        case TK_SHL:
+        case TK_SHR:
+            return lhs == MT_INT64 ? lhs : MT_UNKNOWN;
+        default:
+            return MT_UNKNOWN;
+        }
+    }
+
+    return MT_UNKNOWN;
+}
+
+// Whether the assignment could go without changing what the program does,
+// as long as its value is never read
+static bool_t is_removable(ast_assign_t* assign)
+{
+    type_t type = safe_type(assign->expr);
+    return type != MT_UNKNOWN && compatible(type, assign->symbol->type);
+}
+
+static bool_t always_jumps(ast_t* ast)
+{
+    if (is_kind(ast, eval_func_return) || is_kind(ast, eval_inline_return) ||
+        is_kind(ast, eval_break_loop) || is_kind(ast, eval_continue_loop))
+        return true;
+
+    if (is_kind(ast, eval_block))
+    {
+        ast_block_t* block = (ast_block_t*) ast;
+        return vec_size(block->nodes) > 0 && always_jumps(vec_last(block->nodes));
+    }
+
+    if (is_kind(ast, eval_if_cond))
+    {
+        ast_if_cond_t* if_cond = (ast_if_cond_t*) ast;
+        return if_cond->if_else != NULL && always_jumps(if_cond->if_then) && always_jumps(if_cond->if_else);
+    }
+
+    return false;
+}
+
+// ============================================================================
+// Frames, and what their code refers to
+// ============================================================================
+
+static frame_t* frame_new(ast_func_decl_t* func, ast_block_t* body)
+{
+    frame_t* frame = malloc(sizeof (frame_t));
+    frame->func = func;
+    frame->body = body;
+    frame->contexts = vec_new(0);
+    frame->refs = vec_new(0);
+    frame->tracked = vec_new(0);
+    vec_append(frame->contexts, body->context);
+    vec_append(frames, frame);
+    return frame;
+}
+
+static void frame_free(frame_t* frame)
+{
+    vec_free(frame->contexts);
+    vec_free(frame->refs);
+    vec_free(frame->tracked);
+    free(frame);
+}
+
+static void note_assignment(ast_assign_t* assign)
+{
+    symbol_t* symbol = assign->symbol;
+
+    if (symbol->type != MT_UNKNOWN)
+        return;
+
+    type_t type = safe_type(assign->expr);
+
+    if (type == MT_UNKNOWN)
+    {
+        add(pinned, symbol);
+        return;
+    }
+
+    for (size_t i = 0; i < vec_size(classes); i += 2)
+    {
+        if (vec_get(classes, i) == symbol)
+        {
+            if (!compatible((type_t) (intptr_t) vec_get(classes, i + 1), type))
+                add(pinned, symbol);
+            return;
+        }
+    }
+
+    vec_append(classes, symbol);
+    vec_append(classes, (void*) (intptr_t) type);
+}
+
+// Finds the frames and what their code refers to, and drops the statements
+// that follow a jump in every block on the way
+static ast_t* scan(ast_t* ast, void* data)
+{
+    frame_t* frame = data;
+
+    if (is_kind(ast, eval_variable))
+    {
+        symbol_t* symbol = ((ast_variable_t*) ast)->symbol;
+        add(frame->refs, symbol);
+        add(reads, symbol);
+    }
+    else if (is_kind(ast, eval_assign))
+    {
+        ast_assign_t* assign = (ast_assign_t*) ast;
+        add(frame->refs, assign->symbol);
+        note_assignment(assign);
+    }
+    else if (is_kind(ast, eval_block))
+    {
+        ast_block_t* block = (ast_block_t*) ast;
+
+        add(frame->contexts, block->context);
+
+        for (size_t i = 0; i < vec_size(block->nodes); i++)
+        {
+            ast_t* node = vec_get(block->nodes, i);
+            scan(node, frame);
+
+            if (always_jumps(node))
+                block->nodes->vect_used = i + 1;
+        }
+        return ast;
+    }
+    else if (is_kind(ast, eval_for_loop))
+    {
+        ast_for_loop_t* for_loop = (ast_for_loop_t*) ast;
+
+        if (is_kind(for_loop->body, eval_block))
+            add(frame->contexts, ((ast_block_t*) for_loop->body)->context->parent);
+    }
+    else if (is_kind(ast, eval_func_decl))
+    {
+        ast_func_decl_t* func = (ast_func_decl_t*) ast;
+        scan((ast_t*) func->body, frame_new(func, func->body));
+        return ast;
+    }
+    else if (is_kind(ast, eval_inline))
+        scan((ast_t*) ((ast_inline_t*) ast)->call, frame);
+
+    ast_visit_children(ast, scan, frame);
+    return ast;
+}
+
+// Symbols of the frame that no other frame refers to
+static void find_tracked(frame_t* frame)
+{
+    for (size_t i = 0; i < vec_size(frame->contexts); i++)
+    {
+        context_t* context = vec_get(frame->contexts, i);
+
+        for (size_t j = 0; j < vec_size(context->symbols); j++)
+        {
+            symbol_t* symbol = vec_get(context->symbols, j);
+            bool_t escapes = false;
+
+            if (symbol->type == MT_FUNC || symbol->type == MT_UNKNOWN)
+                continue;
+
+            for (size_t k = 0; k < vec_size(frames) && !escapes; k++)
+            {
+                frame_t* other = vec_get(frames, k);
+                escapes = other != frame && vec_contains(other->refs, symbol);
+            }
+
+            if (!escapes)
+                add(frame->tracked, symbol);
+        }
+    }
+}
+
+// ============================================================================
+// Assignments to variables nobody reads
+// ============================================================================
+
+static bool_t is_unread_store(ast_t* ast)
+{
+    if (!is_kind(ast, eval_assign))
+        return false;
+
+    ast_assign_t* assign = (ast_assign_t*) ast;
+    symbol_t* symbol = assign->symbol;
+
+    if (vec_contains(reads, symbol))
+        return false;
+
+    if (symbol->type == MT_UNKNOWN)
+        return !vec_contains(pinned, symbol);
+
+    return is_removable(assign);
+}
+
+static ast_t* sweep(ast_t* ast, void* data);
+
+static ast_t* sweep_statement(ast_t* ast)
+{
+    if (is_unread_store(ast))
+    {
+        changed = true;
+        return NULL;
+    }
+
+    return sweep(ast, NULL);
+}
+
+static ast_t* sweep(ast_t* ast, void* data)
+{
+    if (is_kind(ast, eval_block))
+    {
+        ast_block_t* block = (ast_block_t*) ast;
+        for (size_t i = 0; i < vec_size(block->nodes); i++)
+            vec_set(block->nodes, i, sweep_statement(vec_get(block->nodes, i)));
+    }
+    else if (is_kind(ast, eval_for_loop))
+    {
+        ast_for_loop_t* for_loop = (ast_for_loop_t*) ast;
+        for_loop->init = sweep_statement(for_loop->init);
+        sweep(for_loop->condition, NULL);
+        for_loop->post = sweep_statement(for_loop->post);
+        sweep(for_loop->body, NULL);
+    }
+    else
+        ast_visit_children(ast, sweep, NULL);
+
+    return ast;
+}
+
+// ============================================================================
+// Liveness
+// ============================================================================
+
+static vector_t* live_before(ast_t* ast, vector_t* out);
+
+// Adds the tracked symbols read under `ast` to `live`. The body of an
+// inlined call is analyzed like a function: what it assigns is its own,
+// so nothing of it is live once it returns.
+static ast_t* read_by(ast_t* ast, void* live)
+{
+    if (is_kind(ast, eval_variable))
+    {
+        symbol_t* symbol = ((ast_variable_t*) ast)->symbol;
+        if (vec_contains(tracked, symbol))
+            add(live, symbol);
+    }
+    else if (is_kind(ast, eval_inline))
+    {
+        ast_inline_t* inline_call = (ast_inline_t*) ast;
+        vector_t* body = live_before((ast_t*) inline_call->body, none);
+
+        read_by((ast_t*) inline_call->call, live);
+        add_all(live, body);
+        vec_free(body);
+    }
+    else if (!is_kind(ast, eval_func_decl))
+        ast_visit_children(ast, read_by, live);
+
+    return ast;
+}
+
+// Live before the statement in `*slot`, which is cleared when it is an
+// assignment nothing reads afterwards
+static vector_t* live_before_statement(ast_t** slot, vector_t* out)
+{
+    ast_t* ast = *slot;
+
+    if (is_kind(ast, eval_assign))
+    {
+        ast_assign_t* assign = (ast_assign_t*) ast;
+
+        if (vec_contains(tracked, assign->symbol) && !vec_contains(out, assign->symbol) && is_removable(assign))
+        {
+            if (removing)
+            {
+                *slot = NULL;
+                changed = true;
+            }
+            return copy(out);
+        }
+    }
+
+    return live_before(ast, out);
+}
+
+static live_loop_t* find_loop(loop_t* loop)
+{
+    for (size_t i = vec_size(loops); i > 0; i--)
+    {
+        live_loop_t* live_loop = vec_get(loops, i - 1);
+        if (live_loop->loop == loop)
+            return live_loop;
+    }
+    return NULL;
+}
+
+// Live before the body of a loop whose post has `post` live before it
+static vector_t* live_before_body(ast_for_loop_t* for_loop, vector_t* out, vector_t* post)
+{
+    live_loop_t live_loop = {for_loop->loop, out, post};
+
+    vec_append(loops, &live_loop);
+    vector_t* live = live_before(for_loop->body, post);
+    loops->vect_used--;
+
+    return live;
+}
+
+// The condition runs first on every iteration, so what is live there is
+// found by going around the loop until nothing more turns live. Nothing is
+// removed on the way, only on a last round once the sets are settled.
+static vector_t* live_before_loop(ast_for_loop_t* for_loop, vector_t* out)
+{
+    if (for_loop->loop == NULL)
+        return copy(out);
+
+    vector_t* begin = copy(out);
+    bool_t enclosing = removing;
+
+    read_by(for_loop->condition, begin);
+
+    removing = false;
+    for (size_t before = SIZE_MAX; before != vec_size(begin); )
+    {
+        before = vec_size(begin);
+
+        vector_t* post = live_before_statement(&for_loop->post, begin);
+        vector_t* body = live_before_body(for_loop, out, post);
+
+        add_all(begin, body);
+        vec_free(body);
+        vec_free(post);
+    }
+    removing = enclosing;
+
+    vector_t* post = live_before_statement(&for_loop->post, begin);
+    vec_free(live_before_body(for_loop, out, post));
+    vec_free(post);
+
+    vector_t* live = live_before_statement(&for_loop->init, begin);
+    vec_free(begin);
+    return live;
+}
+
+static vector_t* live_before(ast_t* ast, vector_t* out)
+{
+    if (ast == NULL)
+        return copy(out);
+
+    if (is_kind(ast, eval_assign))
+    {
+        ast_assign_t* assign = (ast_assign_t*) ast;
+        vector_t* live = copy(out);
+        discard(live, assign->symbol);
+        read_by(assign->expr, live);
+        return live;
+    }
+
+    if (is_kind(ast, eval_block))
+    {
+        ast_block_t* block = (ast_block_t*) ast;
+        vector_t* live = copy(out);
+
+        for (size_t i = vec_size(block->nodes); i > 0; i--)
+        {
+            ast_t* node = vec_get(block->nodes, i - 1);
+            vector_t* before = live_before_statement(&node, live);
+
+            vec_set(block->nodes, i - 1, node);
+            vec_free(live);
+            live = before;
+        }
+        return live;
+    }
+
+    if (is_kind(ast, eval_if_cond))
+    {
+        ast_if_cond_t* if_cond = (ast_if_cond_t*) ast;
+        vector_t* live = live_before(if_cond->if_then, out);
+        vector_t* if_else = live_before(if_cond->if_else, out);
+
+        add_all(live, if_else);
+        vec_free(if_else);
+        read_by(if_cond->condition, live);
+        return live;
+    }
+
+    if (is_kind(ast, eval_for_loop))
+        return live_before_loop((ast_for_loop_t*) ast, out);
+
+    // Analyzed as a frame of its own
+    if (is_kind(ast, eval_func_decl))
+        return copy(out);
+
+    // Nothing of the frame is read after it returns
+    if (is_kind(ast, eval_func_return) || is_kind(ast, eval_inline_return))
+    {
+        vector_t* live = vec_new(0);
+        read_by(((ast_func_return_t*) ast)->expr, live);
+        return live;
+    }
+
+    if (is_kind(ast, eval_break_loop) || is_kind(ast, eval_continue_loop))
+    {
+        bool_t is_break = is_kind(ast, eval_break_loop);
+        live_loop_t* live_loop = find_loop(((ast_break_loop_t*) ast)->loop);
+
+        if (live_loop != NULL)
+            return copy(is_break ? live_loop->end : live_loop->post);
+        return copy(out);
+    }
+
+    // Any other statement is an expression
+    vector_t* live = copy(out);
+    read_by(ast, live);
+    return live;
+}
+
+// ============================================================================
+// Slots
+// ============================================================================
+
+// Numbers the slots of the symbols of the frame that some code still
+// refers to, keeping the parameters first
+static void renumber(frame_t* frame, vector_t* referenced)
+{
+    uint16_t args = frame->func != NULL ? frame->func->args : 0;
+    uint16_t next = args;
+
+    for (size_t i = 0; i < vec_size(frame->contexts); i++)
+    {
+        context_t* context = vec_get(frame->contexts, i);
+
+        for (size_t j = 0; j < vec_size(context->symbols); j++)
+        {
+            symbol_t* symbol = vec_get(context->symbols, j);
+
+            // Parameters come first in the context of the body
+            if (i == 0 && j < args)
+                continue;
+
+            if (symbol->type != MT_FUNC && vec_contains(referenced, symbol))
+                symbol->addr = next++;
+        }
+    }
+
+    frame->body->context->allocated = next;
+}
+
+static void free_frames()
+{
+    for (size_t i = 0; i < vec_size(frames); i++)
+        frame_free(vec_get(frames, i));
+    frames->vect_used = 0;
+}
+
+void dce_program(ast_block_t* program)
+{
+    frames = vec_new(0);
+    reads = vec_new(0);
+    pinned = vec_new(0);
+    classes = vec_new(0);
+    loops = vec_new(0);
+    none = vec_new(0);
+
+    do
+    {
+        free_frames();
+        reads->vect_used = 0;
+        pinned->vect_used = 0;
+        classes->vect_used = 0;
+        changed = false;
+
+        scan((ast_t*) program, frame_new(NULL, program));
+
+        sweep((ast_t*) program, NULL);
+
+        removing = true;
+        for (size_t i = 0; i < vec_size(frames); i++)
+        {
+            frame_t* frame = vec_get(frames, i);
+
+            find_tracked(frame);
+            tracked = frame->tracked;
+            vec_free(live_before((ast_t*) frame->body, none));
+        }
+    }
+    while (changed);
+
+    vector_t* referenced = vec_new(0);
+
+    for (size_t i = 0; i < vec_size(frames); i++)
+        add_all(referenced, ((frame_t*) vec_get(frames, i))->refs);
+
+    for (size_t i = 0; i < vec_size(frames); i++)
+        renumber(vec_get(frames, i), referenced);
+
+    vec_free(referenced);
+    free_frames();
+    vec_free(frames);
+    vec_free(reads);
+    vec_free(pinned);
+    vec_free(classes);
+    vec_free(loops);
+    vec_free(none);
+    tracked = NULL;
+}
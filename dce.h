@@ -0,0 +1,25 @@
+#ifndef DCE_H
+#define DCE_H
+
+#include "ast.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+// Dead code elimination over the AST, for either back end. Statements after
+// a `ret`, `break` or `continue` are dropped, and so are assignments whose
+// value is never read: those to variables no code reads, and those a
+// backward liveness analysis of each frame finds overwritten or forgotten
+// before any read. Only assignments of expressions that can neither fail
+// nor have side effects are removed. The slots of the variables left
+// without any use are then given back, so the `vars` of each PROC shrinks.
+// Runs after loop_optimize_program, whose hidden locals it cleans up too.
+void dce_program(ast_block_t* program);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* DCE_H */
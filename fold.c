@@ -0,0 +1,327 @@
+#include "fold.h"
+#include "builtin.h"
+#include "vm.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+// Folded integers wrap like the VM and are typed MT_INT64, the type every
+// integer expression has after evaluation; ast.c picks the shortest
+// constant opcode from the value. Folded reals are MT_REAL. Nothing that
+// would fail at run time (a division by zero) or that has side effects
+// is ever removed.
+
+static bool_t real_constant(ast_t* ast, real_t* x)
+{
+    if (!is_kind(ast, eval_constant))
+        return false;
+
+    ast_constant_t* constant = (ast_constant_t*) ast;
+
+    if (constant->type != MT_REAL)
+        return false;
+
+    switch (constant->opcode)
+    {
+    case 0:
+        *x = constant->value.as_real;
+        return true;
+    case RCONST_PI:
+        *x = 3.14159265358979323846;
+        return true;
+    }
+    return false;
+}
+
+static ast_t* new_real(real_t x)
+{
+    value_t value;
+    value.as_real = x;
+    return (ast_t*) ast_new_constant(MT_REAL, value);
+}
+
+static bool_t fold_integer(token_type_t op, int64_t lhs, int64_t rhs, int64_t* out)
+{
+    uint64_t a = lhs;
+    uint64_t b = rhs;
+
+    switch (op)
+    {
+    case TK_PLUS:    *out = (int64_t) (a + b); break;
+    case TK_MINUS:   *out = (int64_t) (a - b); break;
+    case TK_MUL:     *out = (int64_t) (a * b); break;
+    case TK_DIV:
+    case TK_MOD:
+        if (rhs == 0 || (lhs == INT64_MIN && rhs == -1))
+            return false;
+        *out = op == TK_DIV ? lhs / rhs : lhs % rhs;
+        break;
+    case TK_EQ:      *out = lhs == rhs; break;
+    case TK_NE:      *out = lhs != rhs; break;
+    case TK_LT:      *out = lhs < rhs; break;
+    case TK_LTE:     *out = lhs <= rhs; break;
+    case TK_GT:      *out = lhs > rhs; break;
+    case TK_GTE:     *out = lhs >= rhs; break;
+    case TK_AND_BIT: *out = lhs & rhs; break;
+    case TK_OR_BIT:  *out = lhs | rhs; break;
+    case TK_XOR_BIT: *out = lhs ^ rhs; break;
+    case TK_AND:     *out = lhs && rhs; break;
+    case TK_OR:      *out = lhs || rhs; break;
+    case TK_SHL:
+    case TK_SHR:
+        if (rhs < 0 || rhs > 63)
+            return false;
+        *out = op == TK_SHL ? (int64_t) (a << rhs) : lhs >> rhs;
+        break;
+    default:
+        return false;
+    }
+    return true;
+}
+
+// Real comparisons give 0.0 or 1.0, as RGT and friends do
+static bool_t fold_real(token_type_t op, real_t lhs, real_t rhs, real_t* out)
+{
+    switch (op)
+    {
+    case TK_PLUS:  *out = lhs + rhs; break;
+    case TK_MINUS: *out = lhs - rhs; break;
+    case TK_MUL:   *out = lhs * rhs; break;
+    case TK_DIV:   *out = lhs / rhs; break;
+    case TK_MOD:   *out = fmod(lhs, rhs); break;
+    case TK_EQ:    *out = lhs == rhs; break;
+    case TK_NE:    *out = lhs != rhs; break;
+    case TK_LT:    *out = lhs < rhs; break;
+    case TK_LTE:   *out = lhs <= rhs; break;
+    case TK_GT:    *out = lhs > rhs; break;
+    case TK_GTE:   *out = lhs >= rhs; break;
+    default:
+        return false;
+    }
+    return true;
+}
+
+static bool_t is_commutative(token_type_t op)
+{
+    switch (op)
+    {
+    case TK_PLUS: case TK_MUL: case TK_EQ: case TK_NE:
+    case TK_AND_BIT: case TK_OR_BIT: case TK_XOR_BIT:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// Returns k when x is 2^k for 0 < k < 63, otherwise 0
+static int64_t power_of_two(int64_t x)
+{
+    if (x < 2 || (x & (x - 1)) != 0)
+        return 0;
+
+    int64_t k = 0;
+    while ((x >>= 1) != 0)
+        ++k;
+    return k;
+}
+
+// Applies identities to a binary node whose operands are not both
+// constant. An operand replaces the whole node only if it has the node's
+// own type, so type checks see the same types as before.
+static ast_t* simplify(ast_binary_t* ast)
+{
+    type_t type = infer_type((ast_t*) ast);
+    int64_t k;
+    real_t r;
+
+    // A constant goes to the right of a commutative operator, where the
+    // ILOAD_ICONST and IADDK forms of the back ends pick it up
+    if (type == MT_INT64 && is_commutative(ast->op) &&
+        integer_constant(ast->lhs_expr, &k) && !integer_constant(ast->rhs_expr, &k))
+    {
+        ast_t* constant = ast->lhs_expr;
+        ast->lhs_expr = ast->rhs_expr;
+        ast->rhs_expr = constant;
+    }
+
+    if (type == MT_INT64 && integer_constant(ast->rhs_expr, &k))
+    {
+        bool_t same = infer_type(ast->lhs_expr) == MT_INT64;
+
+        if (same && k == 0 && (ast->op == TK_PLUS || ast->op == TK_MINUS ||
+                               ast->op == TK_OR_BIT || ast->op == TK_XOR_BIT ||
+                               ast->op == TK_SHL || ast->op == TK_SHR))
+            return ast->lhs_expr;
+
+        if (same && k == 1 && (ast->op == TK_MUL || ast->op == TK_DIV))
+            return ast->lhs_expr;
+
+        if (ast->op == TK_MUL && power_of_two(k) != 0)
+        {
+            ast->op = TK_SHL;
+            ast->rhs_expr = ast_new_integer(power_of_two(k));
+        }
+    }
+    else if (type == MT_REAL)
+    {
+        // x + 0.0 is not x for x = -0.0, but x - 0.0 is
+        if (real_constant(ast->rhs_expr, &r))
+        {
+            if (r == 1.0 && (ast->op == TK_MUL || ast->op == TK_DIV))
+                return ast->lhs_expr;
+
+            if (r == 0.0 && !signbit(r) && ast->op == TK_MINUS)
+                return ast->lhs_expr;
+        }
+        else if (real_constant(ast->lhs_expr, &r))
+        {
+            if (r == 1.0 && ast->op == TK_MUL)
+                return ast->rhs_expr;
+        }
+    }
+
+    return (ast_t*) ast;
+}
+
+static ast_t* fold_unary(ast_unary_t* ast)
+{
+    int64_t k;
+    real_t r;
+
+    ast->expr = fold(ast->expr);
+
+    if (integer_constant(ast->expr, &k))
+    {
+        switch (ast->op)
+        {
+        case TK_PLUS:  return ast_new_integer(k);
+        case TK_MINUS: return ast_new_integer((int64_t) (0 - (uint64_t) k));
+        case TK_NOT:   return ast_new_integer(~k);
+        default:       break;
+        }
+    }
+    else if (real_constant(ast->expr, &r))
+    {
+        switch (ast->op)
+        {
+        case TK_PLUS:  return new_real(r);
+        case TK_MINUS: return new_real(r * -1);
+        default:       break;
+        }
+    }
+
+    return (ast_t*) ast;
+}
+
+static ast_t* fold_binary(ast_binary_t* ast)
+{
+    int64_t lhs;
+    int64_t rhs;
+    int64_t out;
+    real_t real_lhs;
+    real_t real_rhs;
+    real_t real_out;
+
+    ast->lhs_expr = fold(ast->lhs_expr);
+    ast->rhs_expr = fold(ast->rhs_expr);
+
+    if (integer_constant(ast->lhs_expr, &lhs) && integer_constant(ast->rhs_expr, &rhs))
+    {
+        if (fold_integer(ast->op, lhs, rhs, &out))
+            return ast_new_integer(out);
+    }
+    else if (integer_constant(ast->lhs_expr, &lhs) &&
+             ((ast->op == TK_AND && lhs == 0) || (ast->op == TK_OR && lhs != 0)))
+    {
+        // Short-circuit: the right operand is never evaluated
+        return ast_new_integer(ast->op == TK_OR);
+    }
+    else if (real_constant(ast->lhs_expr, &real_lhs) && real_constant(ast->rhs_expr, &real_rhs))
+    {
+        if (fold_real(ast->op, real_lhs, real_rhs, &real_out))
+            return new_real(real_out);
+    }
+
+    return simplify(ast);
+}
+
+// Every foldable builtin but abs() takes and returns reals and maps to one
+// libm call, like its opcode in vm.c
+static ast_t* fold_builtin(ast_func_call_t* ast)
+{
+    const builtin_func_t* builtin = builtin_lookup(ast->symbol->id);
+    size_t count = vec_size(ast->args);
+    real_t args[2];
+    real_t out;
+    int64_t k;
+
+    if (builtin == NULL || count != builtin->arg_count || count > 2)
+        return (ast_t*) ast;
+
+    if (strcmp(builtin->name, "abs") == 0)
+    {
+        ast_t* arg = vec_get(ast->args, 0);
+
+        if (real_constant(arg, &args[0]))
+            return new_real(fabs(args[0]));
+
+        if (integer_constant(arg, &k) && k != INT64_MIN)
+            return ast_new_integer(llabs(k));
+
+        return (ast_t*) ast;
+    }
+
+    for (size_t i = 0; i < count; i++)
+        if (!real_constant(vec_get(ast->args, i), &args[i]))
+            return (ast_t*) ast;
+
+    switch (builtin->opcode)
+    {
+    case RMOD:   out = fmod(args[0], args[1]); break;
+    case RPOW:   out = pow(args[0], args[1]); break;
+    case RATAN2: out = atan2(args[0], args[1]); break;
+    case RSQRT:  out = sqrt(args[0]); break;
+    case REXP:   out = exp(args[0]); break;
+    case RSIN:   out = sin(args[0]); break;
+    case RCOS:   out = cos(args[0]); break;
+    case RTAN:   out = tan(args[0]); break;
+    case RACOS:  out = acos(args[0]); break;
+    case RLOG:   out = log(args[0]); break;
+    case RLOG10: out = log10(args[0]); break;
+    case RLOG2:  out = log2(args[0]); break;
+    case RCEIL:  out = ceil(args[0]); break;
+    case RFLOOR: out = floor(args[0]); break;
+    case RROUND: out = round(args[0]); break;
+    default:
+        return (ast_t*) ast;
+    }
+
+    return new_real(out);
+}
+
+static ast_t* fold_child(ast_t* ast, void* data)
+{
+    return fold(ast);
+}
+
+ast_t* fold(ast_t* ast)
+{
+    if (is_kind(ast, eval_unary))
+        return fold_unary((ast_unary_t*) ast);
+
+    if (is_kind(ast, eval_binary))
+        return fold_binary((ast_binary_t*) ast);
+
+    ast_visit_children(ast, fold_child, NULL);
+
+    // Builtins are marked by the special address
+    if (is_kind(ast, eval_func_call) && ((ast_func_call_t*) ast)->symbol->addr == SYMBOL_BUILTIN_ADDR)
+        return fold_builtin((ast_func_call_t*) ast);
+
+    return ast;
+}
+
+void fold_program(ast_block_t* program)
+{
+    fold((ast_t*) program);
+}
@@ -0,0 +1,25 @@
+#ifndef FOLD_H
+#define FOLD_H
+
+#include "ast.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+// Constant folding and algebraic simplification over the AST. Integer and
+// real subexpressions of constants, and builtin calls such as sqrt(4.0)
+// with constant arguments, are replaced by their value; identities such as
+// x * 1, x + 0 and x * 2 (a shift) are simplified. Runs before code
+// generation for either back end and keeps the static type of every node.
+void fold_program(ast_block_t* program);
+
+// Folds one expression and returns the node that replaces it
+ast_t* fold(ast_t* ast);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* FOLD_H */
@@ -0,0 +1,308 @@
+#include "inline.h"
+#include "arena.h"
+#include <stdlib.h>
+
+// Functions are declared before they are called, so the program is walked
+// in order: a function body is inlined into first, then the function itself
+// becomes a candidate for the calls that follow it.
+
+static _Thread_local vector_t* candidates;
+static _Thread_local size_t limit;
+
+// Statements leave nothing on the stack; a call does unless it is a
+// builtin returning nothing such as print
+static bool_t is_statement(ast_t* ast)
+{
+    if (is_kind(ast, eval_func_call))
+    {
+        ast_func_call_t* call = (ast_func_call_t*) ast;
+        return call->symbol->addr == SYMBOL_BUILTIN_ADDR && call->symbol->extra.func.ret_type == MT_VOID;
+    }
+
+    return ast == NULL || is_kind(ast, eval_assign) || is_kind(ast, eval_block) ||
+           is_kind(ast, eval_if_cond) || is_kind(ast, eval_func_return) ||
+           is_kind(ast, eval_inline_return);
+}
+
+// Counts the nodes of a body that can be inlined into `size`. Variables
+// must be declared in the body itself; `locals` collects the symbols of
+// the blocks walked so far.
+static bool_t check(ast_t* ast, bool_t statement, ast_func_decl_t* func, vector_t* locals, size_t* size)
+{
+    if (ast == NULL)
+        return true;
+
+    if (statement && !is_statement(ast))
+        return false;
+
+    ++*size;
+
+    if (is_kind(ast, eval_constant))
+        return true;
+
+    if (is_kind(ast, eval_variable))
+        return vec_contains(locals, ((ast_variable_t*) ast)->symbol);
+
+    if (is_kind(ast, eval_unary))
+        return check(((ast_unary_t*) ast)->expr, false, func, locals, size);
+
+    if (is_kind(ast, eval_binary))
+    {
+        ast_binary_t* binary = (ast_binary_t*) ast;
+        return check(binary->lhs_expr, false, func, locals, size) &&
+               check(binary->rhs_expr, false, func, locals, size);
+    }
+
+    if (is_kind(ast, eval_assign))
+    {
+        ast_assign_t* assign = (ast_assign_t*) ast;
+        return vec_contains(locals, assign->symbol) && check(assign->expr, false, func, locals, size);
+    }
+
+    if (is_kind(ast, eval_block))
+    {
+        ast_block_t* block = (ast_block_t*) ast;
+
+        for (size_t i = 0; i < vec_size(block->context->symbols); i++)
+            vec_append(locals, vec_get(block->context->symbols, i));
+
+        for (size_t i = 0; i < vec_size(block->nodes); i++)
+            if (!check(vec_get(block->nodes, i), true, func, locals, size))
+                return false;
+        return true;
+    }
+
+    if (is_kind(ast, eval_if_cond))
+    {
+        ast_if_cond_t* if_cond = (ast_if_cond_t*) ast;
+        return check(if_cond->condition, false, func, locals, size) &&
+               check(if_cond->if_then, true, func, locals, size) &&
+               check(if_cond->if_else, true, func, locals, size);
+    }
+
+    if (is_kind(ast, eval_func_return) || is_kind(ast, eval_inline_return))
+        return check(((ast_func_return_t*) ast)->expr, false, func, locals, size);
+
+    if (is_kind(ast, eval_func_call))
+    {
+        ast_func_call_t* call = (ast_func_call_t*) ast;
+
+        if (call->symbol == func->symbol)
+            return false;
+
+        for (size_t i = 0; i < vec_size(call->args); i++)
+            if (!check(vec_get(call->args, i), false, func, locals, size))
+                return false;
+        return true;
+    }
+
+    if (is_kind(ast, eval_inline))
+    {
+        ast_inline_t* ast_inline = (ast_inline_t*) ast;
+        return check((ast_t*) ast_inline->call, false, func, locals, size) &&
+               check((ast_t*) ast_inline->body, true, func, locals, size);
+    }
+
+    // Loops, nested functions
+    return false;
+}
+
+static bool_t is_inlinable(ast_func_decl_t* func)
+{
+    vector_t* locals = vec_new(0);
+    size_t size = 0;
+    bool_t ok = check((ast_t*) func->body, true, func, locals, &size) && size <= limit;
+    vec_free(locals);
+    return ok;
+}
+
+static ast_func_decl_t* find_candidate(symbol_t* symbol)
+{
+    for (size_t i = 0; i < vec_size(candidates); i++)
+    {
+        ast_func_decl_t* func = vec_get(candidates, i);
+        if (func->symbol == symbol)
+            return func;
+    }
+    return NULL;
+}
+
+// Symbols of the callee and their copies in the caller, at the same index
+typedef struct
+{
+    vector_t* from;
+    vector_t* to;
+} remap_t;
+
+static symbol_t* remapped(remap_t* remap, symbol_t* symbol)
+{
+    for (size_t i = 0; i < vec_size(remap->from); i++)
+        if (vec_get(remap->from, i) == symbol)
+            return vec_get(remap->to, i);
+    return symbol;
+}
+
+static ast_t* clone(ast_t* ast, context_t* context, remap_t* remap);
+
+// Copies a block into a new context under `context`. Its symbols are added
+// again there, which allocates their slots in the frame of the caller.
+static ast_block_t* clone_block(ast_block_t* block, context_t* context, remap_t* remap)
+{
+    context_t* copy_context = context_new(context, MB_NORMAL);
+    ast_block_t* copy = ast_new_block(copy_context);
+
+    for (size_t i = 0; i < vec_size(block->context->symbols); i++)
+    {
+        symbol_t* symbol = vec_get(block->context->symbols, i);
+        vec_append(remap->from, symbol);
+        vec_append(remap->to, context_add(copy_context, symbol->id, symbol->type));
+    }
+
+    for (size_t i = 0; i < vec_size(block->nodes); i++)
+        vec_append(copy->nodes, clone(vec_get(block->nodes, i), copy_context, remap));
+
+    return copy;
+}
+
+static ast_func_call_t* clone_call(ast_func_call_t* call, context_t* context, remap_t* remap)
+{
+    vector_t* args = arena_vec_new();
+
+    for (size_t i = 0; i < vec_size(call->args); i++)
+        vec_append(args, clone(vec_get(call->args, i), context, remap));
+
+    return ast_new_func_call(call->symbol, args);
+}
+
+static ast_t* clone(ast_t* ast, context_t* context, remap_t* remap)
+{
+    if (ast == NULL)
+        return NULL;
+
+    if (is_kind(ast, eval_constant))
+    {
+        ast_constant_t* constant = (ast_constant_t*) ast;
+        if (constant->opcode != 0)
+            return (ast_t*) ast_new_builtin_constant(constant->type, constant->opcode);
+        return (ast_t*) ast_new_constant(constant->type, constant->value);
+    }
+
+    if (is_kind(ast, eval_variable))
+        return (ast_t*) ast_new_variable(remapped(remap, ((ast_variable_t*) ast)->symbol));
+
+    if (is_kind(ast, eval_unary))
+    {
+        ast_unary_t* unary = (ast_unary_t*) ast;
+        return (ast_t*) ast_new_unary(unary->op, clone(unary->expr, context, remap));
+    }
+
+    if (is_kind(ast, eval_binary))
+    {
+        ast_binary_t* binary = (ast_binary_t*) ast;
+        return (ast_t*) ast_new_binary(binary->op, clone(binary->lhs_expr, context, remap),
+                                       clone(binary->rhs_expr, context, remap));
+    }
+
+    if (is_kind(ast, eval_assign))
+    {
+        ast_assign_t* assign = (ast_assign_t*) ast;
+        return (ast_t*) ast_new_assign(remapped(remap, assign->symbol), clone(assign->expr, context, remap));
+    }
+
+    if (is_kind(ast, eval_block))
+        return (ast_t*) clone_block((ast_block_t*) ast, context, remap);
+
+    if (is_kind(ast, eval_if_cond))
+    {
+        ast_if_cond_t* if_cond = (ast_if_cond_t*) ast;
+        return (ast_t*) ast_new_if_cond(clone(if_cond->condition, context, remap),
+                                        clone(if_cond->if_then, context, remap),
+                                        clone(if_cond->if_else, context, remap));
+    }
+
+    // A `ret` of the callee ends the inlined body
+    if (is_kind(ast, eval_func_return) || is_kind(ast, eval_inline_return))
+        return (ast_t*) ast_new_inline_return(clone(((ast_func_return_t*) ast)->expr, context, remap));
+
+    if (is_kind(ast, eval_func_call))
+        return (ast_t*) clone_call((ast_func_call_t*) ast, context, remap);
+
+    if (is_kind(ast, eval_inline))
+    {
+        ast_inline_t* ast_inline = (ast_inline_t*) ast;
+        ast_func_call_t* call = clone_call(ast_inline->call, context, remap);
+        return (ast_t*) ast_new_inline(call, clone_block(ast_inline->body, context, remap), ast_inline->ret_type);
+    }
+
+    return NULL;
+}
+
+static ast_t* expand(ast_func_call_t* call, ast_func_decl_t* func, context_t* context)
+{
+    remap_t remap = {vec_new(0), vec_new(0)};
+    ast_block_t* copy = clone_block(func->body, context, &remap);
+    ast_block_t* body = ast_new_block(copy->context);
+
+    // The parameters are the first symbols of the function context
+    for (size_t i = 0; i < func->args; i++)
+    {
+        symbol_t* param = remapped(&remap, vec_get(func->body->context->symbols, i));
+        vec_append(body->nodes, ast_new_assign(param, vec_get(call->args, i)));
+    }
+
+    for (size_t i = 0; i < vec_size(copy->nodes); i++)
+        vec_append(body->nodes, vec_get(copy->nodes, i));
+
+    vec_free(remap.from);
+    vec_free(remap.to);
+
+    type_t ret_type = func->ret_type;
+    if (ret_type == MT_UNKNOWN || ret_type == MT_VOID)
+        ret_type = MT_INT64;
+
+    return (ast_t*) ast_new_inline(call, body, ret_type);
+}
+
+// `context` is the one new blocks of inlined bodies go under
+static ast_t* walk(ast_t* ast, void* context)
+{
+    if (is_kind(ast, eval_block))
+    {
+        ast_visit_children(ast, walk, ((ast_block_t*) ast)->context);
+        return ast;
+    }
+
+    if (is_kind(ast, eval_func_decl))
+    {
+        ast_func_decl_t* func = (ast_func_decl_t*) ast;
+        walk((ast_t*) func->body, NULL);
+        if (is_inlinable(func))
+            vec_append(candidates, func);
+        return ast;
+    }
+
+    ast_visit_children(ast, walk, context);
+
+    if (is_kind(ast, eval_func_call))
+    {
+        ast_func_call_t* call = (ast_func_call_t*) ast;
+
+        // A count mismatch is left to the call to report
+        ast_func_decl_t* func = find_candidate(call->symbol);
+        if (func != NULL && vec_size(call->args) == func->args)
+            return expand(call, func, context);
+    }
+
+    return ast;
+}
+
+void inline_program(ast_block_t* program, size_t max_nodes)
+{
+    candidates = vec_new(0);
+    limit = max_nodes;
+
+    walk((ast_t*) program, NULL);
+
+    vec_free(candidates);
+    candidates = NULL;
+}
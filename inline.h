@@ -0,0 +1,27 @@
+#ifndef INLINE_H
+#define INLINE_H
+
+#include "ast.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+// Largest callee body, in AST nodes, that is inlined
+#define INLINE_MAX_NODES 40
+
+// Function inlining over the AST. Calls to small, non-recursive user
+// functions are replaced by a copy of the callee body (an ast_inline_t).
+// The callee's parameters and locals get fresh symbols in the frame of the
+// caller, allocated through context.c, so every call site has slots of its
+// own. Bodies with loops, nested functions or expression statements that
+// leave a value behind are not inlined. Runs after fold_program, before
+// code generation for either back end.
+void inline_program(ast_block_t* program, size_t max_nodes);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* INLINE_H */
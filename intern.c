@@ -0,0 +1,158 @@
+#include "intern.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define TABLE_INITIAL 64
+#define CHUNK_SIZE 4096
+
+// Strings are packed into chunks, each after a header with its length
+typedef struct chunk_t
+{
+    struct chunk_t* next;
+    size_t used;
+    size_t size;
+    char data[];
+} chunk_t;
+
+typedef struct
+{
+    uint32_t size;
+    uint32_t hash;
+} header_t;
+
+struct intern_t
+{
+    const char** table;     // Open addressing, at most half full
+    uint32_t table_size;
+    uint32_t count;
+    chunk_t* chunks;        // The one strings are added to first
+};
+
+static uint32_t hash_bytes(const char* str, size_t size)
+{
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < size; i++)
+        hash = (hash ^ (uint8_t) str[i]) * 16777619u;
+    return hash;
+}
+
+static const header_t* header(const char* str)
+{
+    return (const header_t*) str - 1;
+}
+
+intern_t* intern_new()
+{
+    intern_t* pool = malloc(sizeof (intern_t));
+    pool->table_size = TABLE_INITIAL;
+    pool->table = calloc(pool->table_size, sizeof (const char*));
+    pool->count = 0;
+    pool->chunks = NULL;
+    return pool;
+}
+
+void intern_free(intern_t* pool)
+{
+    if (pool == NULL)
+        return;
+
+    while (pool->chunks != NULL)
+    {
+        chunk_t* next = pool->chunks->next;
+        free(pool->chunks);
+        pool->chunks = next;
+    }
+
+    free(pool->table);
+    free(pool);
+}
+
+static const char** find(intern_t* pool, const char* str, size_t size, uint32_t hash)
+{
+    uint32_t mask = pool->table_size - 1;
+
+    for (uint32_t i = hash & mask; ; i = (i + 1) & mask)
+    {
+        const char** slot = &pool->table[i];
+
+        if (*slot == NULL)
+            return slot;
+
+        const header_t* h = header(*slot);
+        if (h->hash == hash && h->size == size && memcmp(*slot, str, size) == 0)
+            return slot;
+    }
+}
+
+static void grow(intern_t* pool)
+{
+    const char** old = pool->table;
+    uint32_t old_size = pool->table_size;
+
+    pool->table_size *= 2;
+    pool->table = calloc(pool->table_size, sizeof (const char*));
+
+    for (uint32_t i = 0; i < old_size; i++)
+    {
+        if (old[i] != NULL)
+        {
+            const header_t* h = header(old[i]);
+            *find(pool, old[i], h->size, h->hash) = old[i];
+        }
+    }
+
+    free(old);
+}
+
+// Room for `bytes` bytes, aligned for a header
+static char* allocate(intern_t* pool, size_t bytes)
+{
+    bytes = (bytes + sizeof (header_t) - 1) / sizeof (header_t) * sizeof (header_t);
+
+    if (pool->chunks == NULL || pool->chunks->size - pool->chunks->used < bytes)
+    {
+        size_t size = bytes > CHUNK_SIZE ? bytes : CHUNK_SIZE;
+        chunk_t* chunk = malloc(sizeof (chunk_t) + size);
+        chunk->used = 0;
+        chunk->size = size;
+        chunk->next = pool->chunks;
+        pool->chunks = chunk;
+    }
+
+    char* at = pool->chunks->data + pool->chunks->used;
+    pool->chunks->used += bytes;
+    return at;
+}
+
+const char* intern(intern_t* pool, const char* str, size_t size)
+{
+    uint32_t hash = hash_bytes(str, size);
+    const char** slot = find(pool, str, size, hash);
+
+    if (*slot != NULL)
+        return *slot;
+
+    header_t* h = (header_t*) allocate(pool, sizeof (header_t) + size + 1);
+    char* copy = (char*) (h + 1);
+
+    h->size = size;
+    h->hash = hash;
+    memcpy(copy, str, size);
+    copy[size] = '\0';
+
+    *slot = copy;
+    if (2 * ++pool->count > pool->table_size)
+        grow(pool);
+
+    return copy;
+}
+
+size_t intern_size(const char* str)
+{
+    return header(str)->size;
+}
+
+size_t intern_count(intern_t* pool)
+{
+    return pool->count;
+}
@@ -0,0 +1,31 @@
+#ifndef INTERN_H
+#define INTERN_H
+
+#include "types.h"
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+// A pool of interned strings: every distinct byte string is stored once,
+// so two strings of the same pool are equal exactly when their pointers
+// are. The strings live until the pool is freed.
+typedef struct intern_t intern_t;
+
+intern_t* intern_new();
+void intern_free(intern_t* pool);
+// The copy of `size` bytes of `str` in the pool, NUL terminated
+const char* intern(intern_t* pool, const char* str, size_t size);
+// Length of an interned string
+size_t intern_size(const char* str);
+// Distinct strings in the pool
+size_t intern_count(intern_t* pool);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* INTERN_H */
@@ -0,0 +1,1159 @@
+#include "ir.h"
+#include "vm.h"
+#include "panic.h"
+#include "builtin.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Building mirrors eval in ast.c: the same types, the same conversions and
+// the same errors, so a program compiled through the IR behaves like one
+// compiled directly. Statements after a `ret`, `break` or `continue` go to
+// a new block without predecessors, which ir_simplify_cfg removes.
+
+typedef struct
+{
+    loop_t* loop;
+    ir_block_t* post;       // Target of `continue`
+    ir_block_t* end;        // Target of `break`
+} ir_loop_t;
+
+typedef struct
+{
+    ir_block_t* end;        // Where the returns of the inlined body jump
+    vector_t* results;      // The value of each, in the order of end->preds
+} ir_inline_t;
+
+static _Thread_local ir_module_t* module;
+static _Thread_local ir_func_t* func;
+static _Thread_local ir_block_t* block;
+static _Thread_local ast_func_decl_t* func_decl;
+static _Thread_local vector_t* loops;
+static _Thread_local ir_inline_t* inlined;
+
+static void statement(ast_t* ast);
+static ir_value_t* expr(ast_t* ast, type_t* type);
+
+// Type of a value in the VM: every integer is an i64 there
+static type_t machine_type(type_t type)
+{
+    return type == MT_REAL || type == MT_STR ? type : MT_INT64;
+}
+
+static void insert(vector_t* vector, size_t index, void* item)
+{
+    vec_append(vector, NULL);
+    for (size_t i = vec_size(vector) - 1; i > index; i--)
+        vec_set(vector, i, vec_get(vector, i - 1));
+    vec_set(vector, index, item);
+}
+
+static void remove_at(vector_t* vector, size_t index)
+{
+    for (size_t i = index; i + 1 < vec_size(vector); i++)
+        vec_set(vector, i, vec_get(vector, i + 1));
+    vector->vect_used--;
+}
+
+// ============================================================================
+// Values and blocks
+// ============================================================================
+
+static ir_value_t* new_value(ir_kind_t kind, type_t type)
+{
+    ir_value_t* value = calloc(1, sizeof (ir_value_t));
+    value->kind = kind;
+    value->id = func->next_value++;
+    value->type = type;
+    value->operands = vec_new(0);
+    value->slot = -1;
+    vec_append(func->values, value);
+    return value;
+}
+
+static ir_value_t* integer(int64_t x)
+{
+    ir_value_t* value = new_value(IR_CONST, MT_INT64);
+    value->k.as_int64 = x;
+    return value;
+}
+
+// Value of a variable read before any assignment reaches it
+static ir_value_t* undefined(type_t type)
+{
+    ir_value_t* value = new_value(IR_CONST, machine_type(type));
+    value->k.as_uint64 = 0;
+    if (value->type == MT_STR)
+        value->k.as_str = "";
+    return value;
+}
+
+static ir_value_t* append(ir_value_t* value)
+{
+    value->block = block;
+    vec_append(block->insns, value);
+    return value;
+}
+
+static ir_value_t* op(uint8_t opcode, type_t type, ir_value_t* lhs, ir_value_t* rhs)
+{
+    ir_value_t* value = new_value(IR_OP, type);
+    value->opcode = opcode;
+    if (lhs != NULL)
+        vec_append(value->operands, lhs);
+    if (rhs != NULL)
+        vec_append(value->operands, rhs);
+    return append(value);
+}
+
+ir_block_t* ir_block_new(ir_func_t* owner)
+{
+    ir_block_t* new_block = calloc(1, sizeof (ir_block_t));
+    new_block->id = owner->next_block++;
+    new_block->insns = vec_new(0);
+    new_block->preds = vec_new(0);
+    new_block->defs = vec_new(0);
+    new_block->incomplete = vec_new(0);
+    return new_block;
+}
+
+static ir_block_t* new_block()
+{
+    return ir_block_new(func);
+}
+
+// Makes `next` the block instructions are added to. Blocks are laid out in
+// the order they are entered.
+static void enter(ir_block_t* next)
+{
+    vec_append(func->blocks, next);
+    block = next;
+}
+
+ir_value_t* ir_terminator(ir_block_t* b)
+{
+    ir_value_t* last = vec_size(b->insns) > 0 ? vec_last(b->insns) : NULL;
+    return last != NULL && last->kind >= IR_JMP ? last : NULL;
+}
+
+size_t ir_succ_count(ir_block_t* b)
+{
+    return (b->succs[0] != NULL) + (b->succs[1] != NULL);
+}
+
+static bool_t terminated()
+{
+    return ir_terminator(block) != NULL;
+}
+
+static void add_edge(ir_block_t* from, ir_block_t* to)
+{
+    from->succs[ir_succ_count(from)] = to;
+    vec_append(to->preds, from);
+}
+
+static void jump(ir_block_t* to)
+{
+    append(new_value(IR_JMP, MT_VOID));
+    add_edge(block, to);
+}
+
+static void branch(ir_value_t* condition, ir_block_t* if_true, ir_block_t* if_false)
+{
+    ir_value_t* value = new_value(IR_BRANCH, MT_VOID);
+    vec_append(value->operands, condition);
+    append(value);
+    add_edge(block, if_true);
+    add_edge(block, if_false);
+}
+
+// Code that follows a jump is unreachable until the next label
+static void unreachable()
+{
+    ir_block_t* dead = new_block();
+    dead->sealed = true;
+    enter(dead);
+}
+
+bool_t ir_is_trapping(ir_value_t* value)
+{
+    return value->kind == IR_OP && (value->opcode == IDIV || value->opcode == IMOD);
+}
+
+bool_t ir_has_side_effects(ir_value_t* value)
+{
+    return value->kind == IR_CALL || value->kind == IR_PRINT || value->kind >= IR_JMP ||
+           ir_is_trapping(value);
+}
+
+void ir_replace_uses(ir_func_t* owner, ir_value_t* from, ir_value_t* to)
+{
+    for (size_t i = 0; i < vec_size(owner->values); i++)
+    {
+        ir_value_t* value = vec_get(owner->values, i);
+        for (size_t j = 0; j < vec_size(value->operands); j++)
+            if (vec_get(value->operands, j) == from)
+                vec_set(value->operands, j, to);
+    }
+}
+
+// Removes predecessor `index` of `b` along with the matching phi operands
+void ir_remove_pred(ir_block_t* b, size_t index)
+{
+    remove_at(b->preds, index);
+
+    for (size_t i = 0; i < vec_size(b->insns); i++)
+    {
+        ir_value_t* value = vec_get(b->insns, i);
+        if (value->kind == IR_PHI)
+            remove_at(value->operands, index);
+    }
+}
+
+// ============================================================================
+// SSA construction
+// ============================================================================
+
+static ir_value_t* read_variable(symbol_t* symbol, ir_block_t* b);
+
+static ir_value_t* lookup(vector_t* defs, symbol_t* symbol)
+{
+    for (size_t i = 0; i < vec_size(defs); i += 2)
+        if (vec_get(defs, i) == symbol)
+            return vec_get(defs, i + 1);
+    return NULL;
+}
+
+static void write_variable(symbol_t* symbol, ir_block_t* b, ir_value_t* value)
+{
+    for (size_t i = 0; i < vec_size(b->defs); i += 2)
+    {
+        if (vec_get(b->defs, i) == symbol)
+        {
+            vec_set(b->defs, i + 1, value);
+            return;
+        }
+    }
+    vec_append(b->defs, symbol);
+    vec_append(b->defs, value);
+}
+
+static ir_value_t* new_phi(ir_block_t* b, type_t type)
+{
+    ir_value_t* phi = new_value(IR_PHI, machine_type(type));
+    size_t at = 0;
+
+    while (at < vec_size(b->insns) && ((ir_value_t*) vec_get(b->insns, at))->kind == IR_PHI)
+        ++at;
+
+    phi->block = b;
+    insert(b->insns, at, phi);
+    return phi;
+}
+
+static void add_phi_operands(symbol_t* symbol, ir_value_t* phi)
+{
+    for (size_t i = 0; i < vec_size(phi->block->preds); i++)
+        vec_append(phi->operands, read_variable(symbol, vec_get(phi->block->preds, i)));
+}
+
+// Whether `symbol` belongs to a scope around the function being built
+static bool_t is_outer(symbol_t* symbol)
+{
+    if (func_decl == NULL)
+        return false;
+
+    for (context_t* context = func_decl->body->context->parent; context != NULL; context = context->parent)
+        if (vec_contains(context->symbols, symbol))
+            return true;
+    return false;
+}
+
+// eval reads a variable of an enclosing scope from the slot of its address
+// in the frame of the function, so the IR loads it from there on entry
+static ir_value_t* load(symbol_t* symbol, ir_block_t* entry)
+{
+    ir_value_t* value = new_value(IR_LOAD, machine_type(symbol->type));
+    value->opcode = value->type == MT_REAL ? RLOAD : value->type == MT_STR ? SLOAD : ILOAD;
+    value->index = symbol->addr;
+    value->block = entry;
+    insert(entry->insns, 0, value);
+    return value;
+}
+
+static ir_value_t* read_variable(symbol_t* symbol, ir_block_t* b)
+{
+    ir_value_t* value = lookup(b->defs, symbol);
+
+    if (value != NULL)
+        return value;
+
+    if (!b->sealed)
+    {
+        value = new_phi(b, symbol->type);
+        vec_append(b->incomplete, symbol);
+        vec_append(b->incomplete, value);
+    }
+    else if (vec_size(b->preds) == 0 && b == vec_first(func->blocks) && is_outer(symbol))
+        value = load(symbol, b);
+    else if (vec_size(b->preds) == 0)
+        value = undefined(symbol->type);
+    else if (vec_size(b->preds) == 1)
+        value = read_variable(symbol, vec_first(b->preds));
+    else
+    {
+        // Written first, so that a loop back to this block finds the phi
+        value = new_phi(b, symbol->type);
+        write_variable(symbol, b, value);
+        add_phi_operands(symbol, value);
+    }
+
+    write_variable(symbol, b, value);
+    return value;
+}
+
+// All the predecessors of `b` are known
+static void seal(ir_block_t* b)
+{
+    for (size_t i = 0; i < vec_size(b->incomplete); i += 2)
+        add_phi_operands(vec_get(b->incomplete, i), vec_get(b->incomplete, i + 1));
+    b->sealed = true;
+}
+
+// ============================================================================
+// Expressions
+// ============================================================================
+
+static ir_value_t* need(ir_value_t* value)
+{
+    if (value == NULL)
+        panic("Expression has no value.");
+    return value;
+}
+
+static ir_value_t* conversion(ir_value_t* value, type_t to)
+{
+    switch (to) {
+        case MT_INT8:  return op(I8CAST, MT_INT64, value, NULL);
+        case MT_INT16: return op(I16CAST, MT_INT64, value, NULL);
+        case MT_INT32: return op(I32CAST, MT_INT64, value, NULL);
+        default:       return value;
+    }
+}
+
+static ir_value_t* constant(ast_constant_t* ast, type_t* type)
+{
+    ir_value_t* value;
+
+    *type = ast->type;
+
+    if (ast->opcode != 0)
+    {
+        value = new_value(IR_CONST, machine_type(ast->type));
+        value->opcode = ast->opcode;
+        return value;
+    }
+
+    if (is_integer_type(ast->type))
+    {
+        *type = MT_INT64;
+        return integer(integer_value(ast->type, ast->value));
+    }
+
+    value = new_value(IR_CONST, machine_type(ast->type));
+    value->k = ast->value;
+    return value;
+}
+
+static ir_value_t* unary(ast_unary_t* ast, type_t* type)
+{
+    type_t out;
+    ir_value_t* value = expr(ast->expr, &out);
+
+    if (is_integer_type(out))
+    {
+        *type = MT_INT64;
+        if (ast->op == TK_MINUS)
+            return op(INEG, MT_INT64, value, NULL);
+        if (ast->op == TK_NOT)
+            return op(INOT, MT_INT64, value, NULL);
+        return value;
+    }
+
+    if (out == MT_REAL)
+    {
+        *type = MT_REAL;
+        return ast->op == TK_MINUS ? op(RNEG, MT_REAL, value, NULL) : value;
+    }
+
+    panic("Unary error");
+    return NULL;
+}
+
+static uint8_t integer_opcode(token_type_t token)
+{
+    switch (token)
+    {
+    case TK_PLUS:    return IADD;
+    case TK_MINUS:   return ISUB;
+    case TK_MUL:     return IMUL;
+    case TK_DIV:     return IDIV;
+    case TK_MOD:     return IMOD;
+    case TK_EQ:      return IEQ;
+    case TK_NE:      return INQ;
+    case TK_LT:      return ILT;
+    case TK_LTE:     return ILE;
+    case TK_GT:      return IGT;
+    case TK_GTE:     return IGE;
+    case TK_AND_BIT: return IBAND;
+    case TK_OR_BIT:  return IBOR;
+    case TK_XOR_BIT: return IBXOR;
+    case TK_SHL:     return ISHL;
+    case TK_SHR:     return ISHR;
+    default:         return NOP;
+    }
+}
+
+static uint8_t real_opcode(token_type_t token)
+{
+    switch (token)
+    {
+    case TK_PLUS:  return RADD;
+    case TK_MINUS: return RSUB;
+    case TK_MUL:   return RMUL;
+    case TK_DIV:   return RDIV;
+    case TK_MOD:   return RMOD;
+    case TK_EQ:    return REQ;
+    case TK_NE:    return RNQ;
+    case TK_LT:    return RLT;
+    case TK_LTE:   return RLE;
+    case TK_GT:    return RGT;
+    case TK_GTE:   return RGE;
+    default:       return NOP;
+    }
+}
+
+static void condition(ast_t* ast, ir_block_t* if_true, ir_block_t* if_false);
+
+// `and` and `or` as values: the branches select 1 or 0
+static ir_value_t* logical(ast_binary_t* ast, type_t* type)
+{
+    ir_block_t* is_true = new_block();
+    ir_block_t* is_false = new_block();
+    ir_block_t* exit = new_block();
+
+    condition((ast_t*) ast, is_true, is_false);
+
+    seal(is_true);
+    enter(is_true);
+    jump(exit);
+
+    seal(is_false);
+    enter(is_false);
+    jump(exit);
+
+    seal(exit);
+    enter(exit);
+
+    ir_value_t* phi = new_phi(exit, MT_INT64);
+    vec_append(phi->operands, integer(1));
+    vec_append(phi->operands, integer(0));
+
+    *type = MT_INT64;
+    return phi;
+}
+
+static ir_value_t* binary(ast_binary_t* ast, type_t* type)
+{
+    if (ast->op == TK_AND || ast->op == TK_OR)
+        return logical(ast, type);
+
+    type_t l_out;
+    type_t r_out;
+    ir_value_t* lhs = expr(ast->lhs_expr, &l_out);
+    ir_value_t* rhs = expr(ast->rhs_expr, &r_out);
+    uint8_t opcode = NOP;
+
+    if (is_integer_type(l_out) && is_integer_type(r_out))
+    {
+        *type = MT_INT64;
+        opcode = integer_opcode(ast->op);
+    }
+    else if (l_out == MT_REAL && r_out == MT_REAL)
+    {
+        *type = MT_REAL;
+        opcode = real_opcode(ast->op);
+    }
+
+    if (opcode == NOP)
+        panic("Binary error");
+
+    return op(opcode, *type, need(lhs), need(rhs));
+}
+
+static bool_t is_type_acceptable(type_t type, const type_t* acceptable_types)
+{
+    if (acceptable_types == NULL)
+        return true;
+
+    for (size_t i = 0; acceptable_types[i] != MT_UNKNOWN; i++)
+    {
+        if (acceptable_types[i] == type)
+            return true;
+    }
+    return false;
+}
+
+static ir_value_t* builtin_call(ast_func_call_t* ast, type_t* type)
+{
+    const builtin_func_t* builtin = builtin_lookup(ast->symbol->id);
+    if (builtin == NULL)
+    {
+        panic("Builtin function not found.");
+    }
+
+    ir_value_t* args[2] = {NULL, NULL};
+    type_t arg_type = MT_UNKNOWN;
+
+    if (strcmp(builtin->name, "print") == 0)
+    {
+        for (size_t i = 0; i < vec_size(ast->args); i++)
+        {
+            ir_value_t* arg = expr(vec_get(ast->args, i), &arg_type);
+
+            if (!is_type_acceptable(arg_type, builtin->acceptable_types))
+            {
+                panic("Builtin function argument type mismatch.");
+            }
+
+            ir_value_t* print = new_value(IR_PRINT, MT_VOID);
+
+            if (is_integer_type(arg_type))
+                print->opcode = IPRINT;
+            else if (arg_type == MT_REAL)
+                print->opcode = RPRINT;
+            else if (arg_type == MT_STR)
+                print->opcode = SPRINT;
+            else
+                panic("Print error. Unknown type.");
+
+            vec_append(print->operands, need(arg));
+            append(print);
+        }
+        *type = MT_VOID;
+        return NULL;
+    }
+
+    for (size_t i = 0; i < vec_size(ast->args); i++)
+    {
+        ir_value_t* arg = expr(vec_get(ast->args, i), &arg_type);
+
+        if (!is_type_acceptable(arg_type, builtin->acceptable_types))
+        {
+            panic("Builtin function argument type mismatch.");
+        }
+
+        if (i < 2)
+            args[i] = need(arg);
+    }
+
+    if (strcmp(builtin->name, "abs") == 0)
+    {
+        if (is_integer_type(arg_type))
+        {
+            *type = arg_type;
+            return conversion(op(IABS, MT_INT64, args[0], NULL), arg_type);
+        }
+        else if (arg_type == MT_REAL)
+        {
+            *type = MT_REAL;
+            return op(RABS, MT_REAL, args[0], NULL);
+        }
+        else
+        {
+            panic("abs function requires numeric type.");
+        }
+    }
+
+    *type = builtin->ret_type;
+    return op(builtin->opcode, machine_type(builtin->ret_type), args[0], args[1]);
+}
+
+static void check_call_args(ast_func_call_t* ast)
+{
+    if (ast->symbol->extra.func.param_types == NULL)
+    {
+        panic("Function parameter types not available for type checking.");
+    }
+
+    size_t param_count = vec_size(ast->symbol->extra.func.param_types);
+    size_t arg_count = vec_size(ast->args);
+
+    if (arg_count != param_count)
+    {
+        panic("Function argument count mismatch.");
+    }
+
+    for (size_t i = 0; i < arg_count; i++)
+    {
+        type_t* param_type = vec_get(ast->symbol->extra.func.param_types, i);
+        if (infer_type(vec_get(ast->args, i)) != *param_type)
+        {
+            panic("Function argument type mismatch.");
+        }
+    }
+}
+
+static type_t normalized_ret_type(type_t ret_type)
+{
+    return ret_type == MT_UNKNOWN || ret_type == MT_VOID ? MT_INT64 : ret_type;
+}
+
+// A call in tail position returns its result unconverted, like TAILCALL
+static ir_value_t* user_call(ast_func_call_t* ast, bool_t tail, type_t* type)
+{
+    check_call_args(ast);
+
+    type_t ret_type = normalized_ret_type(ast->symbol->extra.func.ret_type);
+    ir_value_t* call = new_value(IR_CALL, machine_type(ret_type));
+    type_t arg_type;
+
+    call->callee = ast->symbol;
+    call->tail = tail;
+
+    for (size_t i = 0; i < vec_size(ast->args); i++)
+        vec_append(call->operands, need(expr(vec_get(ast->args, i), &arg_type)));
+
+    append(call);
+
+    *type = ret_type;
+    return tail ? call : conversion(call, ret_type);
+}
+
+static ir_value_t* func_call(ast_func_call_t* ast, type_t* type)
+{
+    if (ast->symbol->addr == SYMBOL_BUILTIN_ADDR)
+        return builtin_call(ast, type);
+    return user_call(ast, false, type);
+}
+
+static ir_value_t* inline_call(ast_inline_t* ast, type_t* type)
+{
+    ir_inline_t* enclosing = inlined;
+    ir_inline_t current = {new_block(), vec_new(0)};
+    ir_value_t* result;
+
+    check_call_args(ast->call);
+    inlined = &current;
+
+    statement((ast_t*) ast->body);
+
+    // Falling off the end yields 0, like the ICONST_0 RET of a function
+    if (!terminated())
+    {
+        vec_append(current.results, integer(0));
+        jump(current.end);
+    }
+
+    seal(current.end);
+    enter(current.end);
+    inlined = enclosing;
+
+    if (vec_size(current.results) == 1)
+        result = vec_first(current.results);
+    else
+    {
+        result = new_phi(current.end, ast->ret_type);
+        for (size_t i = 0; i < vec_size(current.results); i++)
+            vec_append(result->operands, vec_get(current.results, i));
+    }
+
+    vec_free(current.results);
+
+    *type = ast->ret_type;
+    return is_integer_type(ast->ret_type) ? conversion(result, ast->ret_type) : result;
+}
+
+static ir_value_t* assign(ast_assign_t* ast, type_t* type)
+{
+    type_t expr_type;
+    ir_value_t* value = expr(ast->expr, &expr_type);
+    type_t var_type = ast->symbol->type;
+
+    // If variable type is unknown, infer from expression
+    if (var_type == MT_UNKNOWN) {
+        var_type = expr_type;
+        ast->symbol->type = var_type;
+    }
+
+    if (is_integer_type(expr_type) && is_integer_type(var_type))
+        value = conversion(value, var_type);
+    else if (expr_type != var_type)
+        panic("Assignment type mismatch");
+
+    write_variable(ast->symbol, block, need(value));
+
+    *type = var_type;
+    return value;
+}
+
+static ir_value_t* expr(ast_t* ast, type_t* type)
+{
+    *type = MT_UNKNOWN;
+
+    if (ast == NULL)
+        return NULL;
+
+    if (is_kind(ast, eval_constant))
+        return constant((ast_constant_t*) ast, type);
+
+    if (is_kind(ast, eval_variable))
+    {
+        symbol_t* symbol = ((ast_variable_t*) ast)->symbol;
+        *type = symbol->type;
+        return read_variable(symbol, block);
+    }
+
+    if (is_kind(ast, eval_unary))
+        return unary((ast_unary_t*) ast, type);
+
+    if (is_kind(ast, eval_binary))
+        return binary((ast_binary_t*) ast, type);
+
+    if (is_kind(ast, eval_assign))
+        return assign((ast_assign_t*) ast, type);
+
+    if (is_kind(ast, eval_func_call))
+        return func_call((ast_func_call_t*) ast, type);
+
+    if (is_kind(ast, eval_inline))
+        return inline_call((ast_inline_t*) ast, type);
+
+    statement(ast);
+    return NULL;
+}
+
+// Branches to `if_true` or `if_false`. `and` and `or` short-circuit
+// through blocks of their own.
+static void condition(ast_t* ast, ir_block_t* if_true, ir_block_t* if_false)
+{
+    if (is_kind(ast, eval_binary))
+    {
+        ast_binary_t* binary = (ast_binary_t*) ast;
+
+        if (binary->op == TK_AND || binary->op == TK_OR)
+        {
+            ir_block_t* rhs = new_block();
+            check_logical(binary);
+
+            if (binary->op == TK_AND)
+                condition(binary->lhs_expr, rhs, if_false);
+            else
+                condition(binary->lhs_expr, if_true, rhs);
+
+            seal(rhs);
+            enter(rhs);
+            condition(binary->rhs_expr, if_true, if_false);
+            return;
+        }
+    }
+
+    type_t type;
+    branch(need(expr(ast, &type)), if_true, if_false);
+}
+
+// ============================================================================
+// Statements
+// ============================================================================
+
+static ir_func_t* new_func(const char* name, symbol_t* symbol, uint16_t args)
+{
+    ir_func_t* new_func = calloc(1, sizeof (ir_func_t));
+    new_func->name = name;
+    new_func->symbol = symbol;
+    new_func->args = args;
+    new_func->blocks = vec_new(0);
+    new_func->values = vec_new(0);
+    vec_append(module->funcs, new_func);
+    return new_func;
+}
+
+static void ret(ir_value_t* value)
+{
+    ir_value_t* value_ret = new_value(IR_RET, MT_VOID);
+    vec_append(value_ret->operands, value);
+    append(value_ret);
+}
+
+static void func_decl_ir(ast_func_decl_t* ast)
+{
+    ir_func_t* enclosing_func = func;
+    ir_block_t* enclosing_block = block;
+    ast_func_decl_t* enclosing_decl = func_decl;
+    vector_t* enclosing_loops = loops;
+    ir_inline_t* enclosing_inline = inlined;
+
+    func = new_func(ast->symbol->id, ast->symbol, ast->args);
+    func_decl = ast;
+    loops = vec_new(0);
+    inlined = NULL;
+
+    ir_block_t* entry = new_block();
+    entry->sealed = true;
+    enter(entry);
+
+    // The parameters are the first symbols of the function context
+    for (uint16_t i = 0; i < ast->args; i++)
+    {
+        symbol_t* symbol = vec_get(ast->body->context->symbols, i);
+        ir_value_t* param = new_value(IR_PARAM, machine_type(symbol->type));
+        param->index = i;
+        write_variable(symbol, entry, param);
+    }
+
+    statement((ast_t*) ast->body);
+
+    if (!terminated())
+        ret(integer(0));
+
+    vec_free(loops);
+    func = enclosing_func;
+    block = enclosing_block;
+    func_decl = enclosing_decl;
+    loops = enclosing_loops;
+    inlined = enclosing_inline;
+}
+
+static void if_cond(ast_if_cond_t* ast)
+{
+    ir_block_t* if_then = new_block();
+    ir_block_t* if_else = ast->if_else != NULL ? new_block() : NULL;
+    ir_block_t* exit = new_block();
+
+    condition(ast->condition, if_then, if_else != NULL ? if_else : exit);
+
+    seal(if_then);
+    enter(if_then);
+    statement(ast->if_then);
+    if (!terminated())
+        jump(exit);
+
+    if (if_else != NULL)
+    {
+        seal(if_else);
+        enter(if_else);
+        statement(ast->if_else);
+        if (!terminated())
+            jump(exit);
+    }
+
+    seal(exit);
+    enter(exit);
+}
+
+static void for_loop(ast_for_loop_t* ast)
+{
+    if (ast->loop == NULL)
+        return;
+
+    statement(ast->init);
+
+    ir_block_t* header = new_block();
+    ir_block_t* body = new_block();
+    ir_block_t* post = new_block();
+    ir_block_t* end = new_block();
+    ir_loop_t loop = {ast->loop, post, end};
+
+    jump(header);
+    enter(header);
+
+    if (ast->condition != NULL)
+        condition(ast->condition, body, end);
+    else
+        jump(body);
+
+    seal(body);
+    enter(body);
+
+    vec_append(loops, &loop);
+    statement(ast->body);
+    loops->vect_used--;
+
+    if (!terminated())
+        jump(post);
+
+    seal(post);
+    enter(post);
+    statement(ast->post);
+    jump(header);
+    seal(header);
+
+    seal(end);
+    enter(end);
+}
+
+static ir_loop_t* find_loop(loop_t* loop)
+{
+    for (size_t i = vec_size(loops); i > 0; i--)
+    {
+        ir_loop_t* target = vec_get(loops, i - 1);
+        if (target->loop == loop)
+            return target;
+    }
+    panic("Jump outside of its loop.");
+    return NULL;
+}
+
+static void func_return(ast_func_return_t* ast)
+{
+    ast_func_call_t* call = tail_call(ast, func_decl);
+    type_t type;
+    ir_value_t* value;
+
+    if (call != NULL)
+        value = user_call(call, true, &type);
+    else
+        value = expr(ast->expr, &type);
+
+    ret(value != NULL ? value : integer(0));
+    unreachable();
+}
+
+static void inline_return(ast_func_return_t* ast)
+{
+    type_t type;
+    ir_value_t* value = expr(ast->expr, &type);
+
+    vec_append(inlined->results, value != NULL ? value : integer(0));
+    jump(inlined->end);
+    unreachable();
+}
+
+static void statement(ast_t* ast)
+{
+    type_t type;
+
+    if (ast == NULL)
+        return;
+
+    if (is_kind(ast, eval_block))
+    {
+        ast_block_t* ast_block = (ast_block_t*) ast;
+        for (size_t i = 0; i < vec_size(ast_block->nodes); i++)
+            statement(vec_get(ast_block->nodes, i));
+    }
+    else if (is_kind(ast, eval_if_cond))
+        if_cond((ast_if_cond_t*) ast);
+    else if (is_kind(ast, eval_for_loop))
+        for_loop((ast_for_loop_t*) ast);
+    else if (is_kind(ast, eval_func_decl))
+        func_decl_ir((ast_func_decl_t*) ast);
+    else if (is_kind(ast, eval_func_return))
+        func_return((ast_func_return_t*) ast);
+    else if (is_kind(ast, eval_inline_return))
+        inline_return((ast_func_return_t*) ast);
+    else if (is_kind(ast, eval_break_loop))
+    {
+        jump(find_loop(((ast_break_loop_t*) ast)->loop)->end);
+        unreachable();
+    }
+    else if (is_kind(ast, eval_continue_loop))
+    {
+        jump(find_loop(((ast_continue_loop_t*) ast)->loop)->post);
+        unreachable();
+    }
+    else
+        expr(ast, &type);
+}
+
+ir_module_t* ir_build(ast_block_t* program)
+{
+    module = malloc(sizeof (ir_module_t));
+    module->funcs = vec_new(0);
+
+    func = new_func("main", NULL, 0);
+    func_decl = NULL;
+    loops = vec_new(0);
+    inlined = NULL;
+
+    ir_block_t* entry = new_block();
+    entry->sealed = true;
+    enter(entry);
+
+    statement((ast_t*) program);
+
+    if (!terminated())
+        append(new_value(IR_HALT, MT_VOID));
+
+    vec_free(loops);
+    loops = NULL;
+    func = NULL;
+    block = NULL;
+
+    ir_module_t* built = module;
+    module = NULL;
+    return built;
+}
+
+void ir_block_free(ir_block_t* b)
+{
+    vec_free(b->insns);
+    vec_free(b->preds);
+    vec_free(b->defs);
+    vec_free(b->incomplete);
+    free(b);
+}
+
+void ir_free(ir_module_t* ir)
+{
+    for (size_t i = 0; i < vec_size(ir->funcs); i++)
+    {
+        ir_func_t* f = vec_get(ir->funcs, i);
+
+        for (size_t j = 0; j < vec_size(f->blocks); j++)
+            ir_block_free(vec_get(f->blocks, j));
+
+        for (size_t j = 0; j < vec_size(f->values); j++)
+        {
+            ir_value_t* value = vec_get(f->values, j);
+            vec_free(value->operands);
+            free(value);
+        }
+
+        vec_free(f->blocks);
+        vec_free(f->values);
+        free(f);
+    }
+
+    vec_free(ir->funcs);
+    free(ir);
+}
+
+// ============================================================================
+// Checks and printing
+// ============================================================================
+
+// Every block ends with its only terminator, its successors list it as a
+// predecessor and its phis have one operand per predecessor
+bool_t ir_verify(ir_func_t* f)
+{
+    for (size_t i = 0; i < vec_size(f->blocks); i++)
+    {
+        ir_block_t* b = vec_get(f->blocks, i);
+        ir_value_t* last = ir_terminator(b);
+
+        if (last == NULL)
+            return false;
+
+        size_t succs = last->kind == IR_JMP ? 1 : last->kind == IR_BRANCH ? 2 : 0;
+        if (ir_succ_count(b) != succs)
+            return false;
+
+        for (size_t j = 0; j < succs; j++)
+        {
+            bool_t found = false;
+            for (size_t k = 0; k < vec_size(b->succs[j]->preds); k++)
+                found |= vec_get(b->succs[j]->preds, k) == b;
+            if (!found)
+                return false;
+        }
+
+        bool_t phis = true;
+        for (size_t j = 0; j < vec_size(b->insns); j++)
+        {
+            ir_value_t* value = vec_get(b->insns, j);
+
+            if (value->block != b || (value->kind >= IR_JMP && value != last))
+                return false;
+
+            if (value->kind == IR_PHI)
+            {
+                if (!phis || vec_size(value->operands) != vec_size(b->preds))
+                    return false;
+            }
+            else
+                phis = false;
+        }
+    }
+    return true;
+}
+
+static void dump_operand(ir_value_t* value, FILE* out)
+{
+    if (value->kind == IR_PARAM)
+        fprintf(out, "arg%u", value->index);
+    else if (value->kind != IR_CONST)
+        fprintf(out, "v%u", value->id);
+    else if (value->opcode != 0)
+        fprintf(out, "%s", OPCODES[value->opcode].name);
+    else if (value->type == MT_REAL)
+        fprintf(out, "%f", value->k.as_real);
+    else if (value->type == MT_STR)
+        fprintf(out, "\"%s\"", value->k.as_str);
+    else
+        fprintf(out, "%ld", (long) value->k.as_int64);
+}
+
+static const char* type_name(type_t type)
+{
+    return type == MT_REAL ? "real" : type == MT_STR ? "str" : "i64";
+}
+
+static void dump_insn(ir_value_t* value, FILE* out)
+{
+    fprintf(out, "    ");
+
+    if (value->type != MT_VOID)
+        fprintf(out, "v%u:%s = ", value->id, type_name(value->type));
+
+    switch (value->kind)
+    {
+    case IR_PHI:    fprintf(out, "phi"); break;
+    case IR_LOAD:   fprintf(out, "%s %u", OPCODES[value->opcode].name, value->index); break;
+    case IR_CALL:   fprintf(out, "%s %s", value->tail ? "tailcall" : "call", value->callee->id); break;
+    case IR_JMP:    fprintf(out, "jmp"); break;
+    case IR_BRANCH: fprintf(out, "br"); break;
+    case IR_RET:    fprintf(out, "ret"); break;
+    case IR_HALT:   fprintf(out, "halt"); break;
+    default:        fprintf(out, "%s", OPCODES[value->opcode].name); break;
+    }
+
+    for (size_t i = 0; i < vec_size(value->operands); i++)
+    {
+        fprintf(out, i == 0 ? " " : ", ");
+        if (value->kind == IR_PHI)
+            fprintf(out, "[b%u: ", ((ir_block_t*) vec_get(value->block->preds, i))->id);
+        dump_operand(vec_get(value->operands, i), out);
+        if (value->kind == IR_PHI)
+            fprintf(out, "]");
+    }
+
+    if (value->kind == IR_JMP)
+        fprintf(out, " b%u", value->block->succs[0]->id);
+    else if (value->kind == IR_BRANCH)
+        fprintf(out, ", b%u, b%u", value->block->succs[0]->id, value->block->succs[1]->id);
+
+    fprintf(out, "\n");
+}
+
+void ir_dump(ir_module_t* ir, FILE* out)
+{
+    for (size_t i = 0; i < vec_size(ir->funcs); i++)
+    {
+        ir_func_t* f = vec_get(ir->funcs, i);
+
+        fprintf(out, "%sfunc %s(%u)\n", i > 0 ? "\n" : "", f->name, f->args);
+
+        for (size_t j = 0; j < vec_size(f->blocks); j++)
+        {
+            ir_block_t* b = vec_get(f->blocks, j);
+
+            fprintf(out, "b%u:", b->id);
+            for (size_t k = 0; k < vec_size(b->preds); k++)
+                fprintf(out, "%s b%u", k == 0 ? "  ; preds" : ",", ((ir_block_t*) vec_get(b->preds, k))->id);
+            fprintf(out, "\n");
+
+            for (size_t k = 0; k < vec_size(b->insns); k++)
+                dump_insn(vec_get(b->insns, k), out);
+        }
+    }
+}
@@ -0,0 +1,128 @@
+#ifndef IR_H
+#define IR_H
+
+#include "ast.h"
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+// SSA intermediate representation between the AST and vm.h code. A
+// function is a control flow graph of basic blocks; every instruction
+// defines at most one value and every value is defined exactly once.
+// Variables do not exist in the IR: ir_build renames them into values and
+// places phis where control flow joins, following Braun et al., "Simple and
+// Efficient Construction of Static Single Assignment Form".
+
+typedef enum
+{
+    IR_CONST,       // `k` of `type`, or the builtin constant `opcode` (RCONST_PI)
+    IR_PARAM,       // Argument `index` of the function
+    IR_LOAD,        // ILOAD, RLOAD or SLOAD (`opcode`) of frame slot `index` on entry
+    IR_PHI,         // One operand per predecessor of its block, in order
+    IR_OP,          // vm.h `opcode` over the operands: IADD, RNEG, I8CAST, RSQRT...
+    IR_CALL,        // User function `callee` with the operands as arguments
+    IR_PRINT,       // IPRINT, RPRINT or SPRINT (`opcode`) of the operand
+    IR_JMP,         // Terminators: to succs[0]
+    IR_BRANCH,      // To succs[0] when the operand is not zero, else succs[1]
+    IR_RET,         // Returns the operand
+    IR_HALT,        // End of the program
+} ir_kind_t;
+
+typedef struct ir_block_t ir_block_t;
+typedef struct ir_value_t ir_value_t;
+
+struct ir_value_t
+{
+    ir_kind_t kind;
+    uint32_t id;
+    type_t type;            // MT_INT64, MT_REAL or MT_STR; MT_VOID when there is no value
+    uint8_t opcode;
+    value_t k;
+    uint16_t index;
+    symbol_t* callee;
+    bool_t tail;            // Call in tail position, lowered to TAILCALL
+    vector_t* operands;     // ir_value_t*
+    ir_block_t* block;      // NULL for constants and parameters
+    int32_t slot;           // Frame slot given by the lowering, or -1
+};
+
+struct ir_block_t
+{
+    uint32_t id;
+    vector_t* insns;        // Phis first, one terminator last
+    vector_t* preds;        // ir_block_t*
+    ir_block_t* succs[2];
+
+    // Construction state
+    vector_t* defs;         // Pairs of symbol_t* and the ir_value_t* it holds
+    vector_t* incomplete;   // Same, for phis added before the block was sealed
+    bool_t sealed;
+};
+
+typedef struct
+{
+    const char* name;
+    symbol_t* symbol;       // NULL for the program itself
+    uint16_t args;
+    vector_t* blocks;       // In layout order, entry first
+    vector_t* values;       // Every value created, owned by the function
+    uint32_t next_value;
+    uint32_t next_block;
+} ir_func_t;
+
+typedef struct
+{
+    vector_t* funcs;        // The program first, then functions in declaration order
+} ir_module_t;
+
+// ir.c
+ir_module_t* ir_build(ast_block_t* program);
+void ir_free(ir_module_t* module);
+void ir_dump(ir_module_t* module, FILE* out);
+bool_t ir_verify(ir_func_t* func);
+
+ir_block_t* ir_block_new(ir_func_t* func);
+void ir_block_free(ir_block_t* block);
+ir_value_t* ir_terminator(ir_block_t* block);
+size_t ir_succ_count(ir_block_t* block);
+bool_t ir_is_trapping(ir_value_t* value);
+bool_t ir_has_side_effects(ir_value_t* value);
+void ir_replace_uses(ir_func_t* func, ir_value_t* from, ir_value_t* to);
+void ir_remove_pred(ir_block_t* block, size_t index);
+
+// irpass.c: passes run on every function until none of them changes it
+typedef bool_t (*ir_pass_run_t)(ir_func_t* func);
+
+typedef struct
+{
+    const char* name;
+    ir_pass_run_t run;
+} ir_pass_t;
+
+typedef struct
+{
+    vector_t* passes;       // ir_pass_t*
+} ir_pass_manager_t;
+
+ir_pass_manager_t* ir_pass_manager_new();
+void ir_pass_manager_free(ir_pass_manager_t* manager);
+void ir_pass_add(ir_pass_manager_t* manager, const char* name, ir_pass_run_t run);
+void ir_pass_add_defaults(ir_pass_manager_t* manager);
+void ir_pass_run(ir_pass_manager_t* manager, ir_module_t* module);
+
+bool_t ir_simplify_cfg(ir_func_t* func);
+bool_t ir_simplify_phis(ir_func_t* func);
+bool_t ir_dce(ir_func_t* func);
+bool_t ir_split_critical_edges(ir_func_t* func);
+
+// irgen.c: generates vm.h code for the module, in place of eval
+void ir_lower(ir_module_t* module);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* IR_H */
@@ -0,0 +1,904 @@
+#include "ir.h"
+#include "vm.h"
+#include "utf8.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+// Lowering of the IR to vm.h code. A value used once, by the next
+// instruction that needs it in the same block, is computed right where it
+// is used and never leaves the stack; every other value lives in a frame
+// slot. Slots are given by coloring the live intervals of the values over
+// the block layout, so values that are never live at once share a slot.
+// Phis are copies into their slot at the end of each predecessor, unless
+// the incoming value was computed right into that slot.
+
+typedef struct
+{
+    size_t at;              // Code address of the 32-bit target
+    void* target;           // ir_block_t*, or the symbol_t* of a CALL
+} fixup_t;
+
+static _Thread_local ir_func_t* func;
+static _Thread_local int32_t* uses;           // Per value id
+static _Thread_local bool_t* folded;            // Computed at its user
+static _Thread_local bool_t* effects;           // Has, or computes at its user, a side effect
+static _Thread_local int32_t* starts;         // Live interval of each value needing a slot
+static _Thread_local int32_t* ends;
+static _Thread_local int32_t* data;           // Data address of each string constant
+static _Thread_local ir_value_t** coalesced;  // The phi whose slot a value shares
+static _Thread_local size_t* labels;          // Code address of each block, by id
+static _Thread_local vector_t* jumps;         // fixup_t* to blocks of the current function
+static _Thread_local vector_t* calls;         // fixup_t* to functions of the module
+
+static bool_t is_slot_value(ir_value_t* value)
+{
+    if (value->kind == IR_PHI || value->kind == IR_PARAM)
+        return true;
+    return (value->kind == IR_OP || value->kind == IR_CALL || value->kind == IR_LOAD) &&
+           !folded[value->id] && uses[value->id] > 0;
+}
+
+static size_t index_of(vector_t* vector, void* item)
+{
+    for (size_t i = 0; i < vec_size(vector); i++)
+        if (vec_get(vector, i) == item)
+            return i;
+    return vec_size(vector);
+}
+
+// ============================================================================
+// Folding
+// ============================================================================
+
+static void count_uses()
+{
+    for (size_t i = 0; i < vec_size(func->blocks); i++)
+    {
+        ir_block_t* block = vec_get(func->blocks, i);
+        for (size_t j = 0; j < vec_size(block->insns); j++)
+        {
+            ir_value_t* value = vec_get(block->insns, j);
+            for (size_t k = 0; k < vec_size(value->operands); k++)
+            {
+                ir_value_t* operand = vec_get(value->operands, k);
+                uses[operand->id]++;
+            }
+        }
+    }
+}
+
+// Decides which operands of each instruction are computed right before it.
+// Operands are taken from the last one back, as the stack would pop them: an
+// operand moves down past the instructions left between it and the ones
+// already taken, unless two side effects would trade places.
+static void fold(ir_block_t* block)
+{
+    for (size_t i = 0; i < vec_size(block->insns); i++)
+    {
+        ir_value_t* value = vec_get(block->insns, i);
+        size_t next = i;
+
+        effects[value->id] = ir_has_side_effects(value);
+
+        if (value->kind == IR_PHI)
+            continue;
+
+        for (size_t k = vec_size(value->operands); k > 0; k--)
+        {
+            ir_value_t* operand = vec_get(value->operands, k - 1);
+
+            if ((operand->kind != IR_OP && operand->kind != IR_CALL) ||
+                operand->block != block || uses[operand->id] != 1)
+                continue;
+
+            size_t at = index_of(block->insns, operand);
+            bool_t movable = at < next;
+
+            for (size_t j = at + 1; j < next && movable; j++)
+            {
+                ir_value_t* between = vec_get(block->insns, j);
+                movable = folded[between->id] || !(effects[operand->id] && effects[between->id]);
+            }
+
+            if (movable)
+            {
+                folded[operand->id] = true;
+                effects[value->id] |= effects[operand->id];
+                next = at;
+            }
+        }
+    }
+}
+
+// ============================================================================
+// Slots
+// ============================================================================
+
+static void extend(ir_value_t* value, int32_t position)
+{
+    if (!is_slot_value(value))
+        return;
+
+    if (coalesced[value->id] != NULL)
+        value = coalesced[value->id];
+
+    if (starts[value->id] < 0 || position < starts[value->id])
+        starts[value->id] = position;
+    if (position > ends[value->id])
+        ends[value->id] = position;
+}
+
+// Calls `use` for every value read from a slot when `value` is computed
+static void leaves(ir_value_t* value, void (*use)(ir_value_t*, void*), void* arg)
+{
+    for (size_t i = 0; i < vec_size(value->operands); i++)
+    {
+        ir_value_t* operand = vec_get(value->operands, i);
+
+        if (folded[operand->id])
+            leaves(operand, use, arg);
+        else if (is_slot_value(operand))
+            use(operand, arg);
+    }
+}
+
+static bool_t is_root(ir_value_t* value)
+{
+    return value->kind != IR_PHI && !folded[value->id];
+}
+
+typedef struct
+{
+    uint64_t* set;
+    uint64_t* defs;
+    int32_t position;
+} leaf_use_t;
+
+static void set_bit(uint64_t* set, uint32_t bit)
+{
+    set[bit / 64] |= (uint64_t) 1 << (bit % 64);
+}
+
+static bool_t get_bit(uint64_t* set, uint32_t bit)
+{
+    return (set[bit / 64] >> (bit % 64)) & 1;
+}
+
+static void add_use(ir_value_t* value, void* arg)
+{
+    leaf_use_t* leaf = arg;
+    if (!get_bit(leaf->defs, value->id))
+        set_bit(leaf->set, value->id);
+}
+
+static void extend_use(ir_value_t* value, void* arg)
+{
+    extend(value, ((leaf_use_t*) arg)->position);
+}
+
+// Operand of the phis of `succ` coming from `pred`
+static ir_value_t* incoming(ir_value_t* phi, ir_block_t* pred)
+{
+    return vec_get(phi->operands, index_of(phi->block->preds, pred));
+}
+
+// Live intervals over positions numbered along the layout: the start of
+// each block, each of its instructions, then its end. Phi copies happen at
+// the position of the terminator of the predecessor.
+static void intervals()
+{
+    size_t count = vec_size(func->blocks);
+    size_t words = (func->next_value + 63) / 64;
+    uint64_t* sets = calloc(count * 4 * words, sizeof (uint64_t));
+    uint64_t** use = malloc(count * sizeof (uint64_t*));
+    uint64_t** def = malloc(count * sizeof (uint64_t*));
+    uint64_t** in = malloc(count * sizeof (uint64_t*));
+    uint64_t** out = malloc(count * sizeof (uint64_t*));
+
+    for (size_t i = 0; i < count; i++)
+    {
+        ir_block_t* block = vec_get(func->blocks, i);
+
+        use[i] = sets + (i * 4) * words;
+        def[i] = sets + (i * 4 + 1) * words;
+        in[i] = sets + (i * 4 + 2) * words;
+        out[i] = sets + (i * 4 + 3) * words;
+
+        for (size_t j = 0; j < vec_size(block->insns); j++)
+        {
+            ir_value_t* value = vec_get(block->insns, j);
+            if (is_slot_value(value))
+                set_bit(def[i], value->id);
+        }
+
+        leaf_use_t leaf = {use[i], def[i], 0};
+        for (size_t j = 0; j < vec_size(block->insns); j++)
+        {
+            ir_value_t* value = vec_get(block->insns, j);
+            if (is_root(value))
+                leaves(value, add_use, &leaf);
+        }
+    }
+
+    // Backward dataflow to a fixed point
+    for (bool_t changed = true; changed; )
+    {
+        changed = false;
+
+        for (size_t i = count; i > 0; i--)
+        {
+            ir_block_t* block = vec_get(func->blocks, i - 1);
+            uint64_t* block_out = out[i - 1];
+
+            for (size_t s = 0; s < ir_succ_count(block); s++)
+            {
+                ir_block_t* succ = block->succs[s];
+                uint64_t* succ_in = in[index_of(func->blocks, succ)];
+
+                for (size_t w = 0; w < words; w++)
+                    block_out[w] |= succ_in[w];
+
+                for (size_t j = 0; j < vec_size(succ->insns); j++)
+                {
+                    ir_value_t* phi = vec_get(succ->insns, j);
+                    if (phi->kind != IR_PHI)
+                        break;
+                    ir_value_t* operand = incoming(phi, block);
+                    if (is_slot_value(operand))
+                        set_bit(block_out, operand->id);
+                }
+            }
+
+            for (size_t w = 0; w < words; w++)
+            {
+                uint64_t live = use[i - 1][w] | (block_out[w] & ~def[i - 1][w]);
+                changed |= live != in[i - 1][w];
+                in[i - 1][w] = live;
+            }
+        }
+    }
+
+    int32_t position = 0;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        ir_block_t* block = vec_get(func->blocks, i);
+        int32_t start = position++;
+
+        for (size_t j = 0; j < vec_size(block->insns); j++)
+        {
+            ir_value_t* value = vec_get(block->insns, j);
+            leaf_use_t leaf = {NULL, NULL, position};
+
+            if (value->kind == IR_PHI)
+                extend(value, start);
+            else if (is_root(value))
+            {
+                leaves(value, extend_use, &leaf);
+                extend(value, position);
+            }
+
+            // Phi copies to the successor
+            if (value->kind == IR_JMP)
+            {
+                ir_block_t* succ = block->succs[0];
+                for (size_t k = 0; k < vec_size(succ->insns); k++)
+                {
+                    ir_value_t* phi = vec_get(succ->insns, k);
+                    if (phi->kind != IR_PHI)
+                        break;
+                    extend(phi, position);
+                    extend(incoming(phi, block), position);
+                }
+            }
+
+            ++position;
+        }
+
+        int32_t end = position++;
+
+        for (uint32_t id = 0; id < func->next_value; id++)
+        {
+            if (get_bit(in[i], id))
+                extend(vec_get(func->values, id), start);
+            if (get_bit(out[i], id))
+                extend(vec_get(func->values, id), end);
+        }
+    }
+
+    free(sets);
+    free(use);
+    free(def);
+    free(in);
+    free(out);
+}
+
+static void find_use(ir_value_t* value, void* arg)
+{
+    if (value == ((ir_value_t**) arg)[0])
+        ((ir_value_t**) arg)[1] = value;
+}
+
+// Whether `phi` is read in `pred` once `value` is computed, including by
+// the copies to the phis of its block
+static bool_t read_after(ir_block_t* pred, ir_value_t* value, ir_value_t* phi)
+{
+    ir_value_t* search[2] = {phi, NULL};
+
+    for (size_t i = index_of(pred->insns, value) + 1; i < vec_size(pred->insns); i++)
+    {
+        ir_value_t* insn = vec_get(pred->insns, i);
+        if (is_root(insn))
+            leaves(insn, find_use, search);
+    }
+
+    for (size_t i = 0; i < vec_size(phi->block->insns); i++)
+    {
+        ir_value_t* other = vec_get(phi->block->insns, i);
+        if (other->kind != IR_PHI)
+            break;
+        if (incoming(other, pred) == phi)
+            return true;
+    }
+
+    return search[1] != NULL;
+}
+
+// An incoming value computed in the predecessor after the last read of the
+// phi there is stored right into the slot of the phi: in `i = i + 1` the
+// old `i` is dead once the new one exists.
+static void coalesce()
+{
+    for (size_t i = 0; i < vec_size(func->blocks); i++)
+    {
+        ir_block_t* block = vec_get(func->blocks, i);
+
+        for (size_t j = 0; j < vec_size(block->insns); j++)
+        {
+            ir_value_t* phi = vec_get(block->insns, j);
+            if (phi->kind != IR_PHI)
+                break;
+
+            for (size_t k = 0; k < vec_size(block->preds); k++)
+            {
+                ir_block_t* pred = vec_get(block->preds, k);
+                ir_value_t* value = vec_get(phi->operands, k);
+
+                if (!is_slot_value(value) || value->kind == IR_PHI || value->kind == IR_PARAM ||
+                    value->block != pred || value->type != phi->type || uses[value->id] != 1)
+                    continue;
+
+                if (!read_after(pred, value, phi))
+                    coalesced[value->id] = phi;
+            }
+        }
+    }
+}
+
+static int compare_starts(const void* lhs, const void* rhs)
+{
+    const ir_value_t* a = *(ir_value_t* const*) lhs;
+    const ir_value_t* b = *(ir_value_t* const*) rhs;
+
+    if (starts[a->id] != starts[b->id])
+        return starts[a->id] < starts[b->id] ? -1 : 1;
+    return a->id < b->id ? -1 : a->id > b->id;
+}
+
+// Greedy coloring in the order the intervals start. Returns the number of
+// slots of the frame.
+static uint16_t allocate()
+{
+    ir_value_t** order = malloc(func->next_value * sizeof (ir_value_t*));
+    int32_t* busy = malloc((func->next_value + func->args) * sizeof (int32_t));
+    size_t count = 0;
+    uint16_t slots = func->args;
+
+    for (uint32_t id = 0; id < func->next_value; id++)
+    {
+        ir_value_t* value = vec_get(func->values, id);
+
+        value->slot = -1;
+        if (value->kind == IR_PARAM)
+        {
+            // Arguments are where the caller put them, from the entry on
+            value->slot = value->index;
+            starts[id] = 0;
+            ends[id] = ends[id] < 0 ? 0 : ends[id];
+        }
+        else if (starts[id] >= 0)
+            order[count++] = value;
+    }
+
+    for (uint16_t i = 0; i < func->args; i++)
+        busy[i] = -1;
+    for (uint32_t id = 0; id < func->next_value; id++)
+    {
+        ir_value_t* value = vec_get(func->values, id);
+        if (value->kind == IR_PARAM)
+            busy[value->slot] = ends[id];
+    }
+
+    qsort(order, count, sizeof (ir_value_t*), compare_starts);
+
+    for (size_t i = 0; i < count; i++)
+    {
+        ir_value_t* value = order[i];
+        uint16_t slot = 0;
+
+        if (coalesced[value->id] != NULL)
+            continue;
+
+        while (slot < slots && busy[slot] >= starts[value->id])
+            ++slot;
+
+        if (slot == slots)
+            ++slots;
+
+        value->slot = slot;
+        busy[slot] = ends[value->id];
+    }
+
+    for (uint32_t id = 0; id < func->next_value; id++)
+        if (coalesced[id] != NULL)
+            ((ir_value_t*) vec_get(func->values, id))->slot = coalesced[id]->slot;
+
+    free(order);
+    free(busy);
+    return slots;
+}
+
+// ============================================================================
+// Code
+// ============================================================================
+
+// Follows the jump or call opcode just emitted, which takes its wide form
+// until the target is known
+static void emit_target(vector_t* fixups, void* target)
+{
+    fixup_t* fixup = malloc(sizeof (fixup_t));
+    fixup->at = vm_code_addr();
+    fixup->target = target;
+    vec_append(fixups, fixup);
+    CODE(fixup->at - 1, vm_wide_op(vm_code_get(fixup->at - 1)));
+    EMIT(NUM32(0));
+}
+
+static void emit_integer(int64_t val)
+{
+    if (val == 0) {
+        EMIT(ICONST_0);
+    } else if (val == 1) {
+        EMIT(ICONST_1);
+    } else if (val >= INT8_MIN && val <= INT8_MAX) {
+        EMIT(I8CONST, NUM8((int8_t)val));
+    } else if (val >= INT16_MIN && val <= INT16_MAX) {
+        EMIT(I16CONST, NUM16((int16_t)val));
+    } else if (val >= INT32_MIN && val <= INT32_MAX) {
+        EMIT(I32CONST, NUM32((int32_t)val));
+    } else {
+        EMIT(ICONST, NUM64(val));
+    }
+}
+
+static void emit_constant(ir_value_t* value)
+{
+    if (value->opcode != 0)
+    {
+        EMIT(value->opcode);
+    }
+    else if (value->type == MT_REAL)
+    {
+        if (value->k.as_real == 0.0 && !signbit(value->k.as_real))
+        {
+            EMIT(RCONST_0);
+        }
+        else if (value->k.as_real == 1.0)
+        {
+            EMIT(RCONST_1);
+        }
+        else
+        {
+            EMIT(RCONST, NUM64(value->k.as_uint64));
+        }
+    }
+    else if (value->type == MT_STR)
+    {
+        if (data[value->id] < 0)
+        {
+            data[value->id] = vm_data_string(value->k.as_str);
+        }
+        uint16_t a = data[value->id];
+        EMIT(SCONST, NUM16(a));
+    }
+    else
+        emit_integer(value->k.as_int64);
+}
+
+static void emit_store(ir_value_t* value)
+{
+    uint16_t addr = value->slot;
+
+    if (value->type == MT_REAL) {
+        EMIT(RSTORE, NUM16(addr));
+    } else if (value->type == MT_STR) {
+        EMIT(SSTORE, NUM16(addr));
+    } else {
+        EMIT(ISTORE, NUM16(addr));
+    }
+}
+
+static void emit_value(ir_value_t* value);
+
+// An i64 kept in a slot
+static bool_t is_local(ir_value_t* value)
+{
+    return value->kind != IR_CONST && !folded[value->id] && value->type == MT_INT64;
+}
+
+static bool_t is_integer(ir_value_t* value, int64_t min, int64_t max)
+{
+    return value->kind == IR_CONST && value->opcode == 0 && value->type == MT_INT64 &&
+           value->k.as_int64 >= min && value->k.as_int64 <= max;
+}
+
+// Pushes the operands. A local and a constant go in one ILOAD_ICONST.
+static void emit_operands(ir_value_t* value)
+{
+    if (value->kind == IR_OP && vec_size(value->operands) == 2)
+    {
+        ir_value_t* lhs = vec_first(value->operands);
+        ir_value_t* rhs = vec_last(value->operands);
+
+        if (is_local(lhs) && is_integer(rhs, INT32_MIN, INT32_MAX))
+        {
+            uint16_t addr = lhs->slot;
+            EMIT(ILOAD_ICONST, NUM16(addr), NUM32(rhs->k.as_int64));
+            return;
+        }
+    }
+
+    for (size_t i = 0; i < vec_size(value->operands); i++)
+        emit_value(vec_get(value->operands, i));
+}
+
+// Computes an operation, leaving its result on the stack
+static void emit_computation(ir_value_t* value)
+{
+    if (value->kind == IR_OP && value->opcode == IADD &&
+        is_local(vec_first(value->operands)) && is_local(vec_last(value->operands)))
+    {
+        uint16_t lhs_addr = ((ir_value_t*) vec_first(value->operands))->slot;
+        uint16_t rhs_addr = ((ir_value_t*) vec_last(value->operands))->slot;
+        EMIT(ILOAD_ILOAD_IADD, NUM16(lhs_addr), NUM16(rhs_addr));
+        return;
+    }
+
+    emit_operands(value);
+
+    if (value->kind == IR_CALL)
+    {
+        EMIT(CALL);
+        emit_target(calls, value->callee);
+    }
+    else
+        EMIT(value->opcode);
+}
+
+// Pushes a value
+static void emit_value(ir_value_t* value)
+{
+    if (value->kind == IR_CONST)
+    {
+        emit_constant(value);
+        return;
+    }
+
+    if (folded[value->id])
+    {
+        emit_computation(value);
+        return;
+    }
+
+    uint16_t addr = value->slot;
+
+    if (value->type == MT_REAL) {
+        EMIT(RLOAD, NUM16(addr));
+    } else if (value->type == MT_STR) {
+        EMIT(SLOAD, NUM16(addr));
+    } else {
+        EMIT(ILOAD, NUM16(addr));
+    }
+}
+
+static void emit_jump(uint8_t opcode, ir_block_t* target)
+{
+    EMIT(opcode);
+    emit_target(jumps, target);
+}
+
+// Stores the incoming values of the phis of `succ`. All of them are pushed
+// before any is stored, since a phi may be the operand of another.
+static void emit_copies(ir_block_t* block, ir_block_t* succ)
+{
+    vector_t* phis = vec_new(0);
+
+    for (size_t i = 0; i < vec_size(succ->insns); i++)
+    {
+        ir_value_t* phi = vec_get(succ->insns, i);
+        if (phi->kind != IR_PHI)
+            break;
+
+        ir_value_t* operand = incoming(phi, block);
+        if (operand->kind != IR_CONST && operand->slot == phi->slot)
+            continue;
+
+        emit_value(operand);
+        vec_append(phis, phi);
+    }
+
+    for (size_t i = vec_size(phis); i > 0; i--)
+        emit_store(vec_get(phis, i - 1));
+
+    vec_free(phis);
+}
+
+static uint8_t compare_jez_opcode(uint8_t opcode)
+{
+    switch (opcode)
+    {
+    case IGT: return IGT_JEZ;
+    case ILT: return ILT_JEZ;
+    case IGE: return IGE_JEZ;
+    case ILE: return ILE_JEZ;
+    case IEQ: return IEQ_JEZ;
+    case INQ: return INQ_JEZ;
+    case RGT: return RGT_JEZ;
+    case RLT: return RLT_JEZ;
+    case RGE: return RGE_JEZ;
+    case RLE: return RLE_JEZ;
+    case REQ: return REQ_JEZ;
+    case RNQ: return RNQ_JEZ;
+    default:  return NOP;
+    }
+}
+
+// Integer compare-and-branch taken when the comparison holds
+static uint8_t compare_jnz_opcode(uint8_t opcode)
+{
+    switch (opcode)
+    {
+    case IGT: return ILE_JEZ;
+    case ILT: return IGE_JEZ;
+    case IGE: return ILT_JEZ;
+    case ILE: return IGT_JEZ;
+    case IEQ: return INQ_JEZ;
+    case INQ: return IEQ_JEZ;
+    default:  return NOP;
+    }
+}
+
+static void emit_branch(ir_value_t* branch, ir_block_t* next)
+{
+    ir_value_t* condition = vec_first(branch->operands);
+    ir_block_t* if_true = branch->block->succs[0];
+    ir_block_t* if_false = branch->block->succs[1];
+    bool_t real = condition->type == MT_REAL;
+
+    if (condition->kind == IR_OP && folded[condition->id] &&
+        compare_jez_opcode(condition->opcode) != NOP)
+    {
+        emit_operands(condition);
+
+        if (next == if_false && compare_jnz_opcode(condition->opcode) != NOP)
+        {
+            emit_jump(compare_jnz_opcode(condition->opcode), if_true);
+            return;
+        }
+
+        emit_jump(compare_jez_opcode(condition->opcode), if_false);
+    }
+    else
+    {
+        emit_value(condition);
+
+        if (next == if_false)
+        {
+            emit_jump(real ? RJNZ : JNZ, if_true);
+            return;
+        }
+
+        emit_jump(real ? RJEZ : JEZ, if_false);
+    }
+
+    if (next != if_true)
+        emit_jump(JMP, if_true);
+}
+
+static void emit_ret(ir_value_t* ret)
+{
+    ir_value_t* value = vec_first(ret->operands);
+
+    if (value->kind == IR_CALL && value->tail && folded[value->id])
+    {
+        emit_operands(value);
+        EMIT(TAILCALL);
+        emit_target(calls, value->callee);
+        uint16_t args = vec_size(value->operands);
+        EMIT(NUM16(args));
+        return;
+    }
+
+    emit_value(value);
+    EMIT(RET);
+}
+
+// `x + k` or `x - k` computed in the slot of x, as after coalescing
+static bool_t emit_increment(ir_value_t* value)
+{
+    ir_value_t* lhs = vec_first(value->operands);
+    ir_value_t* rhs = vec_last(value->operands);
+
+    if ((value->opcode != IADD && value->opcode != ISUB) || !is_local(lhs) ||
+        lhs->slot != value->slot || !is_integer(rhs, INT8_MIN + 1, INT8_MAX))
+        return false;
+
+    uint16_t addr = value->slot;
+    int8_t delta = value->opcode == IADD ? rhs->k.as_int64 : -rhs->k.as_int64;
+    EMIT(IINC_LOCAL, NUM16(addr), NUM8(delta));
+    return true;
+}
+
+// The loads of the entry read the frame as the function found it, so all
+// of them are pushed before any is stored
+static void emit_loads(ir_block_t* entry)
+{
+    vector_t* loads = vec_new(0);
+
+    for (size_t i = 0; i < vec_size(entry->insns); i++)
+    {
+        ir_value_t* value = vec_get(entry->insns, i);
+        if (value->kind != IR_LOAD || uses[value->id] == 0)
+            continue;
+
+        uint16_t addr = value->index;
+        EMIT(value->opcode, NUM16(addr));
+        vec_append(loads, value);
+    }
+
+    for (size_t i = vec_size(loads); i > 0; i--)
+        emit_store(vec_get(loads, i - 1));
+
+    vec_free(loads);
+}
+
+static void emit_insn(ir_value_t* value, ir_block_t* next)
+{
+    switch (value->kind)
+    {
+    case IR_OP:
+    case IR_CALL:
+        if (value->kind == IR_OP && uses[value->id] > 0 && emit_increment(value))
+            break;
+        emit_computation(value);
+        if (uses[value->id] > 0)
+            emit_store(value);
+        else
+            EMIT(DROP, NUM16(1));
+        break;
+    case IR_PRINT:
+        emit_operands(value);
+        EMIT(value->opcode);
+        break;
+    case IR_JMP:
+        emit_copies(value->block, value->block->succs[0]);
+        if (value->block->succs[0] != next)
+            emit_jump(JMP, value->block->succs[0]);
+        break;
+    case IR_BRANCH:
+        emit_branch(value, next);
+        break;
+    case IR_RET:
+        emit_ret(value);
+        break;
+    case IR_HALT:
+        EMIT(HALT);
+        break;
+    default:
+        break;
+    }
+}
+
+static void lower(ir_func_t* lowered)
+{
+    func = lowered;
+    ir_split_critical_edges(func);
+
+    uint32_t count = func->next_value;
+
+    uses = calloc(count, sizeof (int32_t));
+    folded = calloc(count, sizeof (bool_t));
+    effects = calloc(count, sizeof (bool_t));
+    starts = malloc(count * sizeof (int32_t));
+    ends = malloc(count * sizeof (int32_t));
+    data = malloc(count * sizeof (int32_t));
+    coalesced = calloc(count, sizeof (ir_value_t*));
+    labels = calloc(func->next_block, sizeof (size_t));
+    jumps = vec_new(0);
+
+    for (uint32_t i = 0; i < count; i++)
+        starts[i] = ends[i] = data[i] = -1;
+
+    count_uses();
+    for (size_t i = 0; i < vec_size(func->blocks); i++)
+        fold(vec_get(func->blocks, i));
+    coalesce();
+    intervals();
+
+    uint16_t args = func->args;
+    uint16_t vars = allocate() - args;
+
+    // The program is called like a function with no arguments
+    if (func->symbol == NULL)
+        EMIT(ICONST_0, ICONST_0);
+    else
+        func->symbol->addr = vm_code_addr();
+
+    EMIT(PROC, NUM16(args), NUM16(vars));
+
+    for (size_t i = 0; i < vec_size(func->blocks); i++)
+    {
+        ir_block_t* block = vec_get(func->blocks, i);
+        ir_block_t* next = i + 1 < vec_size(func->blocks) ? vec_get(func->blocks, i + 1) : NULL;
+
+        labels[block->id] = vm_code_addr();
+
+        if (i == 0)
+            emit_loads(block);
+
+        for (size_t j = 0; j < vec_size(block->insns); j++)
+        {
+            ir_value_t* value = vec_get(block->insns, j);
+            if (is_root(value))
+                emit_insn(value, next);
+        }
+    }
+
+    for (size_t i = 0; i < vec_size(jumps); i++)
+    {
+        fixup_t* fixup = vec_get(jumps, i);
+        uint32_t label = labels[((ir_block_t*) fixup->target)->id];
+        CODE(fixup->at, NUM32(label));
+        free(fixup);
+    }
+
+    vec_free(jumps);
+    free(uses);
+    free(folded);
+    free(effects);
+    free(starts);
+    free(ends);
+    free(data);
+    free(coalesced);
+    free(labels);
+}
+
+void ir_lower(ir_module_t* module)
+{
+    calls = vec_new(0);
+
+    for (size_t i = 0; i < vec_size(module->funcs); i++)
+        lower(vec_get(module->funcs, i));
+
+    for (size_t i = 0; i < vec_size(calls); i++)
+    {
+        fixup_t* fixup = vec_get(calls, i);
+        uint32_t addr = ((symbol_t*) fixup->target)->addr;
+        CODE(fixup->at, NUM32(addr));
+        free(fixup);
+    }
+
+    vec_free(calls);
+    func = NULL;
+}
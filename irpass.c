@@ -0,0 +1,346 @@
+#include "ir.h"
+#include <stdlib.h>
+
+// Passes over ir_func_t. Each one returns true when it changed the function,
+// so that the manager can run them again until they settle.
+
+#define IR_PASS_ROUNDS 16
+
+ir_pass_manager_t* ir_pass_manager_new()
+{
+    ir_pass_manager_t* manager = malloc(sizeof (ir_pass_manager_t));
+    manager->passes = vec_new(0);
+    return manager;
+}
+
+void ir_pass_manager_free(ir_pass_manager_t* manager)
+{
+    for (size_t i = 0; i < vec_size(manager->passes); i++)
+        free(vec_get(manager->passes, i));
+    vec_free(manager->passes);
+    free(manager);
+}
+
+void ir_pass_add(ir_pass_manager_t* manager, const char* name, ir_pass_run_t run)
+{
+    ir_pass_t* pass = malloc(sizeof (ir_pass_t));
+    pass->name = name;
+    pass->run = run;
+    vec_append(manager->passes, pass);
+}
+
+void ir_pass_add_defaults(ir_pass_manager_t* manager)
+{
+    ir_pass_add(manager, "simplify-cfg", ir_simplify_cfg);
+    ir_pass_add(manager, "simplify-phis", ir_simplify_phis);
+    ir_pass_add(manager, "dce", ir_dce);
+}
+
+void ir_pass_run(ir_pass_manager_t* manager, ir_module_t* module)
+{
+    for (size_t i = 0; i < vec_size(module->funcs); i++)
+    {
+        ir_func_t* func = vec_get(module->funcs, i);
+        bool_t changed = true;
+
+        for (size_t round = 0; changed && round < IR_PASS_ROUNDS; round++)
+        {
+            changed = false;
+            for (size_t j = 0; j < vec_size(manager->passes); j++)
+                changed |= ((ir_pass_t*) vec_get(manager->passes, j))->run(func);
+        }
+    }
+}
+
+static void remove_at(vector_t* vector, size_t index)
+{
+    for (size_t i = index; i + 1 < vec_size(vector); i++)
+        vec_set(vector, i, vec_get(vector, i + 1));
+    vector->vect_used--;
+}
+
+static size_t pred_index(ir_block_t* block, ir_block_t* pred)
+{
+    for (size_t i = 0; i < vec_size(block->preds); i++)
+        if (vec_get(block->preds, i) == pred)
+            return i;
+    return vec_size(block->preds);
+}
+
+// Drops the edge from `block` to succs[index]
+static void remove_succ(ir_block_t* block, size_t index)
+{
+    ir_block_t* succ = block->succs[index];
+
+    ir_remove_pred(succ, pred_index(succ, block));
+    if (index == 0)
+        block->succs[0] = block->succs[1];
+    block->succs[1] = NULL;
+}
+
+static void mark_reachable(ir_block_t* block, vector_t* reached)
+{
+    for (size_t i = 0; i < vec_size(reached); i++)
+        if (vec_get(reached, i) == block)
+            return;
+
+    vec_append(reached, block);
+    for (size_t i = 0; i < ir_succ_count(block); i++)
+        mark_reachable(block->succs[i], reached);
+}
+
+static bool_t is_reached(vector_t* reached, ir_block_t* block)
+{
+    for (size_t i = 0; i < vec_size(reached); i++)
+        if (vec_get(reached, i) == block)
+            return true;
+    return false;
+}
+
+// Turns branches on constants into jumps, removes the blocks no path from
+// the entry reaches and merges a block into its only predecessor when that
+// predecessor has no other successor
+bool_t ir_simplify_cfg(ir_func_t* func)
+{
+    bool_t changed = false;
+
+    for (size_t i = 0; i < vec_size(func->blocks); i++)
+    {
+        ir_block_t* block = vec_get(func->blocks, i);
+        ir_value_t* last = ir_terminator(block);
+
+        if (last->kind != IR_BRANCH || block->succs[0] == block->succs[1])
+            continue;
+
+        ir_value_t* condition = vec_first(last->operands);
+
+        if (condition->kind != IR_CONST || condition->opcode != 0 || condition->type != MT_INT64)
+            continue;
+
+        remove_succ(block, condition->k.as_int64 != 0 ? 1 : 0);
+        last->kind = IR_JMP;
+        last->operands->vect_used = 0;
+        changed = true;
+    }
+
+    vector_t* reached = vec_new(0);
+    mark_reachable(vec_first(func->blocks), reached);
+
+    // Edges between two unreachable blocks go away with them
+    for (size_t i = 0; i < vec_size(func->blocks); i++)
+    {
+        ir_block_t* block = vec_get(func->blocks, i);
+
+        if (is_reached(reached, block))
+            continue;
+
+        for (size_t j = 0; j < ir_succ_count(block); j++)
+            if (is_reached(reached, block->succs[j]))
+                ir_remove_pred(block->succs[j], pred_index(block->succs[j], block));
+    }
+
+    for (size_t i = vec_size(func->blocks); i > 0; i--)
+    {
+        ir_block_t* block = vec_get(func->blocks, i - 1);
+
+        if (is_reached(reached, block))
+            continue;
+
+        remove_at(func->blocks, i - 1);
+        ir_block_free(block);
+        changed = true;
+    }
+
+    vec_free(reached);
+
+    for (size_t i = 1; i < vec_size(func->blocks); i++)
+    {
+        ir_block_t* block = vec_get(func->blocks, i);
+
+        if (vec_size(block->preds) != 1)
+            continue;
+
+        ir_block_t* pred = vec_first(block->preds);
+
+        if (pred == block || ir_succ_count(pred) != 1)
+            continue;
+
+        // Phis of a block with one predecessor are copies
+        while (vec_size(block->insns) > 0 && ((ir_value_t*) vec_first(block->insns))->kind == IR_PHI)
+        {
+            ir_value_t* phi = vec_first(block->insns);
+            ir_replace_uses(func, phi, vec_first(phi->operands));
+            remove_at(block->insns, 0);
+        }
+
+        pred->insns->vect_used--;
+        for (size_t j = 0; j < vec_size(block->insns); j++)
+        {
+            ir_value_t* value = vec_get(block->insns, j);
+            value->block = pred;
+            vec_append(pred->insns, value);
+        }
+
+        pred->succs[0] = block->succs[0];
+        pred->succs[1] = block->succs[1];
+        for (size_t j = 0; j < ir_succ_count(pred); j++)
+        {
+            ir_block_t* succ = pred->succs[j];
+            for (size_t k = 0; k < vec_size(succ->preds); k++)
+                if (vec_get(succ->preds, k) == block)
+                    vec_set(succ->preds, k, pred);
+        }
+
+        remove_at(func->blocks, i);
+        ir_block_free(block);
+        changed = true;
+        --i;
+    }
+
+    return changed;
+}
+
+// Removes the phis whose operands are all one value, or the phi itself
+bool_t ir_simplify_phis(ir_func_t* func)
+{
+    bool_t changed = false;
+
+    for (size_t i = 0; i < vec_size(func->blocks); i++)
+    {
+        ir_block_t* block = vec_get(func->blocks, i);
+
+        for (size_t j = 0; j < vec_size(block->insns); j++)
+        {
+            ir_value_t* phi = vec_get(block->insns, j);
+            ir_value_t* same = NULL;
+            bool_t trivial = true;
+
+            if (phi->kind != IR_PHI)
+                break;
+
+            for (size_t k = 0; k < vec_size(phi->operands); k++)
+            {
+                ir_value_t* operand = vec_get(phi->operands, k);
+                if (operand == phi || operand == same)
+                    continue;
+                if (same != NULL)
+                {
+                    trivial = false;
+                    break;
+                }
+                same = operand;
+            }
+
+            // A phi of nothing but itself only lives in unreachable loops
+            if (!trivial || same == NULL)
+                continue;
+
+            ir_replace_uses(func, phi, same);
+            remove_at(block->insns, j--);
+            changed = true;
+        }
+    }
+
+    return changed;
+}
+
+static void mark_live(ir_value_t* value, uint8_t* live)
+{
+    if (live[value->id])
+        return;
+
+    live[value->id] = 1;
+    for (size_t i = 0; i < vec_size(value->operands); i++)
+        mark_live(vec_get(value->operands, i), live);
+}
+
+// Removes the instructions whose values nothing with a side effect needs
+bool_t ir_dce(ir_func_t* func)
+{
+    uint8_t* live = calloc(func->next_value, sizeof (uint8_t));
+    bool_t changed = false;
+
+    for (size_t i = 0; i < vec_size(func->blocks); i++)
+    {
+        ir_block_t* block = vec_get(func->blocks, i);
+        for (size_t j = 0; j < vec_size(block->insns); j++)
+        {
+            ir_value_t* value = vec_get(block->insns, j);
+            if (ir_has_side_effects(value))
+                mark_live(value, live);
+        }
+    }
+
+    for (size_t i = 0; i < vec_size(func->blocks); i++)
+    {
+        ir_block_t* block = vec_get(func->blocks, i);
+        for (size_t j = 0; j < vec_size(block->insns); j++)
+        {
+            ir_value_t* value = vec_get(block->insns, j);
+            if (!live[value->id])
+            {
+                remove_at(block->insns, j--);
+                changed = true;
+            }
+        }
+    }
+
+    free(live);
+    return changed;
+}
+
+// Puts an empty block on every edge from a branch to a block with phis, so
+// that the copies of the phis have a place of their own on that edge
+bool_t ir_split_critical_edges(ir_func_t* func)
+{
+    bool_t changed = false;
+
+    for (size_t i = 0; i < vec_size(func->blocks); i++)
+    {
+        ir_block_t* block = vec_get(func->blocks, i);
+
+        if (ir_succ_count(block) != 2)
+            continue;
+
+        for (size_t j = 0; j < 2; j++)
+        {
+            ir_block_t* succ = block->succs[j];
+
+            if (vec_size(succ->insns) == 0 || ((ir_value_t*) vec_first(succ->insns))->kind != IR_PHI)
+                continue;
+
+            ir_block_t* edge = ir_block_new(func);
+            ir_value_t* jmp = calloc(1, sizeof (ir_value_t));
+
+            jmp->kind = IR_JMP;
+            jmp->id = func->next_value++;
+            jmp->type = MT_VOID;
+            jmp->operands = vec_new(0);
+            jmp->block = edge;
+            jmp->slot = -1;
+            vec_append(func->values, jmp);
+            vec_append(edge->insns, jmp);
+
+            edge->sealed = true;
+            edge->succs[0] = succ;
+            vec_append(edge->preds, block);
+            block->succs[j] = edge;
+            vec_set(succ->preds, pred_index(succ, block), edge);
+
+            // Laid out right before the successor, where it falls through
+            size_t at = 0;
+            while (vec_get(func->blocks, at) != succ)
+                ++at;
+            vec_append(func->blocks, NULL);
+            for (size_t k = vec_size(func->blocks) - 1; k > at; k--)
+                vec_set(func->blocks, k, vec_get(func->blocks, k - 1));
+            vec_set(func->blocks, at, edge);
+            if (at <= i)
+                ++i;
+
+            changed = true;
+        }
+    }
+
+    return changed;
+}
@@ -0,0 +1,943 @@
+// Native code runs on a stack of its own and leaves it by longjmp, which
+// the fortified longjmp would take for a corrupted stack
+#undef _FORTIFY_SOURCE
+#include "jit.h"
+#include "vm.h"
+#include "utf8.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <inttypes.h>
+#include <setjmp.h>
+
+#if defined(__x86_64__)
+#include <sys/mman.h>
+
+#define NO_REGION (-1)
+
+typedef struct
+{
+    size_t entry;           // Offset of the PROC
+    bool_t global;          // Global block: entered by falling into PROC, left by HALT
+    bool_t compiled;
+    size_t native;          // Offset of the native entry in the code
+} region_t;
+
+typedef struct
+{
+    size_t at;              // Offset of a rel32 in the code
+    size_t target;          // Bytecode offset it refers to
+    bool_t call;            // Target is a region entry rather than a label
+} fixup_t;
+
+struct jit_t
+{
+    uint8_t* code;          // Executable buffer
+    size_t size;
+    size_t used;
+    const uint8_t* data;    // vm data segment, for SPRINT and SLEN
+    value_t* (*trampoline)(value_t*, const void*, value_t*, value_t*, value_t*, uintptr_t, void*);
+    region_t* regions;
+    size_t regions_count;
+    int32_t* owner;         // Region of every bytecode offset
+    size_t* labels;         // Native offset of every bytecode offset
+    fixup_t* fixups;
+    size_t fixups_count;
+};
+
+// The one jit_compile is building
+static jit_t* jit;
+
+// Where the native code running on this thread prints
+static _Thread_local FILE* output;
+// The instance whose stack it runs on, and where to leave on overflow
+static _Thread_local vm_t* running;
+static _Thread_local jmp_buf* overflow;
+
+#define X86(...) do{uint8_t b[] = { __VA_ARGS__ }; x86_bytes(b, sizeof(b));}while(0)
+
+static void x86_bytes(const uint8_t* bytes, size_t len)
+{
+    memcpy(jit->code + jit->used, bytes, len);
+    jit->used += len;
+}
+
+static void x86_imm32(uint32_t x)
+{
+    X86(NUM32(x));
+}
+
+static void x86_imm64(uint64_t x)
+{
+    X86(NUM64(x));
+}
+
+static size_t insn_size(uint8_t op)
+{
+    return OPCODES[op].arg_size + 1;
+}
+
+static uint64_t operand(const uint8_t* bytes, uint8_t size)
+{
+    uint64_t value = 0;
+    for (uint8_t i = 0; i < size; i++)
+        value |= (uint64_t) bytes[i] << (8 * i);
+    return value;
+}
+
+// Code address of the jump or call at `addr`, in its short or wide form
+static uint32_t target(const uint8_t* code, size_t addr)
+{
+    return operand(code + addr + 1, vm_target_size(code[addr]));
+}
+
+// Called by a PROC whose frame would pass the limit in r14; returns the
+// new limit, or leaves jit_call when the stack is full
+static value_t* jit_grow(value_t* top)
+{
+    if (!vm_stack_reserve(running, top))
+        longjmp(*overflow, 1);
+    return vm_stack_limit(running);
+}
+
+// Called by a PROC entered with the native stack nearly full, which the
+// stack of the instance is sized to prevent
+static void jit_deep()
+{
+    longjmp(*overflow, 1);
+}
+
+// Operations too large for a template; native code calls back into C
+static value_t* jit_helper(value_t* sp, uint32_t op, const uint8_t* data)
+{
+    switch (op)
+    {
+    case IPRINT:
+        fprintf(output, "%" PRId64, sp->as_int64);
+        fflush(output);
+        return sp - 1;
+    case RPRINT:
+        fprintf(output, "%f", sp->as_real);
+        fflush(output);
+        return sp - 1;
+    case SPRINT:
+        fprintf(output, "%s", &data[sp->as_uint16]);
+        fflush(output);
+        return sp - 1;
+    case NPRINT:
+        fprintf(output, "\n");
+        fflush(output);
+        return sp;
+    case SLEN:
+        sp->as_int64 = (int64_t) utf8len((const char*) &data[sp->as_uint16]);
+        return sp;
+    case RINC:   sp->as_real++; return sp;
+    case RDEC:   sp->as_real--; return sp;
+    case RSQRT:  sp->as_real = sqrt(sp->as_real); return sp;
+    case REXP:   sp->as_real = exp(sp->as_real); return sp;
+    case RSIN:   sp->as_real = sin(sp->as_real); return sp;
+    case RCOS:   sp->as_real = cos(sp->as_real); return sp;
+    case RTAN:   sp->as_real = tan(sp->as_real); return sp;
+    case RASIN:  sp->as_real = asin(sp->as_real); return sp;
+    case RACOS:  sp->as_real = acos(sp->as_real); return sp;
+    case RLOG:   sp->as_real = log(sp->as_real); return sp;
+    case RLOG10: sp->as_real = log10(sp->as_real); return sp;
+    case RLOG2:  sp->as_real = log2(sp->as_real); return sp;
+    case RCEIL:  sp->as_real = ceil(sp->as_real); return sp;
+    case RFLOOR: sp->as_real = floor(sp->as_real); return sp;
+    case RROUND: sp->as_real = round(sp->as_real); return sp;
+    case RMOD:   sp[-1].as_real = fmod(sp[-1].as_real, sp->as_real); return sp - 1;
+    case RPOW:   sp[-1].as_real = pow(sp[-1].as_real, sp->as_real); return sp - 1;
+    case RATAN2: sp[-1].as_real = atan2(sp[-1].as_real, sp->as_real); return sp - 1;
+    }
+    return sp;
+}
+
+static bool_t is_helper_op(uint8_t op)
+{
+    switch (op)
+    {
+    case IPRINT: case RPRINT: case SPRINT: case NPRINT: case SLEN:
+    case RINC: case RDEC: case RSQRT: case REXP: case RSIN: case RCOS:
+    case RTAN: case RASIN: case RACOS: case RLOG: case RLOG10: case RLOG2:
+    case RCEIL: case RFLOOR: case RROUND: case RMOD: case RPOW: case RATAN2:
+        return true;
+    }
+    return false;
+}
+
+static bool_t is_supported(uint8_t op, bool_t global)
+{
+    if (is_helper_op(op))
+        return true;
+
+    switch (op)
+    {
+    case HALT:
+        return global;
+    case RET: case TAILCALL:
+        return !global;
+    case NOP: case DUP: case DROP: case ALLC: case SWAP: case PROC: case CALL:
+    case JNZ: case JEZ: case JMP:
+    case IINC: case IDEC: case INEG: case IABS: case INOT:
+    case IADD: case ISUB: case IDIV: case IMOD: case IMUL: case IAND: case IOR:
+    case IBXOR: case IBOR: case IBAND: case ISHL: case ISHR:
+    case IGT: case ILT: case IGE: case ILE: case IEQ: case INQ:
+    case I8CONST: case I16CONST: case I32CONST: case ICONST: case ICONST_0: case ICONST_1:
+    case I8CAST: case I16CAST: case I32CAST: case ILOAD: case ISTORE: case ITOR:
+    case RNEG: case RABS: case RADD: case RSUB: case RDIV: case RMUL:
+    case RGT: case RLT: case RGE: case RLE: case REQ: case RNQ:
+    case RLOAD: case RSTORE: case RCONST: case RCONST_0: case RCONST_1: case RCONST_PI:
+    case RTOI: case SLOAD: case SSTORE: case SCONST:
+    case ILOAD_ILOAD_IADD: case ILOAD_ICONST: case IINC_LOCAL: case ISTORE_ILOAD:
+    case IGT_JEZ: case ILT_JEZ: case IGE_JEZ: case ILE_JEZ: case IEQ_JEZ: case INQ_JEZ:
+    case RJEZ: case RJNZ:
+    case RGT_JEZ: case RLT_JEZ: case RGE_JEZ: case RLE_JEZ: case REQ_JEZ: case RNQ_JEZ:
+        return true;
+    }
+    return false;
+}
+
+static bool_t is_jump(uint8_t op)
+{
+    switch (op)
+    {
+    case JMP: case JEZ: case JNZ:
+    case IGT_JEZ: case ILT_JEZ: case IGE_JEZ: case ILE_JEZ: case IEQ_JEZ: case INQ_JEZ:
+    case RJEZ: case RJNZ:
+    case RGT_JEZ: case RLT_JEZ: case RGE_JEZ: case RLE_JEZ: case REQ_JEZ: case RNQ_JEZ:
+        return true;
+    }
+    return false;
+}
+
+static bool_t falls_through(uint8_t op)
+{
+    return op != JMP && op != RET && op != HALT && op != TAILCALL;
+}
+
+static void add_fixup(size_t target, bool_t call)
+{
+    jit->fixups = realloc(jit->fixups, sizeof (fixup_t) * (jit->fixups_count + 1));
+    jit->fixups[jit->fixups_count].at = jit->used;
+    jit->fixups[jit->fixups_count].target = target;
+    jit->fixups[jit->fixups_count].call = call;
+    jit->fixups_count++;
+    x86_imm32(0);
+}
+
+// --- templates ---------------------------------------------------------------
+
+// add rbx, 8; mov [rbx], rax
+static void x86_push_rax()
+{
+    X86(0x48, 0x83, 0xC3, 0x08, 0x48, 0x89, 0x03);
+}
+
+static void x86_push_imm(uint64_t k)
+{
+    X86(0x48, 0xB8);            // mov rax, imm64
+    x86_imm64(k);
+    x86_push_rax();
+}
+
+// mov rax, [rbx - 8]; <op> rax, [rbx]; sub rbx, 8; mov [rbx], rax
+static void x86_int_binary(const uint8_t* op, size_t len)
+{
+    X86(0x48, 0x8B, 0x43, 0xF8);
+    x86_bytes(op, len);
+    X86(0x48, 0x83, 0xEB, 0x08, 0x48, 0x89, 0x03);
+}
+
+// mov rax, [rbx - 8]; cmp rax, [rbx]; setcc al; movzx eax, al; sub rbx, 8; mov [rbx], rax
+static void x86_int_compare(uint8_t setcc)
+{
+    X86(0x48, 0x8B, 0x43, 0xF8, 0x48, 0x3B, 0x03, 0x0F, setcc, 0xC0, 0x0F, 0xB6, 0xC0,
+        0x48, 0x83, 0xEB, 0x08, 0x48, 0x89, 0x03);
+}
+
+// movsd xmm0, [rbx - 8]; <op>sd xmm0, [rbx]; movsd [rbx - 8], xmm0; sub rbx, 8
+static void x86_real_binary(uint8_t op)
+{
+    X86(0xF2, 0x0F, 0x10, 0x43, 0xF8, 0xF2, 0x0F, op, 0x03, 0xF2, 0x0F, 0x11, 0x43, 0xF8,
+        0x48, 0x83, 0xEB, 0x08);
+}
+
+// Leaves the boolean of a real comparison in al
+static void x86_real_compare(uint8_t op)
+{
+    switch (op)
+    {
+    case RGT: case RGE:
+        // movsd xmm0, [rbx - 8]; ucomisd xmm0, [rbx]; seta/setae al
+        X86(0xF2, 0x0F, 0x10, 0x43, 0xF8, 0x66, 0x0F, 0x2E, 0x03,
+            0x0F, op == RGT ? 0x97 : 0x93, 0xC0);
+        break;
+    case RLT: case RLE:
+        // movsd xmm0, [rbx]; ucomisd xmm0, [rbx - 8]; seta/setae al
+        X86(0xF2, 0x0F, 0x10, 0x03, 0x66, 0x0F, 0x2E, 0x43, 0xF8,
+            0x0F, op == RLT ? 0x97 : 0x93, 0xC0);
+        break;
+    case REQ:
+        // ucomisd; sete al; setnp cl; and al, cl
+        X86(0xF2, 0x0F, 0x10, 0x43, 0xF8, 0x66, 0x0F, 0x2E, 0x03,
+            0x0F, 0x94, 0xC0, 0x0F, 0x9B, 0xC1, 0x20, 0xC8);
+        break;
+    case RNQ:
+        // ucomisd; setne al; setp cl; or al, cl
+        X86(0xF2, 0x0F, 0x10, 0x43, 0xF8, 0x66, 0x0F, 0x2E, 0x03,
+            0x0F, 0x95, 0xC0, 0x0F, 0x9A, 0xC1, 0x08, 0xC8);
+        break;
+    }
+    // movzx eax, al; cvtsi2sd xmm0, rax; sub rbx, 8; movsd [rbx], xmm0
+    X86(0x0F, 0xB6, 0xC0, 0xF2, 0x48, 0x0F, 0x2A, 0xC0,
+        0x48, 0x83, 0xEB, 0x08, 0xF2, 0x0F, 0x11, 0x03);
+}
+
+// mov rdi, rbx; mov esi, op; mov rdx, data; call jit_helper with an
+// aligned rsp; mov rbx, rax
+static void x86_call_helper(uint8_t op)
+{
+    X86(0x48, 0x89, 0xDF, 0xBE);
+    x86_imm32(op);
+    X86(0x48, 0xBA);
+    x86_imm64((uint64_t) (uintptr_t) jit->data);
+    X86(0x48, 0xB8);
+    x86_imm64((uint64_t) (uintptr_t) jit_helper);
+    X86(0x55, 0x48, 0x89, 0xE5, 0x48, 0x83, 0xE4, 0xF0, 0xFF, 0xD0,
+        0x48, 0x89, 0xEC, 0x5D, 0x48, 0x89, 0xC3);
+}
+
+// Branch with a 32-bit displacement to a bytecode label
+static void x86_jcc(uint8_t cc, size_t target)
+{
+    X86(0x0F, cc);
+    add_fixup(target, false);
+}
+
+// Branch of a real compare-and-branch after ucomisd, taken when the
+// comparison is false. Unordered (NaN) sets ZF, PF and CF, so only
+// RNQ_JEZ does not branch on it.
+static void x86_real_jez(uint8_t op, size_t target)
+{
+    switch (op)
+    {
+    case RGT_JEZ: case RLT_JEZ:
+        x86_jcc(0x86, target);          // jbe
+        break;
+    case RGE_JEZ: case RLE_JEZ:
+        x86_jcc(0x82, target);          // jb
+        break;
+    case REQ_JEZ:
+        x86_jcc(0x85, target);          // jne
+        x86_jcc(0x8A, target);          // jp
+        break;
+    case RNQ_JEZ:
+        X86(0x7A, 0x06);                // jp over the je
+        x86_jcc(0x84, target);          // je
+        break;
+    }
+}
+
+static void x86_jmp(size_t target)
+{
+    X86(0xE9);
+    add_fixup(target, false);
+}
+
+static void x86_local(uint8_t rex, uint8_t op, uint32_t slot)
+{
+    X86(rex, op, 0x84, 0x24);   // <op> rax, [r12 + disp32]
+    x86_imm32(slot * sizeof (value_t));
+}
+
+static void emit_insn(const uint8_t* code, size_t addr)
+{
+    uint8_t op = vm_short_op(code[addr]);
+    const uint8_t* bytes = code + addr + 1;
+    uint8_t width = vm_target_size(code[addr]);
+    uint32_t a = width != 0 ? target(code, addr) : OPCODES[op].arg_size >= 2 ? operand(bytes, 2) : 0;
+
+    if (is_helper_op(op))
+    {
+        x86_call_helper(op);
+        return;
+    }
+
+    switch (op)
+    {
+    case NOP:
+        break;
+    case DUP:
+        X86(0x48, 0x8B, 0x03);
+        x86_push_rax();
+        break;
+    case DROP:
+        X86(0x48, 0x81, 0xEB);  // sub rbx, imm32
+        x86_imm32(a * sizeof (value_t));
+        break;
+    case ALLC:
+        X86(0x48, 0x81, 0xC3);  // add rbx, imm32
+        x86_imm32(a * sizeof (value_t));
+        break;
+    case SWAP:
+        X86(0x48, 0x8B, 0x03, 0x48, 0x8B, 0x4B, 0xF8, 0x48, 0x89, 0x0B, 0x48, 0x89, 0x43, 0xF8);
+        break;
+    case PROC:
+    {
+        // Same frame as the interpreter: the two CALL slots become locals,
+        // then ip, bp and the frame size go on top and bp points at arg 0
+        uint32_t args = a;
+        uint32_t vars = operand(bytes + 2, 2);
+        X86(0x4C, 0x39, 0xFC,               // cmp rsp, r15
+            0x73, 0x10,                     // jae past the call
+            0x48, 0x83, 0xE4, 0xF0,         // and rsp, -16
+            0x48, 0xB8);                    // mov rax, jit_deep
+        x86_imm64((uint64_t) (uintptr_t) jit_deep);
+        X86(0xFF, 0xD0);                    // call rax, which does not return
+        X86(0x48, 0x8D, 0x83);              // lea rax, [rbx + (vars + 1) * 8]
+        x86_imm32((vars + 1) * sizeof (value_t));
+        X86(0x4C, 0x39, 0xF0,               // cmp rax, r14
+            0x76, 0x1E,                     // jbe past the call
+            0x48, 0x89, 0xC7,               // mov rdi, rax
+            0x48, 0xB8);                    // mov rax, jit_grow
+        x86_imm64((uint64_t) (uintptr_t) jit_grow);
+        X86(0x55, 0x48, 0x89, 0xE5, 0x48, 0x83, 0xE4, 0xF0, 0xFF, 0xD0,
+            0x48, 0x89, 0xEC, 0x5D,
+            0x49, 0x89, 0xC6);              // mov r14, rax
+        X86(0x48, 0x8B, 0x03,               // mov rax, [rbx]       ; bp
+            0x48, 0x8B, 0x4B, 0xF8,         // mov rcx, [rbx - 8]   ; ip
+            0x31, 0xD2,                     // xor edx, edx
+            0x48, 0x89, 0x13,               // mov [rbx], rdx
+            0x48, 0x89, 0x53, 0xF8,         // mov [rbx - 8], rdx
+            0x48, 0x81, 0xC3);              // add rbx, (vars - 2) * 8
+        x86_imm32((uint32_t) (((int32_t) vars - 2) * (int32_t) sizeof (value_t)));
+        X86(0x48, 0x83, 0xC3, 0x08, 0x48, 0x89, 0x0B,
+            0x48, 0x83, 0xC3, 0x08, 0x48, 0x89, 0x03,
+            0x48, 0x83, 0xC3, 0x08, 0x48, 0xC7, 0x03);
+        x86_imm32(args + vars);
+        X86(0x4C, 0x8D, 0xA3);              // lea r12, [rbx - (args + vars + 2) * 8]
+        x86_imm32((uint32_t) -(int32_t) ((args + vars + 2) * sizeof (value_t)));
+        break;
+    }
+    case CALL:
+        // Push a dummy return slot and the bp index, then call the entry
+        X86(0x48, 0x83, 0xC3, 0x10,                         // add rbx, 16
+            0x48, 0xC7, 0x43, 0xF8, 0x00, 0x00, 0x00, 0x00, // mov qword [rbx - 8], 0
+            0x4C, 0x89, 0xE0,                               // mov rax, r12
+            0x4C, 0x29, 0xE8,                               // sub rax, r13
+            0x48, 0xC1, 0xF8, 0x03,                         // sar rax, 3
+            0x48, 0x89, 0x03,                               // mov [rbx], rax
+            0xE8);                                          // call rel32
+        add_fixup(a, true);
+        break;
+    case RET:
+        X86(0x48, 0x8B, 0x03,               // mov rax, [rbx]       ; result
+            0x48, 0x8B, 0x4B, 0xF8,         // mov rcx, [rbx - 8]   ; drops
+            0x48, 0x8B, 0x53, 0xF0,         // mov rdx, [rbx - 16]  ; bp index
+            0x4D, 0x8D, 0x64, 0xD5, 0x00,   // lea r12, [r13 + rdx * 8]
+            0x48, 0xC1, 0xE1, 0x03,         // shl rcx, 3
+            0x48, 0x29, 0xCB,               // sub rbx, rcx
+            0x48, 0x83, 0xEB, 0x18,         // sub rbx, 24
+            0x48, 0x89, 0x03,               // mov [rbx], rax
+            0xC3);                          // ret
+        break;
+    case TAILCALL:
+    {
+        // Copy the arguments over the frame, rebuild what CALL leaves for
+        // PROC and jump: the callee returns straight to our caller
+        uint32_t args = operand(bytes + width, 2);
+        X86(0x48, 0x8B, 0x93);              // mov rdx, [rbx - (args + 1) * 8] ; bp index
+        x86_imm32((uint32_t) -(int32_t) ((args + 1) * sizeof (value_t)));
+        X86(0x48, 0x8D, 0xB3);              // lea rsi, [rbx - (args - 1) * 8]
+        x86_imm32((uint32_t) -((int32_t) args - 1) * (int32_t) sizeof (value_t));
+        X86(0x4C, 0x89, 0xE7,               // mov rdi, r12
+            0xB9);                          // mov ecx, args
+        x86_imm32(args);
+        X86(0xF3, 0x48, 0xA5,               // rep movsq
+            0x49, 0x8D, 0x9C, 0x24);        // lea rbx, [r12 + (args + 1) * 8]
+        x86_imm32((args + 1) * sizeof (value_t));
+        X86(0x48, 0xC7, 0x43, 0xF8, 0x00, 0x00, 0x00, 0x00, // mov qword [rbx - 8], 0
+            0x48, 0x89, 0x13,                               // mov [rbx], rdx
+            0xE9);                                          // jmp rel32
+        add_fixup(a, true);
+        break;
+    }
+    case HALT:
+        X86(0xC3);
+        break;
+    case JMP:
+        x86_jmp(a);
+        break;
+    case JEZ:
+        X86(0x48, 0x8B, 0x03, 0x48, 0x83, 0xEB, 0x08, 0x48, 0x85, 0xC0);
+        x86_jcc(0x84, a);
+        break;
+    case RJEZ:
+    case RJNZ:
+        // +0.0 and -0.0 are the reals with bits << 1 == 0
+        X86(0x48, 0x8B, 0x03, 0x48, 0x83, 0xEB, 0x08, 0x48, 0xD1, 0xE0);
+        x86_jcc(op == RJEZ ? 0x84 : 0x85, a);
+        break;
+    case RGT_JEZ: case RGE_JEZ: case REQ_JEZ: case RNQ_JEZ:
+        // movsd xmm0, [rbx - 8]; ucomisd xmm0, [rbx]; lea rbx, [rbx - 16]
+        X86(0xF2, 0x0F, 0x10, 0x43, 0xF8, 0x66, 0x0F, 0x2E, 0x03, 0x48, 0x8D, 0x5B, 0xF0);
+        x86_real_jez(op, a);
+        break;
+    case RLT_JEZ: case RLE_JEZ:
+        // Swapped: movsd xmm0, [rbx]; ucomisd xmm0, [rbx - 8]; lea rbx, [rbx - 16]
+        X86(0xF2, 0x0F, 0x10, 0x03, 0x66, 0x0F, 0x2E, 0x43, 0xF8, 0x48, 0x8D, 0x5B, 0xF0);
+        x86_real_jez(op, a);
+        break;
+    case JNZ:
+        X86(0x48, 0x8B, 0x03, 0x48, 0x83, 0xEB, 0x08, 0x48, 0x85, 0xC0);
+        x86_jcc(0x85, a);
+        break;
+    case IGT_JEZ: case ILT_JEZ: case IGE_JEZ: case ILE_JEZ: case IEQ_JEZ: case INQ_JEZ:
+    {
+        // mov rax, [rbx - 8]; cmp rax, [rbx]; lea rbx, [rbx - 16]; j<not cc>
+        static const uint8_t negated[] = {0x8E, 0x8D, 0x8C, 0x8F, 0x85, 0x84};
+        X86(0x48, 0x8B, 0x43, 0xF8, 0x48, 0x3B, 0x03, 0x48, 0x8D, 0x5B, 0xF0);
+        x86_jcc(negated[op - IGT_JEZ], a);
+        break;
+    }
+    case IINC:
+        X86(0x48, 0xFF, 0x03);
+        break;
+    case IDEC:
+        X86(0x48, 0xFF, 0x0B);
+        break;
+    case INEG:
+        X86(0x48, 0xF7, 0x1B);
+        break;
+    case INOT:
+        X86(0x48, 0xF7, 0x13);
+        break;
+    case IABS:
+        // mov rax, [rbx]; mov rcx, rax; neg rax; cmovs rax, rcx; mov [rbx], rax
+        X86(0x48, 0x8B, 0x03, 0x48, 0x89, 0xC1, 0x48, 0xF7, 0xD8, 0x48, 0x0F, 0x48, 0xC1,
+            0x48, 0x89, 0x03);
+        break;
+    case IADD:
+        x86_int_binary((uint8_t[]) {0x48, 0x03, 0x03}, 3);
+        break;
+    case ISUB:
+        x86_int_binary((uint8_t[]) {0x48, 0x2B, 0x03}, 3);
+        break;
+    case IMUL:
+        x86_int_binary((uint8_t[]) {0x48, 0x0F, 0xAF, 0x03}, 4);
+        break;
+    case IBAND:
+        x86_int_binary((uint8_t[]) {0x48, 0x23, 0x03}, 3);
+        break;
+    case IBOR:
+        x86_int_binary((uint8_t[]) {0x48, 0x0B, 0x03}, 3);
+        break;
+    case IBXOR:
+        x86_int_binary((uint8_t[]) {0x48, 0x33, 0x03}, 3);
+        break;
+    case ISHL:
+        // mov rcx, [rbx]; shl rax, cl
+        x86_int_binary((uint8_t[]) {0x48, 0x8B, 0x0B, 0x48, 0xD3, 0xE0}, 6);
+        break;
+    case ISHR:
+        // mov rcx, [rbx]; sar rax, cl
+        x86_int_binary((uint8_t[]) {0x48, 0x8B, 0x0B, 0x48, 0xD3, 0xF8}, 6);
+        break;
+    case IDIV:
+    case IMOD:
+        // mov rax, [rbx - 8]; cqo; idiv qword [rbx]; sub rbx, 8; mov [rbx], rax/rdx
+        X86(0x48, 0x8B, 0x43, 0xF8, 0x48, 0x99, 0x48, 0xF7, 0x3B, 0x48, 0x83, 0xEB, 0x08,
+            0x48, 0x89, op == IDIV ? 0x03 : 0x13);
+        break;
+    case IAND:
+    case IOR:
+        // cmp qword [rbx - 8], 0; setne al; cmp qword [rbx], 0; setne cl; and/or al, cl
+        X86(0x48, 0x83, 0x7B, 0xF8, 0x00, 0x0F, 0x95, 0xC0, 0x48, 0x83, 0x3B, 0x00,
+            0x0F, 0x95, 0xC1, op == IAND ? 0x20 : 0x08, 0xC8,
+            0x0F, 0xB6, 0xC0, 0x48, 0x83, 0xEB, 0x08, 0x48, 0x89, 0x03);
+        break;
+    case IGT: x86_int_compare(0x9F); break;
+    case ILT: x86_int_compare(0x9C); break;
+    case IGE: x86_int_compare(0x9D); break;
+    case ILE: x86_int_compare(0x9E); break;
+    case IEQ: x86_int_compare(0x94); break;
+    case INQ: x86_int_compare(0x95); break;
+    case ICONST_0:
+        x86_push_imm(0);
+        break;
+    case ICONST_1:
+        x86_push_imm(1);
+        break;
+    case I8CONST:
+        x86_push_imm((int64_t) (int8_t) operand(bytes, 1));
+        break;
+    case I16CONST:
+        x86_push_imm((int64_t) (int16_t) operand(bytes, 2));
+        break;
+    case I32CONST:
+        x86_push_imm((int64_t) (int32_t) operand(bytes, 4));
+        break;
+    case ICONST:
+    case RCONST:
+        x86_push_imm(operand(bytes, 8));
+        break;
+    case SCONST:
+        x86_push_imm(a);
+        break;
+    case RCONST_0:
+    {
+        value_t k = {.as_real = 0.0};
+        x86_push_imm(k.as_uint64);
+        break;
+    }
+    case RCONST_1:
+    {
+        value_t k = {.as_real = 1.0};
+        x86_push_imm(k.as_uint64);
+        break;
+    }
+    case RCONST_PI:
+    {
+        value_t k = {.as_real = 3.14159265358979323846};
+        x86_push_imm(k.as_uint64);
+        break;
+    }
+    case I8CAST:
+        X86(0x48, 0x0F, 0xBE, 0x03, 0x48, 0x89, 0x03);
+        break;
+    case I16CAST:
+        X86(0x48, 0x0F, 0xBF, 0x03, 0x48, 0x89, 0x03);
+        break;
+    case I32CAST:
+        X86(0x48, 0x63, 0x03, 0x48, 0x89, 0x03);
+        break;
+    case ILOAD:
+    case RLOAD:
+    case SLOAD:
+        x86_local(0x49, 0x8B, a);
+        x86_push_rax();
+        break;
+    case ISTORE:
+    case RSTORE:
+    case SSTORE:
+        X86(0x48, 0x8B, 0x03, 0x48, 0x83, 0xEB, 0x08);
+        x86_local(0x49, 0x89, a);
+        break;
+    case ITOR:
+        X86(0xF2, 0x48, 0x0F, 0x2A, 0x03, 0xF2, 0x0F, 0x11, 0x03);
+        break;
+    case RTOI:
+        // Like the interpreter, only the low 32 bits are written
+        X86(0xF2, 0x0F, 0x2C, 0x03, 0x89, 0x03);
+        break;
+    case RNEG:
+        X86(0x48, 0xB8);
+        x86_imm64(0x8000000000000000ULL);
+        X86(0x48, 0x31, 0x03);
+        break;
+    case RABS:
+        X86(0x48, 0x0F, 0xBA, 0x33, 0x3F);  // btr qword [rbx], 63
+        break;
+    case RADD: x86_real_binary(0x58); break;
+    case RSUB: x86_real_binary(0x5C); break;
+    case RMUL: x86_real_binary(0x59); break;
+    case RDIV: x86_real_binary(0x5E); break;
+    case RGT: case RLT: case RGE: case RLE: case REQ: case RNQ:
+        x86_real_compare(op);
+        break;
+    case ILOAD_ILOAD_IADD:
+        x86_local(0x49, 0x8B, a);
+        x86_local(0x49, 0x03, operand(bytes + 2, 2));
+        x86_push_rax();
+        break;
+    case ILOAD_ICONST:
+        x86_local(0x49, 0x8B, a);
+        X86(0x48, 0x83, 0xC3, 0x10, 0x48, 0x89, 0x43, 0xF8, 0x48, 0xB8);
+        x86_imm64((int64_t) (int32_t) operand(bytes + 2, 4));
+        X86(0x48, 0x89, 0x03);
+        break;
+    case ISTORE_ILOAD:
+        X86(0x48, 0x8B, 0x03);              // mov rax, [rbx]
+        x86_local(0x49, 0x89, a);
+        break;
+    case IINC_LOCAL:
+        X86(0x49, 0x81, 0x84, 0x24);        // add qword [r12 + disp32], imm32
+        x86_imm32(a * sizeof (value_t));
+        x86_imm32((uint32_t) (int32_t) (int8_t) operand(bytes + 2, 1));
+        break;
+    }
+}
+
+// --- regions -----------------------------------------------------------------
+
+static int32_t find_region(size_t entry)
+{
+    for (size_t i = 0; i < jit->regions_count; i++)
+        if (jit->regions[i].entry == entry)
+            return i;
+    return NO_REGION;
+}
+
+static void add_region(size_t entry, bool_t global)
+{
+    if (find_region(entry) != NO_REGION)
+        return;
+    jit->regions = realloc(jit->regions, sizeof (region_t) * (jit->regions_count + 1));
+    jit->regions[jit->regions_count].entry = entry;
+    jit->regions[jit->regions_count].global = global;
+    jit->regions[jit->regions_count].compiled = true;
+    jit->regions[jit->regions_count].native = 0;
+    jit->regions_count++;
+}
+
+// Marks the instructions reachable from the PROC of region r. Returns
+// false when one of them cannot be compiled.
+static bool_t discover(const uint8_t* code, size_t size, int32_t r)
+{
+    size_t* work = malloc(sizeof (size_t) * (size + 1));
+    size_t count = 0;
+    bool_t ok = true;
+
+    work[count++] = jit->regions[r].entry;
+
+    while (count > 0 && ok)
+    {
+        size_t addr = work[--count];
+
+        if (addr >= size || addr < jit->regions[r].entry)
+        {
+            ok = false;
+            break;
+        }
+        if (jit->owner[addr] == r)
+            continue;
+        if (jit->owner[addr] != NO_REGION || code[addr] >= OPCODES_COUNT)
+        {
+            ok = false;
+            break;
+        }
+
+        uint8_t op = vm_short_op(code[addr]);
+        jit->owner[addr] = r;
+
+        if (!is_supported(op, jit->regions[r].global))
+            ok = false;
+        if (falls_through(op))
+            work[count++] = addr + insn_size(code[addr]);
+        if (is_jump(op))
+            work[count++] = target(code, addr);
+    }
+
+    free(work);
+    return ok;
+}
+
+jit_t* jit_compile(const uint8_t* code, size_t size, const uint8_t* data)
+{
+    jit = calloc(1, sizeof (jit_t));
+    jit->data = data;
+
+    // Function entries are the CALL targets; the global block is the PROC
+    // after the two ICONST_0 placeholders of its frame
+    if (size > 2 && code[0] == ICONST_0 && code[1] == ICONST_0 && code[2] == PROC)
+        add_region(2, true);
+
+    for (size_t i = 0; i < size; i += insn_size(code[i]))
+    {
+        if (code[i] >= OPCODES_COUNT)
+        {
+            jit_free(jit);
+            return NULL;
+        }
+        uint8_t op = vm_short_op(code[i]);
+        if (op == CALL || op == TAILCALL)
+            add_region(target(code, i), false);
+    }
+
+    jit->owner = malloc(sizeof (int32_t) * (size + 1));
+    jit->labels = malloc(sizeof (size_t) * (size + 1));
+    for (size_t i = 0; i <= size; i++)
+        jit->owner[i] = NO_REGION;
+
+    for (size_t r = 0; r < jit->regions_count; r++)
+    {
+        region_t* region = &jit->regions[r];
+        if (region->entry >= size || code[region->entry] != PROC || !discover(code, size, r))
+            region->compiled = false;
+    }
+
+    // A function calling an interpreted one is interpreted as well. A tail
+    // call never returns to its caller, so both ends of one run the same way.
+    for (bool_t changed = true; changed; )
+    {
+        changed = false;
+        for (size_t i = 0; i < size; i += insn_size(code[i]))
+        {
+            uint8_t op = vm_short_op(code[i]);
+            if (op != CALL && op != TAILCALL)
+                continue;
+            int32_t caller = jit->owner[i];
+            int32_t callee = find_region(target(code, i));
+            bool_t caller_compiled = caller != NO_REGION && jit->regions[caller].compiled;
+            bool_t callee_compiled = callee != NO_REGION && jit->regions[callee].compiled;
+
+            if (caller_compiled && !callee_compiled)
+            {
+                jit->regions[caller].compiled = false;
+                changed = true;
+            }
+            if (op == TAILCALL && callee_compiled && !caller_compiled)
+            {
+                jit->regions[callee].compiled = false;
+                changed = true;
+            }
+        }
+    }
+
+    // No template is longer than 64 bytes per byte of its instruction
+    jit->size = 64 * (size + 1) + 64;
+    jit->code = mmap(NULL, jit->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (jit->code == MAP_FAILED)
+    {
+        jit->code = NULL;
+        jit_free(jit);
+        return NULL;
+    }
+
+    // Trampoline: save callee-saved registers, load rbx/r12/r13/r14/r15
+    // from the arguments, switch to the native stack whose top is the 7th
+    // argument, call the entry and return the final top of the stack. The
+    // caller's rsp is kept at the top of the native stack.
+    jit->trampoline = (void*) jit->code;
+    X86(0x53, 0x55, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56,    // push rbx, rbp, r12, r13, r14
+        0x41, 0x57,                                         // push r15
+        0x48, 0x89, 0xFB,                                   // mov rbx, rdi
+        0x49, 0x89, 0xD4,                                   // mov r12, rdx
+        0x49, 0x89, 0xCD,                                   // mov r13, rcx
+        0x4D, 0x89, 0xC6,                                   // mov r14, r8
+        0x4D, 0x89, 0xCF,                                   // mov r15, r9
+        0x48, 0x8B, 0x44, 0x24, 0x38,                       // mov rax, [rsp + 56]
+        0x48, 0x89, 0x60, 0xF8,                             // mov [rax - 8], rsp
+        0x48, 0x8D, 0x60, 0xE8,                             // lea rsp, [rax - 24]
+        0xFF, 0xD6,                                         // call rsi
+        0x48, 0x8B, 0x64, 0x24, 0x10,                       // mov rsp, [rsp + 16]
+        0x48, 0x89, 0xD8,                                   // mov rax, rbx
+        0x41, 0x5F,                                         // pop r15
+        0x41, 0x5E, 0x41, 0x5D, 0x41, 0x5C, 0x5D, 0x5B,     // pop r14, r13, r12, rbp, rbx
+        0xC3);                                              // ret
+
+    for (size_t r = 0; r < jit->regions_count; r++)
+    {
+        if (!jit->regions[r].compiled)
+            continue;
+
+        jit->regions[r].native = jit->used;
+
+        // A body never starts before its PROC; code of nested functions
+        // in between belongs to other regions and is skipped
+        for (size_t addr = jit->regions[r].entry; addr < size; addr += insn_size(code[addr]))
+        {
+            if (jit->owner[addr] != (int32_t) r)
+                continue;
+
+            jit->labels[addr] = jit->used;
+            emit_insn(code, addr);
+
+            size_t next = addr + insn_size(code[addr]);
+            if (falls_through(vm_short_op(code[addr])) && (next >= size || jit->owner[next] != (int32_t) r))
+                x86_jmp(next);
+        }
+    }
+
+    for (size_t i = 0; i < jit->fixups_count; i++)
+    {
+        fixup_t* fixup = &jit->fixups[i];
+        size_t target;
+
+        if (fixup->call)
+            target = jit->regions[find_region(fixup->target)].native;
+        else
+            target = jit->labels[fixup->target];
+
+        int32_t rel = (int32_t) (target - (fixup->at + 4));
+        memcpy(jit->code + fixup->at, &rel, 4);
+    }
+
+    mprotect(jit->code, jit->size, PROT_READ | PROT_EXEC);
+
+    // Only the code and the regions are needed from now on
+    free(jit->owner);
+    free(jit->labels);
+    free(jit->fixups);
+    jit->owner = NULL;
+    jit->labels = NULL;
+    jit->fixups = NULL;
+    jit->fixups_count = 0;
+
+    return jit;
+}
+
+const void* jit_entry(jit_t* compiled, size_t addr)
+{
+    for (size_t i = 0; compiled != NULL && i < compiled->regions_count; i++)
+    {
+        region_t* region = &compiled->regions[i];
+        if (region->entry == addr)
+            return region->compiled ? compiled->code + region->native : NULL;
+    }
+    return NULL;
+}
+
+value_t* jit_call(jit_t* compiled, const void* entry, value_t* sp, value_t* bp, value_t* stack, FILE* out, vm_t* vm)
+{
+    jmp_buf env;
+    uintptr_t low;
+    void* top = vm_native_stack(vm, &low);
+
+    output = out;
+    running = vm;
+    overflow = &env;
+
+    if (setjmp(env) != 0)
+        return NULL;
+
+    return compiled->trampoline(sp, entry, bp, stack, vm_stack_limit(vm), low, top);
+}
+
+void jit_free(jit_t* compiled)
+{
+    if (compiled == NULL)
+        return;
+    if (compiled->code != NULL)
+        munmap(compiled->code, compiled->size);
+    free(compiled->regions);
+    free(compiled->owner);
+    free(compiled->labels);
+    free(compiled->fixups);
+    free(compiled);
+}
+
+#else
+
+jit_t* jit_compile(const uint8_t* code, size_t size, const uint8_t* data)
+{
+    return NULL;
+}
+
+void jit_free(jit_t* compiled)
+{
+}
+
+const void* jit_entry(jit_t* compiled, size_t addr)
+{
+    return NULL;
+}
+
+value_t* jit_call(jit_t* compiled, const void* entry, value_t* sp, value_t* bp, value_t* stack, FILE* out, vm_t* vm)
+{
+    return sp;
+}
+
+#endif
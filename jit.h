@@ -0,0 +1,51 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include "types.h"
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+// Baseline template JIT for x86-64. Every function, found by the PROC at a
+// CALL target (and the PROC of the global block), is translated on its own
+// by pasting one machine code template per opcode. A function using an
+// opcode without a template, or calling a function that is not compiled,
+// stays with the interpreter. On other architectures nothing is compiled.
+//
+// Native code works on the vm stack in memory: rbx is the top of the stack,
+// r12 is bp, r13 is the bottom of the stack and r14 the limit of vm.h a new
+// frame may not pass without growing the stack. Frames are laid out exactly
+// as the interpreter lays them out. Every native call also takes a return
+// address on the machine stack, which is the native stack of the instance
+// (vm_native_stack) rather than the thread's, so the depth of a recursion
+// is bounded by the vm stack alone. r15 is the lowest rsp a PROC may start
+// at.
+//
+// The native code of a program only reads it and the data segment, so any
+// number of vm instances may run it at once. jit_compile itself is not
+// reentrant.
+
+typedef struct jit_t jit_t;
+struct vm_t;
+
+// NULL when nothing could be compiled
+jit_t* jit_compile(const uint8_t* code, size_t size, const uint8_t* data);
+void jit_free(jit_t* jit);
+
+// Native entry of the function whose PROC is at `addr`, or NULL
+const void* jit_entry(jit_t* jit, size_t addr);
+
+// Runs native code with `sp` pointing at the top element of the stack and
+// returns the new top: the return value after a RET, or the stack left at
+// HALT for the global block. The print opcodes write to `out`. Returns NULL
+// when the stack of `vm` overflows.
+value_t* jit_call(jit_t* jit, const void* entry, value_t* sp, value_t* bp, value_t* stack, FILE* out, struct vm_t* vm);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* JIT_H */
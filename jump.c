@@ -12,7 +12,10 @@ jump_t* jump_new()
 
 void jump_free(jump_t* jump)
 {
-    free(jump->jumps);
+    for (size_t i = 0; i < vec_size(jump->jumps); i++)
+        free(vec_get(jump->jumps, i));
+
+    vec_free(jump->jumps);
     free(jump);
 }
 
@@ -21,7 +24,8 @@ void jump_to(jump_t* jump)
     size_t* addr = malloc(sizeof(size_t));
     *addr = vm_code_addr();
     vec_append(jump->jumps, addr);
-    EMIT(NUM16(0));
+    CODE(*addr - 1, vm_wide_op(vm_code_get(*addr - 1)));
+    EMIT(NUM32(0));
 }
 
 void jump_label(jump_t* jump)
@@ -32,5 +36,5 @@ void jump_label(jump_t* jump)
 void jump_fix(jump_t* jump)
 {
     for (size_t i = 0; i < vec_size(jump->jumps); i++)
-        CODE(*((size_t*)vec_get(jump->jumps, i)), NUM16(jump->label));
+        CODE(*((size_t*)vec_get(jump->jumps, i)), NUM32(jump->label));
 }
@@ -12,12 +12,13 @@ extern "C"
 typedef struct
 {
     vector_t* jumps;
-    uint16_t label;
+    uint32_t label;
 } jump_t;
 
 
 jump_t* jump_new();
 void jump_free(jump_t* jump);
+// Follows the jump opcode just emitted, which it turns into its wide form
 void jump_to(jump_t* jump);
 void jump_label(jump_t* jump);
 void jump_fix(jump_t* jump);
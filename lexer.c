@@ -1,17 +1,27 @@
 #include "lexer.h"
 #include "token.h"
 #include "buffer.h"
+#include "intern.h"
 #include "utf8.h"
 #include <stdio.h>
 #include <ctype.h>
 #include <stdlib.h>
 #include <string.h>
 
-static FILE* file;
-static bool_t is_stdin;
-static char look;
-static uint32_t row;
-static uint32_t col;
+struct lexer_t
+{
+    FILE* file;
+    bool_t is_stdin;
+    char look;
+    uint32_t row;
+    uint32_t col;
+    intern_t* strings;  // Identifiers and string literals
+    buffer_t text;      // The token being read
+};
+
+// Where the lexer last read on this thread, for panic()
+static _Thread_local uint32_t last_row;
+static _Thread_local uint32_t last_col;
 
 typedef struct
 {
@@ -42,68 +52,93 @@ static const keyword_t KEYWORDS[] = {
     {"extern", TK_EXTERN},
 };
 
-void lexer_init_file(const char* filename)
+static lexer_t* lexer_new(FILE* file, bool_t is_stdin)
+{
+    lexer_t* lexer = malloc(sizeof (lexer_t));
+    lexer->file = file;
+    lexer->is_stdin = is_stdin;
+    lexer->look = 0;
+    lexer->row = 0;
+    lexer->col = 0;
+    lexer->strings = intern_new();
+    buffer_init(&lexer->text, 64);
+    last_row = 0;
+    last_col = 0;
+    return lexer;
+}
+
+lexer_t* lexer_new_file(const char* filename)
+{
+    FILE* file = fopen(filename, "r");
+
+    if (file == NULL)
+        return NULL;
+
+    return lexer_new(file, false);
+}
+
+lexer_t* lexer_new_stdin()
 {
-    row = 0;
-    col = 0;
-    look = 0;
-    is_stdin = false;
-    file = fopen(filename, "r");
+    return lexer_new(stdin, true);
 }
 
-void lexer_init_stdin()
+lexer_t* lexer_new_string(const char* source, size_t size)
 {
-    row = 0;
-    col = 0;
-    look = 0;
-    is_stdin = true;
-    file = stdin;
+    FILE* file = fmemopen((void*) source, size, "r");
+
+    if (file == NULL)
+        return NULL;
+
+    return lexer_new(file, false);
 }
 
-void lexer_free()
+void lexer_free(lexer_t* lexer)
 {
-    if (!is_stdin)
+    if (!lexer->is_stdin)
     {
-        fclose(file);
+        fclose(lexer->file);
     }
+    intern_free(lexer->strings);
+    buffer_free(&lexer->text);
+    free(lexer);
 }
 
 uint32_t lexer_row()
 {
-    return row;
+    return last_row;
 }
 
 uint32_t lexer_col()
 {
-    return col;
+    return last_col;
 }
 
-void lexer_skip_white()
+void lexer_skip_white(lexer_t* lexer)
 {
-    while ((look = fgetc(file)) != EOF && isspace(look))
+    while ((lexer->look = fgetc(lexer->file)) != EOF && isspace(lexer->look))
     {
-        col++;
+        lexer->col++;
 
-        if (look == '\n')
+        if (lexer->look == '\n')
         {
-            row++;
-            col = 0;
+            lexer->row++;
+            lexer->col = 0;
         }
     }
 }
 
-void lexer_skip_line_comment()
+void lexer_skip_line_comment(lexer_t* lexer)
 {
-    while (look == '#')
+    while (lexer->look == '#')
     {
-        while ((look = fgetc(file)) != EOF && look != '\n')
+        while ((lexer->look = fgetc(lexer->file)) != EOF && lexer->look != '\n')
         {
         }
 
-        row++;
-        col = 0;
+        lexer->row++;
+        lexer->col = 0;
 
-        lexer_skip_white();
+        lexer_skip_white(lexer);
     }
 }
 
@@ -129,213 +164,211 @@ token_type_t find_keyword(const char* name)
     return TK_BAD;
 }
 
-token_t lexer_next()
+token_t lexer_next(lexer_t* lexer)
 {
-    lexer_skip_white();
-    lexer_skip_line_comment();
+    lexer_skip_white(lexer);
+    lexer_skip_line_comment(lexer);
 
     token_t token;
     token.type = TK_BAD;
-    token.row = row;
-    token.col = col;
+    token.row = lexer->row;
+    token.col = lexer->col;
     token.value.as_long = 0;
 
-    col++;
+    lexer->col++;
 
-    if (feof(file))
+    if (feof(lexer->file))
     {
         token.type = TK_FIN;
     }
-    else if (look == '{')
+    else if (lexer->look == '{')
     {
         token.type = TK_L_BRACE;
     }
-    else if (look == '}')
+    else if (lexer->look == '}')
     {
         token.type = TK_R_BRACE;
     }
-    else if (look == '(')
+    else if (lexer->look == '(')
     {
         token.type = TK_L_PAREN;
     }
-    else if (look == ')')
+    else if (lexer->look == ')')
     {
         token.type = TK_R_PAREN;
     }
-    else if (look == '[')
+    else if (lexer->look == '[')
     {
         token.type = TK_L_BRACKET;
     }
-    else if (look == ']')
+    else if (lexer->look == ']')
     {
         token.type = TK_R_BRACKET;
     }
-    else if (look == ',')
+    else if (lexer->look == ',')
     {
         token.type = TK_COMMA;
     }
-    else if (look == ':')
+    else if (lexer->look == ':')
     {
         token.type = TK_COLON;
     }
-    else if (look == '.' && fpeek(file) == '.')
+    else if (lexer->look == '.' && fpeek(lexer->file) == '.')
     {
         token.type = TK_DOTDOT;
-        look = fgetc(file);
+        lexer->look = fgetc(lexer->file);
     }
-    else if (look == '.')
+    else if (lexer->look == '.')
     {
         token.type = TK_PERIOD;
     }
-    else if (look == ';')
+    else if (lexer->look == ';')
     {
         token.type = TK_SEMICOLON;
     }
-    else if (look == '+')
+    else if (lexer->look == '+')
     {
         token.type = TK_PLUS;
     }
-    else if (look == '-')
+    else if (lexer->look == '-')
     {
         token.type = TK_MINUS;
     }
-    else if (look == '*')
+    else if (lexer->look == '*')
     {
         token.type = TK_MUL;
     }
-    else if (look == '/')
+    else if (lexer->look == '/')
     {
         token.type = TK_DIV;
     }
-    else if (look == '%')
+    else if (lexer->look == '%')
     {
         token.type = TK_MOD;
     }
-    else if (look == '|')
+    else if (lexer->look == '|')
     {
         token.type = TK_OR_BIT;
     }
-    else if (look == '&')
+    else if (lexer->look == '&')
     {
         token.type = TK_AND_BIT;
     }
-    else if (look == '^')
+    else if (lexer->look == '^')
     {
         token.type = TK_XOR_BIT;
     }
-    else if (look == '\\')
+    else if (lexer->look == '\\')
     {
         token.type = TK_BACKSLASH;
     }
-    else if (look == '?')
+    else if (lexer->look == '?')
     {
         token.type = TK_QUESTION;
     }
-    else if (look == '+' && fpeek(file) == '+')
+    else if (lexer->look == '+' && fpeek(lexer->file) == '+')
     {
         token.type = TK_INC;
-        look = fgetc(file);
+        lexer->look = fgetc(lexer->file);
     }
-    else if (look == '-' && fpeek(file) == '-')
+    else if (lexer->look == '-' && fpeek(lexer->file) == '-')
     {
         token.type = TK_DEC;
-        look = fgetc(file);
+        lexer->look = fgetc(lexer->file);
     }
-    else if (look == '=' && fpeek(file) == '=')
+    else if (lexer->look == '=' && fpeek(lexer->file) == '=')
     {
         token.type = TK_EQ;
-        look = fgetc(file);
+        lexer->look = fgetc(lexer->file);
     }
-    else if (look == '=')
+    else if (lexer->look == '=')
     {
         token.type = TK_ASSIGN;
     }
-    else if (look == '>' && fpeek(file) == '=')
+    else if (lexer->look == '>' && fpeek(lexer->file) == '=')
     {
         token.type = TK_GTE;
-        look = fgetc(file);
+        lexer->look = fgetc(lexer->file);
     }
-    else if (look == '>')
+    else if (lexer->look == '>')
     {
         token.type = TK_GT;
     }
-    else if (look == '<' && fpeek(file) == '=')
+    else if (lexer->look == '<' && fpeek(lexer->file) == '=')
     {
         token.type = TK_LTE;
-        look = fgetc(file);
+        lexer->look = fgetc(lexer->file);
     }
-    else if (look == '<')
+    else if (lexer->look == '<')
     {
         token.type = TK_LT;
     }
-    else if (look == '!' && fpeek(file) == '=')
+    else if (lexer->look == '!' && fpeek(lexer->file) == '=')
     {
         token.type = TK_NE;
-        look = fgetc(file);
+        lexer->look = fgetc(lexer->file);
     }
-    else if (isalpha(look) || look == '_')
+    else if (isalpha(lexer->look) || lexer->look == '_')
     {
-        buffer_t ident;
-        buffer_init(&ident, 32);
-        buffer_add(&ident, look);
+        buffer_t* ident = &lexer->text;
+        ident->used = 0;
+        buffer_add(ident, lexer->look);
 
-        while (is_ident_char(fpeek(file)))
+        while (is_ident_char(fpeek(lexer->file)))
         {
-            look = fgetc(file);
-            col++;
-            buffer_add(&ident, look);
+            lexer->look = fgetc(lexer->file);
+            lexer->col++;
+            buffer_add(ident, lexer->look);
         }
 
-        buffer_add(&ident, '\0');
-        buffer_shrink(&ident);
+        buffer_add(ident, '\0');
 
-        token_type_t t = find_keyword((char*)ident.data);
+        token_type_t t = find_keyword((char*) ident->data);
         token.type = t == TK_BAD ? TK_IDENT : t;
-        token.value.as_str = (char*) ident.data;
+        token.value.as_str = (char*) intern(lexer->strings, (char*) ident->data, ident->used - 1);
     }
-    else if (isdigit(look))
+    else if (isdigit(lexer->look))
     {
         bool_t has_dot = false;
 
-        buffer_t number;
-        buffer_init(&number, 32);
-        buffer_add(&number, look);
+        buffer_t* number = &lexer->text;
+        number->used = 0;
+        buffer_add(number, lexer->look);
 
         while (true)
         {
-            char peek = fpeek(file);
+            char peek = fpeek(lexer->file);
 
             if (isdigit(peek) || peek == '.')
             {
                 if (peek == '.')
                     has_dot = true;
 
-                if ((look = fgetc(file)) != EOF)
+                if ((lexer->look = fgetc(lexer->file)) != EOF)
                 {
-                    col++;
-                    buffer_add(&number, look);
+                    lexer->col++;
+                    buffer_add(number, lexer->look);
                     continue;
                 }
             }
             break;
         }
 
-        buffer_add(&number, '\0');
-        buffer_shrink(&number);
+        buffer_add(number, '\0');
 
         // long vs byte vs short vs int32 ?!
         // how about real, hex, octal, binary, bigint ?!
 
         if (has_dot)
         {
-            uint8_t* end = number.data + number.used - 1;
+            uint8_t* end = number->data + number->used - 1;
             token.type = TK_REAL;
-            token.value.as_real = strtod((char*) number.data, (char**) &end);
+            token.value.as_real = strtod((char*) number->data, (char**) &end);
         }
         else
         {
-            uint8_t* end = number.data + number.used - 1;
-            int64_t val = strtoll((char*) number.data, (char**) &end, 10);
+            uint8_t* end = number->data + number->used - 1;
+            int64_t val = strtoll((char*) number->data, (char**) &end, 10);
             
             // Emit the smallest integer type that fits the value
             if (val >= -128 && val <= 127) {
@@ -353,17 +386,17 @@ token_t lexer_next()
             }
         }
     }
-    else if (look == '"')
+    else if (lexer->look == '"')
     {
-        buffer_t str;
-        buffer_init(&str, 64);
+        buffer_t* str = &lexer->text;
+        str->used = 0;
 
-        while (fpeek(file) != '"' && (look = fgetc(file)) != EOF)
+        while (fpeek(lexer->file) != '"' && (lexer->look = fgetc(lexer->file)) != EOF)
         {
-            if (look == '\\')
+            if (lexer->look == '\\')
             {
                 char escaped = 0;
-                switch (fpeek(file))
+                switch (fpeek(lexer->file))
                 {
                 case 'n':
                     escaped = '\n';
@@ -393,39 +426,41 @@ token_t lexer_next()
 
                 if (escaped != 0)
                 {
-                    look = escaped;
-                    fgetc(file);
-                    col++;
+                    lexer->look = escaped;
+                    fgetc(lexer->file);
+                    lexer->col++;
                 }
             }
 
-            col++;
-            buffer_add(&str, look);
+            lexer->col++;
+            buffer_add(str, lexer->look);
         }
 
-        look = fgetc(file);
+        lexer->look = fgetc(lexer->file);
 
-        if (look != '"')
+        if (lexer->look != '"')
         {
             token.type = TK_BAD;
         }
         else
         {
-            buffer_add(&str, 0);
-            buffer_shrink(&str);
+            buffer_add(str, 0);
 
             // Validate UTF-8 encoding
-            if (utf8valid((utf8_int8_t*)str.data) != NULL)
+            if (utf8valid((utf8_int8_t*) str->data) != NULL)
             {
                 token.type = TK_BAD;
             }
             else
             {
                 token.type = TK_STR;
-                token.value.as_str = (char*) str.data;
+                token.value.as_str = (char*) intern(lexer->strings, (char*) str->data, str->used - 1);
             }
         }
     }
 
+    last_row = lexer->row;
+    last_col = lexer->col;
+
     return token;
 }
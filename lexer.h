@@ -9,10 +9,16 @@ extern "C"
 {
 #endif
 
-void lexer_init_file(const char* filename);
-void lexer_init_stdin();
-void lexer_free();
-token_t lexer_next();
+typedef struct lexer_t lexer_t;
+
+// NULL when the file cannot be opened
+lexer_t* lexer_new_file(const char* filename);
+lexer_t* lexer_new_stdin();
+// Reads `size` bytes of `source`, which must outlive the lexer
+lexer_t* lexer_new_string(const char* source, size_t size);
+void lexer_free(lexer_t* lexer);
+token_t lexer_next(lexer_t* lexer);
+// Position of the lexer that last read on this thread, for error messages
 uint32_t lexer_row();
 uint32_t lexer_col();
 
@@ -0,0 +1,526 @@
+#include "loop.h"
+#include "arena.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+// Loops are optimized outermost first, so an expression invariant in a
+// whole nest is hoisted out of all of it at once. Functions are walked in
+// order, as in inline.c: whether a function is pure is known before the
+// calls that follow its declaration.
+//
+// Hoisting never moves an evaluation that could fail or call a user
+// function to a place where the loop might not have run it: only the
+// condition is evaluated on every entry, and only when it has no side
+// effects of its own.
+
+typedef struct
+{
+    vector_t* assigned;     // Symbols assigned anywhere in the loop
+    context_t* context;     // Context of the init, owning the hidden locals
+    vector_t* init;         // Assignments run once, after the init
+    vector_t* post;         // Assignments run after the post
+} loop_info_t;
+
+// A product of the induction variable kept in a hidden local
+typedef struct
+{
+    token_type_t op;        // TK_MUL or TK_SHL
+    symbol_t* factor;       // Invariant variable, NULL for a constant
+    int64_t value;          // The constant factor
+    symbol_t* symbol;
+} product_t;
+
+static _Thread_local vector_t* pure_funcs;
+static _Thread_local size_t hidden_count;
+
+static bool_t is_variable(ast_t* ast, symbol_t* symbol)
+{
+    return is_kind(ast, eval_variable) && ((ast_variable_t*) ast)->symbol == symbol;
+}
+
+static size_t count(vector_t* symbols, symbol_t* symbol)
+{
+    size_t n = 0;
+    for (size_t i = 0; i < vec_size(symbols); i++)
+        if (vec_get(symbols, i) == symbol)
+            ++n;
+    return n;
+}
+
+// Builtins returning nothing (print) are the only ones with side effects
+static bool_t is_pure_call(ast_func_call_t* call)
+{
+    if (call->symbol->addr == SYMBOL_BUILTIN_ADDR)
+        return call->symbol->extra.func.ret_type != MT_VOID;
+    return vec_contains(pure_funcs, call->symbol);
+}
+
+// What the code of a loop or a function assigns, and whether it calls
+// anything with side effects. Calls to `self` are taken as pure, for the
+// body of a recursive function.
+typedef struct
+{
+    vector_t* assigned;
+    bool_t pure;
+    symbol_t* self;
+} effects_t;
+
+// Appends the symbol of every assignment under `ast` to `assigned` and
+// clears `pure` on a call with side effects. Nested functions are left
+// out, their code does not run there.
+static ast_t* scan(ast_t* ast, void* data)
+{
+    effects_t* effects = data;
+
+    if (is_kind(ast, eval_func_decl))
+        return ast;
+
+    if (is_kind(ast, eval_assign))
+        vec_append(effects->assigned, ((ast_assign_t*) ast)->symbol);
+    else if (is_kind(ast, eval_func_call))
+    {
+        ast_func_call_t* call = (ast_func_call_t*) ast;
+        if (call->symbol != effects->self && !is_pure_call(call))
+            effects->pure = false;
+    }
+
+    ast_visit_children(ast, scan, data);
+    return ast;
+}
+
+// Integer division and modulo fail on a zero divisor
+static bool_t traps(ast_binary_t* binary)
+{
+    return (binary->op == TK_DIV || binary->op == TK_MOD) &&
+           !(infer_type(binary->lhs_expr) == MT_REAL && infer_type(binary->rhs_expr) == MT_REAL);
+}
+
+// Whether `ast` can be evaluated once before the loop: it reads nothing the
+// loop assigns and has no side effects. A `speculative` expression might
+// not have been evaluated by the loop at all, so it must not fail or call
+// a user function either. `internal` collects the locals of inlined bodies,
+// which are assigned by the expression itself.
+static bool_t movable(ast_t* ast, loop_info_t* info, vector_t* internal, bool_t speculative)
+{
+    if (ast == NULL || is_kind(ast, eval_constant))
+        return true;
+
+    if (is_kind(ast, eval_variable))
+    {
+        symbol_t* symbol = ((ast_variable_t*) ast)->symbol;
+        return vec_contains(internal, symbol) || !vec_contains(info->assigned, symbol);
+    }
+
+    if (is_kind(ast, eval_unary))
+        return movable(((ast_unary_t*) ast)->expr, info, internal, speculative);
+
+    if (is_kind(ast, eval_binary))
+    {
+        ast_binary_t* binary = (ast_binary_t*) ast;
+        return !(speculative && traps(binary)) &&
+               movable(binary->lhs_expr, info, internal, speculative) &&
+               movable(binary->rhs_expr, info, internal, speculative);
+    }
+
+    if (is_kind(ast, eval_func_call))
+    {
+        ast_func_call_t* call = (ast_func_call_t*) ast;
+
+        if (!is_pure_call(call) || (speculative && call->symbol->addr != SYMBOL_BUILTIN_ADDR))
+            return false;
+
+        for (size_t i = 0; i < vec_size(call->args); i++)
+            if (!movable(vec_get(call->args, i), info, internal, speculative))
+                return false;
+        return true;
+    }
+
+    if (is_kind(ast, eval_inline))
+        return movable((ast_t*) ((ast_inline_t*) ast)->body, info, internal, speculative);
+
+    if (is_kind(ast, eval_assign))
+    {
+        ast_assign_t* assign = (ast_assign_t*) ast;
+        return vec_contains(internal, assign->symbol) &&
+               movable(assign->expr, info, internal, speculative);
+    }
+
+    if (is_kind(ast, eval_block))
+    {
+        ast_block_t* block = (ast_block_t*) ast;
+
+        for (size_t i = 0; i < vec_size(block->context->symbols); i++)
+            vec_append(internal, vec_get(block->context->symbols, i));
+
+        for (size_t i = 0; i < vec_size(block->nodes); i++)
+            if (!movable(vec_get(block->nodes, i), info, internal, speculative))
+                return false;
+        return true;
+    }
+
+    if (is_kind(ast, eval_if_cond))
+    {
+        ast_if_cond_t* if_cond = (ast_if_cond_t*) ast;
+        return movable(if_cond->condition, info, internal, speculative) &&
+               movable(if_cond->if_then, info, internal, speculative) &&
+               movable(if_cond->if_else, info, internal, speculative);
+    }
+
+    if (is_kind(ast, eval_inline_return))
+        return movable(((ast_func_return_t*) ast)->expr, info, internal, speculative);
+
+    return false;
+}
+
+static bool_t is_invariant(ast_t* ast, loop_info_t* info, bool_t speculative)
+{
+    vector_t* internal = vec_new(0);
+    bool_t ok = movable(ast, info, internal, speculative);
+    vec_free(internal);
+    return ok;
+}
+
+// Variables and constants cost no more to read than a hidden local
+static bool_t is_computed(ast_t* ast)
+{
+    return is_kind(ast, eval_unary) || is_kind(ast, eval_binary) ||
+           is_kind(ast, eval_func_call) || is_kind(ast, eval_inline);
+}
+
+// Identifiers can never start with '$', so hidden locals never clash
+static symbol_t* hidden(loop_info_t* info, type_t type)
+{
+    char* id = arena_alloc(24);
+    snprintf(id, 24, "$%zu", hidden_count++);
+    return context_add(info->context, id, type);
+}
+
+// Assigns `expr` to a hidden local before the loop and returns a read of
+// it. Integer arithmetic is typed right away, so the local can be a factor
+// of a reduced product; anything else is typed by the assignment when the
+// code is generated.
+static ast_t* hoist_value(ast_t* expr, loop_info_t* info)
+{
+    type_t type = MT_UNKNOWN;
+
+    if ((is_kind(expr, eval_unary) || is_kind(expr, eval_binary)) && infer_type(expr) == MT_INT64)
+        type = MT_INT64;
+
+    symbol_t* symbol = hidden(info, type);
+    vec_append(info->init, ast_new_assign(symbol, expr));
+    return (ast_t*) ast_new_variable(symbol);
+}
+
+// Where hoist is in the loop. Branches, the right operand of `and`/`or`,
+// inlined bodies and nested loops are speculative, whatever `speculative`
+// is.
+typedef struct
+{
+    loop_info_t* info;
+    bool_t speculative;
+} hoisting_t;
+
+static ast_t* hoist(ast_t* ast, void* data);
+
+static ast_t* hoist_speculative(ast_t* ast, hoisting_t* hoisting)
+{
+    hoisting_t speculative = {hoisting->info, true};
+    return hoist(ast, &speculative);
+}
+
+// Replaces the largest invariant expressions under `ast` by hidden locals
+static ast_t* hoist(ast_t* ast, void* data)
+{
+    hoisting_t* hoisting = data;
+
+    if (is_computed(ast) && is_invariant(ast, hoisting->info, hoisting->speculative))
+        return hoist_value(ast, hoisting->info);
+
+    if (is_kind(ast, eval_binary))
+    {
+        ast_binary_t* binary = (ast_binary_t*) ast;
+        binary->lhs_expr = hoist(binary->lhs_expr, hoisting);
+        if (binary->op == TK_AND || binary->op == TK_OR)
+            binary->rhs_expr = hoist_speculative(binary->rhs_expr, hoisting);
+        else
+            binary->rhs_expr = hoist(binary->rhs_expr, hoisting);
+    }
+    else if (is_kind(ast, eval_if_cond))
+    {
+        ast_if_cond_t* if_cond = (ast_if_cond_t*) ast;
+        if_cond->condition = hoist(if_cond->condition, hoisting);
+        if_cond->if_then = hoist_speculative(if_cond->if_then, hoisting);
+        if_cond->if_else = hoist_speculative(if_cond->if_else, hoisting);
+    }
+    else if (is_kind(ast, eval_for_loop))
+    {
+        ast_for_loop_t* for_loop = (ast_for_loop_t*) ast;
+        for_loop->init = hoist(for_loop->init, hoisting);
+        for_loop->condition = hoist(for_loop->condition, hoisting);
+        for_loop->post = hoist_speculative(for_loop->post, hoisting);
+        for_loop->body = hoist_speculative(for_loop->body, hoisting);
+    }
+    else if (is_kind(ast, eval_inline))
+        hoist_speculative((ast_t*) ((ast_inline_t*) ast)->body, hoisting);
+    else if (!is_kind(ast, eval_func_decl))
+        ast_visit_children(ast, hoist, hoisting);
+
+    return ast;
+}
+
+// The variable stepped by the post alone, as in `i = i + 4` or `i = i - 1`.
+// Narrower integers wrap on their stores, so only i64 variables qualify; a
+// `var i = 0` is still untyped here and gets i64 from its assignment.
+static symbol_t* induction_variable(ast_for_loop_t* for_loop, loop_info_t* info, int64_t* step)
+{
+    if (!is_kind(for_loop->post, eval_assign))
+        return NULL;
+
+    ast_assign_t* post = (ast_assign_t*) for_loop->post;
+    symbol_t* symbol = post->symbol;
+    int64_t value;
+
+    if (!is_kind(post->expr, eval_binary))
+        return NULL;
+
+    ast_binary_t* binary = (ast_binary_t*) post->expr;
+
+    if ((binary->op != TK_PLUS && binary->op != TK_MINUS) ||
+        !is_variable(binary->lhs_expr, symbol) || !integer_constant(binary->rhs_expr, &value) ||
+        count(info->assigned, symbol) != 1)
+        return NULL;
+
+    if (symbol->type != MT_INT64)
+    {
+        ast_assign_t* init = (ast_assign_t*) for_loop->init;
+        int64_t start;
+
+        if (symbol->type != MT_UNKNOWN || !is_kind(for_loop->init, eval_assign) ||
+            init->symbol != symbol || !integer_constant(init->expr, &start))
+            return NULL;
+    }
+
+    *step = binary->op == TK_PLUS ? value : (int64_t) (0 - (uint64_t) value);
+    return symbol;
+}
+
+// Whether `binary` is `iv * k`, `k * iv` or `iv << k` with `k` an integer
+// constant or a typed integer variable the loop does not assign
+static bool_t reducible(ast_binary_t* binary, symbol_t* iv, loop_info_t* info, ast_t** factor)
+{
+    ast_t* lhs = binary->lhs_expr;
+    ast_t* rhs = binary->rhs_expr;
+    int64_t value;
+
+    if (binary->op == TK_SHL)
+    {
+        *factor = rhs;
+        return is_variable(lhs, iv) && integer_constant(rhs, &value) && value >= 0 && value < 63;
+    }
+
+    if (binary->op != TK_MUL)
+        return false;
+
+    if (is_variable(rhs, iv))
+    {
+        rhs = lhs;
+        lhs = binary->rhs_expr;
+    }
+
+    if (!is_variable(lhs, iv))
+        return false;
+
+    *factor = rhs;
+
+    if (integer_constant(rhs, &value))
+        return true;
+
+    if (!is_kind(rhs, eval_variable))
+        return false;
+
+    symbol_t* symbol = ((ast_variable_t*) rhs)->symbol;
+    return is_integer_type(symbol->type) && !vec_contains(info->assigned, symbol);
+}
+
+// The hidden local holding `iv op factor`. A new one is assigned the
+// product before the loop and advanced by `step op factor` after the post.
+static symbol_t* product(token_type_t op, ast_t* factor, symbol_t* iv, int64_t step,
+                         loop_info_t* info, vector_t* products)
+{
+    symbol_t* variable = is_kind(factor, eval_variable) ? ((ast_variable_t*) factor)->symbol : NULL;
+    int64_t value = 0;
+    ast_t* delta;
+
+    if (variable == NULL)
+        integer_constant(factor, &value);
+
+    for (size_t i = 0; i < vec_size(products); i++)
+    {
+        product_t* p = vec_get(products, i);
+        if (p->op == op && p->factor == variable && p->value == value)
+            return p->symbol;
+    }
+
+    product_t* p = malloc(sizeof (product_t));
+    p->op = op;
+    p->factor = variable;
+    p->value = value;
+    p->symbol = hidden(info, MT_INT64);
+    vec_append(products, p);
+
+    ast_t* k = variable != NULL ? (ast_t*) ast_new_variable(variable) : ast_new_integer(value);
+    vec_append(info->init, ast_new_assign(p->symbol, (ast_t*) ast_new_binary(op, (ast_t*) ast_new_variable(iv), k)));
+
+    if (variable == NULL && op == TK_SHL)
+        delta = ast_new_integer((int64_t) ((uint64_t) step << value));
+    else if (variable == NULL)
+        delta = ast_new_integer((int64_t) ((uint64_t) step * (uint64_t) value));
+    else if (step == 1)
+        delta = (ast_t*) ast_new_variable(variable);
+    else
+    {
+        symbol_t* scaled = hidden(info, MT_INT64);
+        ast_t* expr = (ast_t*) ast_new_binary(TK_MUL, (ast_t*) ast_new_variable(variable), ast_new_integer(step));
+        vec_append(info->init, ast_new_assign(scaled, expr));
+        delta = (ast_t*) ast_new_variable(scaled);
+    }
+
+    ast_t* next = (ast_t*) ast_new_binary(TK_PLUS, (ast_t*) ast_new_variable(p->symbol), delta);
+    vec_append(info->post, ast_new_assign(p->symbol, next));
+
+    return p->symbol;
+}
+
+// The induction variable of a loop and the products of it found so far
+typedef struct
+{
+    symbol_t* iv;
+    int64_t step;
+    loop_info_t* info;
+    vector_t* products;
+} reduction_t;
+
+// Replaces the products of `iv` under `ast` by hidden locals
+static ast_t* reduce(ast_t* ast, void* data)
+{
+    reduction_t* r = data;
+
+    if (is_kind(ast, eval_binary))
+    {
+        ast_binary_t* binary = (ast_binary_t*) ast;
+        ast_t* factor;
+
+        if (reducible(binary, r->iv, r->info, &factor))
+            return (ast_t*) ast_new_variable(product(binary->op, factor, r->iv, r->step, r->info, r->products));
+    }
+
+    if (!is_kind(ast, eval_func_decl))
+        ast_visit_children(ast, reduce, r);
+
+    return ast;
+}
+
+// `ast` followed by `nodes`, as a single statement
+static ast_t* sequence(ast_t* ast, vector_t* nodes, context_t* context)
+{
+    if (vec_size(nodes) == 0)
+        return ast;
+
+    ast_block_t* block = ast_new_block(context);
+    vec_append(block->nodes, ast);
+
+    for (size_t i = 0; i < vec_size(nodes); i++)
+        vec_append(block->nodes, vec_get(nodes, i));
+
+    return (ast_t*) block;
+}
+
+static void optimize(ast_for_loop_t* for_loop)
+{
+    if (for_loop->loop == NULL || !is_kind(for_loop->body, eval_block))
+        return;
+
+    loop_info_t info;
+    effects_t effects = {vec_new(0), true, NULL};
+    int64_t step;
+
+    info.assigned = effects.assigned;
+    info.context = ((ast_block_t*) for_loop->body)->context->parent;
+    info.init = vec_new(0);
+    info.post = vec_new(0);
+
+    scan(for_loop->condition, &effects);
+    hoisting_t hoisting = {&info, !effects.pure};
+    scan(for_loop->body, &effects);
+    scan(for_loop->post, &effects);
+
+    // The condition runs whenever the loop is entered
+    for_loop->condition = hoist(for_loop->condition, &hoisting);
+    for_loop->body = hoist_speculative(for_loop->body, &hoisting);
+    for_loop->post = hoist_speculative(for_loop->post, &hoisting);
+
+    symbol_t* iv = induction_variable(for_loop, &info, &step);
+
+    if (iv != NULL)
+    {
+        reduction_t r = {iv, step, &info, vec_new(0)};
+
+        for_loop->condition = reduce(for_loop->condition, &r);
+        for_loop->body = reduce(for_loop->body, &r);
+
+        for (size_t i = 0; i < vec_size(r.products); i++)
+            free(vec_get(r.products, i));
+        vec_free(r.products);
+    }
+
+    for_loop->init = sequence(for_loop->init, info.init, info.context);
+    for_loop->post = sequence(for_loop->post, info.post, info.context);
+
+    vec_free(info.assigned);
+    vec_free(info.init);
+    vec_free(info.post);
+}
+
+static void walk(ast_t* ast)
+{
+    if (is_kind(ast, eval_block))
+    {
+        ast_block_t* block = (ast_block_t*) ast;
+        for (size_t i = 0; i < vec_size(block->nodes); i++)
+            walk(vec_get(block->nodes, i));
+    }
+    else if (is_kind(ast, eval_if_cond))
+    {
+        ast_if_cond_t* if_cond = (ast_if_cond_t*) ast;
+        walk(if_cond->if_then);
+        walk(if_cond->if_else);
+    }
+    else if (is_kind(ast, eval_for_loop))
+    {
+        ast_for_loop_t* for_loop = (ast_for_loop_t*) ast;
+        optimize(for_loop);
+        walk(for_loop->body);
+    }
+    else if (is_kind(ast, eval_func_decl))
+    {
+        ast_func_decl_t* func = (ast_func_decl_t*) ast;
+        effects_t effects = {vec_new(0), true, func->symbol};
+
+        walk((ast_t*) func->body);
+
+        scan((ast_t*) func->body, &effects);
+        if (effects.pure)
+            vec_append(pure_funcs, func->symbol);
+        vec_free(effects.assigned);
+    }
+}
+
+void loop_optimize_program(ast_block_t* program)
+{
+    pure_funcs = vec_new(0);
+
+    walk((ast_t*) program);
+
+    vec_free(pure_funcs);
+    pure_funcs = NULL;
+}
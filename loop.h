@@ -0,0 +1,22 @@
+#ifndef LOOP_H
+#define LOOP_H
+
+#include "ast.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+// Loop optimizations over the AST, for either back end. In every for loop,
+// invariant pure expressions are hoisted into hidden locals assigned once
+// before the loop, and products of the induction variable by an invariant
+// integer are replaced by a hidden local advanced by the post. Runs after
+// inline_program, so inlined calls are hoisted like any other expression.
+void loop_optimize_program(ast_block_t* program);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LOOP_H */
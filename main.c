@@ -1,8 +1,128 @@
 #include "parser.h"
+#include "vm.h"
+#include "cache.h"
 #include <stdint.h>
 #include <stdio.h>
 #include <getopt.h>
 #include <string.h>
+#include <stdlib.h>
+
+static void usage(const char* name)
+{
+    fprintf(stderr, "Usage: %s [--stdin] [--dasm <file>] [--noexec] [--regvm] [--jit] [--no-peephole] [--peephole-stats] [--no-inline] [--no-dce] [--ir] [--dump-ir <file>] [--emit <file>] [--run-image <file>] [--cache-dir <dir>] [--stack-size <n>] [<file.lm>]\n", name);
+    fprintf(stderr, "  --stdin    Read code from stdin instead of a file\n");
+    fprintf(stderr, "  --dasm     Write disassembly to file\n");
+    fprintf(stderr, "  --noexec   Only compile, do not execute\n");
+    fprintf(stderr, "  --regvm    Compile for and run on the register VM\n");
+    fprintf(stderr, "  --jit      Run functions as native x86-64 code\n");
+    fprintf(stderr, "  --no-peephole     Do not run the peephole optimizer\n");
+    fprintf(stderr, "  --peephole-stats  Report the bytes saved by the peephole optimizer\n");
+    fprintf(stderr, "  --no-inline       Do not inline small functions\n");
+    fprintf(stderr, "  --no-dce          Do not remove dead code and stores\n");
+    fprintf(stderr, "  --ir              Generate code through the SSA IR\n");
+    fprintf(stderr, "  --dump-ir         Write the IR to file\n");
+    fprintf(stderr, "  --emit            Compile to a bytecode image file, do not execute\n");
+    fprintf(stderr, "  --run-image       Run a bytecode image file instead of compiling\n");
+    fprintf(stderr, "  --cache-dir       Keep compiled scripts in dir, MIRZA_CACHE_DIR by default\n");
+    fprintf(stderr, "  --stack-size      Most values on the VM stack, %d by default\n", VM_STACK_SIZE);
+}
+
+// Runs the current program, false if it stopped on an error
+static bool_t execute_program(size_t stack_size)
+{
+    vm_t* machine = vm_new(stack_size);
+    vm_exec(machine);
+
+    const char* error = vm_error(machine);
+    if (error != NULL)
+        fprintf(stderr, "Error: %s\n", error);
+
+    vm_free(machine);
+    return error == NULL;
+}
+
+// Runs an image written by --emit, without lexing or parsing anything
+static int run_image(const char* filename, bool_t jit, size_t stack_size)
+{
+    if (!vm_load(filename))
+        return 1;
+
+    if (jit)
+        vm_enable_jit();
+
+    bool_t ok = execute_program(stack_size);
+    vm_release();
+    return ok ? 0 : 1;
+}
+
+// The whole file, NUL terminated, or NULL
+static char* read_source(const char* filename, size_t* size)
+{
+    FILE* file = fopen(filename, "rb");
+    if (file == NULL)
+        return NULL;
+
+    size_t allc = 4096;
+    char* source = malloc(allc);
+    size_t used = 0;
+    size_t n;
+
+    while ((n = fread(source + used, 1, allc - used - 1, file)) > 0)
+    {
+        used += n;
+        if (used + 1 == allc)
+        {
+            allc *= 2;
+            source = realloc(source, allc);
+        }
+    }
+
+    fclose(file);
+    source[used] = '\0';
+    *size = used;
+    return source;
+}
+
+// Compiles the script unless the cache has its image, then runs it
+static int run_cached(const char* filename, const char* cache_dir, const parser_options_t* options,
+                      bool_t execute, const char* dasm_filename)
+{
+    size_t size;
+    char* source = read_source(filename, &size);
+    char path[CACHE_PATH_SIZE];
+
+    if (source == NULL)
+    {
+        fprintf(stderr, "Error: Cannot open file '%s'\n", filename);
+        return 1;
+    }
+
+    bool_t cached = cache_path(cache_dir, source, size, options, path);
+
+    if (cached && cache_load(path))
+    {
+        if (options->backend == BACKEND_JIT)
+            vm_enable_jit();
+
+        if (dasm_filename != NULL)
+            vm_dasm(dasm_filename);
+    }
+    else
+    {
+        parser_t* parser = parser_new_string(source, size, options);
+        parser_start(parser, false, dasm_filename);
+        parser_free(parser);
+
+        if (cached)
+            cache_store(path);
+    }
+
+    free(source);
+
+    bool_t ok = !execute || execute_program(options->stack_size);
+    vm_release();
+    return ok ? 0 : 1;
+}
 
 int main(int argc, char *argv[])
 {
@@ -10,11 +130,35 @@ int main(int argc, char *argv[])
     int use_stdin = 0;
     char* dasm_filename = NULL;
     int noexec_flag = 0;
+    int regvm_flag = 0;
+    int jit_flag = 0;
+    int no_peephole_flag = 0;
+    int peephole_stats_flag = 0;
+    int no_inline_flag = 0;
+    int no_dce_flag = 0;
+    int ir_flag = 0;
+    char* dump_ir_filename = NULL;
+    char* emit_filename = NULL;
+    char* image_filename = NULL;
+    char* cache_dir = getenv("MIRZA_CACHE_DIR");
+    size_t stack_size = 0;
 
     static struct option long_options[] = {
         {"stdin", no_argument, 0, 's'},
         {"dasm", required_argument, 0, 'd'},
         {"noexec", no_argument, 0, 'n'},
+        {"regvm", no_argument, 0, 'r'},
+        {"jit", no_argument, 0, 'j'},
+        {"no-peephole", no_argument, 0, 'P'},
+        {"peephole-stats", no_argument, 0, 'p'},
+        {"no-inline", no_argument, 0, 'I'},
+        {"no-dce", no_argument, 0, 'E'},
+        {"ir", no_argument, 0, 'i'},
+        {"dump-ir", required_argument, 0, 'D'},
+        {"emit", required_argument, 0, 'e'},
+        {"run-image", required_argument, 0, 'R'},
+        {"cache-dir", required_argument, 0, 'C'},
+        {"stack-size", required_argument, 0, 'S'},
         {0, 0, 0, 0}
     };
 
@@ -31,16 +175,89 @@ int main(int argc, char *argv[])
         case 'n':
             noexec_flag = 1;
             break;
+        case 'r':
+            regvm_flag = 1;
+            break;
+        case 'j':
+            jit_flag = 1;
+            break;
+        case 'P':
+            no_peephole_flag = 1;
+            break;
+        case 'p':
+            peephole_stats_flag = 1;
+            break;
+        case 'I':
+            no_inline_flag = 1;
+            break;
+        case 'E':
+            no_dce_flag = 1;
+            break;
+        case 'i':
+            ir_flag = 1;
+            break;
+        case 'D':
+            dump_ir_filename = optarg;
+            break;
+        case 'e':
+            emit_filename = optarg;
+            break;
+        case 'R':
+            image_filename = optarg;
+            break;
+        case 'C':
+            cache_dir = optarg;
+            break;
+        case 'S':
+        {
+            char* end;
+            stack_size = strtoul(optarg, &end, 10);
+            if (end == optarg || *end != '\0' || stack_size == 0 || stack_size > vm_stack_max())
+            {
+                fprintf(stderr, "Error: Bad stack size '%s'\n", optarg);
+                return 1;
+            }
+            break;
+        }
         default:
-            fprintf(stderr, "Usage: %s [--stdin] [--dasm <file>] [--noexec] [<file.lm>]\n", argv[0]);
-            fprintf(stderr, "  --stdin    Read code from stdin instead of a file\n");
-            fprintf(stderr, "  --dasm     Write disassembly to file\n");
-            fprintf(stderr, "  --noexec   Only compile, do not execute\n");
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (image_filename != NULL)
+    {
+        if (use_stdin || optind < argc || emit_filename != NULL)
+        {
+            fprintf(stderr, "Error: --run-image takes no source to compile\n");
             return 1;
         }
+        return run_image(image_filename, jit_flag, stack_size);
+    }
+
+    if (emit_filename != NULL && regvm_flag)
+    {
+        fprintf(stderr, "Error: Images hold stack VM code, --emit cannot be used with --regvm\n");
+        return 1;
     }
 
-    bool_t execute = !noexec_flag;
+    bool_t execute = !noexec_flag && emit_filename == NULL;
+
+    parser_options_t options;
+    parser_options_init(&options);
+
+    if (regvm_flag)
+        options.backend = BACKEND_REGISTER;
+    else if (jit_flag)
+        options.backend = BACKEND_JIT;
+
+    options.peephole = !no_peephole_flag;
+    options.peephole_report = peephole_stats_flag;
+    options.inlining = !no_inline_flag;
+    options.dead_code = !no_dce_flag;
+    options.use_ir = ir_flag;
+    options.dump_ir_filename = dump_ir_filename;
+    options.stack_size = stack_size;
 
     if (use_stdin)
     {
@@ -49,22 +266,39 @@ int main(int argc, char *argv[])
             fprintf(stderr, "Error: Cannot specify both --stdin and a filename\n");
             return 1;
         }
-        parser_stdin();
-        parser_start(execute, dasm_filename);
-        parser_free();
+        parser_t* parser = parser_new_stdin(&options);
+        bool_t ok = parser_start(parser, execute, dasm_filename);
+        parser_free(parser);
+
+        if (!ok)
+            return 1;
+        if (emit_filename != NULL && !vm_save(emit_filename))
+            return 1;
+    }
+    else if (optind < argc && cache_dir != NULL && cache_dir[0] != '\0'
+             && !regvm_flag && emit_filename == NULL && dump_ir_filename == NULL && !peephole_stats_flag)
+    {
+        return run_cached(argv[optind], cache_dir, &options, execute, dasm_filename);
     }
     else if (optind < argc)
     {
-        parser_load(argv[optind]);
-        parser_start(execute, dasm_filename);
-        parser_free();
+        parser_t* parser = parser_new_file(argv[optind], &options);
+        if (parser == NULL)
+        {
+            fprintf(stderr, "Error: Cannot open file '%s'\n", argv[optind]);
+            return 1;
+        }
+        bool_t ok = parser_start(parser, execute, dasm_filename);
+        parser_free(parser);
+
+        if (!ok)
+            return 1;
+        if (emit_filename != NULL && !vm_save(emit_filename))
+            return 1;
     }
     else
     {
-        fprintf(stderr, "Usage: %s [--stdin] [--dasm <file>] [--noexec] [<file.lm>]\n", argv[0]);
-        fprintf(stderr, "  --stdin    Read code from stdin instead of a file\n");
-        fprintf(stderr, "  --dasm     Write disassembly to file\n");
-        fprintf(stderr, "  --noexec   Only compile, do not execute\n");
+        usage(argv[0]);
         return 1;
     }
 
@@ -0,0 +1,120 @@
+#include "mirza.h"
+#include "parser.h"
+#include "panic.h"
+#include "vm.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct mirza_program_t
+{
+    vm_program_t* program;
+    size_t stack_size;
+};
+
+static void set_error(char* error, size_t error_size, const char* message)
+{
+    if (error == NULL || error_size == 0)
+        return;
+
+    strncpy(error, message, error_size - 1);
+    error[error_size - 1] = '\0';
+}
+
+mirza_program_t* mirza_compile(const char* source, size_t size, const mirza_options_t* options,
+                               char* error, size_t error_size)
+{
+    parser_options_t parser_options;
+    parser_options_init(&parser_options);
+
+    if (options != NULL && options->jit)
+        parser_options.backend = BACKEND_JIT;
+
+    parser_t* parser = parser_new_string(source, size, &parser_options);
+
+    if (parser == NULL)
+    {
+        set_error(error, error_size, "Cannot read the source");
+        return NULL;
+    }
+
+    jmp_buf env;
+
+    if (setjmp(env) != 0)
+    {
+        panic_recover(NULL);
+        set_error(error, error_size, panic_message());
+        vm_release();
+        parser_free(parser);
+        return NULL;
+    }
+
+    panic_recover(&env);
+    parser_start(parser, false, NULL);
+    panic_recover(NULL);
+
+    mirza_program_t* program = malloc(sizeof (mirza_program_t));
+    program->program = vm_program_retain();
+    program->stack_size = options != NULL ? options->stack_size : 0;
+
+    vm_release();
+    parser_free(parser);
+
+    return program;
+}
+
+long mirza_run(const mirza_program_t* program, char* out, size_t out_size)
+{
+    if (program->stack_size > vm_stack_max())
+        return -1;
+
+    vm_t* vm = vm_new_program(program->program, program->stack_size);
+
+    if (out == NULL)
+    {
+        vm_exec(vm);
+        long result = vm_error(vm) == NULL ? 0 : -1;
+        vm_free(vm);
+        return result;
+    }
+
+    if (out_size < 2)
+    {
+        vm_free(vm);
+        return -1;
+    }
+
+    FILE* stream = fmemopen(out, out_size, "w");
+
+    if (stream == NULL)
+    {
+        vm_free(vm);
+        return -1;
+    }
+
+    vm_set_output(vm, stream);
+    vm_exec(vm);
+
+    bool_t failed = vm_error(vm) != NULL;
+    vm_free(vm);
+
+    long length = ftell(stream);
+    fclose(stream);
+
+    if (length < 0)
+        length = 0;
+    if ((size_t) length > out_size - 1)
+        length = out_size - 1;
+
+    out[length] = '\0';
+    return failed ? -1 : length;
+}
+
+void mirza_free(mirza_program_t* program)
+{
+    if (program == NULL)
+        return;
+
+    vm_program_release(program->program);
+    free(program);
+}
@@ -0,0 +1,46 @@
+#ifndef MIRZA_H
+#define MIRZA_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+// Embedding API, built as build/libmirza.a and build/libmirza.so. A script
+// is compiled once into a program that is never changed again, and the
+// program then runs any number of times, every run on a fresh stack.
+// Programs can be compiled and run on any thread, and one program can run
+// on several threads at once.
+
+#define MIRZA_VERSION "0.1.0"
+
+typedef struct mirza_program_t mirza_program_t;
+
+typedef struct
+{
+    int jit;                // Run functions as native x86-64 code
+    size_t stack_size;      // Most values on the stack of a run, 0 for the default
+} mirza_options_t;
+
+// Compiles `size` bytes of `source`. NULL options are the defaults. On a
+// compile error returns NULL and, if `error` is not NULL, copies the message
+// into it.
+mirza_program_t* mirza_compile(const char* source, size_t size, const mirza_options_t* options,
+                               char* error, size_t error_size);
+
+// Runs the program. What it prints goes to `out`, NUL terminated and cut to
+// out_size - 1 bytes, or to stdout when `out` is NULL. Returns the number of
+// bytes written to `out`, or -1 if `out` cannot hold anything or the run
+// stopped on an error. A run whose stack outgrows stack_size stops cleanly
+// with what it printed so far in `out`.
+long mirza_run(const mirza_program_t* program, char* out, size_t out_size);
+
+void mirza_free(mirza_program_t* program);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MIRZA_H */
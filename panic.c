@@ -3,8 +3,27 @@
 #include <stdlib.h>
 #include <stdio.h>
 
+static _Thread_local jmp_buf* recover;
+static _Thread_local char message[256];
+
 void panic(const char* msg)
 {
+    if (recover != NULL)
+    {
+        snprintf(message, sizeof (message), "%s : %d %d", msg, lexer_row() + 1, lexer_col() + 1);
+        longjmp(*recover, 1);
+    }
+
     fprintf(stderr, "%s : %d %d", msg, lexer_row() + 1, lexer_col() + 1);
     exit(0);
 }
+
+void panic_recover(jmp_buf* env)
+{
+    recover = env;
+}
+
+const char* panic_message()
+{
+    return message;
+}
@@ -2,6 +2,7 @@
 #define PANIC_H
 
 #include "types.h"
+#include <setjmp.h>
 
 #ifdef __cplusplus
 extern "C"
@@ -9,6 +10,10 @@ extern "C"
 #endif
 
 void panic(const char* msg);
+// While `env` is set, panic() on this thread longjmps to it instead of
+// exiting, and keeps its message for panic_message(). NULL to exit again.
+void panic_recover(jmp_buf* env);
+const char* panic_message();
 
 #ifdef __cplusplus
 }
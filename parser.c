@@ -4,20 +4,35 @@
 #include "ast.h"
 #include "types.h"
 #include "vm.h"
+#include "rvm.h"
+#include "rgen.h"
 #include "context.h"
 #include "panic.h"
 #include "builtin.h"
+#include "fold.h"
+#include "inline.h"
+#include "loop.h"
+#include "dce.h"
+#include "ir.h"
+#include "arena.h"
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 
-static token_t look;
-static context_t* context;
+struct parser_t
+{
+    lexer_t* lexer;
+    token_t look;
+    context_t* context;     // Innermost scope being parsed
+    context_t* global;      // Scope of the whole program
+    arena_t* arena;         // Owns the tree and its scopes
+    parser_options_t options;
+};
 
-ast_t* factor();
-ast_t* expression();
-ast_t* statement();
-ast_t* func_call(const char* id);
+ast_t* factor(parser_t* parser);
+ast_t* expression(parser_t* parser);
+ast_t* statement(parser_t* parser);
+ast_t* func_call(parser_t* parser, const char* id);
 
 typedef struct
 {
@@ -56,29 +71,103 @@ static const token_type_t UNARY[] = {
     TK_NOT,
 };
 
-void parser_load(const char* filename)
+void parser_options_init(parser_options_t* options)
+{
+    options->backend = BACKEND_STACK;
+    options->peephole = true;
+    options->peephole_report = false;
+    options->inlining = true;
+    options->dead_code = true;
+    options->use_ir = false;
+    options->dump_ir_filename = NULL;
+    options->stack_size = 0;
+}
+
+// Builds the IR of the program and runs the default passes on it
+static ir_module_t* build_ir(parser_t* parser, ast_block_t* block)
+{
+    ir_module_t* module = ir_build(block);
+    ir_pass_manager_t* passes = ir_pass_manager_new();
+
+    ir_pass_add_defaults(passes);
+    ir_pass_run(passes, module);
+    ir_pass_manager_free(passes);
+
+    const char* filename = parser->options.dump_ir_filename;
+
+    if (filename != NULL)
+    {
+        FILE* file = fopen(filename, "w");
+        if (file == NULL)
+        {
+            fprintf(stderr, "Error: Cannot open file '%s' for writing\n", filename);
+        }
+        else
+        {
+            ir_dump(module, file);
+            fclose(file);
+        }
+    }
+
+    return module;
+}
+
+static parser_t* parser_new(lexer_t* lexer, const parser_options_t* options)
+{
+    parser_t* parser = malloc(sizeof (parser_t));
+    parser->lexer = lexer;
+    parser->arena = arena_new();
+
+    arena_enter(parser->arena);
+    parser->global = context_new(NULL, MB_GLOBAL);
+    arena_leave(parser->arena);
+
+    parser->context = parser->global;
+
+    if (options != NULL)
+        parser->options = *options;
+    else
+        parser_options_init(&parser->options);
+
+    parser->look = lexer_next(lexer);
+    return parser;
+}
+
+parser_t* parser_new_file(const char* filename, const parser_options_t* options)
 {
-    lexer_init_file(filename);
-    look.type = TK_BAD;
-    look.col = 0;
-    look.row = 0;
-    look = lexer_next();
-    context = global_context;
+    lexer_t* lexer = lexer_new_file(filename);
+
+    if (lexer == NULL)
+        return NULL;
+
+    return parser_new(lexer, options);
 }
 
-void parser_stdin()
+parser_t* parser_new_stdin(const parser_options_t* options)
 {
-    lexer_init_stdin();
-    look.type = TK_BAD;
-    look.col = 0;
-    look.row = 0;
-    look = lexer_next();
-    context = global_context;
+    return parser_new(lexer_new_stdin(), options);
 }
 
-void parser_free()
+parser_t* parser_new_string(const char* source, size_t size, const parser_options_t* options)
 {
-    lexer_free();
+    lexer_t* lexer = lexer_new_string(source, size);
+
+    if (lexer == NULL)
+        return NULL;
+
+    return parser_new(lexer, options);
+}
+
+void parser_free(parser_t* parser)
+{
+    arena_free(parser->arena);
+    lexer_free(parser->lexer);
+    free(parser);
+}
+
+context_t* parser_context(parser_t* parser)
+{
+    return parser->global;
 }
 
 int16_t token_prec(token_type_t token_type)
@@ -106,45 +195,45 @@ bool_t is_unary(token_type_t token_type)
     return false;
 }
 
-void match(token_type_t token_type)
+void match(parser_t* parser, token_type_t token_type)
 {
-    if (look.type == token_type)
-        look = lexer_next();
+    if (parser->look.type == token_type)
+        parser->look = lexer_next(parser->lexer);
     else
         panic("Not expected token");
 }
 
-char* peek_ident()
+char* peek_ident(parser_t* parser)
 {
-    if (look.type != TK_IDENT)
+    if (parser->look.type != TK_IDENT)
         panic("An identifier is expected");
 
-    return look.value.as_str;
+    return parser->look.value.as_str;
 }
 
-type_t peek_data_type()
+type_t peek_data_type(parser_t* parser)
 {
-    if (look.type != TK_IDENT)
+    if (parser->look.type != TK_IDENT)
         return MT_UNKNOWN;
 
     for (int i = 0; i < sizeof (BUILTIN_DATATYPES) / sizeof (BUILTIN_DATATYPES[0]); i++)
     {
-        if (strcmp(BUILTIN_DATATYPES[i].name, look.value.as_str) == 0)
+        if (strcmp(BUILTIN_DATATYPES[i].name, parser->look.value.as_str) == 0)
             return BUILTIN_DATATYPES[i].type;
     }
 
     return MT_UNKNOWN;
 }
 
-type_t data_type()
+type_t data_type(parser_t* parser)
 {
-    match(TK_COLON);
+    match(parser, TK_COLON);
 
-    type_t t = peek_data_type();
+    type_t t = peek_data_type(parser);
 
     if (t != MT_UNKNOWN)
     {
-        match(look.type);
+        match(parser, parser->look.type);
         return t;
     }
 
@@ -153,39 +242,39 @@ type_t data_type()
     return MT_UNKNOWN;
 }
 
-ast_t* assign(const char* id)
+ast_t* assign(parser_t* parser, const char* id)
 {
-    symbol_t* s = context_get(context, id, false);
+    symbol_t* s = context_get(parser->context, id, false);
 
     if (s == NULL)
         panic("Identifier is not defined.");
 
-    match(TK_ASSIGN);
+    match(parser, TK_ASSIGN);
 
-    return (ast_t*) ast_new_assign(s, expression());
+    return (ast_t*) ast_new_assign(s, expression(parser));
 }
 
-ast_t* var()
+ast_t* var(parser_t* parser)
 {
-    match(TK_VAR);
+    match(parser, TK_VAR);
 
-    const char* id = peek_ident();
+    const char* id = peek_ident(parser);
 
-    match(TK_IDENT);
+    match(parser, TK_IDENT);
 
     if (builtin_is_reserved(id))
         panic("Cannot use builtin function name as identifier.");
 
-    if (context_get(context, id, true) != NULL)
+    if (context_get(parser->context, id, true) != NULL)
         panic("Identifier is already defined.");
 
-    symbol_t* s = context_add(context, id, MT_UNKNOWN);
+    symbol_t* s = context_add(parser->context, id, MT_UNKNOWN);
 
-    if (look.type == TK_COLON)
-        s->type = data_type();
+    if (parser->look.type == TK_COLON)
+        s->type = data_type(parser);
 
-    if (look.type == TK_ASSIGN)
-        return assign(id);
+    if (parser->look.type == TK_ASSIGN)
+        return assign(parser, id);
 
     if (s->type == MT_UNKNOWN)
         panic("No type declared for the variable.");
@@ -193,21 +282,21 @@ ast_t* var()
     return NULL;
 }
 
-ast_t* ident()
+ast_t* ident(parser_t* parser)
 {
-    const char* id = peek_ident();
+    const char* id = peek_ident(parser);
 
-    match(TK_IDENT);
+    match(parser, TK_IDENT);
 
-    if (look.type == TK_ASSIGN)
-        return assign(id);
+    if (parser->look.type == TK_ASSIGN)
+        return assign(parser, id);
 
     // Check if it's a builtin constant
     const builtin_constant_t* constant = builtin_constant_lookup(id);
     if (constant != NULL)
     {
         // Builtin constants cannot be followed by parentheses (they're not functions)
-        if (look.type == TK_L_PAREN)
+        if (parser->look.type == TK_L_PAREN)
             panic("Builtin constant cannot be called as a function.");
         
         // Create a builtin constant AST node with the appropriate type and opcode
@@ -215,34 +304,36 @@ ast_t* ident()
     }
 
     // Check if it's a function call (builtin or user function)
-    if (look.type == TK_L_PAREN)
-        return func_call(id);
+    if (parser->look.type == TK_L_PAREN)
+        return func_call(parser, id);
 
     // Not a function call, must be a variable
-    if (context_get(context, id, false) == NULL)
+    symbol_t* s = context_get(parser->context, id, false);
+
+    if (s == NULL)
         panic("Identifier is not defined.");
 
-    return (ast_t*) ast_new_variable(context_get(context, id, false));
+    return (ast_t*) ast_new_variable(s);
 }
 
-ast_t* binary_expr(int16_t min_prec, ast_t* lhs)
+ast_t* binary_expr(parser_t* parser, int16_t min_prec, ast_t* lhs)
 {
     while (true)
     {
-        int32_t tok_prec = token_prec(look.type);
+        int32_t tok_prec = token_prec(parser->look.type);
         if (tok_prec < min_prec)
             break;
 
-        token_type_t op = look.type;
+        token_type_t op = parser->look.type;
 
-        match(op);
+        match(parser, op);
 
-        ast_t* rhs = factor();
+        ast_t* rhs = factor(parser);
 
-        int16_t next_prec = token_prec(look.type);
+        int16_t next_prec = token_prec(parser->look.type);
 
         if (tok_prec < next_prec)
-            rhs = binary_expr(tok_prec + 1, rhs);
+            rhs = binary_expr(parser, tok_prec + 1, rhs);
 
         lhs = (ast_t*) ast_new_binary(op, lhs, rhs);
     }
@@ -250,86 +341,86 @@ ast_t* binary_expr(int16_t min_prec, ast_t* lhs)
     return lhs;
 }
 
-ast_t* unary_expr()
+ast_t* unary_expr(parser_t* parser)
 {
-    token_type_t unary_token = look.type;
-    match(unary_token);
-    return (ast_t*) ast_new_unary(unary_token, factor());
+    token_type_t unary_token = parser->look.type;
+    match(parser, unary_token);
+    return (ast_t*) ast_new_unary(unary_token, factor(parser));
 }
 
-ast_t* factor()
+ast_t* factor(parser_t* parser)
 {
     ast_t* node = NULL;
 
-    if (look.type == TK_L_PAREN)
+    if (parser->look.type == TK_L_PAREN)
     {
-        match(TK_L_PAREN);
-        node = expression();
-        match(TK_R_PAREN);
+        match(parser, TK_L_PAREN);
+        node = expression(parser);
+        match(parser, TK_R_PAREN);
     }
-    else if (look.type == TK_IDENT)
+    else if (parser->look.type == TK_IDENT)
     {
-        node = ident();
+        node = ident(parser);
     }
-    else if (look.type == TK_TRUE)
+    else if (parser->look.type == TK_TRUE)
     {
-        match(TK_TRUE);
+        match(parser, TK_TRUE);
         value_t value;
         value.as_int64 = 1;
         node = (ast_t*) ast_new_constant(MT_INT64, value);
     }
-    else if (look.type == TK_FALSE)
+    else if (parser->look.type == TK_FALSE)
     {
-        match(TK_FALSE);
+        match(parser, TK_FALSE);
         value_t value;
         value.as_int64 = 0;
         node = (ast_t*) ast_new_constant(MT_INT64, value);
     }
-    else if (look.type == TK_INT8)
+    else if (parser->look.type == TK_INT8)
     {
         value_t value;
-        value.as_int8 = (int8_t)look.value.as_long;
-        match(TK_INT8);
+        value.as_int8 = (int8_t)parser->look.value.as_long;
+        match(parser, TK_INT8);
         node = (ast_t*) ast_new_constant(MT_INT8, value);
     }
-    else if (look.type == TK_INT16)
+    else if (parser->look.type == TK_INT16)
     {
         value_t value;
-        value.as_int16 = (int16_t)look.value.as_long;
-        match(TK_INT16);
+        value.as_int16 = (int16_t)parser->look.value.as_long;
+        match(parser, TK_INT16);
         node = (ast_t*) ast_new_constant(MT_INT16, value);
     }
-    else if (look.type == TK_INT32)
+    else if (parser->look.type == TK_INT32)
     {
         value_t value;
-        value.as_int32 = (int32_t)look.value.as_long;
-        match(TK_INT32);
+        value.as_int32 = (int32_t)parser->look.value.as_long;
+        match(parser, TK_INT32);
         node = (ast_t*) ast_new_constant(MT_INT32, value);
     }
-    else if (look.type == TK_INT64)
+    else if (parser->look.type == TK_INT64)
     {
         value_t value;
-        value.as_int64 = look.value.as_long;
-        match(TK_INT64);
+        value.as_int64 = parser->look.value.as_long;
+        match(parser, TK_INT64);
         node = (ast_t*) ast_new_constant(MT_INT64, value);
     }
-    else if (look.type == TK_REAL)
+    else if (parser->look.type == TK_REAL)
     {
         value_t value;
-        value.as_real = look.value.as_real;
-        match(TK_REAL);
+        value.as_real = parser->look.value.as_real;
+        match(parser, TK_REAL);
         node = (ast_t*) ast_new_constant(MT_REAL, value);
     }
-    else if (look.type == TK_STR)
+    else if (parser->look.type == TK_STR)
     {
         value_t value;
-        value.as_str = look.value.as_str;
-        match(TK_STR);
+        value.as_str = parser->look.value.as_str;
+        match(parser, TK_STR);
         node = (ast_t*) ast_new_constant(MT_STR, value);
     }
-    else if (is_unary(look.type))
+    else if (is_unary(parser->look.type))
     {
-        node = unary_expr();
+        node = unary_expr(parser);
     }
     else
     {
@@ -339,22 +430,22 @@ ast_t* factor()
     return node;
 }
 
-ast_t* expression()
+ast_t* expression(parser_t* parser)
 {
-    return binary_expr(0, factor());
+    return binary_expr(parser, 0, factor(parser));
 }
 
-ast_t* semicolon()
+ast_t* semicolon(parser_t* parser)
 {
-    match(TK_SEMICOLON);
+    match(parser, TK_SEMICOLON);
     return NULL;
 }
 
-ast_t* block(block_t type, vector_t* params)
+ast_t* block(parser_t* parser, block_t type, vector_t* params)
 {
-    match(TK_L_BRACE);
+    match(parser, TK_L_BRACE);
 
-    context_t* new_context = context_new(context, type);
+    context_t* new_context = context_new(parser->context, type);
     
     if (params != NULL)
     {
@@ -367,85 +458,85 @@ ast_t* block(block_t type, vector_t* params)
 
     ast_block_t* blck = ast_new_block(new_context);
 
-    context = new_context;
+    parser->context = new_context;
 
     vec_append(blck->nodes, NULL);
 
-    while (look.type != TK_R_BRACE)
+    while (parser->look.type != TK_R_BRACE)
     {
-        vec_append(blck->nodes, statement());
+        vec_append(blck->nodes, statement(parser));
     }
 
-    match(TK_R_BRACE);
+    match(parser, TK_R_BRACE);
 
-    context = new_context->parent;
+    parser->context = new_context->parent;
 
     return (ast_t*) blck;
 }
 
-ast_t* func_decl()
+ast_t* func_decl(parser_t* parser)
 {
-    match(TK_FUNC);
+    match(parser, TK_FUNC);
 
-    const char* id = peek_ident();
-    match(TK_IDENT);
+    const char* id = peek_ident(parser);
+    match(parser, TK_IDENT);
 
     if (builtin_is_reserved(id))
         panic("Cannot use builtin function name as identifier.");
 
-    if (context_get(context, id, false) != NULL)
+    if (context_get(parser->context, id, false) != NULL)
         panic("Identifier is already defined.");
 
-    symbol_t* s = context_add(context, id, MT_FUNC);
+    symbol_t* s = context_add(parser->context, id, MT_FUNC);
 
-    match(TK_L_PAREN);
+    match(parser, TK_L_PAREN);
 
-    vector_t* params = vec_new(0);
+    vector_t* params = arena_vec_new();
 
-    while (look.type != TK_R_PAREN)
+    while (parser->look.type != TK_R_PAREN)
     {
-        param_t* param = malloc(sizeof(param_t));
-        param->id = peek_ident();
-        match(TK_IDENT);
+        param_t* param = arena_alloc(sizeof(param_t));
+        param->id = peek_ident(parser);
+        match(parser, TK_IDENT);
         
-        param->type = data_type();
+        param->type = data_type(parser);
 
         vec_append(params, param);
 
-        if (look.type == TK_R_PAREN)
+        if (parser->look.type == TK_R_PAREN)
             break;
-        match(TK_COMMA);
+        match(parser, TK_COMMA);
     }
-    match(TK_R_PAREN);
+    match(parser, TK_R_PAREN);
 
-    type_t ret_type = data_type();
+    type_t ret_type = data_type(parser);
 
     s->type = MT_FUNC;
     s->extra.func.ret_type = ret_type;  // Store return type in symbol
     
     // Store parameter types from params vector (already collected above)
-    s->extra.func.param_types = vec_new(0);
+    s->extra.func.param_types = arena_vec_new();
     for (size_t i = 0; i < vec_size(params); i++)
     {
         param_t* param = vec_get(params, i);
-        type_t* param_type = malloc(sizeof(type_t));
+        type_t* param_type = arena_alloc(sizeof(type_t));
         *param_type = param->type;
         vec_append(s->extra.func.param_types, param_type);
     }
 
-    return (ast_t*) ast_new_func_decl(s, (ast_block_t*) block(MB_FUNC, params), vec_size(params), ret_type);
+    return (ast_t*) ast_new_func_decl(s, (ast_block_t*) block(parser, MB_FUNC, params), vec_size(params), ret_type);
 }
 
-ast_t* func_ret()
+ast_t* func_ret(parser_t* parser)
 {
-    if (context_get_func(context) == NULL)
+    if (context_get_func(parser->context) == NULL)
         panic("Return statement outside of function.");
-    match(TK_RETURN);
+    match(parser, TK_RETURN);
     // according to func return type, expect an expression or nothing
-    return (ast_t*) ast_new_func_return(expression());
+    return (ast_t*) ast_new_func_return(expression(parser));
 }
 
-ast_t* func_call(const char* id)
+ast_t* func_call(parser_t* parser, const char* id)
 {
     // Check for builtin function first
     const builtin_func_t* builtin = builtin_lookup(id);
@@ -453,26 +544,26 @@ ast_t* func_call(const char* id)
     if (builtin != NULL)
     {
         // Builtin function found - create a special symbol for it
-        // We'll use a special addr value (0xFFFF) to mark it as builtin
-        symbol_t* builtin_symbol = malloc(sizeof(symbol_t));
+        // We'll use a special addr value (SYMBOL_BUILTIN_ADDR) to mark it as builtin
+        symbol_t* builtin_symbol = arena_alloc(sizeof(symbol_t));
         builtin_symbol->id = id;
         builtin_symbol->type = MT_FUNC;
         builtin_symbol->extra.func.ret_type = builtin->ret_type;
         builtin_symbol->extra.func.param_types = NULL;  // Builtins don't use param_types for type checking
-        builtin_symbol->addr = 0xFFFF;  // Special marker for builtin functions
+        builtin_symbol->addr = SYMBOL_BUILTIN_ADDR;  // Special marker for builtin functions
         
-        match(TK_L_PAREN);
+        match(parser, TK_L_PAREN);
 
-        vector_t* args = vec_new(0);
+        vector_t* args = arena_vec_new();
 
-        while (look.type != TK_R_PAREN)
+        while (parser->look.type != TK_R_PAREN)
         {
-            vec_append(args, expression());
-            if (look.type == TK_R_PAREN)
+            vec_append(args, expression(parser));
+            if (parser->look.type == TK_R_PAREN)
                 break;
-            match(TK_COMMA);
+            match(parser, TK_COMMA);
         }
-        match(TK_R_PAREN);
+        match(parser, TK_R_PAREN);
         
         // Validate argument count (255 means variadic, skip check)
         if (builtin->arg_count != 255 && vec_size(args) != builtin->arg_count)
@@ -483,125 +574,200 @@ ast_t* func_call(const char* id)
         return (ast_t*) ast_new_func_call(builtin_symbol, args);
     }
     
-    // Not a builtin, check context
-    symbol_t* s = context_get(context, id, false);
+    // Not a builtin, check parser->context
+    symbol_t* s = context_get(parser->context, id, false);
 
     if (s == NULL)
         panic("Identifier is not defined.");
 
-    match(TK_L_PAREN);
+    match(parser, TK_L_PAREN);
 
-    vector_t* args = vec_new(0);
+    vector_t* args = arena_vec_new();
 
-    while (look.type != TK_R_PAREN)
+    while (parser->look.type != TK_R_PAREN)
     {
-        vec_append(args, expression());
-        if (look.type == TK_R_PAREN)
+        vec_append(args, expression(parser));
+        if (parser->look.type == TK_R_PAREN)
             break;
-        match(TK_COMMA);
+        match(parser, TK_COMMA);
     }
-    match(TK_R_PAREN);
+    match(parser, TK_R_PAREN);
 
     return (ast_t*) ast_new_func_call(s, args);
 }
 
-ast_t* if_cond()
+ast_t* if_cond(parser_t* parser)
 {
-    match(TK_IF);
-    ast_t* condition = expression();
-    ast_t* if_then = block(MB_NORMAL, NULL);
+    match(parser, TK_IF);
+    ast_t* condition = expression(parser);
+    ast_t* if_then = block(parser, MB_NORMAL, NULL);
     ast_t* if_else = NULL;
-    if (look.type == TK_ELSE)
+    if (parser->look.type == TK_ELSE)
     {
-        match(TK_ELSE);
-        if (look.type == TK_IF)
-            if_else = if_cond();
+        match(parser, TK_ELSE);
+        if (parser->look.type == TK_IF)
+            if_else = if_cond(parser);
         else
-            if_else = block(MB_NORMAL, NULL);
+            if_else = block(parser, MB_NORMAL, NULL);
     }
     return (ast_t*) ast_new_if_cond(condition, if_then, if_else);
 }
 
-ast_t* for_loop()
+ast_t* for_loop(parser_t* parser)
 {
-    context_t* new_context = context_new(context, MB_NORMAL);
-    context = new_context;
+    context_t* new_context = context_new(parser->context, MB_NORMAL);
+    parser->context = new_context;
 
-    match(TK_FOR);
-    ast_t* init = look.type == TK_VAR? var() : expression();
-    match(TK_SEMICOLON);
-    ast_t* condition = expression();
-    match(TK_SEMICOLON);
-    ast_t* post = expression();
+    match(parser, TK_FOR);
+    ast_t* init = parser->look.type == TK_VAR? var(parser) : expression(parser);
+    match(parser, TK_SEMICOLON);
+    ast_t* condition = expression(parser);
+    match(parser, TK_SEMICOLON);
+    ast_t* post = expression(parser);
 
-    ast_block_t* for_block = (ast_block_t*) ast_new_for_loop(init, condition, post, block(MB_LOOP, NULL));
+    ast_block_t* for_block = (ast_block_t*) ast_new_for_loop(init, condition, post, block(parser, MB_LOOP, NULL));
 
-    context = new_context->parent;
+    parser->context = new_context->parent;
 
     return (ast_t*) for_block;
 }
 
-ast_t* break_loop()
+ast_t* break_loop(parser_t* parser)
 {
-    if (context_get_loop(context) == NULL)
+    if (context_get_loop(parser->context) == NULL)
         panic("Break statement outside of loop.");
-    match(TK_BREAK);
-    return (ast_t*) ast_new_break_loop(context_get_loop(context));
+    match(parser, TK_BREAK);
+    return (ast_t*) ast_new_break_loop(context_get_loop(parser->context));
 }
 
-ast_t* continue_loop()
+ast_t* continue_loop(parser_t* parser)
 {
-    if (context_get_loop(context) == NULL)
+    if (context_get_loop(parser->context) == NULL)
         panic("Continue statement outside of loop.");
-    match(TK_CONTINUE);
-    return (ast_t*) ast_new_continue_loop(context_get_loop(context));
+    match(parser, TK_CONTINUE);
+    return (ast_t*) ast_new_continue_loop(context_get_loop(parser->context));
 }
 
-ast_t* statement()
+ast_t* statement(parser_t* parser)
 {
-    switch (look.type)
+    switch (parser->look.type)
     {
     case TK_SEMICOLON:
-        return semicolon();
+        return semicolon(parser);
     case TK_VAR:
-        return var();
+        return var(parser);
     case TK_IF:
-        return if_cond();
+        return if_cond(parser);
     case TK_L_BRACE:
-        return block(MB_NORMAL, NULL);
+        return block(parser, MB_NORMAL, NULL);
     case TK_FOR:
-        return for_loop();
+        return for_loop(parser);
     case TK_FUNC:
-        return func_decl();
+        return func_decl(parser);
     case TK_BREAK:
-        return break_loop();
+        return break_loop(parser);
     case TK_CONTINUE:
-        return continue_loop();
+        return continue_loop(parser);
     case TK_RETURN:
-        return func_ret();
+        return func_ret(parser);
     default:
-        return expression();
+        return expression(parser);
     }
 }
 
-void parser_start(bool_t execute, const char* dasm_filename)
+static bool_t start(parser_t* parser, bool_t execute, const char* dasm_filename)
 {
-    vm_init(2048, 512);
+    parser_options_t* options = &parser->options;
+
+    vm_init(512);
+
+    ast_block_t* block = ast_new_block(parser->global);
+
+    while (parser->look.type != TK_FIN)
+        vec_append(block->nodes, statement(parser));
+
+    fold_program(block);
+
+    if (options->inlining)
+        inline_program(block, INLINE_MAX_NODES);
+
+    loop_optimize_program(block);
 
-    ast_block_t* block = ast_new_block(global_context);
+    if (options->dead_code)
+        dce_program(block);
 
-    while (look.type != TK_FIN)
-        vec_append(block->nodes, statement());
+    ir_module_t* ir = NULL;
 
-    eval((ast_t*) block);
+    if (options->dump_ir_filename != NULL || (options->use_ir && options->backend != BACKEND_REGISTER))
+        ir = build_ir(parser, block);
+
+    if (options->backend == BACKEND_REGISTER)
+    {
+        if (ir != NULL)
+            ir_free(ir);
+
+        rvm_init(options->stack_size != 0 ? options->stack_size : VM_STACK_SIZE);
+        rgen_program(block);
+
+        if (dasm_filename != NULL)
+            rvm_dasm(dasm_filename);
+
+        const char* error = execute ? rvm_exec() : NULL;
+        if (error != NULL)
+            fprintf(stderr, "Error: %s\n", error);
+
+        rvm_free();
+        return error == NULL;
+    }
+
+    if (options->backend == BACKEND_JIT)
+        vm_enable_jit();
+
+    if (options->use_ir)
+        ir_lower(ir);
+    else
+        eval((ast_t*) block);
+
+    if (ir != NULL)
+        ir_free(ir);
+
+    if (options->peephole)
+    {
+        size_t before = vm_code_addr();
+        size_t saved = vm_optimize();
+
+        if (options->peephole_report)
+            fprintf(stderr, "peephole: %zu -> %zu bytes, %zu saved\n",
+                    before, before - saved, saved);
+    }
+    else
+    {
+        vm_narrow();
+    }
 
     if (dasm_filename != NULL)
     {
         vm_dasm(dasm_filename);
     }
     
-    if (execute)
-    {
-        vm_exec();
-    }
+    if (!execute)
+        return true;
+
+    vm_t* machine = vm_new(options->stack_size);
+    vm_exec(machine);
+
+    const char* error = vm_error(machine);
+    if (error != NULL)
+        fprintf(stderr, "Error: %s\n", error);
+
+    vm_free(machine);
+    return error == NULL;
+}
+
+bool_t parser_start(parser_t* parser, bool_t execute, const char* dasm_filename)
+{
+    arena_enter(parser->arena);
+    bool_t ok = start(parser, execute, dasm_filename);
+    arena_leave(parser->arena);
+    return ok;
 }
@@ -2,16 +2,48 @@
 #define PARSER_H
 
 #include "types.h"
+#include "context.h"
 
 #ifdef __cplusplus
 extern "C"
 {
 #endif
 
-void parser_load(const char* filename);
-void parser_stdin();
-void parser_free();
-void parser_start(bool_t execute, const char* dasm_filename);
+typedef enum
+{
+    BACKEND_STACK,      // vm.h, code generated by ast.c
+    BACKEND_REGISTER,   // rvm.h, code generated by rgen.c
+    BACKEND_JIT,        // vm.h with compiled functions run natively (jit.h)
+} backend_t;
+
+typedef struct
+{
+    backend_t backend;
+    bool_t peephole;
+    bool_t peephole_report;     // Report the bytes the peephole optimizer saves
+    bool_t inlining;
+    bool_t dead_code;
+    bool_t use_ir;              // Generate stack VM code through the SSA IR
+    const char* dump_ir_filename;
+    size_t stack_size;          // Values on the stack of the run, 0 for the default
+} parser_options_t;
+
+// A compilation session: it owns the lexer, the current token and the
+// scopes of one program. Separate sessions can compile on separate threads.
+typedef struct parser_t parser_t;
+
+void parser_options_init(parser_options_t* options);
+// NULL when the file cannot be opened. NULL options are the defaults.
+parser_t* parser_new_file(const char* filename, const parser_options_t* options);
+parser_t* parser_new_stdin(const parser_options_t* options);
+// Compiles `size` bytes of `source`, which must outlive the session
+parser_t* parser_new_string(const char* source, size_t size, const parser_options_t* options);
+void parser_free(parser_t* parser);
+// The global scope of the program
+context_t* parser_context(parser_t* parser);
+// Compiles the program and, with `execute`, runs it. False when the run
+// stopped on an error, which is reported on stderr.
+bool_t parser_start(parser_t* parser, bool_t execute, const char* dasm_filename);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,365 @@
+#include "peephole.h"
+#include "vm.h"
+#include "panic.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// An instruction of the code being optimized. Jump and call targets are
+// kept as instruction indices, so deleting instructions never invalidates
+// them: a deleted instruction stands for the next live one after it. Ops
+// are kept in their short form, and `wide` says which one encode writes.
+typedef struct
+{
+    uint8_t op;
+    uint8_t args[8];
+    uint32_t target;    // Destination of jumps and calls
+    uint32_t addr;      // Offset in the optimized code
+    bool_t dead;
+    bool_t label;       // Destination of some live jump or call
+    bool_t wide;        // Its target does not fit 16 bits
+} peep_insn_t;
+
+typedef struct
+{
+    peep_insn_t* insns; // count instructions and one trailing end marker
+    size_t count;
+} peep_t;
+
+static size_t arg_size(uint8_t op)
+{
+    return op < OPCODES_COUNT ? OPCODES[op].arg_size : 0;
+}
+
+static bool_t has_target(uint8_t op)
+{
+    return vm_target_size(op) != 0;
+}
+
+// Bytes of an instruction as encoded
+static size_t insn_size(const peep_insn_t* insn)
+{
+    return arg_size(insn->wide ? vm_wide_op(insn->op) : insn->op) + 1;
+}
+
+static bool_t falls_through(uint8_t op)
+{
+    return op != JMP && op != RET && op != HALT && op != TAILCALL;
+}
+
+static bool_t is_cast(uint8_t op)
+{
+    return op >= I8CAST && op <= I32CAST;
+}
+
+// Whether the constant pushed by `op` already fits the cast `cast`
+static bool_t fits_cast(uint8_t op, uint8_t cast)
+{
+    if (op == ICONST_0 || op == ICONST_1)
+        return true;
+    return op >= I8CONST && op <= I32CONST && op - I8CONST <= cast - I8CAST;
+}
+
+static uint16_t operand16(const uint8_t* bytes)
+{
+    return bytes[0] | (bytes[1] << 8);
+}
+
+static uint32_t operand32(const uint8_t* bytes)
+{
+    return bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | ((uint32_t) bytes[3] << 24);
+}
+
+static void decode(peep_t* p, const buffer_t* code)
+{
+    size_t size = code->used;
+    uint32_t* index = malloc(sizeof (uint32_t) * (size + 1));
+
+    p->count = 0;
+    for (size_t i = 0; i < size; i += arg_size(code->data[i]) + 1)
+        index[i] = p->count++;
+    index[size] = p->count;
+
+    p->insns = calloc(p->count + 1, sizeof (peep_insn_t));
+    p->insns[p->count].op = HALT;
+
+    for (size_t i = 0, n = 0; i < size; i += arg_size(code->data[i]) + 1, n++)
+    {
+        peep_insn_t* insn = &p->insns[n];
+        uint8_t op = code->data[i];
+        uint8_t width = vm_target_size(op);
+        const uint8_t* bytes = code->data + i + 1;
+
+        insn->op = vm_short_op(op);
+
+        if (width != 0)
+        {
+            // The operands after the target move to where the short form
+            // has them
+            uint32_t addr = width == 4 ? operand32(bytes) : operand16(bytes);
+            if (addr > size)
+                panic("Bad jump target");
+            insn->target = index[addr];
+            memcpy(insn->args + 2, bytes + width, arg_size(op) - width);
+        }
+        else
+        {
+            memcpy(insn->args, bytes, arg_size(op));
+        }
+    }
+
+    free(index);
+}
+
+static uint32_t next_live(peep_t* p, uint32_t i)
+{
+    while (i < p->count && p->insns[i].dead)
+        ++i;
+    return i;
+}
+
+static void find_labels(peep_t* p)
+{
+    for (size_t i = 0; i <= p->count; i++)
+        p->insns[i].label = false;
+
+    for (size_t i = 0; i < p->count; i++)
+        if (!p->insns[i].dead && has_target(p->insns[i].op))
+            p->insns[next_live(p, p->insns[i].target)].label = true;
+}
+
+// Retargets a jump whose destination is another JMP to the final
+// destination of the chain. Loops of JMPs are left alone.
+static bool_t thread_jump(peep_t* p, peep_insn_t* insn)
+{
+    uint32_t target = next_live(p, insn->target);
+
+    for (size_t hops = 0; hops < p->count && p->insns[target].op == JMP; hops++)
+        target = next_live(p, p->insns[target].target);
+
+    if (p->insns[target].op == JMP || target == insn->target)
+        return false;
+
+    insn->target = target;
+    return true;
+}
+
+// Rewrites the pair at `i` and the next live instruction. The second one
+// is only ever deleted when nothing jumps to it.
+static bool_t combine(peep_t* p, uint32_t i)
+{
+    peep_insn_t* insn = &p->insns[i];
+    uint32_t j = next_live(p, i + 1);
+    peep_insn_t* next = &p->insns[j];
+
+    if (insn->op == JMP && next_live(p, insn->target) == j)
+    {
+        insn->dead = true;
+        return true;
+    }
+
+    if (j == p->count || next->label)
+        return false;
+
+    // A cast chain keeps only its narrowest cast
+    if (is_cast(insn->op) && is_cast(next->op))
+    {
+        if (next->op < insn->op)
+            insn->op = next->op;
+        next->dead = true;
+        return true;
+    }
+
+    // A constant that already fits the cast
+    if (is_cast(next->op) && fits_cast(insn->op, next->op))
+    {
+        next->dead = true;
+        return true;
+    }
+
+    if (insn->op == ISTORE && next->op == ILOAD
+        && operand16(insn->args) == operand16(next->args))
+    {
+        insn->op = ISTORE_ILOAD;
+        next->dead = true;
+        return true;
+    }
+
+    return false;
+}
+
+// Deletes every instruction that is not reachable from the first one.
+// This covers the ICONST_0, RET closing a function that already returned
+// and the bodies of functions that are never called.
+static bool_t remove_unreachable(peep_t* p)
+{
+    bool_t* reached = calloc(p->count + 1, sizeof (bool_t));
+    uint32_t* work = malloc(sizeof (uint32_t) * (p->count + 1));
+    size_t pending = 0;
+    bool_t changed = false;
+
+    work[pending++] = next_live(p, 0);
+    reached[work[0]] = true;
+
+    while (pending > 0)
+    {
+        uint32_t i = work[--pending];
+        peep_insn_t* insn = &p->insns[i];
+        uint32_t succ[2];
+        size_t n = 0;
+
+        if (i == p->count)
+            continue;
+
+        if (falls_through(insn->op))
+            succ[n++] = next_live(p, i + 1);
+        if (has_target(insn->op))
+            succ[n++] = next_live(p, insn->target);
+
+        for (size_t s = 0; s < n; s++)
+        {
+            if (!reached[succ[s]])
+            {
+                reached[succ[s]] = true;
+                work[pending++] = succ[s];
+            }
+        }
+    }
+
+    for (size_t i = 0; i < p->count; i++)
+    {
+        if (!p->insns[i].dead && !reached[i])
+        {
+            p->insns[i].dead = true;
+            changed = true;
+        }
+    }
+
+    free(work);
+    free(reached);
+    return changed;
+}
+
+static void place(peep_t* p)
+{
+    size_t addr = 0;
+
+    for (size_t i = 0; i <= p->count; i++)
+    {
+        p->insns[i].addr = addr;
+        if (i < p->count && !p->insns[i].dead)
+            addr += insn_size(&p->insns[i]);
+    }
+}
+
+// Every jump and call starts short. One whose target ends up past 16 bits
+// is widened, which only moves code further, so this stops once no more
+// need widening.
+static void encode(peep_t* p, buffer_t* code)
+{
+    bool_t widened = true;
+
+    for (size_t i = 0; i < p->count; i++)
+        p->insns[i].wide = false;
+
+    while (widened)
+    {
+        widened = false;
+        place(p);
+
+        for (size_t i = 0; i < p->count; i++)
+        {
+            peep_insn_t* insn = &p->insns[i];
+
+            if (!insn->dead && has_target(insn->op) && !insn->wide
+                && p->insns[insn->target].addr > UINT16_MAX)
+            {
+                insn->wide = true;
+                widened = true;
+            }
+        }
+    }
+
+    code->used = 0;
+
+    for (size_t i = 0; i < p->count; i++)
+    {
+        peep_insn_t* insn = &p->insns[i];
+
+        if (insn->dead)
+            continue;
+
+        if (has_target(insn->op))
+        {
+            uint32_t target = p->insns[insn->target].addr;
+
+            if (insn->wide)
+            {
+                uint8_t wide[] = { vm_wide_op(insn->op), NUM32(target) };
+                buffer_adds(code, wide, sizeof (wide));
+            }
+            else
+            {
+                uint8_t narrow[] = { insn->op, NUM16(target) };
+                buffer_adds(code, narrow, sizeof (narrow));
+            }
+
+            buffer_adds(code, insn->args + 2, arg_size(insn->op) - 2);
+            continue;
+        }
+
+        buffer_add(code, insn->op);
+        buffer_adds(code, insn->args, arg_size(insn->op));
+    }
+}
+
+size_t peephole_narrow(buffer_t* code)
+{
+    size_t before = code->used;
+    peep_t p;
+
+    if (before == 0)
+        return 0;
+
+    decode(&p, code);
+    encode(&p, code);
+    free(p.insns);
+
+    return before - code->used;
+}
+
+size_t peephole_optimize(buffer_t* code)
+{
+    size_t before = code->used;
+    peep_t p;
+    bool_t changed;
+
+    if (before == 0)
+        return 0;
+
+    decode(&p, code);
+
+    do
+    {
+        changed = remove_unreachable(&p);
+        find_labels(&p);
+
+        for (uint32_t i = 0; i < p.count; i++)
+        {
+            peep_insn_t* insn = &p.insns[i];
+
+            if (insn->dead)
+                continue;
+
+            if (has_target(insn->op) && insn->op != CALL && insn->op != TAILCALL)
+                changed |= thread_jump(&p, insn);
+
+            changed |= combine(&p, i);
+        }
+    } while (changed);
+
+    encode(&p, code);
+    free(p.insns);
+
+    return before - code->used;
+}
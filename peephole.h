@@ -0,0 +1,26 @@
+#ifndef PEEPHOLE_H
+#define PEEPHOLE_H
+
+#include "buffer.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+// Peephole optimizer over the bytecode that ast.c leaves in a code buffer.
+// It narrows cast chains, fuses ISTORE x; ILOAD x into ISTORE_ILOAD,
+// threads jumps to jumps, drops jumps to the next instruction and deletes
+// code that cannot be reached. Jump and call targets are relocated, so it
+// must run before the code is translated or executed. Jumps and calls get
+// their short form (vm.h) wherever the target fits. Returns the number of
+// bytes saved.
+size_t peephole_optimize(buffer_t* code);
+// Only picks the short forms, as peephole_optimize does
+size_t peephole_narrow(buffer_t* code);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PEEPHOLE_H */
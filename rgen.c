@@ -0,0 +1,852 @@
+#include "rgen.h"
+#include "rvm.h"
+#include "vm.h"
+#include "panic.h"
+#include "utf8.h"
+#include "builtin.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Register allocation: a variable lives in the slot context.c assigned to
+// it, so reading it costs no instruction. Temporaries are handed out like a
+// stack above the last variable of the frame and released after every
+// statement; frame_size records the high-water mark for ENTER.
+
+#define ANY_SLOT (-1)
+
+static _Thread_local uint16_t temp_top;
+static _Thread_local uint16_t frame_size;
+
+static uint16_t gen(ast_t* ast, int32_t dst, type_t* type);
+
+static value_t value_int(int64_t x)
+{
+    value_t value;
+    value.as_int64 = x;
+    return value;
+}
+
+static size_t emit(uint8_t op, uint16_t a, uint16_t b, uint16_t c)
+{
+    return rvm_emit(op, a, b, c, value_int(0));
+}
+
+static size_t emit_k(uint8_t op, uint16_t a, uint16_t b, value_t k)
+{
+    return rvm_emit(op, a, b, 0, k);
+}
+
+static void patch(size_t insn, size_t target)
+{
+    rvm_insn(insn)->k.as_uint64 = target;
+}
+
+static uint16_t alloc_temp()
+{
+    uint16_t slot = temp_top++;
+    if (temp_top > frame_size)
+        frame_size = temp_top;
+    return slot;
+}
+
+static uint16_t target_slot(int32_t dst)
+{
+    return dst == ANY_SLOT ? alloc_temp() : (uint16_t) dst;
+}
+
+// Evaluates an expression into a given slot
+static type_t gen_into(ast_t* ast, uint16_t slot)
+{
+    type_t type;
+    uint16_t out = gen(ast, slot, &type);
+    if (out != slot)
+        emit(REG_MOV, slot, out, 0);
+    return type;
+}
+
+static void emit_conversion(type_t from, type_t to, uint16_t slot)
+{
+    if (from == to) return;
+    switch (to) {
+        case MT_INT8:  emit(REG_I8CAST, slot, slot, 0); break;
+        case MT_INT16: emit(REG_I16CAST, slot, slot, 0); break;
+        case MT_INT32: emit(REG_I32CAST, slot, slot, 0); break;
+        default: break;
+    }
+}
+
+// Jumps to a label (of a loop or a short-circuit branch) go through a
+// jump_t, as in ast.c, but record register instruction indices instead of
+// byte offsets
+static void loop_jump_to(jump_t* jump)
+{
+    size_t* insn = malloc(sizeof(size_t));
+    *insn = emit(REG_JMP, 0, 0, 0);
+    vec_append(jump->jumps, insn);
+}
+
+static void loop_jump_fix(jump_t* jump, size_t target)
+{
+    for (size_t i = 0; i < vec_size(jump->jumps); i++)
+        patch(*((size_t*)vec_get(jump->jumps, i)), target);
+}
+
+static uint16_t gen_constant(ast_constant_t* ast, int32_t dst, type_t* type)
+{
+    uint16_t out = target_slot(dst);
+    value_t k = ast->value;
+
+    *type = ast->type;
+
+    if (ast->opcode == RCONST_PI)
+    {
+        k.as_real = 3.14159265358979323846;
+    }
+    else if (ast->opcode != 0)
+    {
+        panic("Unknown builtin constant.");
+    }
+    else if (is_integer_type(ast->type))
+    {
+        k = value_int(integer_value(ast->type, ast->value));
+        *type = MT_INT64;
+    }
+    else if (ast->type == MT_STR)
+    {
+        k.as_uint64 = rvm_data_addr();
+        rvm_data_emit((uint8_t*)ast->value.as_str, utf8size((utf8_int8_t*)ast->value.as_str));
+    }
+
+    emit_k(REG_LOADK, out, 0, k);
+    return out;
+}
+
+static uint16_t gen_unary(ast_unary_t* ast, int32_t dst, type_t* type)
+{
+    uint16_t mark = temp_top;
+    uint16_t in = gen(ast->expr, ANY_SLOT, type);
+    temp_top = mark;
+
+    if (is_integer_type(*type))
+    {
+        *type = MT_INT64;
+        switch (ast->op)
+        {
+        case TK_MINUS:
+        {
+            uint16_t out = target_slot(dst);
+            emit(REG_INEG, out, in, 0);
+            return out;
+        }
+        case TK_NOT:
+        {
+            uint16_t out = target_slot(dst);
+            emit(REG_INOT, out, in, 0);
+            return out;
+        }
+        default:
+            return in;
+        }
+    }
+    else if (*type == MT_REAL)
+    {
+        if (ast->op == TK_MINUS)
+        {
+            uint16_t out = target_slot(dst);
+            emit(REG_RNEG, out, in, 0);
+            return out;
+        }
+        return in;
+    }
+
+    panic("Unary error");
+
+    return 0;
+}
+
+static uint8_t integer_opcode(token_type_t op)
+{
+    switch (op)
+    {
+    case TK_PLUS:    return REG_IADD;
+    case TK_MINUS:   return REG_ISUB;
+    case TK_MUL:     return REG_IMUL;
+    case TK_DIV:     return REG_IDIV;
+    case TK_MOD:     return REG_IMOD;
+    case TK_EQ:      return REG_IEQ;
+    case TK_NE:      return REG_INQ;
+    case TK_LT:      return REG_ILT;
+    case TK_LTE:     return REG_ILE;
+    case TK_GT:      return REG_IGT;
+    case TK_GTE:     return REG_IGE;
+    case TK_AND_BIT: return REG_IBAND;
+    case TK_OR_BIT:  return REG_IBOR;
+    case TK_XOR_BIT: return REG_IBXOR;
+    case TK_SHL:     return REG_ISHL;
+    case TK_SHR:     return REG_ISHR;
+    default:         return REG_NOP;
+    }
+}
+
+static uint8_t real_opcode(token_type_t op)
+{
+    switch (op)
+    {
+    case TK_PLUS:  return REG_RADD;
+    case TK_MINUS: return REG_RSUB;
+    case TK_MUL:   return REG_RMUL;
+    case TK_DIV:   return REG_RDIV;
+    case TK_MOD:   return REG_RMOD;
+    case TK_EQ:    return REG_REQ;
+    case TK_NE:    return REG_RNQ;
+    case TK_LT:    return REG_RLT;
+    case TK_LTE:   return REG_RLE;
+    case TK_GT:    return REG_RGT;
+    case TK_GTE:   return REG_RGE;
+    default:       return REG_NOP;
+    }
+}
+
+static uint8_t compare_jez_opcode(token_type_t op)
+{
+    switch (op)
+    {
+    case TK_GT:  return REG_IGT_JEZ;
+    case TK_LT:  return REG_ILT_JEZ;
+    case TK_GTE: return REG_IGE_JEZ;
+    case TK_LTE: return REG_ILE_JEZ;
+    case TK_EQ:  return REG_IEQ_JEZ;
+    case TK_NE:  return REG_INQ_JEZ;
+    default:     return REG_NOP;
+    }
+}
+
+static uint8_t real_compare_jez_opcode(token_type_t op)
+{
+    switch (op)
+    {
+    case TK_GT:  return REG_RGT_JEZ;
+    case TK_LT:  return REG_RLT_JEZ;
+    case TK_GTE: return REG_RGE_JEZ;
+    case TK_LTE: return REG_RLE_JEZ;
+    case TK_EQ:  return REG_REQ_JEZ;
+    case TK_NE:  return REG_RNQ_JEZ;
+    default:     return REG_NOP;
+    }
+}
+
+// Integer constant operand of `x + k` and `x - k`, folded into IADDK
+static bool_t is_addk(ast_binary_t* ast, int64_t* k)
+{
+    if (ast->op != TK_PLUS && ast->op != TK_MINUS)
+        return false;
+
+    if (!integer_constant(ast->rhs_expr, k))
+        return false;
+
+    if (ast->op == TK_MINUS)
+        *k = -*k;
+
+    return true;
+}
+
+static uint16_t gen_logical(ast_binary_t* ast, int32_t dst, type_t* type);
+
+static uint16_t gen_binary(ast_binary_t* ast, int32_t dst, type_t* type)
+{
+    if (ast->op == TK_AND || ast->op == TK_OR)
+        return gen_logical(ast, dst, type);
+
+    uint16_t mark = temp_top;
+    type_t l_type;
+    type_t r_type;
+    uint16_t lhs = gen(ast->lhs_expr, ANY_SLOT, &l_type);
+
+    int64_t k;
+
+    if (is_integer_type(l_type) && is_addk(ast, &k))
+    {
+        temp_top = mark;
+        uint16_t out = target_slot(dst);
+        rvm_emit(REG_IADDK, out, lhs, 0, value_int(k));
+        *type = MT_INT64;
+        return out;
+    }
+
+    uint16_t rhs = gen(ast->rhs_expr, ANY_SLOT, &r_type);
+    temp_top = mark;
+
+    uint8_t op = REG_NOP;
+
+    if (is_integer_type(l_type) && is_integer_type(r_type))
+    {
+        op = integer_opcode(ast->op);
+        *type = MT_INT64;
+    }
+    else if (l_type == MT_REAL && r_type == MT_REAL)
+    {
+        op = real_opcode(ast->op);
+        *type = MT_REAL;
+    }
+
+    if (op == REG_NOP)
+        panic("Binary error");
+
+    uint16_t out = target_slot(dst);
+    emit(op, out, lhs, rhs);
+    return out;
+}
+
+static uint16_t gen_assign(ast_assign_t* ast, type_t* type)
+{
+    uint16_t addr = ast->symbol->addr;
+    type_t expr_type;
+    uint16_t out = gen(ast->expr, addr, &expr_type);
+    type_t var_type = ast->symbol->type;
+
+    // If variable type is unknown, infer from expression
+    if (var_type == MT_UNKNOWN) {
+        var_type = expr_type;
+        ast->symbol->type = var_type;
+    }
+
+    if (expr_type != var_type && !(is_integer_type(expr_type) && is_integer_type(var_type)))
+        panic("Assignment type mismatch");
+
+    if (out != addr)
+        emit(REG_MOV, addr, out, 0);
+
+    if (is_integer_type(var_type))
+        emit_conversion(MT_INT64, var_type, addr);
+
+    *type = var_type;
+    return addr;
+}
+
+static void gen_statements(ast_block_t* ast)
+{
+    for (size_t i = 0; i < vec_size(ast->nodes); i++)
+    {
+        uint16_t mark = temp_top;
+        type_t type;
+        gen(vec_get(ast->nodes, i), ANY_SLOT, &type);
+        temp_top = mark;
+    }
+}
+
+static bool_t is_logical(ast_t* ast, token_type_t op)
+{
+    return is_kind(ast, eval_binary) && ((ast_binary_t*) ast)->op == op;
+}
+
+static void jump_record(jump_t* jump, size_t insn)
+{
+    size_t* at = malloc(sizeof(size_t));
+    *at = insn;
+    vec_append(jump->jumps, at);
+}
+
+static void gen_jump_if_true(ast_t* condition, jump_t* target);
+
+// Emits a condition and branches taken when it is false, recorded in
+// `target` for loop_jump_fix. `and` and `or` short-circuit as in ast.c.
+static void gen_jump_if_false(ast_t* condition, jump_t* target)
+{
+    uint16_t mark = temp_top;
+    type_t type;
+
+    if (is_logical(condition, TK_AND))
+    {
+        check_logical((ast_binary_t*) condition);
+        gen_jump_if_false(((ast_binary_t*) condition)->lhs_expr, target);
+        gen_jump_if_false(((ast_binary_t*) condition)->rhs_expr, target);
+        return;
+    }
+
+    if (is_logical(condition, TK_OR))
+    {
+        check_logical((ast_binary_t*) condition);
+        jump_t* taken = jump_new();
+        gen_jump_if_true(((ast_binary_t*) condition)->lhs_expr, taken);
+        gen_jump_if_false(((ast_binary_t*) condition)->rhs_expr, target);
+        loop_jump_fix(taken, rvm_code_addr());
+        jump_free(taken);
+        return;
+    }
+
+    if (is_kind(condition, eval_binary))
+    {
+        ast_binary_t* binary = (ast_binary_t*) condition;
+        type_t l_type = infer_type(binary->lhs_expr);
+        type_t r_type = infer_type(binary->rhs_expr);
+        uint8_t op = REG_NOP;
+
+        if (is_integer_type(l_type) && is_integer_type(r_type))
+            op = compare_jez_opcode(binary->op);
+        else if (l_type == MT_REAL && r_type == MT_REAL)
+            op = real_compare_jez_opcode(binary->op);
+
+        if (op != REG_NOP)
+        {
+            uint16_t lhs = gen(binary->lhs_expr, ANY_SLOT, &type);
+            uint16_t rhs = gen(binary->rhs_expr, ANY_SLOT, &type);
+            temp_top = mark;
+            jump_record(target, emit(op, lhs, rhs, 0));
+            return;
+        }
+    }
+
+    uint16_t slot = gen(condition, ANY_SLOT, &type);
+    temp_top = mark;
+    jump_record(target, emit(type == MT_REAL ? REG_RJEZ : REG_JEZ, slot, 0, 0));
+}
+
+static void gen_jump_if_true(ast_t* condition, jump_t* target)
+{
+    uint16_t mark = temp_top;
+    type_t type;
+
+    if (is_logical(condition, TK_OR))
+    {
+        check_logical((ast_binary_t*) condition);
+        gen_jump_if_true(((ast_binary_t*) condition)->lhs_expr, target);
+        gen_jump_if_true(((ast_binary_t*) condition)->rhs_expr, target);
+        return;
+    }
+
+    if (is_logical(condition, TK_AND))
+    {
+        check_logical((ast_binary_t*) condition);
+        jump_t* skip = jump_new();
+        gen_jump_if_false(((ast_binary_t*) condition)->lhs_expr, skip);
+        gen_jump_if_true(((ast_binary_t*) condition)->rhs_expr, target);
+        loop_jump_fix(skip, rvm_code_addr());
+        jump_free(skip);
+        return;
+    }
+
+    uint16_t slot = gen(condition, ANY_SLOT, &type);
+    temp_top = mark;
+    jump_record(target, emit(type == MT_REAL ? REG_RJNZ : REG_JNZ, slot, 0, 0));
+}
+
+// `and` and `or` as values: the short-circuit branches select 1 or 0
+static uint16_t gen_logical(ast_binary_t* ast, int32_t dst, type_t* type)
+{
+    uint16_t out = target_slot(dst);
+    jump_t* is_false = jump_new();
+
+    gen_jump_if_false((ast_t*) ast, is_false);
+
+    emit_k(REG_LOADK, out, 0, value_int(1));
+    size_t exit_jump = emit(REG_JMP, 0, 0, 0);
+
+    loop_jump_fix(is_false, rvm_code_addr());
+    emit_k(REG_LOADK, out, 0, value_int(0));
+
+    patch(exit_jump, rvm_code_addr());
+
+    jump_free(is_false);
+    *type = MT_INT64;
+    return out;
+}
+
+static void gen_if_cond(ast_if_cond_t* ast)
+{
+    type_t type;
+    jump_t* else_jump = jump_new();
+
+    gen_jump_if_false(ast->condition, else_jump);
+
+    gen(ast->if_then, ANY_SLOT, &type);
+
+    if (ast->if_else == NULL)
+    {
+        loop_jump_fix(else_jump, rvm_code_addr());
+        jump_free(else_jump);
+        return;
+    }
+
+    size_t exit_jump = emit(REG_JMP, 0, 0, 0);
+
+    loop_jump_fix(else_jump, rvm_code_addr());
+    jump_free(else_jump);
+
+    gen(ast->if_else, ANY_SLOT, &type);
+
+    patch(exit_jump, rvm_code_addr());
+}
+
+static void gen_for_loop(ast_for_loop_t* ast)
+{
+    if (ast->loop == NULL)
+        return;
+
+    type_t type;
+    uint16_t mark = temp_top;
+
+    gen(ast->init, ANY_SLOT, &type);
+    temp_top = mark;
+
+    size_t begin = rvm_code_addr();
+    gen_jump_if_false(ast->condition, ast->loop->end);
+
+    gen(ast->body, ANY_SLOT, &type);
+
+    size_t post = rvm_code_addr();
+
+    gen(ast->post, ANY_SLOT, &type);
+    temp_top = mark;
+
+    emit_k(REG_JMP, 0, 0, value_int(begin));
+
+    loop_jump_fix(ast->loop->end, rvm_code_addr());
+    loop_jump_fix(ast->loop->post, post);
+}
+
+static uint16_t gen_call_args(ast_func_call_t* ast);
+
+// Function whose body is being generated, NULL in the global block
+static _Thread_local ast_func_decl_t* current_func = NULL;
+
+static void gen_func_decl(ast_func_decl_t* ast)
+{
+    ast_func_decl_t* enclosing = current_func;
+    uint16_t saved_top = temp_top;
+    uint16_t saved_size = frame_size;
+
+    size_t skip = emit(REG_JMP, 0, 0, 0);
+
+    ast->symbol->addr = rvm_code_addr();
+
+    size_t enter = emit(REG_ENTER, 0, 0, 0);
+
+    temp_top = context_allocated(ast->body->context);
+    frame_size = temp_top;
+
+    type_t type;
+    current_func = ast;
+    gen((ast_t*) ast->body, ANY_SLOT, &type);
+    current_func = enclosing;
+
+    uint16_t zero = alloc_temp();
+    emit_k(REG_LOADK, zero, 0, value_int(0));
+    emit(REG_RET, zero, 0, 0);
+
+    rvm_insn(enter)->a = frame_size;
+
+    patch(skip, rvm_code_addr());
+
+    temp_top = saved_top;
+    frame_size = saved_size;
+}
+
+static void gen_func_return(ast_func_return_t* ast)
+{
+    ast_func_call_t* call = tail_call(ast, current_func);
+
+    if (call != NULL)
+    {
+        uint16_t base = gen_call_args(call);
+        emit_k(REG_TAILCALL, vec_size(call->args), base, value_int(call->symbol->addr));
+        return;
+    }
+
+    type_t type;
+    uint16_t slot = gen(ast->expr, ANY_SLOT, &type);
+    emit(REG_RET, slot, 0, 0);
+}
+
+static bool_t is_type_acceptable(type_t type, const type_t* acceptable_types)
+{
+    if (acceptable_types == NULL)
+        return true;
+
+    for (size_t i = 0; acceptable_types[i] != MT_UNKNOWN; i++)
+    {
+        if (acceptable_types[i] == type)
+            return true;
+    }
+    return false;
+}
+
+// Maps the stack machine opcode of a builtin to its register form
+static uint8_t builtin_opcode(uint8_t opcode)
+{
+    switch (opcode)
+    {
+    case RMOD:   return REG_RMOD;
+    case RPOW:   return REG_RPOW;
+    case RSQRT:  return REG_RSQRT;
+    case REXP:   return REG_REXP;
+    case RSIN:   return REG_RSIN;
+    case RCOS:   return REG_RCOS;
+    case RTAN:   return REG_RTAN;
+    case RASIN:  return REG_RASIN;
+    case RACOS:  return REG_RACOS;
+    case RATAN2: return REG_RATAN2;
+    case RLOG:   return REG_RLOG;
+    case RLOG10: return REG_RLOG10;
+    case RLOG2:  return REG_RLOG2;
+    case RCEIL:  return REG_RCEIL;
+    case RFLOOR: return REG_RFLOOR;
+    case RROUND: return REG_RROUND;
+    case SLEN:   return REG_SLEN;
+    default:     return REG_NOP;
+    }
+}
+
+static uint16_t gen_builtin_func(ast_func_call_t* ast, int32_t dst, type_t* type)
+{
+    const builtin_func_t* builtin = builtin_lookup(ast->symbol->id);
+    if (builtin == NULL)
+    {
+        panic("Builtin function not found.");
+    }
+
+    uint16_t mark = temp_top;
+    uint16_t args[2] = {0, 0};
+    type_t arg_type = MT_UNKNOWN;
+
+    if (strcmp(builtin->name, "print") == 0)
+    {
+        for (size_t i = 0; i < vec_size(ast->args); i++)
+        {
+            uint16_t slot = gen(vec_get(ast->args, i), ANY_SLOT, &arg_type);
+            temp_top = mark;
+
+            if (!is_type_acceptable(arg_type, builtin->acceptable_types))
+            {
+                panic("Builtin function argument type mismatch.");
+            }
+
+            if (is_integer_type(arg_type))
+                emit(REG_IPRINT, slot, 0, 0);
+            else if (arg_type == MT_REAL)
+                emit(REG_RPRINT, slot, 0, 0);
+            else if (arg_type == MT_STR)
+                emit(REG_SPRINT, slot, 0, 0);
+            else
+                panic("Print error. Unknown type.");
+        }
+        *type = MT_VOID;
+        return 0;
+    }
+
+    for (size_t i = 0; i < vec_size(ast->args); i++)
+    {
+        args[i] = gen(vec_get(ast->args, i), ANY_SLOT, &arg_type);
+
+        if (!is_type_acceptable(arg_type, builtin->acceptable_types))
+        {
+            panic("Builtin function argument type mismatch.");
+        }
+    }
+
+    temp_top = mark;
+    uint16_t out = target_slot(dst);
+
+    if (strcmp(builtin->name, "abs") == 0)
+    {
+        if (is_integer_type(arg_type))
+        {
+            emit(REG_IABS, out, args[0], 0);
+            emit_conversion(MT_INT64, arg_type, out);
+            *type = arg_type;
+        }
+        else if (arg_type == MT_REAL)
+        {
+            emit(REG_RABS, out, args[0], 0);
+            *type = MT_REAL;
+        }
+        else
+        {
+            panic("abs function requires numeric type.");
+        }
+        return out;
+    }
+
+    uint8_t op = builtin_opcode(builtin->opcode);
+    if (op == REG_NOP)
+    {
+        panic("Builtin function not supported.");
+    }
+
+    emit(op, out, args[0], args[1]);
+    *type = builtin->ret_type;
+    return out;
+}
+
+static void check_call_args(ast_func_call_t* ast)
+{
+    if (ast->symbol->extra.func.param_types == NULL)
+    {
+        panic("Function parameter types not available for type checking.");
+    }
+
+    size_t param_count = vec_size(ast->symbol->extra.func.param_types);
+    size_t arg_count = vec_size(ast->args);
+
+    if (arg_count != param_count)
+    {
+        panic("Function argument count mismatch.");
+    }
+
+    for (size_t i = 0; i < arg_count; i++)
+    {
+        type_t* param_type = vec_get(ast->symbol->extra.func.param_types, i);
+        if (infer_type(vec_get(ast->args, i)) != *param_type)
+        {
+            panic("Function argument type mismatch.");
+        }
+    }
+}
+
+// Checks the arguments of a user function call and lays them out in
+// consecutive temporaries from the returned slot on, which become the
+// first slots of the callee frame
+static uint16_t gen_call_args(ast_func_call_t* ast)
+{
+    check_call_args(ast);
+
+    size_t arg_count = vec_size(ast->args);
+    uint16_t mark = temp_top;
+    uint16_t base = temp_top;
+
+    for (size_t i = 0; i < arg_count; i++)
+        alloc_temp();
+
+    for (size_t i = 0; i < arg_count; i++)
+        gen_into(vec_get(ast->args, i), base + i);
+
+    temp_top = mark;
+    return base;
+}
+
+static uint16_t gen_func_call(ast_func_call_t* ast, int32_t dst, type_t* type)
+{
+    if (ast->symbol->addr == SYMBOL_BUILTIN_ADDR)
+    {
+        return gen_builtin_func(ast, dst, type);
+    }
+
+    uint16_t base = gen_call_args(ast);
+
+    // The callee frame starts at `base` and is at least one slot long
+    if (base + 1 > frame_size)
+        frame_size = base + 1;
+
+    uint16_t out = target_slot(dst);
+    emit_k(REG_CALL, out, base, value_int(ast->symbol->addr));
+
+    type_t ret_type = ast->symbol->extra.func.ret_type;
+    if (ret_type == MT_UNKNOWN || ret_type == MT_VOID) {
+        ret_type = MT_INT64;
+    }
+
+    if (is_integer_type(ret_type)) {
+        emit_conversion(MT_INT64, ret_type, out);
+    }
+
+    *type = ret_type;
+    return out;
+}
+
+// Inlined body being generated: its returns write the result slot and
+// jump to the end
+static _Thread_local jump_t* inline_end = NULL;
+static _Thread_local uint16_t inline_slot;
+
+static uint16_t gen_inline(ast_inline_t* ast, int32_t dst, type_t* type)
+{
+    jump_t* enclosing_end = inline_end;
+    uint16_t enclosing_slot = inline_slot;
+    uint16_t out = target_slot(dst);
+
+    check_call_args(ast->call);
+    inline_end = jump_new();
+    inline_slot = out;
+
+    gen_statements(ast->body);
+    emit_k(REG_LOADK, out, 0, value_int(0));
+
+    loop_jump_fix(inline_end, rvm_code_addr());
+    jump_free(inline_end);
+    inline_end = enclosing_end;
+    inline_slot = enclosing_slot;
+
+    if (is_integer_type(ast->ret_type))
+        emit_conversion(MT_INT64, ast->ret_type, out);
+
+    *type = ast->ret_type;
+    return out;
+}
+
+static void gen_inline_return(ast_func_return_t* ast)
+{
+    gen_into(ast->expr, inline_slot);
+    loop_jump_to(inline_end);
+}
+
+static uint16_t gen(ast_t* ast, int32_t dst, type_t* type)
+{
+    *type = MT_UNKNOWN;
+
+    if (ast == NULL)
+        return 0;
+
+    if (is_kind(ast, eval_constant))
+        return gen_constant((ast_constant_t*) ast, dst, type);
+
+    if (is_kind(ast, eval_variable))
+    {
+        *type = ((ast_variable_t*) ast)->symbol->type;
+        return ((ast_variable_t*) ast)->symbol->addr;
+    }
+
+    if (is_kind(ast, eval_unary))
+        return gen_unary((ast_unary_t*) ast, dst, type);
+
+    if (is_kind(ast, eval_binary))
+        return gen_binary((ast_binary_t*) ast, dst, type);
+
+    if (is_kind(ast, eval_assign))
+        return gen_assign((ast_assign_t*) ast, type);
+
+    if (is_kind(ast, eval_block))
+        gen_statements((ast_block_t*) ast);
+    else if (is_kind(ast, eval_if_cond))
+        gen_if_cond((ast_if_cond_t*) ast);
+    else if (is_kind(ast, eval_for_loop))
+        gen_for_loop((ast_for_loop_t*) ast);
+    else if (is_kind(ast, eval_func_decl))
+        gen_func_decl((ast_func_decl_t*) ast);
+    else if (is_kind(ast, eval_func_return))
+        gen_func_return((ast_func_return_t*) ast);
+    else if (is_kind(ast, eval_func_call))
+        return gen_func_call((ast_func_call_t*) ast, dst, type);
+    else if (is_kind(ast, eval_inline))
+        return gen_inline((ast_inline_t*) ast, dst, type);
+    else if (is_kind(ast, eval_inline_return))
+        gen_inline_return((ast_func_return_t*) ast);
+    else if (is_kind(ast, eval_break_loop))
+        loop_jump_to(((ast_break_loop_t*) ast)->loop->end);
+    else if (is_kind(ast, eval_continue_loop))
+        loop_jump_to(((ast_continue_loop_t*) ast)->loop->post);
+
+    return 0;
+}
+
+void rgen_program(ast_block_t* program)
+{
+    temp_top = context_allocated(program->context);
+    frame_size = temp_top;
+
+    size_t enter = emit(REG_ENTER, 0, 0, 0);
+
+    gen_statements(program);
+
+    emit(REG_HALT, 0, 0, 0);
+
+    rvm_insn(enter)->a = frame_size;
+}
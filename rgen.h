@@ -0,0 +1,19 @@
+#ifndef RGEN_H
+#define RGEN_H
+
+#include "ast.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+// Generates register machine code (rvm.h) for a parsed program. This is a
+// second back end over the same AST that ast.c compiles for vm.h.
+void rgen_program(ast_block_t* program);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* RGEN_H */
@@ -0,0 +1,470 @@
+#include "rvm.h"
+#include "utf8.h"
+#include "buffer.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <inttypes.h>
+
+// Saved state of a caller while a function runs
+typedef struct
+{
+    rinsn_t* ip;        // Instruction after the CALL
+    value_t* bp;        // Caller frame
+    uint16_t dst;       // Caller slot receiving the return value
+} rframe_t;
+
+typedef struct
+{
+    rinsn_t* code;
+    size_t code_used;
+    size_t code_allc;
+    buffer_t data;
+    value_t* stack;
+    size_t stack_size;
+    rframe_t* frames;
+    size_t frames_allc;
+} rvm_t;
+
+static _Thread_local rvm_t rvm;
+
+// NOTE: KEEP THE ORDER AS SAME AS THE REG_ ENUM
+const ropcode_t REG_OPCODES[] = {
+    {REG_NOP, "nop"},
+    {REG_HALT, "halt"},
+    {REG_ENTER, "enter"},
+    {REG_MOV, "mov"},
+    {REG_LOADK, "loadk"},
+    {REG_JMP, "jmp"},
+    {REG_JEZ, "jez"},
+    {REG_JNZ, "jnz"},
+    {REG_RJEZ, "rjez"},
+    {REG_RJNZ, "rjnz"},
+    {REG_CALL, "call"},
+    {REG_RET, "ret"},
+    {REG_TAILCALL, "tailcall"},
+    {REG_IADD, "iadd"},
+    {REG_ISUB, "isub"},
+    {REG_IMUL, "imul"},
+    {REG_IDIV, "idiv"},
+    {REG_IMOD, "imod"},
+    {REG_IAND, "iand"},
+    {REG_IOR, "ior"},
+    {REG_IBXOR, "ibxor"},
+    {REG_IBOR, "ibor"},
+    {REG_IBAND, "iband"},
+    {REG_ISHL, "ishl"},
+    {REG_ISHR, "ishr"},
+    {REG_IGT, "igt"},
+    {REG_ILT, "ilt"},
+    {REG_IGE, "ige"},
+    {REG_ILE, "ile"},
+    {REG_IEQ, "ieq"},
+    {REG_INQ, "inq"},
+    {REG_IADDK, "iaddk"},
+    {REG_INEG, "ineg"},
+    {REG_INOT, "inot"},
+    {REG_IABS, "iabs"},
+    {REG_I8CAST, "i8cast"},
+    {REG_I16CAST, "i16cast"},
+    {REG_I32CAST, "i32cast"},
+    {REG_IGT_JEZ, "igt_jez"},
+    {REG_ILT_JEZ, "ilt_jez"},
+    {REG_IGE_JEZ, "ige_jez"},
+    {REG_ILE_JEZ, "ile_jez"},
+    {REG_IEQ_JEZ, "ieq_jez"},
+    {REG_INQ_JEZ, "inq_jez"},
+    {REG_RGT_JEZ, "rgt_jez"},
+    {REG_RLT_JEZ, "rlt_jez"},
+    {REG_RGE_JEZ, "rge_jez"},
+    {REG_RLE_JEZ, "rle_jez"},
+    {REG_REQ_JEZ, "req_jez"},
+    {REG_RNQ_JEZ, "rnq_jez"},
+    {REG_RADD, "radd"},
+    {REG_RSUB, "rsub"},
+    {REG_RMUL, "rmul"},
+    {REG_RDIV, "rdiv"},
+    {REG_RMOD, "rmod"},
+    {REG_RPOW, "rpow"},
+    {REG_RATAN2, "ratan2"},
+    {REG_RGT, "rgt"},
+    {REG_RLT, "rlt"},
+    {REG_RGE, "rge"},
+    {REG_RLE, "rle"},
+    {REG_REQ, "req"},
+    {REG_RNQ, "rnq"},
+    {REG_RNEG, "rneg"},
+    {REG_RABS, "rabs"},
+    {REG_RSQRT, "rsqrt"},
+    {REG_REXP, "rexp"},
+    {REG_RSIN, "rsin"},
+    {REG_RCOS, "rcos"},
+    {REG_RTAN, "rtan"},
+    {REG_RASIN, "rasin"},
+    {REG_RACOS, "racos"},
+    {REG_RLOG, "rlog"},
+    {REG_RLOG10, "rlog10"},
+    {REG_RLOG2, "rlog2"},
+    {REG_RCEIL, "rceil"},
+    {REG_RFLOOR, "rfloor"},
+    {REG_RROUND, "rround"},
+    {REG_IPRINT, "iprint"},
+    {REG_RPRINT, "rprint"},
+    {REG_SPRINT, "sprint"},
+    {REG_SLEN, "slen"},
+};
+
+#define REG_OPCODES_COUNT (sizeof (REG_OPCODES) / sizeof (REG_OPCODES[0]))
+
+void rvm_init(size_t stack_size)
+{
+    buffer_init(&rvm.data, 0);
+    rvm.code = malloc(sizeof (rinsn_t) * 64);
+    rvm.code_used = 0;
+    rvm.code_allc = 64;
+    rvm.stack = calloc(stack_size, sizeof (value_t));
+    rvm.stack_size = stack_size;
+    rvm.frames = malloc(sizeof (rframe_t) * 16);
+    rvm.frames_allc = 16;
+}
+
+void rvm_free()
+{
+    free(rvm.code);
+    free(rvm.stack);
+    free(rvm.frames);
+    buffer_free(&rvm.data);
+    rvm.code = NULL;
+    rvm.stack = NULL;
+    rvm.frames = NULL;
+    rvm.data.data = NULL;
+}
+
+size_t rvm_emit(uint8_t op, uint16_t a, uint16_t b, uint16_t c, value_t k)
+{
+    if (rvm.code_used == rvm.code_allc)
+    {
+        rvm.code_allc *= 2;
+        rvm.code = realloc(rvm.code, sizeof (rinsn_t) * rvm.code_allc);
+    }
+
+    rinsn_t* insn = &rvm.code[rvm.code_used];
+    insn->op = op;
+    insn->a = a;
+    insn->b = b;
+    insn->c = c;
+    insn->k = k;
+
+    return rvm.code_used++;
+}
+
+rinsn_t* rvm_insn(size_t index)
+{
+    return &rvm.code[index];
+}
+
+size_t rvm_code_addr()
+{
+    return rvm.code_used;
+}
+
+void rvm_data_emit(uint8_t* bytes, size_t len)
+{
+    buffer_adds(&rvm.data, bytes, len);
+}
+
+size_t rvm_data_addr()
+{
+    return buffer_size(&rvm.data);
+}
+
+// Same dispatch choice as vm.c: computed goto unless VM_DISPATCH_SWITCH
+#if !defined(VM_DISPATCH_SWITCH) && (defined(__GNUC__) || defined(__clang__))
+#define RVM_THREADED
+#endif
+
+#ifdef RVM_THREADED
+#define OP(name) op_##name:
+#define NEXT goto *dispatch[ip->op]
+#define LABEL(name) [REG_##name] = &&op_##name
+#else
+#define OP(name) case REG_##name:
+#define NEXT goto dispatch
+#endif
+
+#define R(x) bp[ip->x]
+
+#define BINARY(name, field, expr) \
+    OP(name) { R(a).field = (expr); ++ip; NEXT; }
+#define UNARY(name, field, expr) \
+    OP(name) { R(a).field = (expr); ++ip; NEXT; }
+#define COMPARE_JEZ(name, field, cmp) \
+    OP(name) { if (R(a).field cmp R(b).field) ++ip; else ip = code + ip->k.as_uint64; NEXT; }
+
+const char* rvm_exec()
+{
+    rinsn_t* code = rvm.code;
+    rinsn_t* ip = code;
+    value_t* bp = rvm.stack;
+    value_t* end = rvm.stack + rvm.stack_size;
+    size_t depth = 0;
+
+#ifdef RVM_THREADED
+    static const void* const dispatch[256] = {
+        [0 ... 255] = &&op_BAD,
+        LABEL(NOP), LABEL(HALT), LABEL(ENTER), LABEL(MOV), LABEL(LOADK),
+        LABEL(JMP), LABEL(JEZ), LABEL(JNZ), LABEL(RJEZ), LABEL(RJNZ),
+        LABEL(CALL), LABEL(RET), LABEL(TAILCALL),
+        LABEL(IADD), LABEL(ISUB), LABEL(IMUL), LABEL(IDIV), LABEL(IMOD),
+        LABEL(IAND), LABEL(IOR), LABEL(IBXOR), LABEL(IBOR), LABEL(IBAND),
+        LABEL(ISHL), LABEL(ISHR),
+        LABEL(IGT), LABEL(ILT), LABEL(IGE), LABEL(ILE), LABEL(IEQ), LABEL(INQ),
+        LABEL(IADDK), LABEL(INEG), LABEL(INOT), LABEL(IABS),
+        LABEL(I8CAST), LABEL(I16CAST), LABEL(I32CAST),
+        LABEL(IGT_JEZ), LABEL(ILT_JEZ), LABEL(IGE_JEZ), LABEL(ILE_JEZ),
+        LABEL(IEQ_JEZ), LABEL(INQ_JEZ),
+        LABEL(RGT_JEZ), LABEL(RLT_JEZ), LABEL(RGE_JEZ), LABEL(RLE_JEZ),
+        LABEL(REQ_JEZ), LABEL(RNQ_JEZ),
+        LABEL(RADD), LABEL(RSUB), LABEL(RMUL), LABEL(RDIV), LABEL(RMOD),
+        LABEL(RPOW), LABEL(RATAN2), LABEL(RGT), LABEL(RLT), LABEL(RGE),
+        LABEL(RLE), LABEL(REQ), LABEL(RNQ),
+        LABEL(RNEG), LABEL(RABS), LABEL(RSQRT), LABEL(REXP), LABEL(RSIN),
+        LABEL(RCOS), LABEL(RTAN), LABEL(RASIN), LABEL(RACOS), LABEL(RLOG),
+        LABEL(RLOG10), LABEL(RLOG2), LABEL(RCEIL), LABEL(RFLOOR), LABEL(RROUND),
+        LABEL(IPRINT), LABEL(RPRINT), LABEL(SPRINT), LABEL(SLEN),
+    };
+#endif
+
+    if (code == NULL || rvm.code_used == 0)
+        return NULL;
+    if (rvm.stack == NULL)
+        return "cannot allocate the stack";
+
+#ifdef RVM_THREADED
+    NEXT;
+#else
+dispatch:
+    switch (ip->op)
+    {
+#endif
+    OP(HALT)
+    {
+        return NULL;
+    }
+    OP(NOP)
+    {
+        ++ip;
+        NEXT;
+    }
+    OP(ENTER)
+    {
+        if (bp + ip->a > end)
+            return "stack overflow";
+        ++ip;
+        NEXT;
+    }
+    OP(MOV)
+    {
+        R(a) = R(b);
+        ++ip;
+        NEXT;
+    }
+    OP(LOADK)
+    {
+        R(a) = ip->k;
+        ++ip;
+        NEXT;
+    }
+    OP(JMP)
+    {
+        ip = code + ip->k.as_uint64;
+        NEXT;
+    }
+    OP(JEZ)
+    {
+        if (R(a).as_int64 == 0)
+            ip = code + ip->k.as_uint64;
+        else
+            ++ip;
+        NEXT;
+    }
+    OP(JNZ)
+    {
+        if (R(a).as_int64 != 0)
+            ip = code + ip->k.as_uint64;
+        else
+            ++ip;
+        NEXT;
+    }
+    OP(RJEZ)
+    {
+        if (R(a).as_real == 0.0)
+            ip = code + ip->k.as_uint64;
+        else
+            ++ip;
+        NEXT;
+    }
+    OP(RJNZ)
+    {
+        if (R(a).as_real != 0.0)
+            ip = code + ip->k.as_uint64;
+        else
+            ++ip;
+        NEXT;
+    }
+    OP(CALL)
+    {
+        if (depth == rvm.frames_allc)
+        {
+            rvm.frames_allc *= 2;
+            rvm.frames = realloc(rvm.frames, sizeof (rframe_t) * rvm.frames_allc);
+        }
+        rframe_t* frame = &rvm.frames[depth++];
+        frame->ip = ip + 1;
+        frame->bp = bp;
+        frame->dst = ip->a;
+        bp += ip->b;
+        ip = code + ip->k.as_uint64;
+        NEXT;
+    }
+    OP(RET)
+    {
+        value_t result = R(a);
+        if (depth == 0)
+            return NULL;
+        rframe_t* frame = &rvm.frames[--depth];
+        bp = frame->bp;
+        ip = frame->ip;
+        bp[frame->dst] = result;
+        NEXT;
+    }
+    OP(TAILCALL)
+    {
+        // The frame is reused: the callee returns to our caller
+        for (uint16_t i = 0; i < ip->a; i++)
+            bp[i] = bp[ip->b + i];
+        ip = code + ip->k.as_uint64;
+        NEXT;
+    }
+    BINARY(IADD, as_int64, R(b).as_int64 + R(c).as_int64)
+    BINARY(ISUB, as_int64, R(b).as_int64 - R(c).as_int64)
+    BINARY(IMUL, as_int64, R(b).as_int64 * R(c).as_int64)
+    BINARY(IDIV, as_int64, R(b).as_int64 / R(c).as_int64)
+    BINARY(IMOD, as_int64, R(b).as_int64 % R(c).as_int64)
+    BINARY(IAND, as_int64, R(b).as_int64 && R(c).as_int64)
+    BINARY(IOR, as_int64, R(b).as_int64 || R(c).as_int64)
+    BINARY(IBXOR, as_int64, R(b).as_int64 ^ R(c).as_int64)
+    BINARY(IBOR, as_int64, R(b).as_int64 | R(c).as_int64)
+    BINARY(IBAND, as_int64, R(b).as_int64 & R(c).as_int64)
+    BINARY(ISHL, as_int64, R(b).as_int64 << R(c).as_int64)
+    BINARY(ISHR, as_int64, R(b).as_int64 >> R(c).as_int64)
+    BINARY(IGT, as_int64, R(b).as_int64 > R(c).as_int64)
+    BINARY(ILT, as_int64, R(b).as_int64 < R(c).as_int64)
+    BINARY(IGE, as_int64, R(b).as_int64 >= R(c).as_int64)
+    BINARY(ILE, as_int64, R(b).as_int64 <= R(c).as_int64)
+    BINARY(IEQ, as_int64, R(b).as_int64 == R(c).as_int64)
+    BINARY(INQ, as_int64, R(b).as_int64 != R(c).as_int64)
+    BINARY(IADDK, as_int64, R(b).as_int64 + ip->k.as_int64)
+    UNARY(INEG, as_int64, -R(b).as_int64)
+    UNARY(INOT, as_int64, ~R(b).as_int64)
+    UNARY(IABS, as_int64, llabs(R(b).as_int64))
+    UNARY(I8CAST, as_int64, (int8_t) R(b).as_int64)
+    UNARY(I16CAST, as_int64, (int16_t) R(b).as_int64)
+    UNARY(I32CAST, as_int64, (int32_t) R(b).as_int64)
+    COMPARE_JEZ(IGT_JEZ, as_int64, >)
+    COMPARE_JEZ(ILT_JEZ, as_int64, <)
+    COMPARE_JEZ(IGE_JEZ, as_int64, >=)
+    COMPARE_JEZ(ILE_JEZ, as_int64, <=)
+    COMPARE_JEZ(IEQ_JEZ, as_int64, ==)
+    COMPARE_JEZ(INQ_JEZ, as_int64, !=)
+    COMPARE_JEZ(RGT_JEZ, as_real, >)
+    COMPARE_JEZ(RLT_JEZ, as_real, <)
+    COMPARE_JEZ(RGE_JEZ, as_real, >=)
+    COMPARE_JEZ(RLE_JEZ, as_real, <=)
+    COMPARE_JEZ(REQ_JEZ, as_real, ==)
+    COMPARE_JEZ(RNQ_JEZ, as_real, !=)
+    BINARY(RADD, as_real, R(b).as_real + R(c).as_real)
+    BINARY(RSUB, as_real, R(b).as_real - R(c).as_real)
+    BINARY(RMUL, as_real, R(b).as_real * R(c).as_real)
+    BINARY(RDIV, as_real, R(b).as_real / R(c).as_real)
+    BINARY(RMOD, as_real, fmod(R(b).as_real, R(c).as_real))
+    BINARY(RPOW, as_real, pow(R(b).as_real, R(c).as_real))
+    BINARY(RATAN2, as_real, atan2(R(b).as_real, R(c).as_real))
+    BINARY(RGT, as_real, R(b).as_real > R(c).as_real)
+    BINARY(RLT, as_real, R(b).as_real < R(c).as_real)
+    BINARY(RGE, as_real, R(b).as_real >= R(c).as_real)
+    BINARY(RLE, as_real, R(b).as_real <= R(c).as_real)
+    BINARY(REQ, as_real, R(b).as_real == R(c).as_real)
+    BINARY(RNQ, as_real, R(b).as_real != R(c).as_real)
+    UNARY(RNEG, as_real, -R(b).as_real)
+    UNARY(RABS, as_real, fabs(R(b).as_real))
+    UNARY(RSQRT, as_real, sqrt(R(b).as_real))
+    UNARY(REXP, as_real, exp(R(b).as_real))
+    UNARY(RSIN, as_real, sin(R(b).as_real))
+    UNARY(RCOS, as_real, cos(R(b).as_real))
+    UNARY(RTAN, as_real, tan(R(b).as_real))
+    UNARY(RASIN, as_real, asin(R(b).as_real))
+    UNARY(RACOS, as_real, acos(R(b).as_real))
+    UNARY(RLOG, as_real, log(R(b).as_real))
+    UNARY(RLOG10, as_real, log10(R(b).as_real))
+    UNARY(RLOG2, as_real, log2(R(b).as_real))
+    UNARY(RCEIL, as_real, ceil(R(b).as_real))
+    UNARY(RFLOOR, as_real, floor(R(b).as_real))
+    UNARY(RROUND, as_real, round(R(b).as_real))
+    UNARY(SLEN, as_int64, (int64_t) utf8len((const char*) &rvm.data.data[R(b).as_uint16]))
+    OP(IPRINT)
+    {
+        printf("%" PRId64, R(a).as_int64);
+        fflush(stdout);
+        ++ip;
+        NEXT;
+    }
+    OP(RPRINT)
+    {
+        printf("%f", R(a).as_real);
+        fflush(stdout);
+        ++ip;
+        NEXT;
+    }
+    OP(SPRINT)
+    {
+        printf("%s", &rvm.data.data[R(a).as_uint16]);
+        fflush(stdout);
+        ++ip;
+        NEXT;
+    }
+#ifdef RVM_THREADED
+    op_BAD:
+#else
+    default:
+#endif
+    {
+        return "bad opcode";
+    }
+#ifndef RVM_THREADED
+    }
+#endif
+}
+
+void rvm_dasm(const char* filename)
+{
+    FILE* file = fopen(filename, "w");
+    if (file == NULL)
+    {
+        fprintf(stderr, "Error: Cannot open file '%s' for writing\n", filename);
+        return;
+    }
+
+    for (size_t i = 0; i < rvm.code_used; i++)
+    {
+        rinsn_t* insn = &rvm.code[i];
+        const char* name = insn->op < REG_OPCODES_COUNT ? REG_OPCODES[insn->op].name : "bad";
+
+        fprintf(file, "%lx\t %s %u %u %u", i, name, insn->a, insn->b, insn->c);
+        if (insn->k.as_uint64 != 0)
+            fprintf(file, " 0x%" PRIx64, insn->k.as_uint64);
+        fprintf(file, "\n");
+    }
+
+    fclose(file);
+}
@@ -0,0 +1,140 @@
+#ifndef RVM_H
+#define RVM_H
+
+#include "types.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+// Register machine: an alternative to the stack machine of vm.h. Every
+// instruction names its operands as frame slots addressed off bp, so
+// `a = b + c` is a single IADD a, b, c. Locals keep the slots context.c
+// gives them and temporaries are allocated above them by rgen.c.
+enum
+{
+    REG_NOP,
+    REG_HALT,
+    REG_ENTER,      // a: frame size
+    REG_MOV,        // a = b
+    REG_LOADK,      // a = k
+    REG_JMP,        // goto k
+    REG_JEZ,        // if a == 0 goto k
+    REG_JNZ,        // if a != 0 goto k
+    REG_RJEZ,       // if a == 0.0 goto k
+    REG_RJNZ,       // if a != 0.0 goto k
+    REG_CALL,       // a = call k with arguments from slot b on
+    REG_RET,        // return a
+    REG_TAILCALL,   // move a arguments from slot b on to slot 0, goto k
+
+    REG_IADD,       // a = b op c
+    REG_ISUB,
+    REG_IMUL,
+    REG_IDIV,
+    REG_IMOD,
+    REG_IAND,
+    REG_IOR,
+    REG_IBXOR,
+    REG_IBOR,
+    REG_IBAND,
+    REG_ISHL,
+    REG_ISHR,
+    REG_IGT,
+    REG_ILT,
+    REG_IGE,
+    REG_ILE,
+    REG_IEQ,
+    REG_INQ,
+    REG_IADDK,      // a = b + k
+
+    REG_INEG,       // a = op b
+    REG_INOT,
+    REG_IABS,
+    REG_I8CAST,
+    REG_I16CAST,
+    REG_I32CAST,
+
+    REG_IGT_JEZ,    // if !(a op b) goto k
+    REG_ILT_JEZ,
+    REG_IGE_JEZ,
+    REG_ILE_JEZ,
+    REG_IEQ_JEZ,
+    REG_INQ_JEZ,
+    REG_RGT_JEZ,
+    REG_RLT_JEZ,
+    REG_RGE_JEZ,
+    REG_RLE_JEZ,
+    REG_REQ_JEZ,
+    REG_RNQ_JEZ,
+
+    REG_RADD,       // a = b op c
+    REG_RSUB,
+    REG_RMUL,
+    REG_RDIV,
+    REG_RMOD,
+    REG_RPOW,
+    REG_RATAN2,
+    REG_RGT,
+    REG_RLT,
+    REG_RGE,
+    REG_RLE,
+    REG_REQ,
+    REG_RNQ,
+
+    REG_RNEG,       // a = op b
+    REG_RABS,
+    REG_RSQRT,
+    REG_REXP,
+    REG_RSIN,
+    REG_RCOS,
+    REG_RTAN,
+    REG_RASIN,
+    REG_RACOS,
+    REG_RLOG,
+    REG_RLOG10,
+    REG_RLOG2,
+    REG_RCEIL,
+    REG_RFLOOR,
+    REG_RROUND,
+
+    REG_IPRINT,     // print a
+    REG_RPRINT,
+    REG_SPRINT,
+    REG_SLEN,       // a = length of b
+};
+
+typedef struct
+{
+    uint8_t op;
+    uint16_t a;
+    uint16_t b;
+    uint16_t c;
+    value_t k;          // Constant or instruction index of a jump/call
+} rinsn_t;
+
+typedef struct
+{
+    const uint8_t code;
+    const char name[32];
+} ropcode_t;
+
+extern const ropcode_t REG_OPCODES[];
+
+void rvm_init(size_t stack_size);
+void rvm_free();
+// Runs the code from its start: NULL when it ends, or why it stopped
+// before, like vm_error
+const char* rvm_exec();
+void rvm_dasm(const char* filename);
+size_t rvm_emit(uint8_t op, uint16_t a, uint16_t b, uint16_t c, value_t k);
+rinsn_t* rvm_insn(size_t index);
+size_t rvm_code_addr();
+void rvm_data_emit(uint8_t* bytes, size_t len);
+size_t rvm_data_addr();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* RVM_H */
@@ -0,0 +1,105 @@
+#include "tests.h"
+#include "../intern.h"
+#include <stdio.h>
+#include <string.h>
+
+static void test_intern_same(test_suite_t* suite)
+{
+    intern_t* pool = intern_new();
+    char a[] = "counter";
+    char b[] = "counter";
+
+    const char* x = intern(pool, a, strlen(a));
+    const char* y = intern(pool, b, strlen(b));
+
+    TEST_ASSERT_PTR_EQ(x, y, "equal strings should share one copy");
+    TEST_ASSERT_PTR_NE(x, a, "the pool should keep its own copy");
+    TEST_ASSERT_STR_EQ(x, "counter", "the copy should hold the string");
+    TEST_ASSERT_EQ(intern_count(pool), 1, "pool should hold one string");
+
+    intern_free(pool);
+}
+
+static void test_intern_different(test_suite_t* suite)
+{
+    intern_t* pool = intern_new();
+
+    const char* x = intern(pool, "count", 5);
+    const char* y = intern(pool, "counter", 7);
+    const char* z = intern(pool, "counter", 5);
+
+    TEST_ASSERT_PTR_NE(x, y, "different strings should not be shared");
+    TEST_ASSERT_PTR_EQ(x, z, "only the first size bytes should count");
+    TEST_ASSERT_EQ(intern_count(pool), 2, "pool should hold two strings");
+
+    intern_free(pool);
+}
+
+static void test_intern_size(test_suite_t* suite)
+{
+    intern_t* pool = intern_new();
+
+    const char* empty = intern(pool, "", 0);
+    const char* nul = intern(pool, "a\0b", 3);
+
+    TEST_ASSERT_EQ(intern_size(empty), 0, "empty string should have size 0");
+    TEST_ASSERT_EQ(empty[0], '\0', "strings should be NUL terminated");
+    TEST_ASSERT_EQ(intern_size(nul), 3, "size should count embedded NULs");
+    TEST_ASSERT_PTR_NE(nul, intern(pool, "a", 1), "a prefix up to a NUL is another string");
+
+    intern_free(pool);
+}
+
+static void test_intern_growth(test_suite_t* suite)
+{
+    intern_t* pool = intern_new();
+    const char* first[1000];
+    char name[16];
+
+    for (int i = 0; i < 1000; i++)
+    {
+        snprintf(name, sizeof (name), "id%d", i);
+        first[i] = intern(pool, name, strlen(name));
+    }
+
+    TEST_ASSERT_EQ(intern_count(pool), 1000, "pool should hold 1000 strings");
+
+    for (int i = 0; i < 1000; i++)
+    {
+        snprintf(name, sizeof (name), "id%d", i);
+        TEST_ASSERT_PTR_EQ(intern(pool, name, strlen(name)), first[i], "strings should not move as the pool grows");
+    }
+
+    TEST_ASSERT_EQ(intern_count(pool), 1000, "lookups should not add strings");
+
+    intern_free(pool);
+}
+
+static void test_intern_long(test_suite_t* suite)
+{
+    intern_t* pool = intern_new();
+    static char text[10000];
+    memset(text, 'x', sizeof (text));
+
+    const char* x = intern(pool, text, sizeof (text));
+
+    TEST_ASSERT_EQ(intern_size(x), sizeof (text), "strings past a chunk should be kept whole");
+    TEST_ASSERT(memcmp(x, text, sizeof (text)) == 0, "the copy should hold the string");
+    TEST_ASSERT_PTR_EQ(intern(pool, text, sizeof (text)), x, "long strings should be shared too");
+
+    intern_free(pool);
+}
+
+int main(void)
+{
+    RUN_SUITE("intern",
+        {"intern_same", test_intern_same},
+        {"intern_different", test_intern_different},
+        {"intern_size", test_intern_size},
+        {"intern_growth", test_intern_growth},
+        {"intern_long", test_intern_long}
+    );
+
+    printf("All intern tests passed!\n");
+    return 0;
+}
@@ -0,0 +1,192 @@
+#include "tests.h"
+#include "../mirza.h"
+#include <pthread.h>
+#include <malloc.h>
+
+#define COUNTER_PROGRAM \
+    "var n : i64 = 0\nfor var i = 0; i < 10; i = i + 1 {\nn = n + i\n}\nprint(n, \" \", \"ok\")\n"
+
+static void test_run_many(test_suite_t* suite)
+{
+    char out[64];
+    const char* source = COUNTER_PROGRAM;
+    mirza_program_t* program = mirza_compile(source, strlen(source), NULL, NULL, 0);
+
+    TEST_ASSERT_NOT_NULL(program, "should compile");
+
+    // Every run starts from fresh globals
+    for (int i = 0; i < 3; i++)
+    {
+        long length = mirza_run(program, out, sizeof(out));
+        TEST_ASSERT_EQ(length, 5, "should write 5 bytes");
+        TEST_ASSERT_STR_EQ(out, "45 ok", "should print 45 ok");
+    }
+
+    mirza_free(program);
+}
+
+static void test_source_not_terminated(test_suite_t* suite)
+{
+    char out[64];
+    // Only the first statement is compiled
+    const char* source = "print(7)\nprint(8)\n";
+    mirza_program_t* program = mirza_compile(source, 9, NULL, NULL, 0);
+
+    TEST_ASSERT_NOT_NULL(program, "should compile");
+    mirza_run(program, out, sizeof(out));
+    mirza_free(program);
+
+    TEST_ASSERT_STR_EQ(out, "7", "should print 7");
+}
+
+static void test_compile_error(test_suite_t* suite)
+{
+    char error[128] = {0};
+    const char* source = "var x = 1\nprint(y)\n";
+    mirza_program_t* program = mirza_compile(source, strlen(source), NULL, error, sizeof(error));
+
+    TEST_ASSERT_NULL(program, "should not compile");
+    TEST_ASSERT(strstr(error, "Identifier is not defined.") != NULL, "should report the error");
+
+    // Strings have no truth for `and` / `or`
+    source = "var s = \"a\"\nprint(s and 1)\n";
+    program = mirza_compile(source, strlen(source), NULL, error, sizeof(error));
+    TEST_ASSERT_NULL(program, "should not compile a string operand of and");
+    TEST_ASSERT(strstr(error, "Binary error") != NULL, "should report the string operand");
+
+    // The thread compiles again after an error
+    source = "print(1)\n";
+    program = mirza_compile(source, strlen(source), NULL, NULL, 0);
+    TEST_ASSERT_NOT_NULL(program, "should compile after an error");
+    mirza_free(program);
+}
+
+static void test_truncated_output(test_suite_t* suite)
+{
+    char out[4];
+    const char* source = COUNTER_PROGRAM;
+    mirza_program_t* program = mirza_compile(source, strlen(source), NULL, NULL, 0);
+
+    long length = mirza_run(program, out, sizeof(out));
+    long none = mirza_run(program, out, 1);
+    mirza_free(program);
+
+    TEST_ASSERT_EQ(length, 3, "should fill the buffer");
+    TEST_ASSERT_STR_EQ(out, "45 ", "should keep the first 3 bytes");
+    TEST_ASSERT_EQ(none, -1, "should not run into a buffer without room");
+}
+
+static void test_stack_overflow(test_suite_t* suite)
+{
+    char out[64];
+    const char* source =
+        "print(\"deep\")\nfunc depth(n : i64) : i64 {\nif n == 0 {\nret 0\n}\nret 1 + depth(n - 1)\n}\n"
+        "var n : i64 = 100000\nprint(depth(n))\n";
+    mirza_options_t options = { .jit = 0, .stack_size = 50000 };
+    mirza_program_t* program = mirza_compile(source, strlen(source), &options, NULL, 0);
+
+    long failed = mirza_run(program, out, sizeof(out));
+    mirza_free(program);
+
+    options.stack_size = 0;
+    program = mirza_compile(source, strlen(source), &options, NULL, 0);
+    long length = mirza_run(program, out, sizeof(out));
+    mirza_free(program);
+
+    TEST_ASSERT_EQ(failed, -1, "should fail past the stack size");
+    TEST_ASSERT_EQ(length, 10, "should write 10 bytes with the default size");
+    TEST_ASSERT_STR_EQ(out, "deep100000", "should print deep100000");
+
+    options.stack_size = SIZE_MAX;
+    program = mirza_compile(source, strlen(source), &options, NULL, 0);
+    long huge = mirza_run(program, out, sizeof(out));
+    mirza_free(program);
+
+    TEST_ASSERT_EQ(huge, -1, "should not run with a stack larger than memory");
+}
+
+// Functions, loops, inlining and a compile error: everything a compile
+// makes goes with mirza_free, or with mirza_compile when it fails
+static void test_compile_many(test_suite_t* suite)
+{
+    char out[64];
+    const char* source =
+        "var g : i64 = 1\nfunc sq(x : i64) : i64 {\nret x * x\n}\nfunc h(x : i64) : i64 {\nret g + x\n}\n"
+        "var s : i64 = 0\nfor var i = 0; i < 10; i = i + 1 {\nif i > 3 {\nbreak\n}\ns = s + sq(i) * 3\n}\n"
+        "print(s, \" \", h(s))\n";
+    const char* wrong = "var x = 1\nprint(y)\n";
+
+    // The first compiles grow the buffers the allocator keeps
+    for (int i = 0; i < 100; i++)
+        mirza_free(mirza_compile(source, strlen(source), NULL, NULL, 0));
+
+    size_t before = mallinfo2().uordblks;
+
+    for (int i = 0; i < 500; i++)
+    {
+        mirza_program_t* program = mirza_compile(source, strlen(source), NULL, NULL, 0);
+        mirza_run(program, out, sizeof(out));
+        mirza_free(program);
+        mirza_compile(wrong, strlen(wrong), NULL, NULL, 0);
+    }
+
+    size_t after = mallinfo2().uordblks;
+
+    TEST_ASSERT_STR_EQ(out, "42 84", "should print 42 84");
+    TEST_ASSERT(after < before + 65536, "compiles should not keep memory");
+}
+
+typedef struct
+{
+    mirza_program_t* program;
+    char out[64];
+} run_t;
+
+static void* run_program(void* arg)
+{
+    run_t* run = arg;
+
+    for (int i = 0; i < 100; i++)
+        mirza_run(run->program, run->out, sizeof(run->out));
+    return NULL;
+}
+
+static void test_threads(test_suite_t* suite)
+{
+    const char* source = "func fib(n : i64) : i64 {\nif n < 2 {\nret n\n}\nret fib(n - 1) + fib(n - 2)\n}\nvar n : i64 = 15\nprint(fib(n))\n";
+    mirza_options_t options = {.jit = 1, .stack_size = 0};
+    run_t runs[4];
+    pthread_t threads[4];
+
+    mirza_program_t* program = mirza_compile(source, strlen(source), &options, NULL, 0);
+    TEST_ASSERT_NOT_NULL(program, "should compile");
+
+    for (int i = 0; i < 4; i++)
+    {
+        runs[i].program = program;
+        pthread_create(&threads[i], NULL, run_program, &runs[i]);
+    }
+    for (int i = 0; i < 4; i++)
+        pthread_join(threads[i], NULL);
+
+    mirza_free(program);
+
+    for (int i = 0; i < 4; i++)
+        TEST_ASSERT_STR_EQ(runs[i].out, "610", "every run should print 610");
+}
+
+int main(void)
+{
+    RUN_SUITE("embedding api",
+        {"run_many", test_run_many},
+        {"source_not_terminated", test_source_not_terminated},
+        {"compile_error", test_compile_error},
+        {"truncated_output", test_truncated_output},
+        {"stack_overflow", test_stack_overflow},
+        {"compile_many", test_compile_many},
+        {"threads", test_threads}
+    );
+
+    printf("All embedding api tests passed!\n");
+    return 0;
+}
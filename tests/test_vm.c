@@ -0,0 +1,1101 @@
+#include "tests.h"
+#include "../cache.h"
+#include "../rvm.h"
+#include <pthread.h>
+
+// ============================================================================
+// Superinstructions
+// ============================================================================
+
+static void test_loop_header(test_suite_t* suite)
+{
+    capture_stdout_start();
+    compile_and_run("var s = 0\nfor var i = 0; i < 100; i = i + 1 {\ns = s + i\n}\nprint(s)\n");
+    capture_stdout_end();
+    
+    TEST_ASSERT_STR_EQ(captured_output, "4950", "should print 4950");
+}
+
+static void test_local_increment(test_suite_t* suite)
+{
+    capture_stdout_start();
+    compile_and_run("var x : i64 = 10\nx = x - 3\nx = x + 127\nx = x - 128\nprint(x)\n");
+    capture_stdout_end();
+    
+    TEST_ASSERT_STR_EQ(captured_output, "6", "should print 6");
+}
+
+static void test_narrow_increment_wraps(test_suite_t* suite)
+{
+    capture_stdout_start();
+    compile_and_run("var x : i8 = 127\nx = x + 1\nprint(x)\n");
+    capture_stdout_end();
+    
+    TEST_ASSERT_STR_EQ(captured_output, "-128", "should print -128");
+}
+
+static void test_local_sum(test_suite_t* suite)
+{
+    capture_stdout_start();
+    compile_and_run("var a : i8 = 100\nvar b : i16 = -300\nprint(a + b)\n");
+    capture_stdout_end();
+    
+    TEST_ASSERT_STR_EQ(captured_output, "-200", "should print -200");
+}
+
+static void test_compare_branch(test_suite_t* suite)
+{
+    capture_stdout_start();
+    compile_and_run("var x = 5\n"
+                    "if x > 4 {\nprint(1)\n}\nif x < 5 {\nprint(2)\n}\n"
+                    "if x >= 5 {\nprint(3)\n}\nif x <= 4 {\nprint(4)\n}\n"
+                    "if x == 5 {\nprint(5)\n}\nif x != 5 {\nprint(6)\n}\n");
+    capture_stdout_end();
+    
+    TEST_ASSERT_STR_EQ(captured_output, "135", "should print 135");
+}
+
+static void test_compare_branch_real(test_suite_t* suite)
+{
+    capture_stdout_start();
+    compile_and_run("var r : real = 1.5\nif r < 2.0 {\nprint(1)\n} else {\nprint(0)\n}\n");
+    capture_stdout_end();
+    
+    TEST_ASSERT_STR_EQ(captured_output, "1", "should print 1");
+}
+
+// ============================================================================
+// Register VM
+// ============================================================================
+
+static void compile_and_run_register(const char* code)
+{
+    compile_options.backend = BACKEND_REGISTER;
+    compile_and_run(code);
+    compile_options.backend = BACKEND_STACK;
+}
+
+static void test_register_loop(test_suite_t* suite)
+{
+    capture_stdout_start();
+    compile_and_run_register("var s = 0\nfor var i = 0; i < 100; i = i + 1 {\nif i == 50 {\ncontinue\n}\ns = s + i\n}\nprint(s)\n");
+    capture_stdout_end();
+    
+    TEST_ASSERT_STR_EQ(captured_output, "4900", "should print 4900");
+}
+
+static void test_register_recursion(test_suite_t* suite)
+{
+    capture_stdout_start();
+    compile_and_run_register("func fib(n : i64) : i64 {\nif n < 2 {\nret n\n}\nret fib(n - 1) + fib(n - 2)\n}\nvar n : i64 = 15\nprint(fib(n))\n");
+    capture_stdout_end();
+    
+    TEST_ASSERT_STR_EQ(captured_output, "610", "should print 610");
+}
+
+static void test_register_narrow_assign(test_suite_t* suite)
+{
+    capture_stdout_start();
+    compile_and_run_register("var x : i8 = 100\nx = x + x\nprint(x)\n");
+    capture_stdout_end();
+    
+    TEST_ASSERT_STR_EQ(captured_output, "-56", "should print -56");
+}
+
+static void test_register_real_and_str(test_suite_t* suite)
+{
+    capture_stdout_start();
+    compile_and_run_register("var r : real = sqrt(16.0)\nvar s = \"ab\"\nprint(r * 0.5, \" \", s, slen(s))\n");
+    capture_stdout_end();
+    
+    TEST_ASSERT_STR_EQ(captured_output, "2.000000 ab2", "should print 2.000000 ab2");
+}
+
+// ============================================================================
+// JIT: every program must print the same on the interpreter and natively
+// ============================================================================
+
+static char interpreted_output[sizeof(captured_output)];
+
+static void compile_and_run_both(const char* code)
+{
+    capture_stdout_start();
+    compile_and_run(code);
+    capture_stdout_end();
+    strcpy(interpreted_output, captured_output);
+
+    compile_options.backend = BACKEND_JIT;
+    capture_stdout_start();
+    compile_and_run(code);
+    capture_stdout_end();
+    compile_options.backend = BACKEND_STACK;
+}
+
+static void test_jit_integer_loop(test_suite_t* suite)
+{
+    compile_and_run_both("var s = 0\nfor var i = 0; i < 1000; i = i + 1 {\nif i % 3 == 0 {\ncontinue\n}\ns = s + i * 2 - i / 2\n}\nprint(s, \" \", -s & 255, \" \", s | 7, \" \", s ^ 1)\n");
+    
+    TEST_ASSERT_STR_EQ(captured_output, interpreted_output, "jit should match the interpreter");
+    TEST_ASSERT_STR_EQ(captured_output, "499167 33 499167 499166", "should print 499167 33 499167 499166");
+}
+
+static void test_jit_recursion(test_suite_t* suite)
+{
+    compile_and_run_both("func fib(n : i64) : i64 {\nif n < 2 {\nret n\n}\nret fib(n - 1) + fib(n - 2)\n}\nvar n : i64 = 20\nprint(fib(n))\n");
+    
+    TEST_ASSERT_STR_EQ(captured_output, interpreted_output, "jit should match the interpreter");
+    TEST_ASSERT_STR_EQ(captured_output, "6765", "should print 6765");
+}
+
+static void test_jit_real(test_suite_t* suite)
+{
+    compile_and_run_both("var r : real = 0.5\nfor var i = 0; i < 10; i = i + 1 {\nr = r * 1.5 - 0.25\n}\n"
+                         "print(r, \" \", sqrt(16.0), \" \", -r)\nif r > 1.0 {\nprint(1)\n}\nif r == r {\nprint(2)\n}\nif r < 1.0 {\nprint(3)\n}\n");
+    
+    TEST_ASSERT_STR_EQ(captured_output, interpreted_output, "jit should match the interpreter");
+}
+
+static void test_jit_narrow_types(test_suite_t* suite)
+{
+    compile_and_run_both("func wrap(x : i8) : i8 {\nret x + x\n}\nvar a : i8 = 100\nvar b : i16 = 30000\nb = b + b\nprint(wrap(a), \" \", b, \" \", abs(a - 120))\n");
+    
+    TEST_ASSERT_STR_EQ(captured_output, interpreted_output, "jit should match the interpreter");
+    TEST_ASSERT_STR_EQ(captured_output, "-56 -5536 20", "should print -56 -5536 20");
+}
+
+// ============================================================================
+// Short-circuit and / or
+// ============================================================================
+
+static const char* SHORT_CIRCUIT_PROGRAM =
+    "func expensive(x : i64) : i64 {\nprint(\"E\")\nret x\n}\n"
+    "var n : i64 = 3\n"
+    "for var i = 0; i < 6; i = i + 1 {\n"
+    "if i < n and expensive(i) > 0 {\nprint(i)\n}\n"
+    "if i > 4 or expensive(i) == 2 {\nprint(\"!\")\n}\n}\n"
+    "var a = 0\nvar b = 5\nvar c = a and expensive(b)\n"
+    "print(\" \", c, \" \", a or b, \" \", b and 7, \" \", (a or 0) and b)\n";
+
+static void test_short_circuit(test_suite_t* suite)
+{
+    capture_stdout_start();
+    compile_and_run(SHORT_CIRCUIT_PROGRAM);
+    capture_stdout_end();
+
+    TEST_ASSERT_STR_EQ(captured_output, "EEE1EE2E!EE! 0 1 1 0", "should print EEE1EE2E!EE! 0 1 1 0");
+}
+
+static void test_register_short_circuit(test_suite_t* suite)
+{
+    capture_stdout_start();
+    compile_and_run_register(SHORT_CIRCUIT_PROGRAM);
+    capture_stdout_end();
+
+    TEST_ASSERT_STR_EQ(captured_output, "EEE1EE2E!EE! 0 1 1 0", "should print EEE1EE2E!EE! 0 1 1 0");
+}
+
+// `and` and `or` take the truth of reals like conditions do, -0.0 is false,
+// and select 1 or 0 for any mix of operands
+static const char* LOGICAL_OPERAND_PROGRAM =
+    "var i : i64 = 0\nvar r : real = 0.0\nvar h : real = 0.5\nvar z : real = -0.0\n"
+    "if h and i == 0 {\nprint(\"A\")\n}\nif z or r {\nprint(\"Z\")\n}\n"
+    "print(\" \", 1.5 and 2.5, \" \", h or i, \" \", r or i, \" \", z and 1, \" \", i or h, \" \", h and r)\n";
+
+static void test_logical_operands(test_suite_t* suite)
+{
+    compile_and_run_both(LOGICAL_OPERAND_PROGRAM);
+    TEST_ASSERT_STR_EQ(interpreted_output, "A 1 1 0 0 1 0", "should print A 1 1 0 0 1 0");
+    TEST_ASSERT_STR_EQ(captured_output, interpreted_output, "jit should match the interpreter");
+
+    capture_stdout_start();
+    compile_and_run_register(LOGICAL_OPERAND_PROGRAM);
+    capture_stdout_end();
+    TEST_ASSERT_STR_EQ(captured_output, interpreted_output, "register vm should match the interpreter");
+}
+
+// ============================================================================
+// Typed branches
+// ============================================================================
+
+// m has the bit pattern of -0.0 and n is a NaN
+static const char* TYPED_BRANCH_PROGRAM =
+    "var m : i64 = -9223372036854775807 - 1\nvar r : real = 0.5\nvar z : real = -0.0\nvar n : real = sqrt(-1.0)\n"
+    "if m {\nprint(\"M\")\n}\nif r {\nprint(\"R\")\n}\nif z {\nprint(\"Z\")\n}\n"
+    "if n != n {\nprint(\"N\")\n}\nif n > 0.0 or n <= 0.0 {\nprint(\"X\")\n}\nif n == n {\nprint(\"Y\")\n}\n"
+    "if r > 0.25 and r < 1.0 {\nprint(\"B\")\n}\n"
+    "print(\" \", m != 0 and r >= 0.5, \" \", z or n < 0.0)\n";
+
+static void test_typed_branches(test_suite_t* suite)
+{
+    compile_and_run_both(TYPED_BRANCH_PROGRAM);
+
+    TEST_ASSERT_STR_EQ(captured_output, interpreted_output, "jit should match the interpreter");
+    TEST_ASSERT_STR_EQ(captured_output, "MRNB 1 0", "should print MRNB 1 0");
+}
+
+static void test_register_typed_branches(test_suite_t* suite)
+{
+    capture_stdout_start();
+    compile_and_run_register(TYPED_BRANCH_PROGRAM);
+    capture_stdout_end();
+
+    TEST_ASSERT_STR_EQ(captured_output, "MRNB 1 0", "should print MRNB 1 0");
+}
+
+// ============================================================================
+// Tail calls
+// ============================================================================
+
+// sum recurses far deeper than the stack; wrap narrows the result of outer
+static const char* TAIL_CALL_PROGRAM =
+    "func sum(n : i64, acc : i64) : i64 {\nif n == 0 {\nret acc\n}\nret sum(n - 1, acc + n)\n}\n"
+    "func wrap(x : i64) : i8 {\nret x\n}\nfunc outer(x : i64) : i64 {\nret wrap(x)\n}\n"
+    "func pick(a : i64, b : i64, c : i64) : i64 {\nret a * 100 + b * 10 + c\n}\n"
+    "func rot(a : i64, b : i64, c : i64) : i64 {\nret pick(c, a, b)\n}\n"
+    "var n : i64 = 1000000\nvar z : i64 = 0\nvar a : i64 = 1\nvar b : i64 = 2\nvar c : i64 = 3\nvar w : i64 = 200\n"
+    "print(sum(n, z), \" \", outer(w), \" \", rot(a, b, c))\n";
+
+static void test_tail_calls(test_suite_t* suite)
+{
+    compile_and_run_both(TAIL_CALL_PROGRAM);
+
+    TEST_ASSERT_STR_EQ(captured_output, interpreted_output, "jit should match the interpreter");
+    TEST_ASSERT_STR_EQ(captured_output, "500000500000 -56 312", "should print 500000500000 -56 312");
+}
+
+static void test_register_tail_calls(test_suite_t* suite)
+{
+    capture_stdout_start();
+    compile_and_run_register(TAIL_CALL_PROGRAM);
+    capture_stdout_end();
+
+    TEST_ASSERT_STR_EQ(captured_output, "500000500000 -56 312", "should print 500000500000 -56 312");
+}
+
+// ============================================================================
+// Inlining
+// ============================================================================
+
+// clamp is too large to inline once the two calls of max are inlined into it
+static const char* INLINE_PROGRAM =
+    "func max(a : i64, b : i64) : i64 {\nif a > b {\nret a\n} else {\nret b\n"
+    "}\n}\nfunc clamp(x : i64, lo : i64, hi : i64) : i64 {\nret max(lo, -max(-x, -hi))\n"
+    "}\nfunc is_odd(x : i64) : i64 {\nvar r = x % 2\nif r != 0 {\nret 1\n}\n"
+    "ret 0\n}\nfunc half(x : real) : real {\nret x / 2.0\n}\nfunc narrow(x : i64) : i8 {\n"
+    "ret x\n}\nfunc nothing(x : i64) : i64 {\nvar y : i64 = x\n}\nvar s : i64 = 0\n"
+    "var two : i64 = 2\nvar three : i64 = 3\nvar seven : i64 = 7\nfor var i : i64 = 0; i < 10; i = i + 1 {\n"
+    "s = s + clamp(i, two, seven) * is_odd(i) + max(i, max(three, i))\n}\nvar a : i64 = 200\n"
+    "print(s, \" \", half(3.0), \" \", narrow(a), \" \", nothing(a), \" \", max(max(a, two), max(seven, a + 1)))\n";
+
+static void test_inline_functions(test_suite_t* suite)
+{
+    compile_and_run_both(INLINE_PROGRAM);
+
+    TEST_ASSERT_STR_EQ(captured_output, interpreted_output, "jit should match the interpreter");
+    TEST_ASSERT_STR_EQ(captured_output, "75 1.500000 -56 0 201", "should print 75 1.500000 -56 0 201");
+}
+
+static void test_register_inline_functions(test_suite_t* suite)
+{
+    capture_stdout_start();
+    compile_and_run_register(INLINE_PROGRAM);
+    capture_stdout_end();
+
+    TEST_ASSERT_STR_EQ(captured_output, "75 1.500000 -56 0 201", "should print 75 1.500000 -56 0 201");
+}
+
+static void test_no_inline(test_suite_t* suite)
+{
+    compile_options.inlining = false;
+    capture_stdout_start();
+    compile_and_run(INLINE_PROGRAM);
+    capture_stdout_end();
+    compile_options.inlining = true;
+
+    TEST_ASSERT_STR_EQ(captured_output, "75 1.500000 -56 0 201", "should print 75 1.500000 -56 0 201");
+}
+
+// ============================================================================
+// Loop optimizations
+// ============================================================================
+
+// fib is recursive, so it is not inlined and its call in the condition is
+// hoisted as a call. The division by d sits behind an if and must stay in
+// the loop, since d is zero.
+static const char* LOOP_PROGRAM =
+    "func fib(n : i64) : i64 {\nif n < 2 {\nret n\n}\nret fib(n - 1) + fib(n - 2)\n}\n"
+    "var m : i64 = 7\nvar d : i64 = 0\nvar f : i64 = 6\nvar s : i64 = 0\nvar z : i64 = 0\n"
+    "for var i = 0; i < fib(f) * 2; i = i + 1 {\nfor var j = 0; j < m; j = j + 1 {\n"
+    "s = s + i * m + j * 4 + (m * m + 1)\n}\nif d != 0 {\nz = z + 100 / d\n}\n}\n"
+    "for var i = 100; i > 0; i = i - 3 {\nif i / 2 > 10 {\ncontinue\n}\nz = z + i * m + i * 8\n}\n"
+    "print(s, \" \", z)\n";
+
+static void test_loop_optimizations(test_suite_t* suite)
+{
+    compile_and_run_both(LOOP_PROGRAM);
+
+    TEST_ASSERT_STR_EQ(captured_output, interpreted_output, "jit should match the interpreter");
+    TEST_ASSERT_STR_EQ(captured_output, "12824 1050", "should print 12824 1050");
+}
+
+static void test_register_loop_optimizations(test_suite_t* suite)
+{
+    capture_stdout_start();
+    compile_and_run_register(LOOP_PROGRAM);
+    capture_stdout_end();
+
+    TEST_ASSERT_STR_EQ(captured_output, "12824 1050", "should print 12824 1050");
+}
+
+// ============================================================================
+// Dead code elimination
+// ============================================================================
+
+// b and c are never read, the first store to d is overwritten and the
+// statements after ret and break never run. e is live across the break.
+// loop.c keeps i * 2 in a hidden local, and the function symbol f has a
+// slot that is never used.
+static const char* DEAD_CODE_PROGRAM =
+    "func f(x : i64) : i64 {\nvar dead : i64 = x * 3\nfor var i : i64 = 0; i < x; i = i + 1 {\n"
+    "if i > 2 {\nret i\nprint(\"never\")\n}\n}\nret 0\nprint(\"never\")\n}\n"
+    "var a : i64 = 7\nvar b : real = 2.5\nvar c = \"unused\"\nvar d : i64 = 1\nd = a + 2\n"
+    "var e : i64 = 0\nfor var i : i64 = 0; i < 10; i = i + 1 {\ne = i * 2\n"
+    "if i == 4 {\nbreak\ne = 100\n}\n}\nprint(f(a), \" \", d, \" \", e)\n";
+
+static void test_dead_code(test_suite_t* suite)
+{
+    compile_options.dead_code = false;
+    capture_stdout_start();
+    compile_and_run(DEAD_CODE_PROGRAM);
+    capture_stdout_end();
+    compile_options.dead_code = true;
+
+    TEST_ASSERT_STR_EQ(captured_output, "3 9 8", "should print 3 9 8 without dce");
+    TEST_ASSERT_EQ(compiled_globals, 8, "every global and hidden local should have a slot");
+
+    capture_stdout_start();
+    compile_and_run(DEAD_CODE_PROGRAM);
+    capture_stdout_end();
+
+    TEST_ASSERT_STR_EQ(captured_output, "3 9 8", "should print 3 9 8");
+    TEST_ASSERT_EQ(compiled_globals, 5, "only a, d, e, i and the hidden i * 2 should keep a slot");
+}
+
+static void test_register_dead_code(test_suite_t* suite)
+{
+    capture_stdout_start();
+    compile_and_run_register(DEAD_CODE_PROGRAM);
+    capture_stdout_end();
+
+    TEST_ASSERT_STR_EQ(captured_output, "3 9 8", "should print 3 9 8");
+}
+
+// A frame past the stack or an unknown opcode stops the run with an error
+static void test_register_errors(test_suite_t* suite)
+{
+    value_t k = {0};
+
+    rvm_init(16);
+    rvm_emit(REG_ENTER, 100, 0, 0, k);
+    rvm_emit(REG_HALT, 0, 0, 0, k);
+    const char* overflow = rvm_exec();
+    rvm_free();
+
+    rvm_init(16);
+    rvm_emit(REG_SLEN + 1, 0, 0, 0, k);
+    const char* bad = rvm_exec();
+    rvm_free();
+
+    TEST_ASSERT_NOT_NULL(overflow, "should stop past the stack");
+    TEST_ASSERT_STR_EQ(overflow, "stack overflow", "should report the overflow");
+    TEST_ASSERT_NOT_NULL(bad, "should stop on an unknown opcode");
+    TEST_ASSERT_STR_EQ(bad, "bad opcode", "should report the opcode");
+}
+
+// ============================================================================
+// SSA IR: code lowered from the IR must print what eval's code prints
+// ============================================================================
+
+static char direct_output[sizeof(captured_output)];
+
+static void compile_and_run_ir(const char* code, backend_t backend)
+{
+    capture_stdout_start();
+    compile_and_run(code);
+    capture_stdout_end();
+    strcpy(direct_output, captured_output);
+
+    compile_options.use_ir = true;
+    compile_options.backend = backend;
+    capture_stdout_start();
+    compile_and_run(code);
+    capture_stdout_end();
+    compile_options.backend = BACKEND_STACK;
+    compile_options.use_ir = false;
+}
+
+// The loop swaps a and b through t and carries a string and a real, so its
+// header has phis of every type, some reading the others
+static const char* IR_PHI_PROGRAM =
+    "var a : i64 = 1\nvar b : i64 = 2\nvar t : i64 = 0\nvar s = \"x\"\nvar r : real = 1.0\n"
+    "for var i = 0; i < 5; i = i + 1 {\nt = a\na = b\nb = t + b\nif i == 3 {\ns = \"y\"\n}\nr = r * 2.0\n}\n"
+    "print(a, \" \", b, \" \", s, \" \", r, \" \", t)\n";
+
+static void test_ir_phis(test_suite_t* suite)
+{
+    compile_and_run_ir(IR_PHI_PROGRAM, BACKEND_STACK);
+
+    TEST_ASSERT_STR_EQ(captured_output, direct_output, "ir should match eval");
+    TEST_ASSERT_STR_EQ(captured_output, "13 21 y 32.000000 8", "should print 13 21 y 32.000000 8");
+}
+
+// h and k read g and r, which eval loads from the slots of their addresses
+// in the frame of the callee
+static const char* OUTER_PROGRAM =
+    "var g : i64 = 1\nvar r : real = 0.5\nfunc h(x : i64) : i64 {\nret g + x\n}\n"
+    "func k(x : i64, y : real) : real {\nret r + y\n}\n"
+    "var a : i64 = 7\nvar b : real = 2.0\nprint(h(a), \" \", k(a, b))\n";
+
+static void test_ir_programs(test_suite_t* suite)
+{
+    compile_and_run_ir(SHORT_CIRCUIT_PROGRAM, BACKEND_STACK);
+    TEST_ASSERT_STR_EQ(captured_output, direct_output, "short circuit should match eval");
+
+    compile_and_run_ir(LOGICAL_OPERAND_PROGRAM, BACKEND_STACK);
+    TEST_ASSERT_STR_EQ(captured_output, direct_output, "logical operands should match eval");
+
+    compile_and_run_ir(TYPED_BRANCH_PROGRAM, BACKEND_STACK);
+    TEST_ASSERT_STR_EQ(captured_output, direct_output, "typed branches should match eval");
+
+    compile_and_run_ir(TAIL_CALL_PROGRAM, BACKEND_STACK);
+    TEST_ASSERT_STR_EQ(captured_output, "500000500000 -56 312", "tail calls should print 500000500000 -56 312");
+
+    compile_and_run_ir(INLINE_PROGRAM, BACKEND_STACK);
+    TEST_ASSERT_STR_EQ(captured_output, "75 1.500000 -56 0 201", "inlining should print 75 1.500000 -56 0 201");
+
+    compile_and_run_ir(LOOP_PROGRAM, BACKEND_STACK);
+    TEST_ASSERT_STR_EQ(captured_output, "12824 1050", "loops should print 12824 1050");
+
+    compile_and_run_ir(DEAD_CODE_PROGRAM, BACKEND_STACK);
+    TEST_ASSERT_STR_EQ(captured_output, "3 9 8", "dead code should print 3 9 8");
+
+    compile_and_run_ir(OUTER_PROGRAM, BACKEND_STACK);
+    TEST_ASSERT_STR_EQ(captured_output, direct_output, "outer variables should match eval");
+}
+
+static void test_ir_jit(test_suite_t* suite)
+{
+    compile_and_run_ir(IR_PHI_PROGRAM, BACKEND_JIT);
+    TEST_ASSERT_STR_EQ(captured_output, direct_output, "phis should match eval");
+
+    compile_and_run_ir(TAIL_CALL_PROGRAM, BACKEND_JIT);
+    TEST_ASSERT_STR_EQ(captured_output, direct_output, "tail calls should match eval");
+
+    compile_and_run_ir(LOOP_PROGRAM, BACKEND_JIT);
+    TEST_ASSERT_STR_EQ(captured_output, direct_output, "loops should match eval");
+}
+
+static void test_dump_ir(test_suite_t* suite)
+{
+    char filename[] = "/tmp/mirza_ir_XXXXXX";
+    int fd = mkstemp(filename);
+    char dump[4096] = {0};
+
+    TEST_ASSERT(fd >= 0, "should create a temporary file");
+    close(fd);
+
+    compile_options.dump_ir_filename = filename;
+    capture_stdout_start();
+    compile_and_run(IR_PHI_PROGRAM);
+    capture_stdout_end();
+    compile_options.dump_ir_filename = NULL;
+
+    FILE* file = fopen(filename, "r");
+    TEST_ASSERT_NOT_NULL(file, "should write the dump");
+    fread(dump, 1, sizeof(dump) - 1, file);
+    fclose(file);
+    remove(filename);
+
+    TEST_ASSERT_STR_EQ(captured_output, "13 21 y 32.000000 8", "dumping should not change the program");
+    TEST_ASSERT(strstr(dump, "func main(0)") != NULL, "should dump the program");
+    TEST_ASSERT(strstr(dump, "phi") != NULL, "should dump the phis of the loop");
+}
+
+// ============================================================================
+// Constant folding
+// ============================================================================
+
+static void test_fold_constants(test_suite_t* suite)
+{
+    capture_stdout_start();
+    compile_and_run("var x : i64 = 7\nprint(2 * 3 + x, \" \", -5 + 3, \" \", 100000 * 3, \" \", 7 / 2, \" \", sqrt(4.0), \" \", pow(2.0, 10.0), \" \", abs(-7))\n");
+    capture_stdout_end();
+
+    TEST_ASSERT_STR_EQ(captured_output, "13 -2 300000 3 2.000000 1024.000000 7", "should print 13 -2 300000 3 2.000000 1024.000000 7");
+}
+
+static void test_fold_identities(test_suite_t* suite)
+{
+    capture_stdout_start();
+    compile_and_run("var x : i64 = -7\nvar r : real = 2.5\nprint(x * 1, \" \", 0 + x, \" \", x * 8, \" \", 4 * x, \" \", r * 1.0, \" \", r - 0.0)\n");
+    capture_stdout_end();
+
+    TEST_ASSERT_STR_EQ(captured_output, "-7 -7 -56 -28 2.500000 2.500000", "should print -7 -7 -56 -28 2.500000 2.500000");
+}
+
+// -0.0 folds to a constant that must keep its sign, so it cannot use RCONST_0
+static const char* SIGNED_ZERO_PROGRAM = "print(-0.0, \" \", 1.0 / -0.0)\n";
+
+static void test_fold_signed_zero(test_suite_t* suite)
+{
+    compile_and_run_both(SIGNED_ZERO_PROGRAM);
+    TEST_ASSERT_STR_EQ(interpreted_output, "-0.000000 -inf", "should print -0.000000 -inf");
+    TEST_ASSERT_STR_EQ(captured_output, interpreted_output, "jit should match the interpreter");
+
+    compile_and_run_ir(SIGNED_ZERO_PROGRAM, BACKEND_STACK);
+    TEST_ASSERT_STR_EQ(captured_output, "-0.000000 -inf", "ir should print -0.000000 -inf");
+}
+
+// ============================================================================
+// Peephole optimizer: the optimized code must print the same as the original
+// ============================================================================
+
+static char unoptimized_output[sizeof(captured_output)];
+
+static void compile_and_run_peephole(const char* code)
+{
+    compile_options.peephole = false;
+    capture_stdout_start();
+    compile_and_run(code);
+    capture_stdout_end();
+    strcpy(unoptimized_output, captured_output);
+    compile_options.peephole = true;
+
+    capture_stdout_start();
+    compile_and_run(code);
+    capture_stdout_end();
+}
+
+static void test_peephole_jumps(test_suite_t* suite)
+{
+    compile_and_run_peephole("func f(x : i64) : i64 {\nif x > 3 {\nret x * 2\n}\nret x\n}\n"
+                             "var s = 0\nfor var i = 0; i < 10; i = i + 1 {\nif i > 5 {\nif i > 7 {\ns = s + 1\n}\n}\ns = s + f(i)\n}\nprint(s)\n");
+
+    TEST_ASSERT_STR_EQ(captured_output, unoptimized_output, "optimized code should match");
+    TEST_ASSERT_STR_EQ(captured_output, "86", "should print 86");
+}
+
+static void test_peephole_casts_and_stores(test_suite_t* suite)
+{
+    compile_and_run_peephole("var a : i8 = 0\nvar b : i16 = 0\nb = 300\na = b\nprint(a, \" \")\n"
+                             "var c : i32 = 1\nc = c + 70000\nprint(c)\n");
+
+    TEST_ASSERT_STR_EQ(captured_output, unoptimized_output, "optimized code should match");
+    TEST_ASSERT_STR_EQ(captured_output, "44 70001", "should print 44 70001");
+}
+
+// ============================================================================
+// Instances: one program, run on several threads at once
+// ============================================================================
+
+#define INSTANCE_PROGRAM \
+    "func fib(n : i64) : i64 {\nif n < 2 {\nret n\n}\nret fib(n - 1) + fib(n - 2)\n}\n" \
+    "var n : i64 = 20\nvar s = 0\nfor var i = 0; i < 3; i = i + 1 {\ns = s + fib(n)\n}\nprint(s, \" \")\n"
+
+static void* run_instance(void* machine)
+{
+    vm_exec(machine);
+    return NULL;
+}
+
+static void run_instances(void)
+{
+    vm_t* machines[4];
+    pthread_t threads[4];
+
+    compile(INSTANCE_PROGRAM, 0);
+    for (int i = 0; i < 4; i++)
+        machines[i] = vm_new(2048);
+
+    // The program outlives its release while instances still use it
+    vm_release();
+
+    capture_stdout_start();
+    for (int i = 0; i < 4; i++)
+        pthread_create(&threads[i], NULL, run_instance, machines[i]);
+    for (int i = 0; i < 4; i++)
+        pthread_join(threads[i], NULL);
+    capture_stdout_end();
+
+    for (int i = 0; i < 4; i++)
+        vm_free(machines[i]);
+}
+
+static void test_instances(test_suite_t* suite)
+{
+    run_instances();
+    TEST_ASSERT_STR_EQ(captured_output, "20295 20295 20295 20295 ", "every instance should print 20295");
+
+    compile_options.backend = BACKEND_JIT;
+    run_instances();
+    compile_options.backend = BACKEND_STACK;
+    TEST_ASSERT_STR_EQ(captured_output, "20295 20295 20295 20295 ", "every native instance should print 20295");
+}
+
+// ============================================================================
+// Sessions: separate programs, compiled on several threads at once
+// ============================================================================
+
+#define SESSION_PROGRAM \
+    "func fib(n : i64) : i64 {\nif n < 2 {\nret n\n}\nret fib(n - 1) + fib(n - 2)\n}\n" \
+    "var n : i64 = %d\nfor var i = 0; i < 50; i = i + 1 {\nn = n + 0\n}\nprint(fib(n), \" \")\n"
+
+typedef struct
+{
+    int n;
+    vm_t* machine;
+} session_t;
+
+static void* compile_session(void* arg)
+{
+    session_t* session = arg;
+    char code[512];
+
+    snprintf(code, sizeof(code), SESSION_PROGRAM, session->n);
+    compile(code, 0);
+    session->machine = vm_new(2048);
+    vm_release();
+    return NULL;
+}
+
+static void test_sessions(test_suite_t* suite)
+{
+    session_t sessions[4];
+    pthread_t threads[4];
+
+    for (int i = 0; i < 4; i++)
+    {
+        sessions[i].n = 10 + i;
+        pthread_create(&threads[i], NULL, compile_session, &sessions[i]);
+    }
+    for (int i = 0; i < 4; i++)
+        pthread_join(threads[i], NULL);
+
+    capture_stdout_start();
+    for (int i = 0; i < 4; i++)
+        vm_exec(sessions[i].machine);
+    capture_stdout_end();
+
+    for (int i = 0; i < 4; i++)
+        vm_free(sessions[i].machine);
+
+    TEST_ASSERT_STR_EQ(captured_output, "55 89 144 233 ", "every session should compile its own program");
+}
+
+// ============================================================================
+// Scopes: lookups through many symbols, shadowing and the global fallback
+// ============================================================================
+
+static void test_many_symbols(test_suite_t* suite)
+{
+    char code[16384];
+    size_t used = 0;
+
+    for (int i = 0; i < 300; i++)
+        used += snprintf(code + used, sizeof(code) - used, "var v%d : i64 = %d\n", i, i);
+    snprintf(code + used, sizeof(code) - used,
+             "func f(v5 : i64) : i64 {\nvar v6 : i64 = 1000\nret v5 + v6\n}\n"
+             "for var i = 0; i < 1; i = i + 1 {\nvar v8 : i64 = 2000\nprint(v8 + v299, \" \")\n}\n"
+             "print(f(v1), \" \", v5, \" \", v6, \" \", v8, \" \", v150)\n");
+
+    capture_stdout_start();
+    compile_and_run(code);
+    capture_stdout_end();
+
+    TEST_ASSERT_STR_EQ(captured_output, "2299 1001 5 6 8 150", "should print 2299 1001 5 6 8 150");
+}
+
+// Each distinct literal is stored in the data segment once
+static void test_shared_literals(test_suite_t* suite)
+{
+    capture_stdout_start();
+    compile("var s = \"hello\"\nprint(s, \" \", \"hello\", \" \")\nprint(\"hello\")\n", 1);
+    capture_stdout_end();
+
+    TEST_ASSERT_STR_EQ(captured_output, "hello hello hello", "should print hello hello hello");
+    TEST_ASSERT_EQ(vm_data_addr(), 8, "data should hold \"hello\" and \" \" once each");
+    vm_release();
+}
+
+// ============================================================================
+// Wide jumps: code past 64 KiB is reached through 32-bit addresses
+// ============================================================================
+
+// The if jumps over more than 64 KiB of code, after which come a loop, a
+// call and a tail call to functions defined there
+static char* wide_program()
+{
+    const char* head = "func twice(n : i64) : i64 {\nret n * 2\n}\nvar x : i64 = 0\nvar y : i64 = 3\nif x >= 0 {\n";
+    const char* line = "x = x + y\n";
+    const char* tail =
+        "}\nfunc sum(n : i64, acc : i64) : i64 {\nif n == 0 {\nret acc\n}\nret sum(n - 1, acc + n)\n}\n"
+        "for var i = 0; i < 10; i = i + 1 {\nx = x + twice(i)\n}\nvar n : i64 = 100\nvar z : i64 = 0\n"
+        "print(x, \" \", sum(n, z))\n";
+    size_t lines = 12000;
+    char* code = malloc(strlen(head) + strlen(line) * lines + strlen(tail) + 1);
+
+    strcpy(code, head);
+    for (size_t i = 0; i < lines; i++)
+        strcat(code + strlen(head) + strlen(line) * i, line);
+    strcat(code, tail);
+    return code;
+}
+
+static void test_wide_jumps(test_suite_t* suite)
+{
+    char* code = wide_program();
+
+    compile_options.inlining = false;
+    compile_and_run_both(code);
+    TEST_ASSERT_STR_EQ(captured_output, interpreted_output, "jit should match the interpreter");
+    TEST_ASSERT_STR_EQ(captured_output, "36090 5050", "should print 36090 5050");
+
+    compile_options.peephole = false;
+    capture_stdout_start();
+    compile_and_run(code);
+    capture_stdout_end();
+    compile_options.peephole = true;
+    compile_options.inlining = true;
+    TEST_ASSERT_STR_EQ(captured_output, "36090 5050", "should print 36090 5050 without the peephole optimizer");
+
+    free(code);
+}
+
+// ============================================================================
+// Stack: it grows with the recursion, up to its size
+// ============================================================================
+
+#define DEEP_PROGRAM \
+    "func depth(n : i64) : i64 {\nif n == 0 {\nret 0\n}\nret 1 + depth(n - 1)\n}\n" \
+    "var n : i64 = 100000\nprint(depth(n))\n"
+
+static void test_stack_growth(test_suite_t* suite)
+{
+    compile_and_run_both(DEEP_PROGRAM);
+    TEST_ASSERT_STR_EQ(captured_output, interpreted_output, "jit should match the interpreter");
+    TEST_ASSERT_STR_EQ(captured_output, "100000", "should print 100000");
+}
+
+static void test_stack_overflow(test_suite_t* suite)
+{
+    for (int jit = 0; jit < 2; jit++)
+    {
+        compile_options.backend = jit ? BACKEND_JIT : BACKEND_STACK;
+        compile(DEEP_PROGRAM, 0);
+        compile_options.backend = BACKEND_STACK;
+
+        capture_stdout_start();
+        vm_t* machine = vm_new(50000);
+        vm_exec(machine);
+        capture_stdout_end();
+
+        TEST_ASSERT_NOT_NULL(vm_error(machine), "should stop on an error");
+        TEST_ASSERT_STR_EQ(vm_error(machine), "stack overflow", "should report the overflow");
+        TEST_ASSERT_STR_EQ(captured_output, "", "should print nothing");
+        vm_free(machine);
+        vm_release();
+    }
+
+    compile(DEEP_PROGRAM, 0);
+    vm_t* machine = vm_new(SIZE_MAX);
+    vm_exec(machine);
+
+    TEST_ASSERT_STR_EQ(vm_error(machine), "stack size too large", "should not reserve past the address space");
+    vm_free(machine);
+    vm_release();
+}
+
+static void* run_machine(void* machine)
+{
+    vm_exec(machine);
+    return NULL;
+}
+
+// Native calls nest on a machine stack of the instance, so a recursion the
+// stack of the instance holds runs as deep as in the interpreter even on a
+// thread with a small stack
+static void test_native_depth(test_suite_t* suite)
+{
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, 1 << 20);
+
+    for (int jit = 0; jit < 2; jit++)
+    {
+        pthread_t thread;
+
+        compile_options.backend = jit ? BACKEND_JIT : BACKEND_STACK;
+        compile(DEEP_PROGRAM, 0);
+        compile_options.backend = BACKEND_STACK;
+
+        vm_t* machine = vm_new(10000000);
+        capture_stdout_start();
+        pthread_create(&thread, &attr, run_machine, machine);
+        pthread_join(thread, NULL);
+        capture_stdout_end();
+
+        TEST_ASSERT_NULL(vm_error(machine), "should not run out of the thread's stack");
+        TEST_ASSERT_STR_EQ(captured_output, "100000", "should print 100000");
+        vm_free(machine);
+        vm_release();
+    }
+
+    pthread_attr_destroy(&attr);
+}
+
+// Code the compiler never emits stops the instance instead of the process
+static void test_bad_code(test_suite_t* suite)
+{
+    vm_init(16);
+    EMIT(JMP, NUM16(100));
+    EMIT(HALT);
+
+    vm_t* machine = vm_new(2048);
+    vm_exec(machine);
+    TEST_ASSERT_STR_EQ(vm_error(machine), "bad jump target", "should reject a jump out of the code");
+    vm_free(machine);
+
+    vm_init(16);
+    EMIT(OPCODES_COUNT);
+    EMIT(HALT);
+
+    machine = vm_new(2048);
+    vm_exec(machine);
+    TEST_ASSERT_STR_EQ(vm_error(machine), "bad opcode", "should stop on an unknown opcode");
+    vm_free(machine);
+    vm_release();
+}
+
+// ============================================================================
+// Images: a saved program runs the same once loaded back
+// ============================================================================
+
+static void test_image(test_suite_t* suite)
+{
+    char filename[] = "/tmp/mirza_image_XXXXXX";
+    int fd = mkstemp(filename);
+
+    TEST_ASSERT(fd >= 0, "should create a temporary file");
+    close(fd);
+
+    compile(IR_PHI_PROGRAM, 0);
+    TEST_ASSERT(vm_save(filename), "should save the image");
+    vm_release();
+
+    TEST_ASSERT(vm_load(filename), "should load the image");
+    capture_stdout_start();
+    vm_t* machine = vm_new(2048);
+    vm_exec(machine);
+    vm_free(machine);
+    capture_stdout_end();
+    vm_release();
+
+    TEST_ASSERT_STR_EQ(captured_output, "13 21 y 32.000000 8", "should print 13 21 y 32.000000 8");
+
+    // Flip a byte of the code
+    FILE* file = fopen(filename, "r+b");
+    fseek(file, 48, SEEK_SET);
+    int byte = fgetc(file);
+    fseek(file, 48, SEEK_SET);
+    fputc(byte ^ 0xFF, file);
+    fclose(file);
+
+    bool_t loaded = vm_load(filename);
+    remove(filename);
+
+    TEST_ASSERT(!loaded, "should reject a corrupted image");
+}
+
+// Writes `image` to `filename` with `size` bytes at `offset` replaced and
+// the checksum made to match, so only the check under test can reject it
+static bool_t load_patched(const char* filename, uint8_t* image, size_t image_size,
+                           size_t offset, const uint8_t* bytes, size_t size)
+{
+    uint8_t* patched = malloc(image_size);
+    uint32_t hash = 2166136261u;
+
+    memcpy(patched, image, image_size);
+    memcpy(patched + offset, bytes, size);
+
+    // FNV-1a of everything after the checksum, at offset 8
+    for (size_t i = 12; i < image_size; i++)
+    {
+        hash ^= patched[i];
+        hash *= 16777619u;
+    }
+    memcpy(patched + 8, &hash, sizeof (hash));
+
+    FILE* file = fopen(filename, "wb");
+    fwrite(patched, 1, image_size, file);
+    fclose(file);
+    free(patched);
+
+    return vm_load(filename);
+}
+
+// An image with a valid checksum is still checked against what
+// vm_translate and the handlers rely on
+static void test_image_checks(test_suite_t* suite)
+{
+    char filename[] = "/tmp/mirza_image_XXXXXX";
+    int fd = mkstemp(filename);
+    uint8_t image[256];
+
+    TEST_ASSERT(fd >= 0, "should create a temporary file");
+    close(fd);
+
+    // iconst_0 iconst_0 proc 0 0, then sconst 0 sprint halt
+    compile("print(\"hi\")\n", 0);
+    TEST_ASSERT(vm_save(filename), "should save the image");
+    vm_release();
+
+    FILE* file = fopen(filename, "rb");
+    size_t size = fread(image, 1, sizeof (image), file);
+    fclose(file);
+
+    uint32_t code = *(uint32_t*) (image + 20);
+    size_t proc = 0;
+    while (image[code + proc] != PROC)
+        proc++;
+
+    TEST_ASSERT(load_patched(filename, image, size, 0, NULL, 0), "should load the image as it is");
+    vm_release();
+
+    uint32_t entry = proc + 1;
+    TEST_ASSERT(!load_patched(filename, image, size, 12, (uint8_t*) &entry, 4), "should reject an entry inside an instruction");
+
+    uint16_t inside = proc + 1;
+    uint8_t jump[] = {JMP, NUM16(inside)};
+    TEST_ASSERT(!load_patched(filename, image, size, code + proc, jump, 3), "should reject a jump inside an instruction");
+
+    uint8_t far[] = {JMP, NUM16(1000)};
+    TEST_ASSERT(!load_patched(filename, image, size, code + proc, far, 3), "should reject a jump out of the code");
+
+    uint8_t data[] = {SCONST, NUM16(3)};
+    TEST_ASSERT(!load_patched(filename, image, size, code + proc + 5, data, 3), "should reject a string out of the data");
+
+    uint32_t globals = 5;
+    TEST_ASSERT(!load_patched(filename, image, size, 16, (uint8_t*) &globals, 4), "should reject a global frame unlike the entry PROC");
+
+    remove(filename);
+}
+
+static void test_cache(test_suite_t* suite)
+{
+    char dir[] = "/tmp/mirza_cache_XXXXXX";
+    char path[CACHE_PATH_SIZE];
+    char other[CACHE_PATH_SIZE];
+    const char* source = "print(\"cached\")\n";
+
+    TEST_ASSERT_NOT_NULL(mkdtemp(dir), "should create a temporary directory");
+    TEST_ASSERT(cache_path(dir, source, strlen(source), &compile_options, path), "should name the entry");
+    TEST_ASSERT(!cache_load(path), "should miss an empty cache");
+
+    compile(source, 0);
+    TEST_ASSERT(cache_store(path), "should store the entry");
+    vm_release();
+
+    TEST_ASSERT(cache_load(path), "should hit the stored entry");
+    capture_stdout_start();
+    vm_t* machine = vm_new(2048);
+    vm_exec(machine);
+    vm_free(machine);
+    capture_stdout_end();
+    vm_release();
+
+    // A torn entry is a silent miss and is dropped
+    FILE* errors = tmpfile();
+    int saved_stderr = dup(STDERR_FILENO);
+    TEST_ASSERT(truncate(path, 16) == 0, "should truncate the entry");
+    fflush(stderr);
+    dup2(fileno(errors), STDERR_FILENO);
+    bool_t loaded = cache_load(path);
+    fflush(stderr);
+    dup2(saved_stderr, STDERR_FILENO);
+    close(saved_stderr);
+    TEST_ASSERT(!loaded, "should miss a truncated entry");
+    TEST_ASSERT(ftell(errors) == 0, "should not report a truncated entry");
+    TEST_ASSERT(access(path, F_OK) != 0, "should remove a truncated entry");
+    fclose(errors);
+
+    cache_path(dir, source, strlen(source) - 1, &compile_options, other);
+    TEST_ASSERT(strcmp(path, other) != 0, "other source should have another entry");
+    compile_options.peephole = false;
+    cache_path(dir, source, strlen(source), &compile_options, other);
+    compile_options.peephole = true;
+    TEST_ASSERT(strcmp(path, other) != 0, "other options should have another entry");
+
+    remove(path);
+    rmdir(dir);
+
+    TEST_ASSERT_STR_EQ(captured_output, "cached", "should print cached");
+}
+
+int main(void)
+{
+    RUN_SUITE("virtual machine",
+        {"loop_header", test_loop_header},
+        {"local_increment", test_local_increment},
+        {"narrow_increment_wraps", test_narrow_increment_wraps},
+        {"local_sum", test_local_sum},
+        {"compare_branch", test_compare_branch},
+        {"compare_branch_real", test_compare_branch_real},
+        {"register_loop", test_register_loop},
+        {"register_recursion", test_register_recursion},
+        {"register_narrow_assign", test_register_narrow_assign},
+        {"register_real_and_str", test_register_real_and_str},
+        {"jit_integer_loop", test_jit_integer_loop},
+        {"jit_recursion", test_jit_recursion},
+        {"jit_real", test_jit_real},
+        {"jit_narrow_types", test_jit_narrow_types},
+        {"short_circuit", test_short_circuit},
+        {"register_short_circuit", test_register_short_circuit},
+        {"logical_operands", test_logical_operands},
+        {"typed_branches", test_typed_branches},
+        {"register_typed_branches", test_register_typed_branches},
+        {"tail_calls", test_tail_calls},
+        {"register_tail_calls", test_register_tail_calls},
+        {"inline_functions", test_inline_functions},
+        {"register_inline_functions", test_register_inline_functions},
+        {"no_inline", test_no_inline},
+        {"loop_optimizations", test_loop_optimizations},
+        {"register_loop_optimizations", test_register_loop_optimizations},
+        {"dead_code", test_dead_code},
+        {"register_dead_code", test_register_dead_code},
+        {"register_errors", test_register_errors},
+        {"ir_phis", test_ir_phis},
+        {"ir_programs", test_ir_programs},
+        {"ir_jit", test_ir_jit},
+        {"dump_ir", test_dump_ir},
+        {"fold_constants", test_fold_constants},
+        {"fold_identities", test_fold_identities},
+        {"fold_signed_zero", test_fold_signed_zero},
+        {"peephole_jumps", test_peephole_jumps},
+        {"peephole_casts_and_stores", test_peephole_casts_and_stores},
+        {"instances", test_instances},
+        {"sessions", test_sessions},
+        {"many_symbols", test_many_symbols},
+        {"shared_literals", test_shared_literals},
+        {"wide_jumps", test_wide_jumps},
+        {"stack_growth", test_stack_growth},
+        {"stack_overflow", test_stack_overflow},
+        {"native_depth", test_native_depth},
+        {"bad_code", test_bad_code},
+        {"image", test_image},
+        {"image_checks", test_image_checks},
+        {"cache", test_cache}
+    );
+    
+    printf("All virtual machine tests passed!\n");
+    return 0;
+}
@@ -51,28 +51,21 @@ void capture_stdout_end(void)
     close(original_stdout_fd);
 }
 
-void reset_compiler_state(void)
-{
-    // Clear global context symbols
-    // Note: global_context is a const pointer, but the struct it points to is mutable
-    context_t* ctx = (context_t*)global_context;  // Cast away const for field access
-    if (ctx->symbols != NULL) {
-        // Free all symbols in the vector
-        for (size_t i = 0; i < vec_size(ctx->symbols); i++) {
-            symbol_t* sym = (symbol_t*) vec_get(ctx->symbols, i);
-            free(sym);
-        }
-        vec_free(ctx->symbols);
-        ctx->symbols = NULL;
-    }
-    ctx->allocated = 0;
-}
+parser_options_t compile_options = {
+    .backend = BACKEND_STACK,
+    .peephole = true,
+    .peephole_report = false,
+    .inlining = true,
+    .dead_code = true,
+    .use_ir = false,
+    .dump_ir_filename = NULL,
+    .stack_size = 0,
+};
 
-void compile_and_run(const char* code)
+_Thread_local uint16_t compiled_globals;
+
+void compile(const char* code, bool_t execute)
 {
-    // Reset state before each test
-    reset_compiler_state();
-    
     // Create a temporary file
     char tmp_filename[] = "/tmp/mirza_test_XXXXXX";
     int fd = mkstemp(tmp_filename);
@@ -92,13 +85,19 @@ void compile_and_run(const char* code)
     close(fd);
     
     // Parse and execute from file
-    parser_load(tmp_filename);
-    parser_start(1, NULL);  // execute=true, dasm_filename=NULL
-    parser_free();
-    
-    // Free VM after execution
-    vm_free();
+    parser_t* parser = parser_new_file(tmp_filename, &compile_options);
+    parser_start(parser, execute, NULL);
+    compiled_globals = context_allocated(parser_context(parser));
+    parser_free(parser);
     
     // Clean up
     unlink(tmp_filename);
-}
\ No newline at end of file
+}
+
+void compile_and_run(const char* code)
+{
+    compile(code, 1);
+
+    // Release the program after execution
+    vm_release();
+}
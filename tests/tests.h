@@ -152,7 +152,13 @@ struct test_suite_t {
 extern char captured_output[4096];
 void capture_stdout_start(void);
 void capture_stdout_end(void);
-void reset_compiler_state(void);
+// Options of the programs compile() builds, the defaults unless a test
+// changes them and puts them back
+extern parser_options_t compile_options;
+// Slots the global scope of the last compiled program allocated
+extern _Thread_local uint16_t compiled_globals;
+// Compiles `code`, leaving it as the current program of the VM
+void compile(const char* code, bool_t execute);
 void compile_and_run(const char* code);
 
 #ifdef __cplusplus
@@ -49,6 +49,8 @@ typedef enum
     TK_OR_BIT,
     TK_AND_BIT,
     TK_XOR_BIT,
+    TK_SHL,         // No lexeme yet, produced by fold.c
+    TK_SHR,
     TK_NOT,
     TK_EQ,
     TK_NE,
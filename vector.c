@@ -77,3 +77,11 @@ size_t vec_size(vector_t* vector)
 
     return vector->vect_used;
 }
+
+bool_t vec_contains(vector_t* vector, void* data)
+{
+    for (size_t i = 0; i < vec_size(vector); i++)
+        if (vector->nodes[i].data == data)
+            return true;
+    return false;
+}
@@ -1,6 +1,7 @@
 #ifndef VECTOR_H
 #define VECTOR_H
 
+#include "types.h"
 #include <stddef.h>
 
 #ifdef __cplusplus
@@ -31,6 +32,7 @@ void* vec_first(vector_t* vector);
 void* vec_last(vector_t* vector);
 void* vec_append(vector_t* vector, void* data);
 size_t vec_size(vector_t* vector);
+bool_t vec_contains(vector_t* vector, void* data);
 
 #ifdef __cplusplus
 }
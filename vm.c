@@ -1,28 +1,98 @@
 #include "vm.h"
 #include "utf8.h"
 #include "buffer.h"
+#include "jit.h"
+#include "peephole.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
 #include <math.h>
 #include <inttypes.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
+// A decoded instruction. vm_exec never touches the raw bytes of the code:
+// before the first run they are translated into an array of these records,
+// with operands widened and aligned and jump targets resolved to records.
+typedef struct vm_insn_t
+{
+    const void* handler;        // Label of the handler (threaded dispatch)
+    struct vm_insn_t* target;   // Destination of JMP, JEZ, JNZ and CALL
+    value_t k;                  // Constant operand
+    uint32_t a;                 // First operand: slot, count or PROC args
+    uint32_t b;                 // Second operand: PROC vars or slot
+    uint32_t addr;              // Offset of the instruction in the code
+    uint8_t opcode;
+} vm_insn_t;
+
+// A string literal already in the data segment
 typedef struct
+{
+    const char* str;
+    uint32_t addr;
+} vm_string_t;
+
+// The code and data emitted by the compiler, and their translation. Once
+// translated a program is only read, so every vm_t made from it shares it,
+// from any thread.
+struct vm_program_t
+{
+    buffer_t code;
+    buffer_t data;
+    vm_insn_t* insns;     // Translated code, built by the first vm_new
+    size_t insns_count;
+    jit_t* jit;           // Native code of the functions, with the JIT on
+    uint32_t entry;       // Code address the instances start at
+    void* image;          // The mapping code and data point into, by vm_load
+    size_t image_size;
+    uint32_t refs;        // The compiler, and every vm_t made from it
+    vm_string_t* strings; // Literals in the data, keyed by pointer
+    uint32_t strings_size;
+    uint32_t strings_used;
+    struct {
+        uint8_t jit: 1;
+    } flags;
+};
+
+// The stack is reserved whole, stack_max values and a guard page, but
+// only its first stack_size values are mapped. A PROC whose frame would
+// pass `limit` maps more, in place, so pointers into the stack stay valid.
+// Past the limit an instruction may push STACK_SLACK values before it runs
+// into memory that is not mapped.
+struct vm_t
 {
     uint32_t ip;          // Points the index of current machine instruction to execute: program[ip] or *(program + ip)
     uint32_t sp;          // Points the top element of the machine stack: stack[sp]
     uint32_t bp;          // Base index
     value_t* stack;
-    size_t stack_size;
-    buffer_t code;
-    buffer_t data;
+    value_t* limit;       // Highest top a new frame may leave
+    size_t stack_size;    // Values mapped
+    size_t stack_max;     // Values reserved
+    size_t stack_bytes;   // Size of the reservation
+    void* native;         // Machine stack of the native code, or NULL
+    size_t native_bytes;  // Its size, a guard page at the bottom included
+    const uint8_t* data;  // Data segment of the program
+    vm_program_t* program;
+    FILE* out;            // Where the print opcodes write
+    const char* error;    // Why the instance stopped before its HALT
     struct {
         uint8_t halt: 1;
     } flags;
-} vm_t;
+};
+
+#define STACK_INITIAL 4096
+#define STACK_SLACK 1024
+// Room the C helpers of native code keep below its deepest frame
+#define NATIVE_SLACK (256 * 1024)
 
-static vm_t vm;
+// The program the compiler on this thread emits into
+static _Thread_local vm_program_t* program;
+
+// Held while a program is translated: the JIT compiles one at a time
+static uint8_t translating;
 
 
 // NOTE: KEEP THE ORDER AS SAME AS OPCODE ENUM
@@ -30,7 +100,7 @@ static vm_t vm;
 const opcode_t OPCODES[] = {
     {NOP, 0, "nop"},
     {DUP, 0, "dup"},
-    {DROP, 0, "drop"},
+    {DROP, 2, "drop"},
     {ALLC, 2, "allc"},
     {SWAP, 0, "swap"},
     {PROC, 4, "proc"},
@@ -124,687 +194,629 @@ const opcode_t OPCODES[] = {
     // XSTORE
     // XSTOREG
     {NPRINT, 0, "nprint"},
+    {ILOAD_ILOAD_IADD, 4, "iload_iload_iadd"},
+    {ILOAD_ICONST, 6, "iload_iconst"},
+    {IINC_LOCAL, 3, "iinc_local"},
+    {IGT_JEZ, 2, "igt_jez"},
+    {ILT_JEZ, 2, "ilt_jez"},
+    {IGE_JEZ, 2, "ige_jez"},
+    {ILE_JEZ, 2, "ile_jez"},
+    {IEQ_JEZ, 2, "ieq_jez"},
+    {INQ_JEZ, 2, "inq_jez"},
+    {ISTORE_ILOAD, 2, "istore_iload"},
+    {RJEZ, 2, "rjez"},
+    {RJNZ, 2, "rjnz"},
+    {RGT_JEZ, 2, "rgt_jez"},
+    {RLT_JEZ, 2, "rlt_jez"},
+    {RGE_JEZ, 2, "rge_jez"},
+    {RLE_JEZ, 2, "rle_jez"},
+    {REQ_JEZ, 2, "req_jez"},
+    {RNQ_JEZ, 2, "rnq_jez"},
+    {TAILCALL, 4, "tailcall"},
+    {CALL_W, 4, "call_w"},
+    {JNZ_W, 4, "jnz_w"},
+    {JEZ_W, 4, "jez_w"},
+    {JMP_W, 4, "jmp_w"},
+    {IGT_JEZ_W, 4, "igt_jez_w"},
+    {ILT_JEZ_W, 4, "ilt_jez_w"},
+    {IGE_JEZ_W, 4, "ige_jez_w"},
+    {ILE_JEZ_W, 4, "ile_jez_w"},
+    {IEQ_JEZ_W, 4, "ieq_jez_w"},
+    {INQ_JEZ_W, 4, "inq_jez_w"},
+    {RJEZ_W, 4, "rjez_w"},
+    {RJNZ_W, 4, "rjnz_w"},
+    {RGT_JEZ_W, 4, "rgt_jez_w"},
+    {RLT_JEZ_W, 4, "rlt_jez_w"},
+    {RGE_JEZ_W, 4, "rge_jez_w"},
+    {RLE_JEZ_W, 4, "rle_jez_w"},
+    {REQ_JEZ_W, 4, "req_jez_w"},
+    {RNQ_JEZ_W, 4, "rnq_jez_w"},
+    {TAILCALL_W, 6, "tailcall_w"},
 };
 
-void vm_init(size_t stack_size, size_t code_size)
+const size_t OPCODES_COUNT = sizeof (OPCODES) / sizeof (OPCODES[0]);
+
+// Short forms of CALL_W to TAILCALL_W, in their order
+static const uint8_t SHORT_FORMS[] = {
+    CALL, JNZ, JEZ, JMP,
+    IGT_JEZ, ILT_JEZ, IGE_JEZ, ILE_JEZ, IEQ_JEZ, INQ_JEZ,
+    RJEZ, RJNZ,
+    RGT_JEZ, RLT_JEZ, RGE_JEZ, RLE_JEZ, REQ_JEZ, RNQ_JEZ,
+    TAILCALL,
+};
+
+uint8_t vm_short_op(uint8_t op)
 {
-    buffer_init(&vm.data, 0);
-    buffer_init(&vm.code, code_size);
-    vm.stack = malloc(sizeof (type_t) * stack_size);
-    vm.stack_size = stack_size;
-    vm.ip = 0;
-    vm.sp = 0;
-    vm.bp = 0;
-    vm.flags.halt = 0;
+    return op >= CALL_W && op <= TAILCALL_W ? SHORT_FORMS[op - CALL_W] : op;
 }
 
-void vm_free()
+uint8_t vm_wide_op(uint8_t op)
 {
-    free(vm.stack);
-    buffer_free(&vm.data);
-    buffer_free(&vm.code);
+    for (size_t i = 0; i < sizeof (SHORT_FORMS); i++)
+        if (SHORT_FORMS[i] == op)
+            return CALL_W + i;
+    return op;
 }
 
-void exec_opcode(uint8_t* opcode)
+uint8_t vm_target_size(uint8_t op)
 {
-    switch (*opcode)
-    {
-    case HALT:
-    {
-        vm.flags.halt = 1;
-        ++vm.ip;
-        break;
-    }
-    case NOP:
-    {
-        ++vm.ip;
-        break;
-    }
-    case DUP:
-    {
-        vm.stack[vm.sp + 1] = vm.stack[vm.sp];
-        ++vm.sp;
-        ++vm.ip;
-        break;
-    }
-    case SWAP:
-    {
-        value_t tmp = vm.stack[vm.sp];
-        vm.stack[vm.sp] = vm.stack[vm.sp - 1];
-        vm.stack[vm.sp - 1] = tmp;
-        ++vm.ip;
-        break;
-    }
-    case DROP:
-    {
-        vm.sp -= *((uint16_t*) (opcode + 1));
-        vm.ip += 3;
-        break;
-    }
-    case ALLC:
-    {
-        vm.sp += *((uint16_t*) (opcode + 1));
-        vm.ip += 3;
-        break;
-    }
-    case PROC:
-    {
-        uint16_t args = *((uint16_t*) (opcode + 1));
-        uint16_t vars = *((uint16_t*) (opcode + 3));
-        uint32_t _bp = vm.stack[vm.sp].as_uint32;
-        uint32_t _ip = vm.stack[vm.sp - 1].as_uint32;
-        vm.stack[vm.sp].as_uint32 = 0;
-        vm.stack[vm.sp - 1].as_uint32 = 0;
-        vm.sp += vars - 2;
-        vm.stack[++vm.sp].as_uint32 = _ip;
-        vm.stack[++vm.sp].as_uint32 = _bp;
-        vm.stack[++vm.sp].as_uint32 = args + vars;
-        vm.bp = vm.sp - (args + vars + 2);
-        vm.ip += 5;
-        break;
-    }
-    case CALL:
-    {
-        vm.stack[++vm.sp].as_uint32 = vm.ip + 3;
-        vm.stack[++vm.sp].as_uint32 = vm.bp;
-        vm.ip = *((uint16_t*) (opcode + 1));
-        break;
-    }
-    case RET:
-    {
-        value_t retv = vm.stack[vm.sp--];
-        uint32_t drops = vm.stack[vm.sp--].as_uint32;
-        uint32_t _bp = vm.stack[vm.sp--].as_uint32;
-        uint32_t _ip = vm.stack[vm.sp--].as_uint32;
-        vm.sp -= drops;
-        vm.stack[++vm.sp] = retv;
-        vm.ip = (uint16_t) _ip;
-        vm.bp = (uint16_t) _bp;
-        break;
-    }
-    case JMP:
-    {
-        vm.ip = *((uint16_t*) (opcode + 1));
-        break;
-    }
-    case JEZ:
-    {
-        // Check both int64 and real (for real comparison results)
-        // Real comparisons return 0.0 or 1.0, so we need to check as_real first
-        // to avoid reading as_int64 when the value is actually a real
-        int is_zero = (vm.stack[vm.sp].as_real == 0.0) || (vm.stack[vm.sp].as_int64 == 0);
-        if (is_zero)
-            vm.ip = *((uint16_t*) (opcode + 1));
-        else
-            vm.ip += 3;
-        --vm.sp;
-        break;
-    }
-    case JNZ:
-    {
-        if (vm.stack[vm.sp].as_int64 != 0)
-            vm.ip = *((uint16_t*) (opcode + 1));
-        else
-            vm.ip += 3;
-        --vm.sp;
-        break;
-    }
-    case IINC:
-    {
-        vm.stack[vm.sp].as_int64++;
-        ++vm.ip;
-        break;
-    }
-    case IDEC:
-    {
-        vm.stack[vm.sp].as_int64--;
-        ++vm.ip;
-        break;
-    }
-    case INEG:
-    {
-        vm.stack[vm.sp].as_int64 *= -1;
-        ++vm.ip;
-        break;
-    }
-    case IABS:
-    {
-        vm.stack[vm.sp].as_int64 = llabs(vm.stack[vm.sp].as_int64);
-        ++vm.ip;
-        break;
-    }
-    case INOT:
-    {
-        vm.stack[vm.sp].as_int64 = ~vm.stack[vm.sp].as_int64;
-        ++vm.ip;
-        break;
-    }
-    case IADD:
-    {
-        vm.stack[vm.sp - 1].as_int64 = vm.stack[vm.sp - 1].as_int64 + vm.stack[vm.sp].as_int64;
-        --vm.sp;
-        ++vm.ip;
-        break;
-    }
-    case ISUB:
-    {
-        vm.stack[vm.sp - 1].as_int64 = vm.stack[vm.sp - 1].as_int64 - vm.stack[vm.sp].as_int64;
-        --vm.sp;
-        ++vm.ip;
-        break;
-    }
-    case IMUL:
-    {
-        vm.stack[vm.sp - 1].as_int64 = vm.stack[vm.sp - 1].as_int64 * vm.stack[vm.sp].as_int64;
-        --vm.sp;
-        ++vm.ip;
-        break;
-    }
-    case IDIV:
-    {
-        vm.stack[vm.sp - 1].as_int64 = vm.stack[vm.sp - 1].as_int64 / vm.stack[vm.sp].as_int64;
-        --vm.sp;
-        ++vm.ip;
-        break;
-    }
-    case IMOD:
-    {
-        vm.stack[vm.sp - 1].as_int64 = vm.stack[vm.sp - 1].as_int64 % vm.stack[vm.sp].as_int64;
-        --vm.sp;
-        ++vm.ip;
-        break;
-    }
-    case IAND:
-    {
-        vm.stack[vm.sp - 1].as_int64 = vm.stack[vm.sp - 1].as_int64 && vm.stack[vm.sp].as_int64;
-        --vm.sp;
-        ++vm.ip;
-        break;
-    }
-    case IOR:
-    {
-        vm.stack[vm.sp - 1].as_int64 = vm.stack[vm.sp - 1].as_int64 || vm.stack[vm.sp].as_int64;
-        --vm.sp;
-        ++vm.ip;
-        break;
-    }
-    case IBXOR:
-    {
-        vm.stack[vm.sp - 1].as_int64 = vm.stack[vm.sp - 1].as_int64 ^ vm.stack[vm.sp].as_int64;
-        --vm.sp;
-        ++vm.ip;
-        break;
-    }
-    case IBOR:
-    {
-        vm.stack[vm.sp - 1].as_int64 = vm.stack[vm.sp - 1].as_int64 | vm.stack[vm.sp].as_int64;
-        --vm.sp;
-        ++vm.ip;
-        break;
-    }
-    case IBAND:
-    {
-        vm.stack[vm.sp - 1].as_int64 = vm.stack[vm.sp - 1].as_int64 & vm.stack[vm.sp].as_int64;
-        --vm.sp;
-        ++vm.ip;
-        break;
-    }
-    case ISHL:
-    {
-        vm.stack[vm.sp - 1].as_int64 = vm.stack[vm.sp - 1].as_int64 << vm.stack[vm.sp].as_int64;
-        --vm.sp;
-        ++vm.ip;
-        break;
-    }
-    case ISHR:
-    {
-        vm.stack[vm.sp - 1].as_int64 = vm.stack[vm.sp - 1].as_int64 >> vm.stack[vm.sp].as_int64;
-        --vm.sp;
-        ++vm.ip;
-        break;
-    }
-    case IGT:
-    {
-        vm.stack[vm.sp - 1].as_int64 = vm.stack[vm.sp - 1].as_int64 > vm.stack[vm.sp].as_int64;
-        --vm.sp;
-        ++vm.ip;
-        break;
-    }
-    case ILT:
-    {
-        vm.stack[vm.sp - 1].as_int64 = vm.stack[vm.sp - 1].as_int64 < vm.stack[vm.sp].as_int64;
-        --vm.sp;
-        ++vm.ip;
-        break;
-    }
-    case IGE:
-    {
-        vm.stack[vm.sp - 1].as_int64 = vm.stack[vm.sp - 1].as_int64 >= vm.stack[vm.sp].as_int64;
-        --vm.sp;
-        ++vm.ip;
-        break;
-    }
-    case ILE:
-    {
-        vm.stack[vm.sp - 1].as_int64 = vm.stack[vm.sp - 1].as_int64 <= vm.stack[vm.sp].as_int64;
-        --vm.sp;
-        ++vm.ip;
-        break;
-    }
-    case IEQ:
-    {
-        vm.stack[vm.sp - 1].as_int64 = vm.stack[vm.sp - 1].as_int64 == vm.stack[vm.sp].as_int64;
-        --vm.sp;
-        ++vm.ip;
-        break;
-    }
-    case INQ:
-    {
-        vm.stack[vm.sp - 1].as_int64 = vm.stack[vm.sp - 1].as_int64 != vm.stack[vm.sp].as_int64;
-        --vm.sp;
-        ++vm.ip;
-        break;
-    }
-    case I8CONST:
-    {
-        int8_t val = (int8_t)opcode[1];
-        vm.stack[++vm.sp].as_int64 = (int64_t)val;
-        vm.ip += 2;
-        break;
-    }
-    case I16CONST:
-    {
-        int16_t val = *((int16_t*)(opcode + 1));
-        vm.stack[++vm.sp].as_int64 = (int64_t)val;
-        vm.ip += 3;
-        break;
-    }
-    case I32CONST:
-    {
-        int32_t val = *((int32_t*)(opcode + 1));
-        vm.stack[++vm.sp].as_int64 = (int64_t)val;
-        vm.ip += 5;
-        break;
-    }
-    case ICONST:
-    {
-        vm.stack[++vm.sp].as_int64 = *((int64_t*) (opcode + 1));
-        vm.ip += 9;
-        break;
-    }
-    case ICONST_0:
-    {
-        vm.stack[++vm.sp].as_int64 = 0;
-        ++vm.ip;
-        break;
-    }
-    case ICONST_1:
-    {
-        vm.stack[++vm.sp].as_int64 = 1;
-        ++vm.ip;
-        break;
-    }
-    case IPRINT:
-    {
-        printf("%" PRId64, vm.stack[vm.sp].as_int64);
-        fflush(stdout);
-        --vm.sp;
-        ++vm.ip;
-        break;
-    }
-    case ITOR:
-    {
-        vm.stack[vm.sp].as_real = (real_t) vm.stack[vm.sp].as_int64;
-        ++vm.ip;
-        break;
-    }
-    case I8CAST:
-    {
-        // Convert int64 to int8 (truncate to 8 bits, sign-extend)
-        vm.stack[vm.sp].as_int64 = (int64_t)(int8_t)vm.stack[vm.sp].as_int64;
-        ++vm.ip;
-        break;
-    }
-    case I16CAST:
-    {
-        // Convert int64 to int16 (truncate to 16 bits, sign-extend)
-        vm.stack[vm.sp].as_int64 = (int64_t)(int16_t)vm.stack[vm.sp].as_int64;
-        ++vm.ip;
-        break;
-    }
-    case I32CAST:
-    {
-        // Convert int64 to int32 (truncate to 32 bits, sign-extend)
-        vm.stack[vm.sp].as_int64 = (int64_t)(int32_t)vm.stack[vm.sp].as_int64;
-        ++vm.ip;
-        break;
-    }
-    case ILOAD:
-    {
-        vm.stack[vm.sp + 1].as_int64 = vm.stack[vm.bp + *((uint16_t*) (opcode + 1))].as_int64;
-        ++vm.sp;
-        vm.ip += 3;
-        break;
-    }
-    case ISTORE:
-    {
-        vm.stack[vm.bp + *((uint16_t*) (opcode + 1))].as_int64 = vm.stack[vm.sp].as_int64;
-        --vm.sp;
-        vm.ip += 3;
-        break;
-    }
-    case RLOAD:
-    {
-        vm.stack[vm.sp + 1].as_real = vm.stack[vm.bp + *((uint16_t*) (opcode + 1))].as_real;
-        ++vm.sp;
-        vm.ip += 3;
-        break;
-    }
-    case RSTORE:
-    {
-        vm.stack[vm.bp + *((uint16_t*) (opcode + 1))].as_real = vm.stack[vm.sp].as_real;
-        --vm.sp;
-        vm.ip += 3;
-        break;
-    }
-    case RINC:
-    {
-        vm.stack[vm.sp].as_real++;
-        ++vm.ip;
-        break;
-    }
-    case RDEC:
-    {
-        vm.stack[vm.sp].as_real--;
-        ++vm.ip;
-        break;
-    }
-    case RNEG:
-    {
-        vm.stack[vm.sp].as_real *= -1;
-        ++vm.ip;
-        break;
-    }
-    case RABS:
-    {
-        vm.stack[vm.sp].as_real = fabs(vm.stack[vm.sp].as_real);
-        ++vm.ip;
-        break;
-    }
-    case RADD:
-    {
-        vm.stack[vm.sp - 1].as_real = vm.stack[vm.sp - 1].as_real + vm.stack[vm.sp].as_real;
-        --vm.sp;
-        ++vm.ip;
-        break;
-    }
-    case RSUB:
-    {
-        vm.stack[vm.sp - 1].as_real = vm.stack[vm.sp - 1].as_real - vm.stack[vm.sp].as_real;
-        --vm.sp;
-        ++vm.ip;
-        break;
-    }
-    case RMUL:
-    {
-        vm.stack[vm.sp - 1].as_real = vm.stack[vm.sp - 1].as_real * vm.stack[vm.sp].as_real;
-        --vm.sp;
-        ++vm.ip;
-        break;
-    }
-    case RDIV:
-    {
-        vm.stack[vm.sp - 1].as_real = vm.stack[vm.sp - 1].as_real / vm.stack[vm.sp].as_real;
-        --vm.sp;
-        ++vm.ip;
-        break;
-    }
-    case RMOD:
-    {
-        vm.stack[vm.sp - 1].as_real = fmod(vm.stack[vm.sp - 1].as_real, vm.stack[vm.sp].as_real);
-        --vm.sp;
-        ++vm.ip;
-        break;
-    }
-    case RPOW:
-    {
-        vm.stack[vm.sp - 1].as_real = pow(vm.stack[vm.sp - 1].as_real, vm.stack[vm.sp].as_real);
-        --vm.sp;
-        ++vm.ip;
-        break;
-    }
-    case RSQRT:
-    {
-        vm.stack[vm.sp].as_real = sqrt(vm.stack[vm.sp].as_real);
-        ++vm.ip;
-        break;
-    }
-    case REXP:
-    {
-        vm.stack[vm.sp].as_real = exp(vm.stack[vm.sp].as_real);
-        ++vm.ip;
-        break;
-    }
-    case RSIN:
-    {
-        vm.stack[vm.sp].as_real = sin(vm.stack[vm.sp].as_real);
-        ++vm.ip;
-        break;
-    }
-    case RCOS:
-    {
-        vm.stack[vm.sp].as_real = cos(vm.stack[vm.sp].as_real);
-        ++vm.ip;
-        break;
-    }
-    case RTAN:
-    {
-        vm.stack[vm.sp].as_real = tan(vm.stack[vm.sp].as_real);
-        ++vm.ip;
-        break;
-    }
-    case RASIN:
-    {
-        vm.stack[vm.sp].as_real = asin(vm.stack[vm.sp].as_real);
-        ++vm.ip;
-        break;
-    }
-    case RACOS:
-    {
-        vm.stack[vm.sp].as_real = acos(vm.stack[vm.sp].as_real);
-        ++vm.ip;
-        break;
-    }
-    case RATAN2:
-    {
-        vm.stack[vm.sp - 1].as_real = atan2(vm.stack[vm.sp - 1].as_real, vm.stack[vm.sp].as_real);
-        --vm.sp;
-        ++vm.ip;
-        break;
-    }
-    case RLOG:
-    {
-        vm.stack[vm.sp].as_real = log(vm.stack[vm.sp].as_real);
-        ++vm.ip;
-        break;
-    }
-    case RLOG10:
-    {
-        vm.stack[vm.sp].as_real = log10(vm.stack[vm.sp].as_real);
-        ++vm.ip;
-        break;
-    }
-    case RLOG2:
-    {
-        vm.stack[vm.sp].as_real = log2(vm.stack[vm.sp].as_real);
-        ++vm.ip;
-        break;
-    }
-    case RCEIL:
-    {
-        vm.stack[vm.sp].as_real = ceil(vm.stack[vm.sp].as_real);
-        ++vm.ip;
-        break;
-    }
-    case RFLOOR:
-    {
-        vm.stack[vm.sp].as_real = floor(vm.stack[vm.sp].as_real);
-        ++vm.ip;
-        break;
-    }
-    case RROUND:
-    {
-        vm.stack[vm.sp].as_real = round(vm.stack[vm.sp].as_real);
-        ++vm.ip;
-        break;
-    }
-    case RGT:
-    {
-        vm.stack[vm.sp - 1].as_real = vm.stack[vm.sp - 1].as_real > vm.stack[vm.sp].as_real;
-        --vm.sp;
-        ++vm.ip;
-        break;
-    }
-    case RLT:
-    {
-        vm.stack[vm.sp - 1].as_real = vm.stack[vm.sp - 1].as_real < vm.stack[vm.sp].as_real;
-        --vm.sp;
-        ++vm.ip;
-        break;
-    }
-    case RGE:
-    {
-        vm.stack[vm.sp - 1].as_real = vm.stack[vm.sp - 1].as_real >= vm.stack[vm.sp].as_real;
-        --vm.sp;
-        ++vm.ip;
-        break;
-    }
-    case RLE:
-    {
-        vm.stack[vm.sp - 1].as_real = vm.stack[vm.sp - 1].as_real <= vm.stack[vm.sp].as_real;
-        --vm.sp;
-        ++vm.ip;
-        break;
-    }
-    case REQ:
-    {
-        vm.stack[vm.sp - 1].as_real = vm.stack[vm.sp - 1].as_real == vm.stack[vm.sp].as_real;
-        --vm.sp;
-        ++vm.ip;
-        break;
-    }
-    case RNQ:
-    {
-        vm.stack[vm.sp - 1].as_real = vm.stack[vm.sp - 1].as_real != vm.stack[vm.sp].as_real;
-        --vm.sp;
-        ++vm.ip;
-        break;
-    }
-    case RCONST:
-    {
-        vm.stack[++vm.sp].as_uint64 = *((uint64_t*) (opcode + 1));
-        vm.ip += 9;
-        break;
-    }
-    case RCONST_0:
-    {
-        vm.stack[++vm.sp].as_real = 0.0;
-        ++vm.ip;
-        break;
-    }
-    case RCONST_1:
-    {
-        vm.stack[++vm.sp].as_real = 1.0;
-        ++vm.ip;
-        break;
-    }
-    case RCONST_PI:
-    {
-        vm.stack[++vm.sp].as_real = 3.14159265358979323846;
-        ++vm.ip;
-        break;
-    }
-    case RPRINT:
+    if (op >= CALL_W && op <= TAILCALL_W)
+        return 4;
+    return vm_wide_op(op) != op ? 2 : 0;
+}
+
+static void program_release(vm_program_t* released)
+{
+    if (released == NULL || __atomic_sub_fetch(&released->refs, 1, __ATOMIC_ACQ_REL) != 0)
+        return;
+
+    jit_free(released->jit);
+    free(released->insns);
+    free(released->strings);
+
+    if (released->image != NULL)
     {
-        printf("%f", vm.stack[vm.sp].as_real);
-        fflush(stdout);
-        --vm.sp;
-        ++vm.ip;
-        break;
+        munmap(released->image, released->image_size);
     }
-    case RTOI:
+    else
     {
-        vm.stack[vm.sp].as_int32 = (int32_t) vm.stack[vm.sp].as_real;
-        ++vm.ip;
-        break;
+        buffer_free(&released->data);
+        buffer_free(&released->code);
     }
-    case SLOAD:
+
+    free(released);
+}
+
+void vm_init(size_t code_size)
+{
+    vm_release();
+
+    program = calloc(1, sizeof (vm_program_t));
+    buffer_init(&program->data, 0);
+    buffer_init(&program->code, code_size);
+    program->refs = 1;
+}
+
+void vm_release()
+{
+    program_release(program);
+    program = NULL;
+}
+
+void vm_enable_jit()
+{
+    program->flags.jit = 1;
+}
+
+// Runs the peephole optimizer over the emitted code. Must be called before
+// the first vm_new. Returns the number of bytes saved.
+size_t vm_optimize()
+{
+    return peephole_optimize(&program->code);
+}
+
+// Only picks the short forms of the jumps and calls whose target fits, for
+// code that skips the optimizer. Returns the number of bytes saved.
+size_t vm_narrow()
+{
+    return peephole_narrow(&program->code);
+}
+
+static void run(vm_t* vm, bool_t prepare);
+
+vm_program_t* vm_program_retain()
+{
+    __atomic_add_fetch(&program->refs, 1, __ATOMIC_RELAXED);
+    return program;
+}
+
+void vm_program_release(vm_program_t* released)
+{
+    program_release(released);
+}
+
+vm_t* vm_new(size_t stack_size)
+{
+    return vm_new_program(program, stack_size);
+}
+
+static size_t page_align(size_t bytes)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    return (bytes + page - 1) / page * page;
+}
+
+size_t vm_stack_max()
+{
+    return (SIZE_MAX - 2 * page_align(1)) / sizeof (value_t);
+}
+
+// Maps the stack up to `size` values, at most stack_max
+static void stack_map(vm_t* vm, size_t size)
+{
+    size_t bytes = page_align(sizeof (value_t) * size);
+
+    if (bytes > vm->stack_bytes - page_align(1))
+        bytes = vm->stack_bytes - page_align(1);
+    if (mprotect(vm->stack, bytes, PROT_READ | PROT_WRITE) != 0)
+        return;
+
+    vm->stack_size = bytes / sizeof (value_t);
+    if (vm->stack_size > vm->stack_max)
+        vm->stack_size = vm->stack_max;
+    vm->limit = vm->stack + vm->stack_size - STACK_SLACK;
+}
+
+bool_t vm_stack_reserve(vm_t* vm, value_t* top)
+{
+    size_t needed = top - vm->stack + STACK_SLACK;
+
+    if (needed > vm->stack_max)
+        return false;
+
+    size_t size = vm->stack_size * 2;
+    stack_map(vm, size > needed ? size : needed);
+    return top <= vm->limit;
+}
+
+value_t* vm_stack_limit(vm_t* vm)
+{
+    return vm->limit;
+}
+
+// Every native call leaves a return address of 8 bytes on the machine stack
+// and a frame of at least 3 values on the vm stack, so half the size of the
+// vm stack overflows the vm stack first, whatever the thread's stack is
+static bool_t native_map(vm_t* vm)
+{
+    size_t page = page_align(1);
+
+    vm->native_bytes = page_align(vm->stack_max * sizeof (value_t) / 2) + page_align(NATIVE_SLACK) + page;
+    vm->native = mmap(NULL, vm->native_bytes, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+
+    if (vm->native == MAP_FAILED)
     {
-        vm.stack[vm.sp + 1].as_uint16 = vm.stack[vm.bp + *((uint16_t*) (opcode + 1))].as_uint16;
-        ++vm.sp;
-        vm.ip += 3;
-        break;
+        vm->native = NULL;
+        return false;
     }
-    case SSTORE:
+
+    mprotect(vm->native, page, PROT_NONE);
+    return true;
+}
+
+void* vm_native_stack(vm_t* vm, uintptr_t* low)
+{
+    *low = (uintptr_t) vm->native + page_align(1) + page_align(NATIVE_SLACK);
+    return (uint8_t*) vm->native + vm->native_bytes;
+}
+
+vm_t* vm_new_program(vm_program_t* compiled, size_t stack_size)
+{
+    vm_t* vm = malloc(sizeof (vm_t));
+
+    if (stack_size == 0)
+        stack_size = VM_STACK_SIZE;
+    if (stack_size < 2 * STACK_SLACK)
+        stack_size = 2 * STACK_SLACK;
+
+    vm->stack_max = stack_size;
+    vm->stack_bytes = 0;
+    vm->stack = MAP_FAILED;
+    if (stack_size <= vm_stack_max())
+    {
+        vm->stack_bytes = page_align(sizeof (value_t) * stack_size) + page_align(1);
+        vm->stack = mmap(NULL, vm->stack_bytes, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    }
+    vm->stack_size = 0;
+    vm->native = NULL;
+    vm->native_bytes = 0;
+    vm->error = NULL;
+    vm->ip = compiled->entry;
+    vm->sp = 0;
+    vm->bp = 0;
+    vm->flags.halt = 0;
+    vm->program = compiled;
+    vm->data = compiled->data.data;
+    vm->out = stdout;
+    __atomic_add_fetch(&compiled->refs, 1, __ATOMIC_RELAXED);
+
+    // An instance that cannot run is halted with its error, which the
+    // first vm_exec leaves as it is
+    if (vm->stack == MAP_FAILED)
     {
-        vm.stack[vm.bp + *((uint16_t*) (opcode + 1))].as_uint16 = vm.stack[vm.sp].as_uint16;
-        --vm.sp;
-        vm.ip += 3;
-        break;
+        vm->stack = NULL;
+        vm->error = stack_size > vm_stack_max() ? "stack size too large" : "cannot map the stack";
+        vm->flags.halt = 1;
+        return vm;
     }
-    case SCONST:
+
+    stack_map(vm, STACK_INITIAL < stack_size ? STACK_INITIAL : stack_size);
+    run(vm, true);
+
+    if (compiled->insns == NULL)
     {
-        vm.stack[++vm.sp].as_int16 = *((uint16_t*) (opcode + 1));
-        vm.ip += 3;
-        break;
+        vm->error = "bad jump target";
+        vm->flags.halt = 1;
     }
-    case SPRINT:
+    else if (compiled->jit != NULL && !native_map(vm))
     {
-        printf("%s", &vm.data.data[vm.stack[vm.sp].as_uint16]);
-        fflush(stdout);
-        --vm.sp;
-        ++vm.ip;
-        break;
+        vm->error = "cannot map the native stack";
+        vm->flags.halt = 1;
     }
-    case SLEN:
+
+    return vm;
+}
+
+void vm_set_output(vm_t* vm, FILE* out)
+{
+    vm->out = out;
+}
+
+const char* vm_error(vm_t* vm)
+{
+    return vm->error;
+}
+
+void vm_free(vm_t* vm)
+{
+    program_release(vm->program);
+    if (vm->stack != NULL)
+        munmap(vm->stack, vm->stack_bytes);
+    if (vm->native != NULL)
+        munmap(vm->native, vm->native_bytes);
+    free(vm);
+}
+
+// Dispatch: with GCC/Clang the handlers are threaded through a table of
+// label addresses and every handler ends with its own indirect jump to the
+// next one. Build with -DVM_DISPATCH_SWITCH (make DISPATCH=switch) to get
+// the portable switch loop instead, or with -DVM_DISPATCH_TAILCALL (make
+// DISPATCH=tailcall) to make every handler a function that tail calls the
+// next one, so the registers are passed in machine registers.
+#if defined(VM_DISPATCH_TAILCALL)
+#define VM_TAILCALL
+#elif !defined(VM_DISPATCH_SWITCH) && (defined(__GNUC__) || defined(__clang__))
+#define VM_THREADED
+#endif
+
+// Clang guarantees the tail call with musttail. GCC has no such attribute
+// and turns the calls into jumps as sibling calls, which needs -O2.
+#if defined(__has_attribute)
+#if __has_attribute(musttail)
+#define MUSTTAIL __attribute__((musttail))
+#endif
+#endif
+#ifndef MUSTTAIL
+#define MUSTTAIL
+#endif
+
+// While running, ip, sp and bp live in locals and the top of the stack is
+// cached in `tos`: the logical stack is sp[...] followed by tos, so most
+// handlers never touch vm or memory. SAVE_REGS() writes them back to *vm.
+#define SAVE_REGS() \
+    do { *++sp = tos; vm->sp = sp - vm->stack; vm->bp = bp - vm->stack; } while (0)
+
+// Stops the instance at the current instruction with an error
+#define FAIL(message) \
+    do { SAVE_REGS(); vm->ip = ip->addr; vm->error = message; vm->flags.halt = 1; return; } while (0)
+
+// Maps enough stack for `top` before a frame is built, or fails
+#define RESERVE(top) \
+    do { if ((top) > vm->limit && !vm_stack_reserve(vm, top)) FAIL("stack overflow"); } while (0)
+
+#if defined(VM_THREADED)
+#define OP(name) op_##name:
+#define OP_BAD op_BAD:
+#define NEXT goto *ip->handler
+#define LABEL(name) [name] = &&op_##name
+#elif defined(VM_TAILCALL)
+typedef void (*vm_handler_t)(vm_insn_t* ip, value_t* sp, value_t* bp, value_t tos, vm_t* vm);
+#define OP(name) \
+    static void op_##name(vm_insn_t* ip, value_t* sp, value_t* bp, value_t tos, vm_t* vm)
+#define OP_BAD OP(BAD)
+#define NEXT MUSTTAIL return ((vm_handler_t) ip->handler)(ip, sp, bp, tos, vm)
+#define LABEL(name) [name] = (const void*) op_##name
+#else
+#define OP(name) case name:
+#define OP_BAD default:
+#define NEXT goto dispatch
+#endif
+
+// Handler of every opcode, for the table of labels or functions
+#define HANDLERS \
+    LABEL(NOP), LABEL(DUP), LABEL(DROP), LABEL(ALLC), LABEL(SWAP), \
+    LABEL(PROC), LABEL(CALL), LABEL(RET), LABEL(JNZ), LABEL(JEZ), \
+    LABEL(JMP), LABEL(HALT), LABEL(IINC), LABEL(IDEC), LABEL(INEG), \
+    LABEL(IABS), LABEL(INOT), LABEL(IADD), LABEL(ISUB), LABEL(IDIV), \
+    LABEL(IMOD), LABEL(IMUL), LABEL(IAND), LABEL(IOR), LABEL(IBXOR), \
+    LABEL(IBOR), LABEL(IBAND), LABEL(ISHL), LABEL(ISHR), LABEL(IGT), \
+    LABEL(ILT), LABEL(IGE), LABEL(ILE), LABEL(IEQ), LABEL(INQ), \
+    LABEL(I8CONST), LABEL(I16CONST), LABEL(I32CONST), LABEL(ICONST), \
+    LABEL(ICONST_0), LABEL(ICONST_1), LABEL(IPRINT), LABEL(I8CAST), \
+    LABEL(I16CAST), LABEL(I32CAST), LABEL(ILOAD), LABEL(ISTORE), LABEL(ITOR), \
+    LABEL(RINC), LABEL(RDEC), LABEL(RNEG), LABEL(RABS), LABEL(RADD), \
+    LABEL(RSUB), LABEL(RDIV), LABEL(RMOD), LABEL(RMUL), LABEL(RPOW), \
+    LABEL(RSQRT), LABEL(REXP), LABEL(RSIN), LABEL(RCOS), LABEL(RTAN), \
+    LABEL(RASIN), LABEL(RACOS), LABEL(RATAN2), LABEL(RLOG), LABEL(RLOG10), \
+    LABEL(RLOG2), LABEL(RCEIL), LABEL(RFLOOR), LABEL(RROUND), LABEL(RGT), \
+    LABEL(RLT), LABEL(RGE), LABEL(RLE), LABEL(REQ), LABEL(RNQ), \
+    LABEL(RLOAD), LABEL(RSTORE), LABEL(RCONST), LABEL(RCONST_0), \
+    LABEL(RCONST_1), LABEL(RCONST_PI), LABEL(RPRINT), LABEL(RTOI), \
+    LABEL(SLOAD), LABEL(SSTORE), LABEL(SCONST), LABEL(SPRINT), LABEL(SLEN), \
+    LABEL(NPRINT), LABEL(ILOAD_ILOAD_IADD), LABEL(ILOAD_ICONST), \
+    LABEL(IINC_LOCAL), LABEL(IGT_JEZ), LABEL(ILT_JEZ), LABEL(IGE_JEZ), \
+    LABEL(ILE_JEZ), LABEL(IEQ_JEZ), LABEL(INQ_JEZ), LABEL(ISTORE_ILOAD), \
+    LABEL(RJEZ), LABEL(RJNZ), LABEL(RGT_JEZ), LABEL(RLT_JEZ), LABEL(RGE_JEZ), \
+    LABEL(RLE_JEZ), LABEL(REQ_JEZ), LABEL(RNQ_JEZ), LABEL(TAILCALL), \
+    LABEL(JIT_PROC), LABEL(JIT_CALL)
+
+
+// Internal opcodes of translated records that enter native code: a CALL of
+// a compiled function and the PROC of a compiled global block. The native
+// entry is kept in k.
+enum
+{
+    JIT_PROC = 254,
+    JIT_CALL = 255,
+};
+
+static size_t insn_size(uint8_t op)
+{
+    return op < OPCODES_COUNT ? OPCODES[op].arg_size + 1 : 1;
+}
+
+static uint64_t decode_operand(const uint8_t* bytes, uint8_t size)
+{
+    uint64_t value = 0;
+    for (uint8_t i = 0; i < size; i++)
+        value |= (uint64_t) bytes[i] << (8 * i);
+    return value;
+}
+
+// Translates the code of a program into its insns. `handlers` maps opcodes
+// to dispatch labels and is NULL for the switch build. One trailing HALT
+// record is appended so that a jump to the very end of the code is still
+// valid. False when a jump or call lands out of the code or inside an
+// instruction.
+static bool_t vm_translate(vm_program_t* translated, const void* const* handlers)
+{
+    size_t size = translated->code.used;
+    uint32_t* index = malloc(sizeof (uint32_t) * (size + 1));
+    size_t count = 0;
+
+    for (size_t i = 0; i < size; i++)
+        index[i] = UINT32_MAX;
+
+    for (size_t i = 0; i < size; i += insn_size(translated->code.data[i]))
+        index[i] = count++;
+
+    index[size] = count;
+
+    translated->insns = calloc(count + 1, sizeof (vm_insn_t));
+    translated->insns_count = count + 1;
+
+    for (size_t i = 0; i < size; i += insn_size(translated->code.data[i]))
     {
-        // Get string address from stack
-        uint16_t str_addr = vm.stack[vm.sp].as_uint16;
-        // Calculate length (excluding null terminator)
-        const char* str = (const char*)&vm.data.data[str_addr];
-        vm.stack[vm.sp].as_int64 = (int64_t)utf8len(str);
-        ++vm.ip;
-        break;
+        uint8_t op = translated->code.data[i];
+        uint8_t* bytes = translated->code.data + i + 1;
+        vm_insn_t* insn = &translated->insns[index[i]];
+
+        insn->opcode = vm_short_op(op);
+        insn->addr = i;
+
+        switch (insn->opcode)
+        {
+        case DROP:
+        case ALLC:
+        case ILOAD:
+        case ISTORE:
+        case ISTORE_ILOAD:
+        case RLOAD:
+        case RSTORE:
+        case SLOAD:
+        case SSTORE:
+            insn->a = decode_operand(bytes, 2);
+            break;
+        case PROC:
+        case ILOAD_ILOAD_IADD:
+            insn->a = decode_operand(bytes, 2);
+            insn->b = decode_operand(bytes + 2, 2);
+            break;
+        case ILOAD_ICONST:
+            insn->a = decode_operand(bytes, 2);
+            insn->k.as_int64 = (int32_t) decode_operand(bytes + 2, 4);
+            break;
+        case IINC_LOCAL:
+            insn->a = decode_operand(bytes, 2);
+            insn->k.as_int64 = (int8_t) decode_operand(bytes + 2, 1);
+            break;
+        case JMP:
+        case JEZ:
+        case JNZ:
+        case CALL:
+        case IGT_JEZ:
+        case ILT_JEZ:
+        case IGE_JEZ:
+        case ILE_JEZ:
+        case IEQ_JEZ:
+        case INQ_JEZ:
+        case RJEZ:
+        case RJNZ:
+        case RGT_JEZ:
+        case RLT_JEZ:
+        case RGE_JEZ:
+        case RLE_JEZ:
+        case REQ_JEZ:
+        case RNQ_JEZ:
+        case TAILCALL:
+        {
+            uint8_t width = vm_target_size(op);
+            uint64_t addr = decode_operand(bytes, width);
+            if (addr > size || index[addr] == UINT32_MAX)
+            {
+                free(translated->insns);
+                translated->insns = NULL;
+                free(index);
+                return false;
+            }
+            insn->target = &translated->insns[index[addr]];
+            if (insn->opcode == TAILCALL)
+                insn->a = decode_operand(bytes + width, 2);
+            break;
+        }
+        case I8CONST:
+            insn->k.as_int64 = (int8_t) decode_operand(bytes, 1);
+            break;
+        case I16CONST:
+            insn->k.as_int64 = (int16_t) decode_operand(bytes, 2);
+            break;
+        case I32CONST:
+            insn->k.as_int64 = (int32_t) decode_operand(bytes, 4);
+            break;
+        case ICONST:
+        case RCONST:
+            insn->k.as_uint64 = decode_operand(bytes, 8);
+            break;
+        case SCONST:
+            insn->k.as_uint64 = decode_operand(bytes, 2);
+            break;
+        }
     }
-    case NPRINT:
+
+    translated->insns[count].opcode = HALT;
+    translated->insns[count].addr = size;
+
+    if (translated->flags.jit)
     {
-        printf("\n");
-        fflush(stdout);
-        ++vm.ip;
-        break;
-    }
-    default:
-        printf("BAD OPCODE [%d : %d]\n", *opcode, vm.ip);
-        exit(0);
-        break;
+        translated->jit = jit_compile(translated->code.data, size, translated->data.data);
+
+        for (size_t i = 0; i < count; i++)
+        {
+            vm_insn_t* insn = &translated->insns[i];
+            const void* entry = NULL;
+
+            if (insn->opcode == CALL)
+                entry = jit_entry(translated->jit, insn->target->addr);
+            else if (insn->opcode == PROC)
+                entry = jit_entry(translated->jit, insn->addr);
+
+            if (entry != NULL)
+            {
+                insn->k.as_ptr = (uintptr_t) entry;
+                insn->opcode = insn->opcode == CALL ? JIT_CALL : JIT_PROC;
+            }
+        }
     }
+
+    for (size_t i = 0; handlers != NULL && i <= count; i++)
+        translated->insns[i].handler = handlers[translated->insns[i].opcode];
+
+    free(index);
+    return true;
 }
 
-void vm_exec()
+#ifdef VM_TAILCALL
+#include "vm_ops.h"
+
+static const void* const dispatch[256] = {
+    [0 ... 255] = (const void*) op_BAD,
+    HANDLERS
+};
+#endif
+
+// Runs `vm` from where it stopped or, with `prepare`, only makes sure its
+// program is translated: the labels of the threaded handlers only exist in
+// here.
+static void run(vm_t* vm, bool_t prepare)
 {
-    while (!vm.flags.halt)
+    vm_insn_t* ip;
+    value_t* sp;
+    value_t* bp;
+    value_t tos;
+
+#ifdef VM_THREADED
+    static const void* const dispatch[256] = {
+        [0 ... 255] = &&op_BAD,
+        HANDLERS
+    };
+#endif
+
+    if (prepare)
     {
-        exec_opcode(vm.code.data + vm.ip);
+        while (__atomic_test_and_set(&translating, __ATOMIC_ACQUIRE))
+            ;
+
+        if (vm->program->insns == NULL)
+        {
+#if defined(VM_THREADED) || defined(VM_TAILCALL)
+            vm_translate(vm->program, dispatch);
+#else
+            vm_translate(vm->program, NULL);
+#endif
+        }
+
+        __atomic_clear(&translating, __ATOMIC_RELEASE);
+        return;
     }
+
+    if (vm->flags.halt)
+        return;
+
+    ip = vm->program->insns;
+    while (ip->addr < vm->ip)
+        ++ip;
+
+    sp = vm->stack + vm->sp - 1;
+    bp = vm->stack + vm->bp;
+    tos = vm->stack[vm->sp];
+
+#if defined(VM_TAILCALL)
+    ((vm_handler_t) ip->handler)(ip, sp, bp, tos, vm);
+#elif defined(VM_THREADED)
+    NEXT;
+#include "vm_ops.h"
+#else
+dispatch:
+    switch (ip->opcode)
+    {
+#include "vm_ops.h"
+    }
+#endif
+}
+
+void vm_exec(vm_t* vm)
+{
+    run(vm, false);
 }
 
-void vm_dump()
+void vm_dump(vm_t* vm)
 {
     printf("-- begin --\n");
-    printf("ip: %du  sp: %du bp: %du", vm.ip, vm.sp, vm.bp);
+    printf("ip: %du  sp: %du bp: %du", vm->ip, vm->sp, vm->bp);
     printf("[ ");
-    for (int i = vm.sp; i >= 0; i--)
-        printf("%lu ", vm.stack[i].as_uint64);
+    for (int i = vm->sp; i >= 0; i--)
+        printf("%lu ", vm->stack[i].as_uint64);
     printf("]\n");
     printf("-- end   --\n");
 }
@@ -818,14 +830,14 @@ void vm_dasm(const char* filename)
         return;
     }
 
-    for (size_t i = 0; i < vm.code.used; i++)
+    for (size_t i = 0; i < program->code.used; i++)
     {
-        opcode_t opcode = OPCODES[vm.code.data[i]];
+        opcode_t opcode = OPCODES[program->code.data[i]];
 
         fprintf(file, "%lx\t %s", i, opcode.name);
 
         for (int a = 0; a < opcode.arg_size; a++)
-            fprintf(file, " 0x%x", (vm.code.data[i + a + 1] & 0xFF));
+            fprintf(file, " 0x%x", (program->code.data[i + a + 1] & 0xFF));
         fprintf(file, "\n");
 
         i += opcode.arg_size;
@@ -836,37 +848,290 @@ void vm_dasm(const char* filename)
 
 void vm_code_emit(uint8_t* bytes, size_t len)
 {
-    buffer_adds(&vm.code, bytes, len);
+    buffer_adds(&program->code, bytes, len);
 }
 
 void vm_code_set(size_t index, uint8_t* bytes, size_t len)
 {
-    buffer_sets(&vm.code, index, bytes, len);
+    buffer_sets(&program->code, index, bytes, len);
+}
+
+uint8_t vm_code_get(size_t index)
+{
+    return program->code.data[index];
 }
 
 size_t vm_code_addr()
 {
-    return buffer_size(&vm.code);
+    return buffer_size(&program->code);
 }
 
 void vm_data_emit(uint8_t* bytes, size_t len)
 {
-    buffer_adds(&vm.data, bytes, len);
+    buffer_adds(&program->data, bytes, len);
 }
 
 size_t vm_data_addr()
 {
-    return buffer_size(&vm.data);
+    return buffer_size(&program->data);
 }
 
-void vm_save(char* name)
+static vm_string_t* string_slot(vm_string_t* strings, uint32_t size, const char* str)
 {
-    // this must have data ...
-    FILE* file = fopen(name, "w");
-    fwrite(vm.code.data, vm.code.used, 1, file);
-    fclose(file);
+    uint32_t mask = size - 1;
+    uint32_t i = (uint32_t) (((uintptr_t) str >> 3) * 0x9E3779B97F4A7C15ull >> 32) & mask;
+
+    while (strings[i].str != NULL && strings[i].str != str)
+        i = (i + 1) & mask;
+    return &strings[i];
+}
+
+// Emits a NUL terminated literal once per program. Literals are interned
+// by the lexer, so the same text is always the same pointer.
+size_t vm_data_string(const char* str)
+{
+    if (2 * (program->strings_used + 1) > program->strings_size)
+    {
+        vm_string_t* old = program->strings;
+        uint32_t old_size = program->strings_size;
+
+        program->strings_size = old_size == 0 ? 16 : old_size * 2;
+        program->strings = calloc(program->strings_size, sizeof (vm_string_t));
+
+        for (uint32_t i = 0; i < old_size; i++)
+            if (old[i].str != NULL)
+                *string_slot(program->strings, program->strings_size, old[i].str) = old[i];
+        free(old);
+    }
+
+    vm_string_t* slot = string_slot(program->strings, program->strings_size, str);
+    if (slot->str == NULL)
+    {
+        slot->str = str;
+        slot->addr = vm_data_addr();
+        vm_data_emit((uint8_t*) str, strlen(str) + 1);
+        program->strings_used++;
+    }
+    return slot->addr;
+}
+
+// Image layout: the header, then the code and the data segment, each at
+// an offset aligned to 8. Numbers are in host byte order, images are only
+// meant for machines like the one that wrote them.
+typedef struct
+{
+    char magic[4];
+    uint16_t version;
+    uint16_t flags;         // None yet, must be 0
+    uint32_t checksum;      // FNV-1a of everything after this field
+    uint32_t entry;
+    uint32_t globals;       // Slots of the global frame
+    uint32_t code_offset;
+    uint32_t code_size;
+    uint32_t data_offset;
+    uint32_t data_size;
+} vm_image_t;
+
+static const char IMAGE_MAGIC[4] = {'M', 'R', 'Z', 'I'};
+
+#define IMAGE_ALIGN(X) (((X) + 7) & ~(size_t) 7)
+
+static uint32_t fnv1a(uint32_t hash, const uint8_t* bytes, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        hash ^= bytes[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static uint32_t image_checksum(const uint8_t* image, size_t size)
+{
+    size_t start = offsetof(vm_image_t, checksum) + sizeof (uint32_t);
+    return fnv1a(2166136261u, image + start, size - start);
+}
+
+// Slots of the global frame: the locals of the PROC the entry runs into
+static uint32_t global_frame(const uint8_t* code, size_t size, size_t entry)
+{
+    for (size_t i = entry; i < size; i += OPCODES[code[i]].arg_size + 1)
+    {
+        if (code[i] == PROC)
+            return decode_operand(code + i + 1, 2) + decode_operand(code + i + 3, 2);
+    }
+    return 0;
+}
+
+bool_t vm_save(const char* filename)
+{
+    vm_image_t header = {0};
+    memcpy(header.magic, IMAGE_MAGIC, sizeof (IMAGE_MAGIC));
+    header.version = VM_IMAGE_VERSION;
+    header.entry = program->entry;
+    header.globals = global_frame(program->code.data, program->code.used, program->entry);
+    header.code_offset = IMAGE_ALIGN(sizeof (vm_image_t));
+    header.code_size = program->code.used;
+    header.data_offset = IMAGE_ALIGN(header.code_offset + header.code_size);
+    header.data_size = program->data.used;
+
+    size_t size = header.data_offset + header.data_size;
+    uint8_t* image = calloc(1, size);
+
+    memcpy(image + header.code_offset, program->code.data, header.code_size);
+    if (header.data_size > 0)
+        memcpy(image + header.data_offset, program->data.data, header.data_size);
+    memcpy(image, &header, sizeof (header));
+
+    header.checksum = image_checksum(image, size);
+    memcpy(image, &header, sizeof (header));
+
+    FILE* file = fopen(filename, "wb");
+    if (file == NULL)
+    {
+        fprintf(stderr, "Error: Cannot open file '%s' for writing\n", filename);
+        free(image);
+        return false;
+    }
+
+    bool_t written = fwrite(image, size, 1, file) == 1;
+    written = fclose(file) == 0 && written;
+    free(image);
+
+    if (!written)
+        fprintf(stderr, "Error: Cannot write file '%s'\n", filename);
+
+    return written;
+}
+
+// Checks what the checksum cannot: that a well formed image from another
+// build does not make the VM read out of its segments
+static const char* image_error(const uint8_t* image, size_t size)
+{
+    const vm_image_t* header = (const vm_image_t*) image;
+
+    if (size < sizeof (vm_image_t) || memcmp(header->magic, IMAGE_MAGIC, sizeof (IMAGE_MAGIC)) != 0)
+        return "not an image";
+    if (header->version != VM_IMAGE_VERSION || header->flags != 0)
+        return "unsupported version";
+    if (image_checksum(image, size) != header->checksum)
+        return "bad checksum";
+    if ((uint64_t) header->code_offset + header->code_size > size
+        || (uint64_t) header->data_offset + header->data_size > size)
+        return "segment out of the file";
+    if (header->code_size == 0 || header->entry >= header->code_size)
+        return "bad entry point";
+    if (header->data_size > 0 && image[header->data_offset + header->data_size - 1] != '\0')
+        return "unterminated data segment";
+
+    const uint8_t* code = image + header->code_offset;
+    size_t code_size = header->code_size;
+    size_t i = 0;
+
+    // Where the instructions start, and the end of the code, which a jump
+    // may target like vm_translate allows
+    uint8_t* starts = calloc(code_size + 1, 1);
+    const char* error = NULL;
+
+    while (i < code_size && error == NULL)
+    {
+        starts[i] = 1;
+        if (code[i] >= OPCODES_COUNT)
+            error = "bad opcode";
+        else
+            i += OPCODES[code[i]].arg_size + 1;
+    }
+
+    if (error == NULL && i != code_size)
+        error = "truncated code";
+    starts[code_size] = 1;
+
+    if (error == NULL && !starts[header->entry])
+        error = "bad entry point";
+
+    for (i = 0; i < code_size && error == NULL; i += OPCODES[code[i]].arg_size + 1)
+    {
+        uint8_t width = vm_target_size(code[i]);
+
+        if (width != 0)
+        {
+            uint64_t target = decode_operand(code + i + 1, width);
+            if (target > code_size || !starts[target])
+                error = "bad jump target";
+        }
+        else if (code[i] == SCONST && decode_operand(code + i + 1, 2) >= header->data_size)
+        {
+            error = "bad data address";
+        }
+    }
+
+    free(starts);
+
+    if (error == NULL && header->globals != global_frame(code, code_size, header->entry))
+        error = "bad global frame";
+
+    return error;
+}
+
+static bool_t load(const char* filename, bool_t quiet)
+{
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+    {
+        if (!quiet)
+            fprintf(stderr, "Error: Cannot open file '%s'\n", filename);
+        return false;
+    }
+
+    struct stat st;
+    void* image = MAP_FAILED;
+
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+        image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (image == MAP_FAILED)
+    {
+        if (!quiet)
+            fprintf(stderr, "Error: Cannot map file '%s'\n", filename);
+        return false;
+    }
+
+    const char* error = image_error(image, st.st_size);
+    if (error != NULL)
+    {
+        if (!quiet)
+            fprintf(stderr, "Error: Bad image '%s': %s\n", filename, error);
+        munmap(image, st.st_size);
+        return false;
+    }
+
+    const vm_image_t* header = image;
+
+    vm_release();
+
+    // The segments are used in place, the buffers never grow
+    program = calloc(1, sizeof (vm_program_t));
+    program->code.data = (uint8_t*) image + header->code_offset;
+    program->code.allc = header->code_size;
+    program->code.used = header->code_size;
+    program->data.data = (uint8_t*) image + header->data_offset;
+    program->data.allc = header->data_size;
+    program->data.used = header->data_size;
+    program->entry = header->entry;
+    program->image = image;
+    program->image_size = st.st_size;
+    program->refs = 1;
+
+    return true;
+}
+
+bool_t vm_load(const char* filename)
+{
+    return load(filename, false);
 }
 
-void vm_load(char* name)
+bool_t vm_try_load(const char* filename)
 {
+    return load(filename, true);
 }
@@ -2,6 +2,7 @@
 #define VM_H
 
 #include "types.h"
+#include <stdio.h>
 
 #define EMIT(...) do{uint8_t b[] = { __VA_ARGS__ }; vm_code_emit(b, sizeof(b) / sizeof(b[0]));}while(0)
 #define CODE(i, ...) do{uint8_t b[] = { __VA_ARGS__ }; vm_code_set(i, b, sizeof(b) / sizeof(b[0]));}while(0)
@@ -107,6 +108,54 @@ enum
     // XSTORE
     // XSTOREG
     NPRINT,
+
+    // superinstructions
+    ILOAD_ILOAD_IADD,
+    ILOAD_ICONST,
+    IINC_LOCAL,
+    IGT_JEZ,
+    ILT_JEZ,
+    IGE_JEZ,
+    ILE_JEZ,
+    IEQ_JEZ,
+    INQ_JEZ,
+    ISTORE_ILOAD,
+
+    // typed branches: JEZ and JNZ test integers, these test reals
+    RJEZ,
+    RJNZ,
+    RGT_JEZ,
+    RLT_JEZ,
+    RGE_JEZ,
+    RLE_JEZ,
+    REQ_JEZ,
+    RNQ_JEZ,
+
+    TAILCALL,   // addr, args: a call in tail position reusing the frame
+
+    // wide forms: the ops above with a code address, the same with a 32-bit
+    // address instead of a 16-bit one. The compiler emits them for targets
+    // it does not know yet, and vm_narrow/vm_optimize pick the short form
+    // wherever the address fits.
+    CALL_W,
+    JNZ_W,
+    JEZ_W,
+    JMP_W,
+    IGT_JEZ_W,
+    ILT_JEZ_W,
+    IGE_JEZ_W,
+    ILE_JEZ_W,
+    IEQ_JEZ_W,
+    INQ_JEZ_W,
+    RJEZ_W,
+    RJNZ_W,
+    RGT_JEZ_W,
+    RLT_JEZ_W,
+    RGE_JEZ_W,
+    RLE_JEZ_W,
+    REQ_JEZ_W,
+    RNQ_JEZ_W,
+    TAILCALL_W,
 };
 
 #define NUM64(X) \
@@ -132,6 +181,9 @@ enum
 #define NUM8(X) \
     (X & 0xFF)
 
+// Bump when the opcodes or the image layout change
+#define VM_IMAGE_VERSION 2
+
 typedef struct
 {
     const uint8_t code;
@@ -140,18 +192,80 @@ typedef struct
 } opcode_t;
 
 extern const opcode_t OPCODES[];
+extern const size_t OPCODES_COUNT;
+
+// The code address of a jump or call is its first operand: 2 bytes in the
+// short forms, 4 in the wide ones, none for other ops
+uint8_t vm_target_size(uint8_t op);
+uint8_t vm_short_op(uint8_t op);    // Itself unless a wide form
+uint8_t vm_wide_op(uint8_t op);     // Of a short form
+
+// A compiled program, shared by the compiler and its instances
+typedef struct vm_program_t vm_program_t;
+
+// A running instance of the program. The code and data are shared read
+// only by all instances, each has its own stack and registers, so separate
+// instances can run on separate threads.
+typedef struct vm_t vm_t;
+
+// Starts a new program: the emit functions below build it until the next
+// vm_init or vm_release.
+void vm_init(size_t code_size);
+void vm_release();
+void vm_enable_jit();
+size_t vm_optimize();
+size_t vm_narrow();
+// Most values the stack of an instance grows to, unless vm_new says
+#define VM_STACK_SIZE (1 << 20)
 
-void vm_init(size_t stack_size, size_t code_size);
-void vm_free();
-void vm_exec();
-void vm_dump();
+// A new instance of the current program. The program lives on until its
+// last instance is freed, even after vm_init or vm_release. Its stack
+// grows on demand up to `stack_size` values, 0 for VM_STACK_SIZE, and a
+// run that needs more stops with the error "stack overflow". An instance
+// whose stack cannot be mapped or whose code does not translate is made
+// already stopped, with its error set.
+vm_t* vm_new(size_t stack_size);
+// Largest stack_size of an instance, whose stack and guard page have to
+// fit in the address space
+size_t vm_stack_max();
+// A reference to the current program that outlives the next vm_init, to
+// make instances of it later with vm_new_program
+vm_program_t* vm_program_retain();
+void vm_program_release(vm_program_t* program);
+vm_t* vm_new_program(vm_program_t* compiled, size_t stack_size);
+// The machine stack native code of the instance runs on, with the JIT on:
+// returns its top and sets `low` to the lowest rsp a PROC may start at. It
+// is sized so that a deep recursion overflows the stack of the instance
+// first, as it does in the interpreter.
+void* vm_native_stack(vm_t* vm, uintptr_t* low);
+// Where the print opcodes of the instance write, stdout by default
+void vm_set_output(vm_t* vm, FILE* out);
+void vm_exec(vm_t* vm);
+// Why the last vm_exec stopped before the end of the program, or NULL
+const char* vm_error(vm_t* vm);
+// Maps the stack of a running instance up to `top`, false when that is
+// past its size. vm_stack_limit is the top that needs no more.
+bool_t vm_stack_reserve(vm_t* vm, value_t* top);
+value_t* vm_stack_limit(vm_t* vm);
+void vm_free(vm_t* vm);
+void vm_dump(vm_t* vm);
 void vm_dasm(const char* filename);
-void vm_save(char* name);
-void vm_load(char* name);
+// Images hold a program ready to run: a versioned header, the code, the
+// data segment, the size of the global frame and the entry point, checked
+// by a checksum. vm_save writes the current program. vm_load maps an image
+// read only and makes it the current program without copying it, so it
+// can only be run, not emitted into. Both report errors on stderr.
+// vm_try_load is vm_load without the report, for callers that have
+// another way to get the program.
+bool_t vm_save(const char* filename);
+bool_t vm_load(const char* filename);
+bool_t vm_try_load(const char* filename);
 void vm_code_emit(uint8_t* bytes, size_t len);
 void vm_code_set(size_t index, uint8_t* bytes, size_t len);
+uint8_t vm_code_get(size_t index);
 size_t vm_code_addr();
 void vm_data_emit(uint8_t* bytes, size_t len);
 size_t vm_data_addr();
+size_t vm_data_string(const char* str);
 
 #endif /* VM_H */
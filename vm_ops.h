@@ -0,0 +1,894 @@
+// Opcode handlers of vm_exec, written once with the OP/NEXT/OP_BAD macros of
+// vm.c. With threaded and switch dispatch this file is included in the body
+// of vm_exec; with tail call dispatch every OP is a function on its own.
+
+OP(HALT)
+{
+    vm->flags.halt = 1;
+    vm->ip = ip->addr + 1;
+    SAVE_REGS();
+    return;
+}
+OP(NOP)
+{
+    ++ip;
+    NEXT;
+}
+OP(DUP)
+{
+    *++sp = tos;
+    ++ip;
+    NEXT;
+}
+OP(SWAP)
+{
+    value_t tmp = tos;
+    tos = *sp;
+    *sp = tmp;
+    ++ip;
+    NEXT;
+}
+OP(DROP)
+{
+    *++sp = tos;
+    sp -= ip->a;
+    tos = *sp--;
+    ++ip;
+    NEXT;
+}
+OP(ALLC)
+{
+    RESERVE(sp + ip->a + 1);
+    *++sp = tos;
+    sp += ip->a;
+    tos = *sp--;
+    ++ip;
+    NEXT;
+}
+OP(PROC)
+{
+    uint32_t args = ip->a;
+    uint32_t vars = ip->b;
+    RESERVE(sp + vars + 2);
+    *++sp = tos;
+    value_t _bp = sp[0];
+    value_t _ip = sp[-1];
+    sp[0].as_uint64 = 0;
+    sp[-1].as_uint64 = 0;
+    sp += (int32_t) vars - 2;
+    *++sp = _ip;
+    *++sp = _bp;
+    tos.as_uint64 = args + vars;
+    bp = sp - (args + vars + 1);
+    ++ip;
+    NEXT;
+}
+OP(CALL)
+{
+    *++sp = tos;
+    (++sp)->as_ptr = (uintptr_t) (ip + 1);
+    tos.as_uint64 = bp - vm->stack;
+    ip = ip->target;
+    NEXT;
+}
+OP(RET)
+{
+    // The return value stays in tos
+    uint32_t drops = sp[0].as_uint32;
+    uint32_t _bp = sp[-1].as_uint32;
+    uintptr_t _ip = sp[-2].as_ptr;
+    sp -= 3 + drops;
+    ip = (vm_insn_t*) _ip;
+    bp = vm->stack + _bp;
+    NEXT;
+}
+OP(TAILCALL)
+{
+    // The arguments replace the ones of the current frame, then the callee
+    // PROC finds the return ip and bp of this frame where CALL leaves them
+    uint32_t args = ip->a;
+    *++sp = tos;
+    value_t* from = sp - args + 1;
+    uintptr_t _ip = from[-3].as_ptr;
+    uint64_t _bp = from[-2].as_uint64;
+    for (uint32_t i = 0; i < args; i++)
+        bp[i] = from[i];
+    sp = bp + args;
+    sp->as_ptr = _ip;
+    tos.as_uint64 = _bp;
+    ip = ip->target;
+    NEXT;
+}
+OP(JMP)
+{
+    ip = ip->target;
+    NEXT;
+}
+OP(JEZ)
+{
+    // Integer conditions only; real ones branch with RJEZ
+    if (tos.as_int64 == 0)
+        ip = ip->target;
+    else
+        ++ip;
+    tos = *sp--;
+    NEXT;
+}
+OP(JNZ)
+{
+    if (tos.as_int64 != 0)
+        ip = ip->target;
+    else
+        ++ip;
+    tos = *sp--;
+    NEXT;
+}
+OP(IINC)
+{
+    tos.as_int64++;
+    ++ip;
+    NEXT;
+}
+OP(IDEC)
+{
+    tos.as_int64--;
+    ++ip;
+    NEXT;
+}
+OP(INEG)
+{
+    tos.as_int64 *= -1;
+    ++ip;
+    NEXT;
+}
+OP(IABS)
+{
+    tos.as_int64 = llabs(tos.as_int64);
+    ++ip;
+    NEXT;
+}
+OP(INOT)
+{
+    tos.as_int64 = ~tos.as_int64;
+    ++ip;
+    NEXT;
+}
+OP(IADD)
+{
+    tos.as_int64 = sp->as_int64 + tos.as_int64;
+    --sp;
+    ++ip;
+    NEXT;
+}
+OP(ISUB)
+{
+    tos.as_int64 = sp->as_int64 - tos.as_int64;
+    --sp;
+    ++ip;
+    NEXT;
+}
+OP(IMUL)
+{
+    tos.as_int64 = sp->as_int64 * tos.as_int64;
+    --sp;
+    ++ip;
+    NEXT;
+}
+OP(IDIV)
+{
+    tos.as_int64 = sp->as_int64 / tos.as_int64;
+    --sp;
+    ++ip;
+    NEXT;
+}
+OP(IMOD)
+{
+    tos.as_int64 = sp->as_int64 % tos.as_int64;
+    --sp;
+    ++ip;
+    NEXT;
+}
+OP(IAND)
+{
+    tos.as_int64 = sp->as_int64 && tos.as_int64;
+    --sp;
+    ++ip;
+    NEXT;
+}
+OP(IOR)
+{
+    tos.as_int64 = sp->as_int64 || tos.as_int64;
+    --sp;
+    ++ip;
+    NEXT;
+}
+OP(IBXOR)
+{
+    tos.as_int64 = sp->as_int64 ^ tos.as_int64;
+    --sp;
+    ++ip;
+    NEXT;
+}
+OP(IBOR)
+{
+    tos.as_int64 = sp->as_int64 | tos.as_int64;
+    --sp;
+    ++ip;
+    NEXT;
+}
+OP(IBAND)
+{
+    tos.as_int64 = sp->as_int64 & tos.as_int64;
+    --sp;
+    ++ip;
+    NEXT;
+}
+OP(ISHL)
+{
+    tos.as_int64 = sp->as_int64 << tos.as_int64;
+    --sp;
+    ++ip;
+    NEXT;
+}
+OP(ISHR)
+{
+    tos.as_int64 = sp->as_int64 >> tos.as_int64;
+    --sp;
+    ++ip;
+    NEXT;
+}
+OP(IGT)
+{
+    tos.as_int64 = sp->as_int64 > tos.as_int64;
+    --sp;
+    ++ip;
+    NEXT;
+}
+OP(ILT)
+{
+    tos.as_int64 = sp->as_int64 < tos.as_int64;
+    --sp;
+    ++ip;
+    NEXT;
+}
+OP(IGE)
+{
+    tos.as_int64 = sp->as_int64 >= tos.as_int64;
+    --sp;
+    ++ip;
+    NEXT;
+}
+OP(ILE)
+{
+    tos.as_int64 = sp->as_int64 <= tos.as_int64;
+    --sp;
+    ++ip;
+    NEXT;
+}
+OP(IEQ)
+{
+    tos.as_int64 = sp->as_int64 == tos.as_int64;
+    --sp;
+    ++ip;
+    NEXT;
+}
+OP(INQ)
+{
+    tos.as_int64 = sp->as_int64 != tos.as_int64;
+    --sp;
+    ++ip;
+    NEXT;
+}
+OP(I8CONST)
+{
+    *++sp = tos;
+    tos = ip->k;
+    ++ip;
+    NEXT;
+}
+OP(I16CONST)
+{
+    *++sp = tos;
+    tos = ip->k;
+    ++ip;
+    NEXT;
+}
+OP(I32CONST)
+{
+    *++sp = tos;
+    tos = ip->k;
+    ++ip;
+    NEXT;
+}
+OP(ICONST)
+{
+    *++sp = tos;
+    tos = ip->k;
+    ++ip;
+    NEXT;
+}
+OP(ICONST_0)
+{
+    *++sp = tos;
+    tos.as_int64 = 0;
+    ++ip;
+    NEXT;
+}
+OP(ICONST_1)
+{
+    *++sp = tos;
+    tos.as_int64 = 1;
+    ++ip;
+    NEXT;
+}
+OP(IPRINT)
+{
+    fprintf(vm->out, "%" PRId64, tos.as_int64);
+    fflush(vm->out);
+    tos = *sp--;
+    ++ip;
+    NEXT;
+}
+OP(ITOR)
+{
+    tos.as_real = (real_t) tos.as_int64;
+    ++ip;
+    NEXT;
+}
+OP(I8CAST)
+{
+    // Convert int64 to int8 (truncate to 8 bits, sign-extend)
+    tos.as_int64 = (int64_t)(int8_t)tos.as_int64;
+    ++ip;
+    NEXT;
+}
+OP(I16CAST)
+{
+    // Convert int64 to int16 (truncate to 16 bits, sign-extend)
+    tos.as_int64 = (int64_t)(int16_t)tos.as_int64;
+    ++ip;
+    NEXT;
+}
+OP(I32CAST)
+{
+    // Convert int64 to int32 (truncate to 32 bits, sign-extend)
+    tos.as_int64 = (int64_t)(int32_t)tos.as_int64;
+    ++ip;
+    NEXT;
+}
+OP(ILOAD)
+{
+    *++sp = tos;
+    tos.as_int64 = bp[ip->a].as_int64;
+    ++ip;
+    NEXT;
+}
+OP(ISTORE)
+{
+    bp[ip->a].as_int64 = tos.as_int64;
+    tos = *sp--;
+    ++ip;
+    NEXT;
+}
+OP(RLOAD)
+{
+    *++sp = tos;
+    tos.as_real = bp[ip->a].as_real;
+    ++ip;
+    NEXT;
+}
+OP(RSTORE)
+{
+    bp[ip->a].as_real = tos.as_real;
+    tos = *sp--;
+    ++ip;
+    NEXT;
+}
+OP(RINC)
+{
+    tos.as_real++;
+    ++ip;
+    NEXT;
+}
+OP(RDEC)
+{
+    tos.as_real--;
+    ++ip;
+    NEXT;
+}
+OP(RNEG)
+{
+    tos.as_real *= -1;
+    ++ip;
+    NEXT;
+}
+OP(RABS)
+{
+    tos.as_real = fabs(tos.as_real);
+    ++ip;
+    NEXT;
+}
+OP(RADD)
+{
+    tos.as_real = sp->as_real + tos.as_real;
+    --sp;
+    ++ip;
+    NEXT;
+}
+OP(RSUB)
+{
+    tos.as_real = sp->as_real - tos.as_real;
+    --sp;
+    ++ip;
+    NEXT;
+}
+OP(RMUL)
+{
+    tos.as_real = sp->as_real * tos.as_real;
+    --sp;
+    ++ip;
+    NEXT;
+}
+OP(RDIV)
+{
+    tos.as_real = sp->as_real / tos.as_real;
+    --sp;
+    ++ip;
+    NEXT;
+}
+OP(RMOD)
+{
+    tos.as_real = fmod(sp->as_real, tos.as_real);
+    --sp;
+    ++ip;
+    NEXT;
+}
+OP(RPOW)
+{
+    tos.as_real = pow(sp->as_real, tos.as_real);
+    --sp;
+    ++ip;
+    NEXT;
+}
+OP(RSQRT)
+{
+    tos.as_real = sqrt(tos.as_real);
+    ++ip;
+    NEXT;
+}
+OP(REXP)
+{
+    tos.as_real = exp(tos.as_real);
+    ++ip;
+    NEXT;
+}
+OP(RSIN)
+{
+    tos.as_real = sin(tos.as_real);
+    ++ip;
+    NEXT;
+}
+OP(RCOS)
+{
+    tos.as_real = cos(tos.as_real);
+    ++ip;
+    NEXT;
+}
+OP(RTAN)
+{
+    tos.as_real = tan(tos.as_real);
+    ++ip;
+    NEXT;
+}
+OP(RASIN)
+{
+    tos.as_real = asin(tos.as_real);
+    ++ip;
+    NEXT;
+}
+OP(RACOS)
+{
+    tos.as_real = acos(tos.as_real);
+    ++ip;
+    NEXT;
+}
+OP(RATAN2)
+{
+    tos.as_real = atan2(sp->as_real, tos.as_real);
+    --sp;
+    ++ip;
+    NEXT;
+}
+OP(RLOG)
+{
+    tos.as_real = log(tos.as_real);
+    ++ip;
+    NEXT;
+}
+OP(RLOG10)
+{
+    tos.as_real = log10(tos.as_real);
+    ++ip;
+    NEXT;
+}
+OP(RLOG2)
+{
+    tos.as_real = log2(tos.as_real);
+    ++ip;
+    NEXT;
+}
+OP(RCEIL)
+{
+    tos.as_real = ceil(tos.as_real);
+    ++ip;
+    NEXT;
+}
+OP(RFLOOR)
+{
+    tos.as_real = floor(tos.as_real);
+    ++ip;
+    NEXT;
+}
+OP(RROUND)
+{
+    tos.as_real = round(tos.as_real);
+    ++ip;
+    NEXT;
+}
+OP(RGT)
+{
+    tos.as_real = sp->as_real > tos.as_real;
+    --sp;
+    ++ip;
+    NEXT;
+}
+OP(RLT)
+{
+    tos.as_real = sp->as_real < tos.as_real;
+    --sp;
+    ++ip;
+    NEXT;
+}
+OP(RGE)
+{
+    tos.as_real = sp->as_real >= tos.as_real;
+    --sp;
+    ++ip;
+    NEXT;
+}
+OP(RLE)
+{
+    tos.as_real = sp->as_real <= tos.as_real;
+    --sp;
+    ++ip;
+    NEXT;
+}
+OP(REQ)
+{
+    tos.as_real = sp->as_real == tos.as_real;
+    --sp;
+    ++ip;
+    NEXT;
+}
+OP(RNQ)
+{
+    tos.as_real = sp->as_real != tos.as_real;
+    --sp;
+    ++ip;
+    NEXT;
+}
+OP(RCONST)
+{
+    *++sp = tos;
+    tos = ip->k;
+    ++ip;
+    NEXT;
+}
+OP(RCONST_0)
+{
+    *++sp = tos;
+    tos.as_real = 0.0;
+    ++ip;
+    NEXT;
+}
+OP(RCONST_1)
+{
+    *++sp = tos;
+    tos.as_real = 1.0;
+    ++ip;
+    NEXT;
+}
+OP(RCONST_PI)
+{
+    *++sp = tos;
+    tos.as_real = 3.14159265358979323846;
+    ++ip;
+    NEXT;
+}
+OP(RPRINT)
+{
+    fprintf(vm->out, "%f", tos.as_real);
+    fflush(vm->out);
+    tos = *sp--;
+    ++ip;
+    NEXT;
+}
+OP(RTOI)
+{
+    tos.as_int32 = (int32_t) tos.as_real;
+    ++ip;
+    NEXT;
+}
+OP(SLOAD)
+{
+    *++sp = tos;
+    tos.as_uint16 = bp[ip->a].as_uint16;
+    ++ip;
+    NEXT;
+}
+OP(SSTORE)
+{
+    bp[ip->a].as_uint16 = tos.as_uint16;
+    tos = *sp--;
+    ++ip;
+    NEXT;
+}
+OP(SCONST)
+{
+    *++sp = tos;
+    tos = ip->k;
+    ++ip;
+    NEXT;
+}
+OP(SPRINT)
+{
+    fprintf(vm->out, "%s", &vm->data[tos.as_uint16]);
+    fflush(vm->out);
+    tos = *sp--;
+    ++ip;
+    NEXT;
+}
+OP(SLEN)
+{
+    // Get string address from stack
+    uint16_t str_addr = tos.as_uint16;
+    // Calculate length (excluding null terminator)
+    const char* str = (const char*)&vm->data[str_addr];
+    tos.as_int64 = (int64_t)utf8len(str);
+    ++ip;
+    NEXT;
+}
+OP(NPRINT)
+{
+    fprintf(vm->out, "\n");
+    fflush(vm->out);
+    ++ip;
+    NEXT;
+}
+OP(ILOAD_ILOAD_IADD)
+{
+    *++sp = tos;
+    tos.as_int64 = bp[ip->a].as_int64 + bp[ip->b].as_int64;
+    ++ip;
+    NEXT;
+}
+OP(ILOAD_ICONST)
+{
+    *++sp = tos;
+    (++sp)->as_int64 = bp[ip->a].as_int64;
+    tos = ip->k;
+    ++ip;
+    NEXT;
+}
+OP(IINC_LOCAL)
+{
+    bp[ip->a].as_int64 += ip->k.as_int64;
+    ++ip;
+    NEXT;
+}
+OP(IGT_JEZ)
+{
+    int64_t lhs = sp->as_int64;
+    int64_t rhs = tos.as_int64;
+    tos = sp[-1];
+    sp -= 2;
+    if (lhs > rhs)
+        ++ip;
+    else
+        ip = ip->target;
+    NEXT;
+}
+OP(ILT_JEZ)
+{
+    int64_t lhs = sp->as_int64;
+    int64_t rhs = tos.as_int64;
+    tos = sp[-1];
+    sp -= 2;
+    if (lhs < rhs)
+        ++ip;
+    else
+        ip = ip->target;
+    NEXT;
+}
+OP(IGE_JEZ)
+{
+    int64_t lhs = sp->as_int64;
+    int64_t rhs = tos.as_int64;
+    tos = sp[-1];
+    sp -= 2;
+    if (lhs >= rhs)
+        ++ip;
+    else
+        ip = ip->target;
+    NEXT;
+}
+OP(ILE_JEZ)
+{
+    int64_t lhs = sp->as_int64;
+    int64_t rhs = tos.as_int64;
+    tos = sp[-1];
+    sp -= 2;
+    if (lhs <= rhs)
+        ++ip;
+    else
+        ip = ip->target;
+    NEXT;
+}
+OP(IEQ_JEZ)
+{
+    int64_t lhs = sp->as_int64;
+    int64_t rhs = tos.as_int64;
+    tos = sp[-1];
+    sp -= 2;
+    if (lhs == rhs)
+        ++ip;
+    else
+        ip = ip->target;
+    NEXT;
+}
+OP(INQ_JEZ)
+{
+    int64_t lhs = sp->as_int64;
+    int64_t rhs = tos.as_int64;
+    tos = sp[-1];
+    sp -= 2;
+    if (lhs != rhs)
+        ++ip;
+    else
+        ip = ip->target;
+    NEXT;
+}
+OP(ISTORE_ILOAD)
+{
+    // ISTORE x; ILOAD x without the round trip through the stack
+    bp[ip->a].as_int64 = tos.as_int64;
+    ++ip;
+    NEXT;
+}
+OP(RJEZ)
+{
+    if (tos.as_real == 0.0)
+        ip = ip->target;
+    else
+        ++ip;
+    tos = *sp--;
+    NEXT;
+}
+OP(RJNZ)
+{
+    if (tos.as_real != 0.0)
+        ip = ip->target;
+    else
+        ++ip;
+    tos = *sp--;
+    NEXT;
+}
+OP(RGT_JEZ)
+{
+    real_t lhs = sp->as_real;
+    real_t rhs = tos.as_real;
+    tos = sp[-1];
+    sp -= 2;
+    if (lhs > rhs)
+        ++ip;
+    else
+        ip = ip->target;
+    NEXT;
+}
+OP(RLT_JEZ)
+{
+    real_t lhs = sp->as_real;
+    real_t rhs = tos.as_real;
+    tos = sp[-1];
+    sp -= 2;
+    if (lhs < rhs)
+        ++ip;
+    else
+        ip = ip->target;
+    NEXT;
+}
+OP(RGE_JEZ)
+{
+    real_t lhs = sp->as_real;
+    real_t rhs = tos.as_real;
+    tos = sp[-1];
+    sp -= 2;
+    if (lhs >= rhs)
+        ++ip;
+    else
+        ip = ip->target;
+    NEXT;
+}
+OP(RLE_JEZ)
+{
+    real_t lhs = sp->as_real;
+    real_t rhs = tos.as_real;
+    tos = sp[-1];
+    sp -= 2;
+    if (lhs <= rhs)
+        ++ip;
+    else
+        ip = ip->target;
+    NEXT;
+}
+OP(REQ_JEZ)
+{
+    real_t lhs = sp->as_real;
+    real_t rhs = tos.as_real;
+    tos = sp[-1];
+    sp -= 2;
+    if (lhs == rhs)
+        ++ip;
+    else
+        ip = ip->target;
+    NEXT;
+}
+OP(RNQ_JEZ)
+{
+    real_t lhs = sp->as_real;
+    real_t rhs = tos.as_real;
+    tos = sp[-1];
+    sp -= 2;
+    if (lhs != rhs)
+        ++ip;
+    else
+        ip = ip->target;
+    NEXT;
+}
+OP(JIT_CALL)
+{
+    // Same frame as CALL, then the callee runs natively up to its RET
+    value_t* top = sp;
+    *++sp = tos;
+    (++sp)->as_ptr = (uintptr_t) (ip + 1);
+    (++sp)->as_uint64 = bp - vm->stack;
+    sp = jit_call(vm->program->jit, (const void*) ip->k.as_ptr, sp, bp, vm->stack, vm->out, vm);
+    if (sp == NULL)
+    {
+        sp = top;
+        FAIL("stack overflow");
+    }
+    tos = *sp--;
+    ++ip;
+    NEXT;
+}
+OP(JIT_PROC)
+{
+    // Only the global block is entered through its PROC. Native code
+    // returns at its HALT.
+    value_t* top = sp;
+    *++sp = tos;
+    sp = jit_call(vm->program->jit, (const void*) ip->k.as_ptr, sp, bp, vm->stack, vm->out, vm);
+    if (sp == NULL)
+    {
+        sp = top;
+        FAIL("stack overflow");
+    }
+    tos = *sp--;
+    ip = &vm->program->insns[vm->program->insns_count - 1];
+    NEXT;
+}
+OP_BAD
+{
+    FAIL("bad opcode");
+}